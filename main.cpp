@@ -10,14 +10,43 @@
 #include <glm/ext.hpp>
 
 #include <unistd.h>
+#include <dirent.h>
+#include <strings.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <pulse/simple.h>
 #include <pulse/error.h>
+#ifdef HAVE_SNDFILE
+#include <sndfile.h>
+#endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <list>
+#include <map>
 #include <memory>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 typedef signed short PCM16;
@@ -40,6 +69,12 @@ PCM16 BytesToPcm16(uint8_t msbyte, uint8_t lsbyte)
     return ((PCM16)msbyte << 8) | lsbyte;
 }
 
+// Seconds on a monotonic clock, for timing that doesn't depend on a windowing library
+double SecondsNow()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 // GLFW error callback
 void ErrorCallback(int error, const char *description)
 {
@@ -111,10 +146,14 @@ GLuint CreateProgram(GLuint vertShader, GLuint fragShader)
 class PaSimpleStream
 {
 public:
-    PaSimpleStream(const std::string &name, const std::string &streamName, const pa_sample_spec &spec) noexcept(false)
+    // An empty device name picks the server's default source or sink
+    PaSimpleStream(const std::string &name, const std::string &streamName, const pa_sample_spec &spec,
+                   pa_stream_direction_t direction = PA_STREAM_RECORD, const pa_buffer_attr *attr = NULL,
+                   const std::string &device = "") noexcept(false)
     {
         int error;
-        stream = pa_simple_new(NULL, name.c_str(), PA_STREAM_RECORD, NULL, streamName.c_str(), &spec, NULL, NULL, &error);
+        stream = pa_simple_new(NULL, name.c_str(), direction, device.empty() ? NULL : device.c_str(),
+                               streamName.c_str(), &spec, NULL, attr, &error);
         if (!stream)
         {
             std::string errorString = pa_strerror(error);
@@ -148,6 +187,10 @@ const size_t AUDIO_FRAMEBUF_SIZE = 2 * (size_t(SAMPLE_RATE * FPS_LIMIT) + 2 - si
 const size_t WIN_WIDTH = 640;
 // Starting window height
 const size_t WIN_HEIGHT = 480;
+// Peak level (dBFS) a frame must exceed to count as sound rather than silence
+const float SILENCE_THRESHOLD_DB = -60.0f;
+// Seconds of continuous silence after which drawing stops and the display is frozen
+const double SILENCE_SECONDS = 2.0;
 
 // Wrapper for a single uint8_t array that supports copy and move operations
 struct AudioSample
@@ -156,25 +199,52 @@ struct AudioSample
     AudioSample(AudioSample &other)
     {
         std::copy(other.data, other.data + capacity, data);
+        captureTime = other.captureTime;
+        discontinuity = other.discontinuity;
     }
     AudioSample(AudioSample &&other)
     {
         std::copy(other.data, other.data + capacity, data);
         std::memset(other.data, 0, capacity);
+        captureTime = other.captureTime;
+        discontinuity = other.discontinuity;
     }
     AudioSample &operator=(const AudioSample &other)
     {
         std::copy(other.data, other.data + capacity, data);
+        captureTime = other.captureTime;
+        discontinuity = other.discontinuity;
+        return *this;
     }
     AudioSample &operator=(AudioSample &&other)
     {
         std::copy(other.data, other.data + capacity, data);
         std::memset(other.data, 0, capacity);
+        captureTime = other.captureTime;
+        discontinuity = other.discontinuity;
+        return *this;
     }
     static const size_t capacity = AUDIO_FRAMEBUF_SIZE;
     uint8_t data[capacity];
+    // SecondsNow() at which the last sample of data was captured
+    double captureTime = 0.0;
+    // Index of the first sample in data that doesn't continue the audio before it (the start of
+    // another file), -1 if all of it does
+    int discontinuity = -1;
 };
 
+// Peak level of a frame of audio in dBFS
+float PeakDecibels(const AudioSample &sample)
+{
+    PCM16 peak = 0;
+    for (size_t i = 0; i < AudioSample::capacity; i += sizeof(PCM16))
+    {
+        PCM16 value = BytesToPcm16(sample.data[i + 1], sample.data[i]);
+        peak = std::max<PCM16>(peak, value == INT16_MIN ? INT16_MAX : PCM16(std::abs(value)));
+    }
+    return Pcm16ToDecibels(peak);
+}
+
 // Container for audio data that can be locked and used across threads
 struct AudioBuffer : public boost::basic_lockable_adapter<boost::mutex>
 {
@@ -215,6 +285,9 @@ bool AudioSampler::Read(AudioSample &sample)
     {
         return false;
     }
+    // data still sitting in the server's buffers was captured that much earlier
+    pa_usec_t latency = pa_simple_get_latency(stream->GetStream(), &error);
+    sample.captureTime = SecondsNow() - (error == 0 ? latency / 1e6 : 0.0);
     return true;
 }
 
@@ -250,10 +323,26 @@ public:
 
     virtual void Start() = 0;
     virtual void Stop() = 0;
+
+    // Sets a function called from the sampling thread whenever a frame louder than silence arrives
+    void SetActivityCallback(const std::function<void()> &callback);
+
+    // Frames captured but not read yet
+    virtual size_t QueuedFrames() = 0;
+    // Frames lost because the queue was full when they were captured
+    virtual size_t Overruns() = 0;
+
+protected:
+    std::function<void()> activityCallback;
 };
 
 StreamingAudioSource::StreamingAudioSource(const std::string &name) : AudioSource(name) {}
 
+void StreamingAudioSource::SetActivityCallback(const std::function<void()> &callback)
+{
+    activityCallback = callback;
+}
+
 // Provides clients the ability to read audio data from the default sound device
 class DefaultSoundDevice : public StreamingAudioSource
 {
@@ -267,6 +356,9 @@ public:
     virtual void Start() override;
     virtual void Stop() override;
 
+    virtual size_t QueuedFrames() override;
+    virtual size_t Overruns() override;
+
     DefaultSoundDevice(const DefaultSoundDevice &) = delete;
     DefaultSoundDevice &operator=(const DefaultSoundDevice &) = delete;
 
@@ -275,6 +367,7 @@ private:
 
     size_t readCursor = 0;
     size_t writeCursor = 0;
+    std::atomic<size_t> overruns{0};
 
     AudioBuffer buffer;
     std::unique_ptr<AudioSampler> sampler;
@@ -310,6 +403,17 @@ void DefaultSoundDevice::Stop()
     isOpen = false;
 }
 
+size_t DefaultSoundDevice::QueuedFrames()
+{
+    boost::lock_guard<AudioBuffer> bufferGuard(buffer);
+    return buffer.data.size();
+}
+
+size_t DefaultSoundDevice::Overruns()
+{
+    return overruns;
+}
+
 void DefaultSoundDevice::ProcessSound()
 {
     AudioSample sample;
@@ -323,223 +427,12146 @@ void DefaultSoundDevice::ProcessSound()
     {
         boost::lock_guard<AudioSampler> samplerGuard(*sampler);
         bool read = sampler->Read(sample);
+        if (read && activityCallback && PeakDecibels(sample) > SILENCE_THRESHOLD_DB)
+        {
+            activityCallback();
+        }
         boost::lock_guard<AudioBuffer> bufferGuard(buffer);
+        if (buffer.data.full())
+        {
+            // the circular buffer drops the oldest frame
+            ++overruns;
+        }
         buffer.data.push_back(std::move(sample));
     }
 }
 
-int main(int argc, char *argv[])
+// 64 bit FNV-1a style hash that folds in 8 bytes per step
+uint64_t HashBytes(const void *data, size_t size, uint64_t seed = 14695981039346656037ULL)
 {
-    // Initialize audio source
-    std::unique_ptr<StreamingAudioSource> audioSource(new DefaultSoundDevice(argv[0]));
-    boost::scoped_thread<> audioThread(boost::thread(&StreamingAudioSource::ProcessSound, audioSource.get()));
-
-    // Create rendering window
-    GLFWwindow *window = NULL;
-
-    glfwSetErrorCallback(ErrorCallback);
-
-    if (!glfwInit())
+    const uint64_t prime = 1099511628211ULL;
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    uint64_t hash = seed;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
     {
-        std::cerr << "failed to init GLFW" << std::endl;
-        return EXIT_FAILURE;
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * prime;
     }
+    return hash;
+}
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, "hellopulse", NULL, NULL);
-    if (!window)
+// Creates a directory and any missing parents, returns false if the path can't be created
+bool MakeDirectories(const std::string &path)
+{
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
     {
-        std::cerr << "failed to init window" << std::endl;
-        glfwTerminate();
-        return EXIT_FAILURE;
+        std::string part = path.substr(0, pos);
+        if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            return false;
+        }
+        if (pos == std::string::npos)
+        {
+            return true;
+        }
     }
+}
 
-    glfwMakeContextCurrent(window);
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+// Per-user directory for persistent caches ($XDG_CACHE_HOME/hellopulse or ~/.cache/hellopulse)
+std::string CacheDirectory()
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
     {
-        std::cerr << "failed to load glad" << std::endl;
-        glfwTerminate();
-        return EXIT_FAILURE;
+        return std::string(xdg) + "/hellopulse";
+    }
+    const char *home = getenv("HOME");
+    if (home && *home)
+    {
+        return std::string(home) + "/.cache/hellopulse";
     }
+    return "";
+}
 
-    glfwSwapInterval(1);
+// Mono PCM16 history that zoomable views read from. Live capture appends into a bounded ring,
+// file sources expose their memory mapped samples directly. Positions are absolute sample indices.
+class SampleHistory
+{
+public:
+    SampleHistory(size_t capacity, size_t sampleRate);
+    SampleHistory(const PCM16 *samples, size_t count, size_t stride, size_t sampleRate);
 
-    // Create shaders and shader program
-    const char *vertSrc =
-        "#version 330 core\n"
-        "in vec2 position;\n"
-        "void main(){\n"
-        "   gl_Position = vec4(position, 0.0f, 1.0f);\n"
-        "}\n";
+    // Appends to the owned ring, overwriting the oldest samples once full
+    void Append(const PCM16 *samples, size_t count);
 
-    const char *fragSrc =
-        "#version 330 core\n"
-        "out vec4 fragColor;\n"
-        "uniform vec4 color;\n"
-        "void main(){\n"
-        "   fragColor = color;\n"
-        "}\n";
+    // Copies count samples starting at start as floats; positions not held read as silence
+    void Read(size_t start, size_t count, float *out) const;
+    // Same as Read, without conversion
+    void ReadPcm16(size_t start, size_t count, PCM16 *out) const;
+    // Same as Read for one channel of a file backed history; an owned ring holds one channel only
+    void ReadChannel(size_t channel, size_t start, size_t count, float *out) const;
 
-    GLuint vertShader = CreateShader(GL_VERTEX_SHADER, vertSrc);
-    if (INVALID_GL_ID(vertShader) || !ShaderIsCompiled(vertShader))
+    // Absolute position one past the newest sample
+    size_t Size() const { return size; }
+    // Absolute position of the oldest sample still held
+    size_t First() const { return size > capacity ? size - capacity : 0; }
+    size_t SampleRate() const { return sampleRate; }
+    // Interleaved channels of the file a history views, 1 for an owned ring
+    size_t Channels() const { return stride; }
+    // True if no more samples will be appended (file backed history)
+    bool IsComplete() const { return view != nullptr; }
+
+    SampleHistory(const SampleHistory &) = delete;
+    SampleHistory &operator=(const SampleHistory &) = delete;
+
+private:
+    std::vector<PCM16> ring;
+    const PCM16 *view = nullptr;
+    size_t stride = 1;
+    size_t capacity;
+    size_t size = 0;
+    size_t sampleRate;
+};
+
+SampleHistory::SampleHistory(size_t capacity, size_t sampleRate)
+    : ring(capacity), capacity(capacity), sampleRate(sampleRate)
+{
+}
+
+SampleHistory::SampleHistory(const PCM16 *samples, size_t count, size_t stride, size_t sampleRate)
+    : view(samples), stride(stride), capacity(count), size(count), sampleRate(sampleRate)
+{
+}
+
+void SampleHistory::Append(const PCM16 *samples, size_t count)
+{
+    if (view)
     {
-        PrintShaderLog(std::cout, vertShader);
-        return EXIT_FAILURE;
+        return;
     }
-    GLuint fragShader = CreateShader(GL_FRAGMENT_SHADER, fragSrc);
-    if (INVALID_GL_ID(fragShader) || !ShaderIsCompiled(fragShader))
+    for (size_t i = 0; i < count; ++i)
     {
-        PrintShaderLog(std::cout, fragShader);
-        return EXIT_FAILURE;
+        ring[(size + i) % capacity] = samples[i];
     }
-    GLuint program = CreateProgram(vertShader, fragShader);
-    if (INVALID_GL_ID(program) || !ProgramIsLinked(program))
+    size += count;
+}
+
+void SampleHistory::Read(size_t start, size_t count, float *out) const
+{
+    size_t first = First();
+    for (size_t i = 0; i < count; ++i)
     {
-        PrintProgramLog(std::cout, program);
-        return EXIT_FAILURE;
+        size_t pos = start + i;
+        if (pos < first || pos >= size)
+        {
+            out[i] = 0.0f;
+        }
+        else
+        {
+            out[i] = Pcm16ToFloat(view ? view[pos * stride] : ring[pos % capacity]);
+        }
     }
-    // save color uniform location for later
-    GLint colorUniform = glGetUniformLocation(program, "color");
+}
 
-    // Set lines to be thicker
-    glEnable(GL_LINE_SMOOTH);
-    glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
-    glLineWidth(0.5f);
+void SampleHistory::ReadPcm16(size_t start, size_t count, PCM16 *out) const
+{
+    size_t first = First();
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t pos = start + i;
+        if (pos < first || pos >= size)
+        {
+            out[i] = 0;
+        }
+        else
+        {
+            out[i] = view ? view[pos * stride] : ring[pos % capacity];
+        }
+    }
+}
 
-    // Use GL_LEQUAL for depth to allow later draw calls with equal depth to overwrite previous ones
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
+void SampleHistory::ReadChannel(size_t channel, size_t start, size_t count, float *out) const
+{
+    size_t first = First();
+    channel = std::min(channel, stride - 1);
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t pos = start + i;
+        if (pos < first || pos >= size)
+        {
+            out[i] = 0.0f;
+        }
+        else
+        {
+            out[i] = Pcm16ToFloat(view ? view[pos * stride + channel] : ring[pos % capacity]);
+        }
+    }
+}
+
+// Plays back an audio file whose interleaved PCM16 samples are all in memory, mapped or decoded.
+// Read() advances one frame of the first channel at a time, History() exposes the whole file.
+class FileSource : public AudioSource
+{
+public:
+    FileSource(const std::string &name);
+
+    virtual bool Read(AudioSample &sample) override;
 
-    // reserve enough space upfront for 1 second of audio with an extra 1 frame buffer
-    const size_t numPoints = SAMPLE_RATE + SAMPLE_RATE * FPS_LIMIT;
-    std::vector<glm::vec2> channelValues0;
-    channelValues0.reserve(numPoints);
+    SampleHistory &History() { return *history; }
+    const SampleHistory &History() const { return *history; }
+    // Interleaved samples of every channel
+    const PCM16 *Samples() const { return samples; }
+    size_t Channels() const { return channels; }
+    size_t Frames() const { return frames; }
+    // Hash of the file's content, used to key persistent caches
+    uint64_t ContentHash() const { return contentHash; }
+    // Seconds spent decoding a compressed file, 0 for files used in place
+    double DecodeSeconds() const { return decodeSeconds; }
 
-    // offset into channelValues buffer (for copying per-frame values)
-    size_t offset = 0;
-    // number of data points
-    size_t count = 0;
+    FileSource(const FileSource &) = delete;
+    FileSource &operator=(const FileSource &) = delete;
+
+protected:
+    // Makes samples, which must outlive the source, the file's content
+    void Attach(const PCM16 *samples, size_t channels, size_t frames, size_t sampleRate, uint64_t contentHash);
+
+    double decodeSeconds = 0.0;
+
+private:
+    const PCM16 *samples = nullptr;
+    size_t channels = 0;
+    size_t frames = 0;
+    size_t readCursor = 0;
+    uint64_t contentHash = 0;
+    std::unique_ptr<SampleHistory> history;
+};
+
+FileSource::FileSource(const std::string &name) : AudioSource(name) {}
 
+void FileSource::Attach(const PCM16 *samples, size_t channels, size_t frames, size_t sampleRate, uint64_t contentHash)
+{
+    this->samples = samples;
+    this->channels = channels;
+    this->frames = frames;
+    this->contentHash = contentHash;
+    history.reset(new SampleHistory(samples, frames, channels, sampleRate));
+    isOpen = true;
+}
 
-    // Create vbo for audio data
-    GLuint vbo0;
-    glGenBuffers(1, &vbo0);
-    if (vbo0 == 0)
+bool FileSource::Read(AudioSample &sample)
+{
+    if (readCursor >= frames)
     {
-        std::cerr << "vbo created with id 0" << std::endl;
-        return EXIT_FAILURE;
+        isOpen = false;
+        return false;
     }
-    glBindBuffer(GL_ARRAY_BUFFER, vbo0);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec2) * numPoints, nullptr, GL_DYNAMIC_DRAW);
-
-    // Create vao for audio data
-    GLuint vao0 = 0;
-    glGenVertexArrays(1, &vao0);
-    if (vao0 == 0)
+    sample.captureTime = SecondsNow();
+    for (size_t i = 0; i < AUDIO_FRAMEBUF_SIZE; i += sizeof(PCM16))
     {
-        std::cerr << "vao created with id 0" << std::endl;
-        return EXIT_FAILURE;
+        PCM16 value = readCursor < frames ? samples[readCursor * channels] : 0;
+        sample.data[i] = uint16_t(value) & 0xff;
+        sample.data[i + 1] = uint16_t(value) >> 8;
+        ++readCursor;
     }
-    glBindVertexArray(vao0);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo0);
-    GLint positionAttrib = glGetAttribLocation(program, "position");
-    glVertexAttribPointer(positionAttrib, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
-    glEnableVertexAttribArray(positionAttrib);
+    return true;
+}
 
-    // x position for sample points
-    float xPosition = -1.0f;
+// Opens a PCM16 WAV file through a read-only memory mapping (little endian host assumed)
+class WaveFileSource : public FileSource
+{
+public:
+    WaveFileSource(const std::string &path) noexcept(false);
+    ~WaveFileSource();
 
-    double lastTime = glfwGetTime();
-    double timer = lastTime;
-    double secondsSinceReset = 0;
+private:
+    void *mapping = MAP_FAILED;
+    size_t mappingSize = 0;
+};
 
-    int numFrames = 0;
-    double deltaTime = 0;
+// Opens any supported audio file: PCM16 WAV, capture archives and, when built with libsndfile,
+// FLAC, Ogg/Vorbis and the other formats it reads
+std::unique_ptr<FileSource> OpenFileSource(const std::string &path) noexcept(false);
 
-    // use static blue color for lines
-    glUseProgram(program);
-    glUniform4f(colorUniform, 0.0f, 0.0f, 1.0f, 1.0f);
-    glUseProgram(0);
+// True for the extensions of files OpenFileSource can open
+bool IsAudioFileName(const std::string &name);
 
-    while (!glfwWindowShouldClose(window))
+WaveFileSource::WaveFileSource(const std::string &path) : FileSource(path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
     {
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        throw std::runtime_error("failed to open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 12)
+    {
+        close(fd);
+        throw std::runtime_error("not a wave file: " + path);
+    }
+    mappingSize = info.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map " + path);
+    }
 
-        // Update timer
-        double currentTime = glfwGetTime();
-        deltaTime += (currentTime - lastTime) / FPS_LIMIT;
-        lastTime = currentTime;
+    const uint8_t *bytes = static_cast<const uint8_t *>(mapping);
+    if (std::memcmp(bytes, "RIFF", 4) != 0 || std::memcmp(bytes + 8, "WAVE", 4) != 0)
+    {
+        munmap(mapping, mappingSize);
+        throw std::runtime_error("not a wave file: " + path);
+    }
 
-        if (!audioSource->IsOpen())
+    // Walk the chunk list for the format and data chunks
+    uint16_t format = 0, bitsPerSample = 0;
+    uint32_t sampleRate = 0;
+    size_t channels = 0, frames = 0;
+    const PCM16 *samples = nullptr;
+    size_t offset = 12;
+    while (offset + 8 <= mappingSize)
+    {
+        uint32_t chunkSize;
+        std::memcpy(&chunkSize, bytes + offset + 4, 4);
+        const uint8_t *chunk = bytes + offset + 8;
+        size_t available = std::min<size_t>(chunkSize, mappingSize - offset - 8);
+        if (std::memcmp(bytes + offset, "fmt ", 4) == 0 && available >= 16)
         {
-            audioSource->Start();
+            uint16_t numChannels;
+            std::memcpy(&format, chunk, 2);
+            std::memcpy(&numChannels, chunk + 2, 2);
+            std::memcpy(&sampleRate, chunk + 4, 4);
+            std::memcpy(&bitsPerSample, chunk + 14, 2);
+            channels = numChannels;
         }
-
-        // Read an audio sample from the device 
-        AudioSample sample;
-        if (audioSource->Read(sample))
+        else if (std::memcmp(bytes + offset, "data", 4) == 0)
         {
-            // Convert audio sample to floating point values
-            std::vector<glm::vec2> channelValuesPerFrame0;
-            channelValuesPerFrame0.reserve(AUDIO_FRAMEBUF_SIZE / sizeof(PCM16));
-            for (int i = 0; i < AUDIO_FRAMEBUF_SIZE; i += sizeof(PCM16)) // read a 16 byte value and store it
-            {
-                PCM16 s1 = BytesToPcm16(sample.data[i + 1], sample.data[i]);
-                //PCM16 s2 = BytesToPcm16(buf[i + 2], buf[i + 3]);
-                float x = xPosition;
-                float y = Pcm16ToFloat(s1) / 2.0f; // transform range from [-1,1] to [-0.5, 0.5]
-                glm::vec2 pos = {x, y};
-                channelValues0.push_back(pos);
-                channelValuesPerFrame0.push_back(pos);
-                count += 1;
-                xPosition += float(sizeof(PCM16)) / SAMPLE_RATE;
-            }
-
-            // Copy data into vbo
-            glBindBuffer(GL_ARRAY_BUFFER, vbo0);
-            glBufferSubData(GL_ARRAY_BUFFER, offset, sizeof(glm::vec2) * AUDIO_FRAMEBUF_SIZE / 2, channelValuesPerFrame0.data());
-            offset += sizeof(glm::vec2) * AUDIO_FRAMEBUF_SIZE / 2;
+            samples = reinterpret_cast<const PCM16 *>(chunk);
+            frames = channels ? available / (sizeof(PCM16) * channels) : 0;
+            break;
         }
+        offset += 8 + chunkSize + (chunkSize & 1);
+    }
+    if (format != 1 || bitsPerSample != 16 || channels == 0 || !samples)
+    {
+        munmap(mapping, mappingSize);
+        throw std::runtime_error("only PCM16 wave files are supported: " + path);
+    }
+
+    Attach(samples, channels, frames, sampleRate, HashBytes(mapping, mappingSize));
+}
+
+WaveFileSource::~WaveFileSource()
+{
+    if (mapping != MAP_FAILED)
+    {
+        munmap(mapping, mappingSize);
+    }
+}
+
+// Audio made in software and handed out one frame per frame period, the way a device delivers it.
+// Subclasses make the frames; the sampling thread paces them into a buffer that drops the oldest
+// frame when it is full.
+class PacedSource : public StreamingAudioSource
+{
+public:
+    PacedSource(const std::string &name);
+
+    virtual bool Read(AudioSample &sample) override;
+
+    virtual void ProcessSound() override;
+
+    virtual void Start() override;
+    virtual void Stop() override;
+
+    virtual size_t QueuedFrames() override;
+    virtual size_t Overruns() override;
+
+protected:
+    // Makes the frame due next on the sampling thread, false if there is none yet, in which case
+    // the frames after it are paced from the time one is made again
+    virtual bool Generate(AudioSample &sample) = 0;
+    // Called with the buffer locked as a frame enters it, is read from it or is dropped from it
+    // unread, for state that travels along with the frames
+    virtual void Queued(const AudioSample &) {}
+    virtual void Taken(const AudioSample &) {}
+    virtual void Dropped(const AudioSample &) {}
+
+    // frames made and waiting to be read
+    AudioBuffer buffer;
+
+private:
+    std::atomic<size_t> overruns{0};
+};
+
+PacedSource::PacedSource(const std::string &name) : StreamingAudioSource(name)
+{
+    buffer.data.set_capacity(SAMPLE_RATE / AUDIO_FRAMEBUF_SIZE + 1);
+}
+
+bool PacedSource::Read(AudioSample &sample)
+{
+    boost::lock_guard<AudioBuffer> bufferGuard(buffer);
+
+    if (buffer.data.empty())
+    {
+        return false;
+    }
+
+    sample = buffer.data.front();
+    buffer.data.pop_front();
+    Taken(sample);
+
+    return true;
+}
+
+void PacedSource::Start()
+{
+    isOpen = true;
+}
+
+void PacedSource::Stop()
+{
+    isOpen = false;
+}
 
-        // Draw data points
-        glUseProgram(program);
-        glBindVertexArray(vao0);
-        glDrawArrays(GL_LINE_STRIP, 0, count);
-        ++numFrames;
+size_t PacedSource::QueuedFrames()
+{
+    boost::lock_guard<AudioBuffer> bufferGuard(buffer);
+    return buffer.data.size();
+}
+
+size_t PacedSource::Overruns()
+{
+    return overruns;
+}
 
-        // display fps once per second
-        if (glfwGetTime() - timer >= 1.0)
+void PacedSource::ProcessSound()
+{
+    while (!isOpen)
+    {
+        boost::this_thread::sleep(boost::posix_time::millisec(25));
+    }
+    // one frame per frame period, the way a device delivers them
+    const double period = double(AUDIO_FRAMEBUF_SIZE / sizeof(PCM16)) / SAMPLE_RATE;
+    double nextFrame = SecondsNow();
+    AudioSample sample;
+    while (isOpen)
+    {
+        nextFrame += period;
+        double wait = nextFrame - SecondsNow();
+        if (wait > 0.0)
         {
-            ++timer;
-            ++secondsSinceReset;
-            std::cout << "Fps: " << numFrames << std::endl;
-            numFrames = 0;
+            boost::this_thread::sleep(boost::posix_time::microseconds(long(wait * 1e6)));
         }
 
-        if (xPosition > 1.0f)
+        if (!Generate(sample))
         {
-            // wrap x position around if we've gone past the right side of the screen
-            xPosition = -1.0f;
-
-            offset = 0;
-            count = 0;
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // ensure clear framebuffer
-            // reset the data storage
-            glBindBuffer(GL_ARRAY_BUFFER, vbo0);
-            glBufferSubData(GL_ARRAY_BUFFER, offset, numPoints, nullptr);
-            channelValues0.clear();
-            std::cout << "x position wrapped" << std::endl;
-            secondsSinceReset = 0;
+            nextFrame = std::max(nextFrame, SecondsNow());
+            continue;
         }
-
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        sample.captureTime = SecondsNow();
+        if (activityCallback && PeakDecibels(sample) > SILENCE_THRESHOLD_DB)
+        {
+            activityCallback();
+        }
+        boost::lock_guard<AudioBuffer> bufferGuard(buffer);
+        if (buffer.data.full())
+        {
+            // the circular buffer drops the oldest frame
+            ++overruns;
+            Dropped(buffer.data.front());
+        }
+        Queued(sample);
+        buffer.data.push_back(std::move(sample));
     }
+}
+
+// Seconds of audio decoded ahead of playback by a playlist. Once that much is buffered the decoder
+// opens the next file, so it is ready long before the current one ends.
+const double PLAYLIST_PREFETCH_SECONDS = 2.0;
+
+// Plays a list of wave files back to back without gaps, paced in real time like a capture. A
+// decoder thread keeps the next seconds of audio converted ahead of playback; the last frame of a
+// file continues with the first samples of the next one, and AudioSample::discontinuity marks
+// where the last file starting in it starts.
+class PlaylistSource : public PacedSource
+{
+public:
+    // Files at another sample rate than SAMPLE_RATE or that fail to open are skipped. With loop
+    // set the list starts over after the last file.
+    PlaylistSource(const std::string &name, const std::vector<std::string> &paths, bool loop);
+    ~PlaylistSource();
 
-    audioSource->Stop();
+    virtual void Stop() override;
 
-    glfwDestroyWindow(window);
+    // Frames that were due while the decoder had nothing ready
+    size_t Stalls() const { return stalls; }
+    // File whose audio was read last, empty before the first frame
+    std::string Playing();
+    // Files starting in the frame read last, in order; more than one where files are shorter than a frame
+    std::vector<std::string> Started();
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    PlaylistSource(const PlaylistSource &) = delete;
+    PlaylistSource &operator=(const PlaylistSource &) = delete;
+
+protected:
+    virtual bool Generate(AudioSample &sample) override;
+    virtual void Queued(const AudioSample &sample) override;
+    virtual void Taken(const AudioSample &sample) override;
+    virtual void Dropped(const AudioSample &sample) override;
+
+private:
+    // Opens entry index of the list, nullptr (after logging why) if it can't be played
+    std::unique_ptr<FileSource> Open(size_t index);
+    void DecodeLoop();
+
+    std::vector<std::string> paths;
+    bool loop;
+    size_t prefetchFrames;
+
+    // frames decoded ahead of playback, and the names of the files starting in those with a
+    // discontinuity, one entry per such frame
+    boost::mutex decodeMutex;
+    boost::condition_variable decodeCondition;
+    std::deque<AudioSample> decoded;
+    std::deque<std::vector<std::string>> starts;
+    bool stopping = false;
+    bool finished = false;
+
+    // names starting in the frame being queued, and in the buffered frames as in starts; guarded
+    // by the buffer
+    std::vector<std::string> generatedStarts;
+    std::deque<std::vector<std::string>> bufferedStarts;
+    std::vector<std::string> started;
+    std::string playing;
+    std::atomic<size_t> stalls{0};
+
+    // last, so the decoder starts after everything it uses and is joined first
+    boost::scoped_thread<> decoder;
+};
+
+PlaylistSource::PlaylistSource(const std::string &name, const std::vector<std::string> &paths, bool loop)
+    : PacedSource(name), paths(paths), loop(loop),
+      prefetchFrames(size_t(PLAYLIST_PREFETCH_SECONDS * SAMPLE_RATE) / (AUDIO_FRAMEBUF_SIZE / sizeof(PCM16)) + 1)
+{
+    decoder = boost::scoped_thread<>(boost::thread(&PlaylistSource::DecodeLoop, this));
+}
+
+PlaylistSource::~PlaylistSource()
+{
+    Stop();
+}
+
+std::unique_ptr<FileSource> PlaylistSource::Open(size_t index)
+{
+    std::unique_ptr<FileSource> file;
+    try
+    {
+        file = OpenFileSource(paths[index]);
+        if (file->History().SampleRate() != SAMPLE_RATE)
+        {
+            throw std::runtime_error("sample rate isn't " + std::to_string(SAMPLE_RATE));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << paths[index] << ": " << e.what() << std::endl;
+        file.reset();
+    }
+    return file;
+}
+
+void PlaylistSource::DecodeLoop()
+{
+    const size_t frameSamples = AUDIO_FRAMEBUF_SIZE / sizeof(PCM16);
+    AudioSample frame;
+    PCM16 values[AUDIO_FRAMEBUF_SIZE / sizeof(PCM16)];
+    size_t fill = 0;
+    // files starting in the frame being filled
+    std::vector<std::string> frameStarts;
+    bool played = false;
+
+    size_t nextIndex = 0;
+    std::unique_ptr<FileSource> next;
+    auto openNext = [&]() {
+        // one pass over the list without a playable file ends it, even when looping
+        for (size_t tried = 0; !next && tried < paths.size() && (nextIndex < paths.size() || (loop && played)); ++tried)
+        {
+            nextIndex = nextIndex < paths.size() ? nextIndex : 0;
+            next = Open(nextIndex++);
+        }
+    };
+
+    openNext();
+    while (next)
+    {
+        std::unique_ptr<FileSource> current(std::move(next));
+        std::string path = paths[nextIndex - 1];
+        played = true;
+        bool lookedAhead = false;
+        SampleHistory &history = current->History();
+        frame.discontinuity = fill;
+        frameStarts.push_back(path);
+        for (size_t position = 0; position < history.Size();)
+        {
+            size_t count = std::min(frameSamples - fill, history.Size() - position);
+            history.ReadPcm16(position, count, values + fill);
+            position += count;
+            fill += count;
+            if (fill < frameSamples)
+            {
+                break;
+            }
+            for (size_t i = 0; i < frameSamples; ++i)
+            {
+                frame.data[2 * i] = uint16_t(values[i]) & 0xff;
+                frame.data[2 * i + 1] = uint16_t(values[i]) >> 8;
+            }
+            fill = 0;
+
+            boost::unique_lock<boost::mutex> lock(decodeMutex);
+            if (frame.discontinuity >= 0)
+            {
+                starts.push_back(std::move(frameStarts));
+                frameStarts.clear();
+            }
+            decoded.push_back(std::move(frame));
+            frame.discontinuity = -1;
+            while (decoded.size() >= prefetchFrames && !stopping)
+            {
+                // buffered far enough ahead, a good time to open the next file
+                if (!lookedAhead)
+                {
+                    lookedAhead = true;
+                    lock.unlock();
+                    openNext();
+                    lock.lock();
+                    continue;
+                }
+                decodeCondition.wait(lock);
+            }
+            if (stopping)
+            {
+                return;
+            }
+        }
+        if (!lookedAhead)
+        {
+            openNext();
+        }
+    }
+
+    // the end of the last file, padded with silence
+    boost::lock_guard<boost::mutex> guard(decodeMutex);
+    if (fill > 0)
+    {
+        std::fill(values + fill, values + frameSamples, 0);
+        for (size_t i = 0; i < frameSamples; ++i)
+        {
+            frame.data[2 * i] = uint16_t(values[i]) & 0xff;
+            frame.data[2 * i + 1] = uint16_t(values[i]) >> 8;
+        }
+        if (frame.discontinuity >= 0)
+        {
+            starts.push_back(std::move(frameStarts));
+        }
+        decoded.push_back(std::move(frame));
+    }
+    finished = true;
+}
+
+void PlaylistSource::Stop()
+{
+    PacedSource::Stop();
+    boost::lock_guard<boost::mutex> guard(decodeMutex);
+    stopping = true;
+    decodeCondition.notify_all();
+}
+
+std::string PlaylistSource::Playing()
+{
+    boost::lock_guard<AudioBuffer> bufferGuard(buffer);
+    return playing;
+}
+
+std::vector<std::string> PlaylistSource::Started()
+{
+    boost::lock_guard<AudioBuffer> bufferGuard(buffer);
+    return started;
+}
+
+bool PlaylistSource::Generate(AudioSample &sample)
+{
+    boost::lock_guard<boost::mutex> guard(decodeMutex);
+    if (decoded.empty())
+    {
+        // after the last file playback simply ends, before it the decoder fell behind
+        stalls += !finished;
+        return false;
+    }
+    sample = std::move(decoded.front());
+    decoded.pop_front();
+    if (sample.discontinuity >= 0)
+    {
+        generatedStarts = std::move(starts.front());
+        starts.pop_front();
+    }
+    decodeCondition.notify_all();
+    return true;
+}
+
+void PlaylistSource::Queued(const AudioSample &sample)
+{
+    if (sample.discontinuity >= 0)
+    {
+        bufferedStarts.push_back(std::move(generatedStarts));
+        generatedStarts.clear();
+    }
+}
+
+void PlaylistSource::Taken(const AudioSample &sample)
+{
+    started.clear();
+    if (sample.discontinuity >= 0)
+    {
+        started = std::move(bufferedStarts.front());
+        bufferedStarts.pop_front();
+        playing = started.back();
+    }
+}
+
+void PlaylistSource::Dropped(const AudioSample &sample)
+{
+    if (sample.discontinuity >= 0)
+    {
+        bufferedStarts.pop_front();
+    }
+}
+
+// Reads a playlist: one wave file per line, relative to the playlist's directory, with empty lines
+// and lines starting with # ignored (so M3U files work)
+std::vector<std::string> ReadPlaylist(const std::string &path) noexcept(false)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("failed to open " + path);
+    }
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    std::vector<std::string> paths;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        paths.push_back(line[0] == '/' ? line : directory + line);
+    }
+    if (paths.empty())
+    {
+        throw std::runtime_error("no files in playlist " + path);
+    }
+    return paths;
+}
+
+// Synthetic test tone paced in real time like a capture, for checking the analysers against known
+// figures: a sine with optional second and third harmonics and white noise, quantized to PCM16
+// with triangular dither.
+class ToneSource : public PacedSource
+{
+public:
+    // levelDb and noiseDb are relative to a full scale sine, thdPercent is split evenly between the
+    // second and third harmonic. A noiseDb of -inf adds dither only.
+    ToneSource(const std::string &name, double frequency, double levelDb, double thdPercent, double noiseDb);
+    ~ToneSource();
+
+protected:
+    virtual bool Generate(AudioSample &sample) override;
+
+private:
+
+    double phaseStep;
+    double amplitude;
+    double harmonic;
+    double noise;
+    double phase = 0.0;
+    std::mt19937 random;
+};
+
+ToneSource::ToneSource(const std::string &name, double frequency, double levelDb, double thdPercent, double noiseDb)
+    : PacedSource(name), phaseStep(2.0 * M_PI * frequency / SAMPLE_RATE),
+      amplitude(32767.0 * pow(10.0, levelDb / 20.0)), harmonic(thdPercent / 100.0 / sqrt(2.0)),
+      noise(32767.0 * sqrt(0.5) * pow(10.0, noiseDb / 20.0))
+{
+}
+
+ToneSource::~ToneSource()
+{
+    Stop();
+}
+
+bool ToneSource::Generate(AudioSample &sample)
+{
+    std::uniform_real_distribution<double> dither(-0.5, 0.5);
+    std::normal_distribution<double> white(0.0, 1.0);
+    for (size_t i = 0; i < AUDIO_FRAMEBUF_SIZE; i += sizeof(PCM16))
+    {
+        double value = amplitude * (sin(phase) + harmonic * (sin(2.0 * phase) + sin(3.0 * phase)));
+        value += noise * white(random) + dither(random) + dither(random);
+        PCM16 quantized = PCM16(std::min(std::max(floor(value + 0.5), -32768.0), 32767.0));
+        sample.data[i] = uint16_t(quantized) & 0xff;
+        sample.data[i + 1] = uint16_t(quantized) >> 8;
+        phase = fmod(phase + phaseStep, 2.0 * M_PI);
+    }
+    return true;
+}
+
+// Audio the playback stream buffers ahead of the speakers. Latency is compensated either way, a
+// small buffer only makes the estimate of what's audible fresher.
+const double PLAYBACK_TARGET_LATENCY = 0.05;
+// Frames written to the playback stream at a time
+const size_t PLAYBACK_CHUNK_FRAMES = 256;
+
+// Plays a file through a PulseAudio playback stream on a thread of its own. Writes block while the
+// server's buffer is full, so the sound card's clock paces playback; the stream latency sampled
+// after every write tells which frame is being heard at a given time.
+class FilePlayback
+{
+public:
+    FilePlayback(const std::string &name, const FileSource &file) noexcept(false);
+    ~FilePlayback();
+
+    // Frame of the file heard at time (on the SecondsNow() clock)
+    double AudibleFrame(double time) const;
+    // Latency of the stream at the latest sample
+    double Latency() const;
+    // Time frame is heard by the stream clock, false until a sample of the clock taken after the
+    // time after is available
+    bool HeardTime(double frame, double after, double &time) const;
+
+    FilePlayback(const FilePlayback &) = delete;
+    FilePlayback &operator=(const FilePlayback &) = delete;
+
+private:
+    void PlayLoop();
+
+    const FileSource &file;
+    double rate;
+    std::unique_ptr<PaSimpleStream> stream;
+    std::atomic<bool> stopping{false};
+
+    // latest sample of the stream clock: when it was taken, frames written by then and the latency
+    mutable boost::mutex clockMutex;
+    double clockTime = -1.0;
+    uint64_t clockWritten = 0;
+    double clockLatency = 0.0;
+
+    // last, so the thread starts after everything it uses and is joined first
+    boost::scoped_thread<> thread;
+};
+
+FilePlayback::FilePlayback(const std::string &name, const FileSource &file)
+    : file(file), rate(double(file.History().SampleRate()))
+{
+    pa_sample_spec spec = {PA_SAMPLE_S16LE, uint32_t(rate), uint8_t(file.Channels())};
+    if (!pa_sample_spec_valid(&spec))
+    {
+        throw std::runtime_error("can't play " + std::to_string(file.Channels()) + " channels at " +
+                                 std::to_string(uint32_t(rate)) + " Hz");
+    }
+    pa_buffer_attr attr;
+    attr.maxlength = uint32_t(-1);
+    attr.tlength = pa_usec_to_bytes(pa_usec_t(PLAYBACK_TARGET_LATENCY * 1e6), &spec);
+    attr.prebuf = uint32_t(-1);
+    attr.minreq = uint32_t(-1);
+    attr.fragsize = uint32_t(-1);
+    stream.reset(new PaSimpleStream(name, "playback", spec, PA_STREAM_PLAYBACK, &attr));
+    thread = boost::scoped_thread<>(boost::thread(&FilePlayback::PlayLoop, this));
+}
+
+FilePlayback::~FilePlayback()
+{
+    stopping = true;
+}
+
+void FilePlayback::PlayLoop()
+{
+    size_t channels = file.Channels();
+    uint64_t written = 0;
+    while (!stopping && written < file.Frames())
+    {
+        size_t count = std::min<uint64_t>(PLAYBACK_CHUNK_FRAMES, file.Frames() - written);
+        int error = 0;
+        if (pa_simple_write(stream->GetStream(), file.Samples() + written * channels, count * channels * sizeof(PCM16),
+                            &error) < 0)
+        {
+            std::cerr << "playback failed: " << pa_strerror(error) << std::endl;
+            return;
+        }
+        written += count;
+
+        // the midpoint of the query is the best guess for when the latency was current
+        double before = SecondsNow();
+        pa_usec_t latency = pa_simple_get_latency(stream->GetStream(), &error);
+        double after = SecondsNow();
+        if (error == 0)
+        {
+            boost::lock_guard<boost::mutex> guard(clockMutex);
+            clockTime = 0.5 * (before + after);
+            clockWritten = written;
+            clockLatency = latency / 1e6;
+        }
+    }
+    int error;
+    if (stopping)
+    {
+        pa_simple_flush(stream->GetStream(), &error);
+    }
+    else
+    {
+        pa_simple_drain(stream->GetStream(), &error);
+    }
+}
+
+double FilePlayback::AudibleFrame(double time) const
+{
+    boost::lock_guard<boost::mutex> guard(clockMutex);
+    if (clockTime < 0.0)
+    {
+        return 0.0;
+    }
+    // the sound card keeps playing at the sample rate after the sample was taken, but never past
+    // what was written
+    double frame = clockWritten - (clockLatency - (time - clockTime)) * rate;
+    return std::min(std::max(frame, 0.0), double(clockWritten));
+}
+
+bool FilePlayback::HeardTime(double frame, double after, double &time) const
+{
+    boost::lock_guard<boost::mutex> guard(clockMutex);
+    if (clockTime <= after)
+    {
+        return false;
+    }
+    time = clockTime + clockLatency - (clockWritten - frame) / rate;
+    return true;
+}
+
+double FilePlayback::Latency() const
+{
+    boost::lock_guard<boost::mutex> guard(clockMutex);
+    return clockLatency;
+}
+
+// Radix-2 decimation in time FFT over complex values, twiddles and bit reversal precomputed
+class Fft
+{
+public:
+    Fft(size_t size) noexcept(false);
+
+    // In-place forward transform
+    void Forward(std::complex<float> *data) const;
+    // In-place inverse transform, scaled by 1/N
+    void Inverse(std::complex<float> *data) const;
+
+    size_t Size() const { return size; }
+
+private:
+    void Transform(std::complex<float> *data, bool inverse) const;
+
+    size_t size;
+    std::vector<std::complex<float>> twiddles;
+    std::vector<size_t> bitReverse;
+};
+
+Fft::Fft(size_t size) : size(size), twiddles(size / 2), bitReverse(size)
+{
+    if (size < 2 || (size & (size - 1)) != 0)
+    {
+        throw std::invalid_argument("Fft size must be a power of two");
+    }
+    for (size_t k = 0; k < size / 2; ++k)
+    {
+        double angle = -2.0 * M_PI * double(k) / double(size);
+        twiddles[k] = std::complex<float>(cos(angle), sin(angle));
+    }
+    size_t bits = 0;
+    while ((size_t(1) << bits) < size)
+    {
+        ++bits;
+    }
+    for (size_t i = 0; i < size; ++i)
+    {
+        size_t reversed = 0;
+        for (size_t b = 0; b < bits; ++b)
+        {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        bitReverse[i] = reversed;
+    }
+}
+
+void Fft::Forward(std::complex<float> *data) const
+{
+    Transform(data, false);
+}
+
+void Fft::Inverse(std::complex<float> *data) const
+{
+    Transform(data, true);
+    float scale = 1.0f / size;
+    for (size_t i = 0; i < size; ++i)
+    {
+        data[i] *= scale;
+    }
+}
+
+void Fft::Transform(std::complex<float> *data, bool inverse) const
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (i < bitReverse[i])
+        {
+            std::swap(data[i], data[bitReverse[i]]);
+        }
+    }
+    float sign = inverse ? -1.0f : 1.0f;
+    for (size_t len = 2; len <= size; len <<= 1)
+    {
+        size_t half = len / 2;
+        size_t step = size / len;
+        for (size_t i = 0; i < size; i += len)
+        {
+            for (size_t j = 0; j < half; ++j)
+            {
+                // written out by hand, std::complex multiplication checks for NaN/inf and is slow
+                const std::complex<float> &w = twiddles[j * step];
+                std::complex<float> &a = data[i + j];
+                std::complex<float> &b = data[i + j + half];
+                float wr = w.real(), wi = sign * w.imag();
+                float tr = wr * b.real() - wi * b.imag();
+                float ti = wr * b.imag() + wi * b.real();
+                b = std::complex<float>(a.real() - tr, a.imag() - ti);
+                a = std::complex<float>(a.real() + tr, a.imag() + ti);
+            }
+        }
+    }
+}
+
+// Analysis parameters that determine spectrogram tile contents
+struct SpectrogramParams
+{
+    // FFT size (bins per column is half of this)
+    size_t fftSize = 1024;
+    // Samples between columns at zoom level 0, doubling with each level
+    size_t baseHop = 256;
+    // Columns per tile
+    size_t tileColumns = 256;
+    // Number of zoom levels
+    size_t levels = 16;
+    // Magnitude mapped to 0
+    float floorDb = -100.0f;
+    // Wavelet scales of a scalogram, 0 for an STFT spectrogram. A scalogram's fftSize is the size of
+    // the transform shared by a block of columns.
+    size_t scales = 0;
+    // STFT energy moved to each bin's instantaneous frequency and group delay
+    bool reassigned = false;
+
+    size_t Bins() const { return scales ? scales : fftSize / 2; }
+    size_t Hop(size_t level) const { return baseHop << level; }
+    // Samples covered by one tile at a level
+    size_t TileSpan(size_t level) const { return tileColumns * Hop(level); }
+    size_t TileBytes() const { return tileColumns * Bins(); }
+
+    uint64_t Hash() const
+    {
+        // the floor is negative, through a signed integer to be well defined
+        uint64_t values[] = {fftSize, baseHop, tileColumns, uint64_t(int64_t(floorDb * 1000.0f)), scales, reassigned};
+        return HashBytes(values, sizeof(values));
+    }
+};
+
+// Identifies a spectrogram tile by zoom level and index along the time axis
+struct TileKey
+{
+    size_t level;
+    size_t index;
+
+    bool operator==(const TileKey &other) const { return level == other.level && index == other.index; }
+};
+
+struct TileKeyHash
+{
+    size_t operator()(const TileKey &key) const { return std::hash<size_t>()(key.index * 31 + key.level); }
+};
+
+// Block of spectrogram columns at one zoom level, stored as 8 bit magnitudes with one row of
+// bins per column. Tiles at the live edge fill in as more audio arrives.
+struct SpectrogramTile
+{
+    TileKey key;
+    size_t validColumns = 0;
+    std::vector<uint8_t> data;
+};
+
+// Least recently used set of spectrogram tiles held in memory, bounded by tile count
+class TileCache
+{
+public:
+    TileCache(size_t capacity);
+
+    // Returns the tile (marking it most recently used) or null if not cached
+    std::shared_ptr<SpectrogramTile> Find(const TileKey &key);
+    // Inserts a tile, evicting the least recently used one when full
+    void Insert(const std::shared_ptr<SpectrogramTile> &tile);
+
+private:
+    typedef std::list<std::shared_ptr<SpectrogramTile>> TileList;
+
+    size_t capacity;
+    TileList tiles; // most recently used first
+    std::unordered_map<TileKey, TileList::iterator, TileKeyHash> index;
+};
+
+TileCache::TileCache(size_t capacity) : capacity(capacity) {}
+
+std::shared_ptr<SpectrogramTile> TileCache::Find(const TileKey &key)
+{
+    auto found = index.find(key);
+    if (found == index.end())
+    {
+        return nullptr;
+    }
+    tiles.splice(tiles.begin(), tiles, found->second);
+    return *found->second;
+}
+
+void TileCache::Insert(const std::shared_ptr<SpectrogramTile> &tile)
+{
+    auto found = index.find(tile->key);
+    if (found != index.end())
+    {
+        tiles.erase(found->second);
+        index.erase(found);
+    }
+    if (tiles.size() >= capacity)
+    {
+        index.erase(tiles.back()->key);
+        tiles.pop_back();
+    }
+    tiles.push_front(tile);
+    index[tile->key] = tiles.begin();
+}
+
+// Persistent store of complete tiles for file backed histories, one file per tile named after
+// the source content hash, analysis parameters and tile key
+class DiskTileCache
+{
+public:
+    DiskTileCache(uint64_t sourceHash, const SpectrogramParams &params);
+
+    bool Load(SpectrogramTile &tile) const;
+    void Store(const SpectrogramTile &tile) const;
+
+    bool IsEnabled() const { return !directory.empty(); }
+
+private:
+    std::string PathFor(const TileKey &key) const;
+
+    std::string directory;
+    uint64_t prefix;
+    size_t tileBytes;
+    size_t tileColumns;
+};
+
+DiskTileCache::DiskTileCache(uint64_t sourceHash, const SpectrogramParams &params)
+    : prefix(sourceHash ^ params.Hash()), tileBytes(params.TileBytes()), tileColumns(params.tileColumns)
+{
+    std::string cache = CacheDirectory();
+    // live histories have no stable identity (hash 0), so they only use the memory tiers
+    if (sourceHash != 0 && !cache.empty() && MakeDirectories(cache + "/tiles"))
+    {
+        directory = cache + "/tiles";
+    }
+}
+
+std::string DiskTileCache::PathFor(const TileKey &key) const
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx-%zu-%zu.tile", (unsigned long long)prefix, key.level, key.index);
+    return directory + name;
+}
+
+bool DiskTileCache::Load(SpectrogramTile &tile) const
+{
+    if (!IsEnabled())
+    {
+        return false;
+    }
+    std::ifstream file(PathFor(tile.key), std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    tile.data.resize(tileBytes);
+    if (!file.read(reinterpret_cast<char *>(tile.data.data()), tileBytes))
+    {
+        return false;
+    }
+    tile.validColumns = tileColumns;
+    return true;
+}
+
+void DiskTileCache::Store(const SpectrogramTile &tile) const
+{
+    if (!IsEnabled())
+    {
+        return;
+    }
+    // write to a temporary name first so readers never see a partial tile
+    std::string path = PathFor(tile.key);
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(tile.data.data()), tile.data.size());
+        if (!file)
+        {
+            return;
+        }
+    }
+    rename(temp.c_str(), path.c_str());
+}
+
+// Grid of tile slots in a single GL texture, reassigned least recently used first. Resident tiles
+// draw straight from their slot, only columns computed since the last upload are transferred.
+class TileAtlas
+{
+public:
+    TileAtlas(size_t slotWidth, size_t slotHeight, size_t slotsX, size_t slotsY) noexcept(false);
+    ~TileAtlas();
+
+    // Starts a new frame; slots used during the current frame are never evicted
+    void BeginFrame() { ++frame; }
+    // Makes the tile resident, returns its slot or SIZE_MAX if every slot is in use this frame
+    size_t Acquire(const SpectrogramTile &tile);
+    // Texture coordinates of a slot's first and last texel centers
+    void SlotRect(size_t slot, glm::vec4 &rect) const;
+
+    GLuint Texture() const { return texture; }
+
+    TileAtlas(const TileAtlas &) = delete;
+    TileAtlas &operator=(const TileAtlas &) = delete;
+
+private:
+    struct Slot
+    {
+        TileKey key;
+        bool used = false;
+        size_t uploadedColumns = 0;
+        uint64_t lastUse = 0;
+    };
+
+    size_t slotWidth, slotHeight, slotsX, slotsY;
+    GLuint texture = 0;
+    uint64_t frame = 0;
+    std::vector<Slot> slots;
+    std::unordered_map<TileKey, size_t, TileKeyHash> resident;
+};
+
+TileAtlas::TileAtlas(size_t slotWidth, size_t slotHeight, size_t slotsX, size_t slotsY)
+    : slotWidth(slotWidth), slotHeight(slotHeight), slotsX(slotsX), slotsY(slotsY), slots(slotsX * slotsY)
+{
+    glGenTextures(1, &texture);
+    if (INVALID_GL_ID(texture))
+    {
+        throw std::runtime_error("atlas texture created with id 0");
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, slotWidth * slotsX, slotHeight * slotsY, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+    // nearest filtering keeps neighbouring slots from bleeding into each other
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+TileAtlas::~TileAtlas()
+{
+    glDeleteTextures(1, &texture);
+}
+
+size_t TileAtlas::Acquire(const SpectrogramTile &tile)
+{
+    size_t slot;
+    auto found = resident.find(tile.key);
+    if (found != resident.end())
+    {
+        slot = found->second;
+    }
+    else
+    {
+        slot = 0;
+        for (size_t i = 1; i < slots.size(); ++i)
+        {
+            if (!slots[slot].used)
+            {
+                break;
+            }
+            if (!slots[i].used || slots[i].lastUse < slots[slot].lastUse)
+            {
+                slot = i;
+            }
+        }
+        if (slots[slot].used)
+        {
+            if (slots[slot].lastUse == frame)
+            {
+                return SIZE_MAX;
+            }
+            resident.erase(slots[slot].key);
+        }
+        slots[slot].key = tile.key;
+        slots[slot].used = true;
+        slots[slot].uploadedColumns = 0;
+        resident[tile.key] = slot;
+    }
+
+    Slot &entry = slots[slot];
+    entry.lastUse = frame;
+    if (tile.validColumns > entry.uploadedColumns)
+    {
+        // columns are rows of the texture, so new columns are one contiguous upload
+        size_t x = (slot % slotsX) * slotWidth;
+        size_t y = (slot / slotsX) * slotHeight + entry.uploadedColumns;
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, slotWidth, tile.validColumns - entry.uploadedColumns,
+                        GL_RED, GL_UNSIGNED_BYTE, tile.data.data() + entry.uploadedColumns * slotWidth);
+        entry.uploadedColumns = tile.validColumns;
+    }
+    return slot;
+}
+
+void TileAtlas::SlotRect(size_t slot, glm::vec4 &rect) const
+{
+    float width = float(slotWidth * slotsX);
+    float height = float(slotHeight * slotsY);
+    rect.x = ((slot % slotsX) * slotWidth + 0.5f) / width;
+    rect.y = ((slot / slotsX) * slotHeight + 0.5f) / height;
+    rect.z = ((slot % slotsX + 1) * slotWidth - 0.5f) / width;
+    rect.w = ((slot / slotsX + 1) * slotHeight - 0.5f) / height;
+}
+
+// Splits [0, count) into contiguous ranges and runs body(begin, end) for each on its own thread, as
+// many threads as cores unless threads is given
+void ParallelFor(size_t count, const std::function<void(size_t, size_t)> &body, size_t threads = 0)
+{
+    threads = std::max<size_t>(1, std::min<size_t>(threads ? threads : boost::thread::hardware_concurrency(), count));
+    if (threads <= 1)
+    {
+        body(0, count);
+        return;
+    }
+    boost::thread_group group;
+    for (size_t t = 0; t < threads; ++t)
+    {
+        size_t begin = count * t / threads;
+        size_t end = count * (t + 1) / threads;
+        group.create_thread([&body, begin, end]() { body(begin, end); });
+    }
+    group.join_all();
+}
+
+// Threads kept waiting for work, for work split many times a second where starting and joining
+// threads each time, as ParallelFor does, would cost more than the work. Run is called from one
+// thread at a time.
+class WorkerPool
+{
+public:
+    // threads = 0 for one per core, the calling thread counts as one
+    WorkerPool(size_t threads = 0);
+    ~WorkerPool();
+
+    size_t Threads() const { return threads; }
+
+    // Splits [0, count) into contiguous ranges like ParallelFor and runs body(begin, end) for each,
+    // the first on the calling thread, and returns when all are done
+    void Run(size_t count, const std::function<void(size_t, size_t)> &body);
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+private:
+    void Work(size_t index);
+
+    size_t threads;
+    boost::mutex mutex;
+    boost::condition_variable wake;
+    boost::condition_variable done;
+    // the job of the current generation and the ranges still running
+    const std::function<void(size_t, size_t)> *job = nullptr;
+    size_t jobCount = 0;
+    size_t jobRanges = 0;
+    size_t pending = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+    boost::thread_group workers;
+};
+
+WorkerPool::WorkerPool(size_t threads)
+    : threads(threads ? threads : std::max(1u, boost::thread::hardware_concurrency()))
+{
+    for (size_t t = 1; t < this->threads; ++t)
+    {
+        workers.create_thread([this, t]() { Work(t); });
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    workers.join_all();
+}
+
+void WorkerPool::Run(size_t count, const std::function<void(size_t, size_t)> &body)
+{
+    size_t ranges = std::max<size_t>(1, std::min(threads, count));
+    if (ranges <= 1)
+    {
+        body(0, count);
+        return;
+    }
+    {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        job = &body;
+        jobCount = count;
+        jobRanges = ranges;
+        pending = ranges - 1;
+        ++generation;
+    }
+    wake.notify_all();
+    body(0, count / ranges);
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (pending > 0)
+    {
+        done.wait(lock);
+    }
+    job = nullptr;
+}
+
+void WorkerPool::Work(size_t index)
+{
+    uint64_t seen = 0;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (;;)
+    {
+        while (!stopping && generation == seen)
+        {
+            wake.wait(lock);
+        }
+        if (stopping)
+        {
+            return;
+        }
+        // a job split into fewer ranges than threads leaves the last ones idle
+        seen = generation;
+        if (index >= jobRanges)
+        {
+            continue;
+        }
+        const std::function<void(size_t, size_t)> &body = *job;
+        size_t begin = jobCount * index / jobRanges;
+        size_t end = jobCount * (index + 1) / jobRanges;
+        lock.unlock();
+        body(begin, end);
+        lock.lock();
+        if (--pending == 0)
+        {
+            done.notify_one();
+        }
+    }
+}
+
+// Rows of the scalogram, wavelet scales log spaced from SCALOGRAM_LOW_HZ to SCALOGRAM_HIGH_HZ or
+// 0.45 of the sample rate, whichever is lower
+const size_t SCALOGRAM_SCALES = 64;
+const double SCALOGRAM_LOW_HZ = 50.0;
+const double SCALOGRAM_HIGH_HZ = 16000.0;
+// Transform size shared by a block of scalogram columns, raised where the lowest wavelet needs more
+const size_t SCALOGRAM_FFT_SIZE = 16384;
+// Cycles of the Morlet wavelet's centre frequency per standard deviation of its envelope, times 2 pi.
+// Higher resolves frequency better and time worse.
+const double MORLET_OMEGA = 6.0;
+// Standard deviations of a wavelet kept in time and in frequency, its tails are below -60 dB
+const double MORLET_SUPPORT = 4.0;
+
+// Smallest power of two of at least n
+size_t NextPowerOfTwo(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+    {
+        p <<= 1;
+    }
+    return p;
+}
+
+// Continuous wavelet transform with complex Morlet wavelets, each scale's convolution done in the
+// frequency domain. A block of columns shares one forward transform; each scale then multiplies
+// the few bins its wavelet passes and runs its own inverse transform, only as long as its band and
+// the spacing of the columns need, so the upper scales cost the most. Scales run in parallel.
+class MorletTransform
+{
+public:
+    // Scales are split over threads threads, 0 for one per core
+    MorletTransform(double sampleRate, size_t scales = SCALOGRAM_SCALES, size_t fftSize = SCALOGRAM_FFT_SIZE,
+                    size_t threads = 0);
+
+    size_t Scales() const { return bands.size(); }
+    double Frequency(size_t scale) const { return bands[scale].frequency; }
+    // Samples a column needs on either side of its position
+    size_t Margin() const { return margin; }
+    // Columns one forward transform serves at a hop
+    size_t BlockColumns(size_t hop) const;
+
+    // Magnitudes in dB relative to a full scale sine of count columns at samples first + c * hop,
+    // the scales of a column adjacent and lowest first
+    void Columns(const SampleHistory &history, size_t first, size_t hop, size_t count, float *out) const;
+
+private:
+    struct Band
+    {
+        double frequency;
+        // gains of the bins from firstBin on, where the wavelet's spectrum is significant
+        size_t firstBin;
+        std::vector<float> gains;
+        // smallest transform size holding the band
+        size_t size;
+    };
+
+    // Block samples before the first column, a multiple of the output spacing of the inverse transforms
+    size_t Lead(size_t hop) const;
+    // Output spacing of the inverse transforms, the largest power of two dividing hop
+    size_t Grid(size_t hop) const;
+
+    size_t margin;
+    size_t size;
+    Fft fft;
+    std::vector<Band> bands;
+    // inverse transforms by size, every power of two up to size
+    std::map<size_t, Fft> inverses;
+    // kept from one call of Columns to the next, running work doesn't change the transform
+    mutable WorkerPool pool;
+};
+
+MorletTransform::MorletTransform(double sampleRate, size_t scales, size_t fftSize, size_t threads)
+    : margin(size_t(MORLET_SUPPORT * MORLET_OMEGA / (2.0 * M_PI * SCALOGRAM_LOW_HZ) * sampleRate)),
+      size(NextPowerOfTwo(std::max(fftSize, 4 * margin))), fft(size), pool(std::min(threads, scales))
+{
+    for (size_t m = 2; m <= size; m <<= 1)
+    {
+        inverses.insert(std::make_pair(m, Fft(m)));
+    }
+
+    // a Gaussian around each scale's frequency with a width of frequency / omega in the frequency
+    // domain, zero at negative frequencies, scaled by 2 so a sine reads its amplitude
+    double high = std::min(SCALOGRAM_HIGH_HZ, 0.45 * sampleRate);
+    bands.resize(scales);
+    for (size_t s = 0; s < scales; ++s)
+    {
+        Band &band = bands[s];
+        band.frequency = SCALOGRAM_LOW_HZ * pow(high / SCALOGRAM_LOW_HZ, scales > 1 ? double(s) / (scales - 1) : 0.0);
+        double sigma = band.frequency / MORLET_OMEGA;
+        double binHz = sampleRate / size;
+        size_t low = std::max<size_t>(1, size_t(ceil((band.frequency - MORLET_SUPPORT * sigma) / binHz)));
+        size_t top = std::min(size / 2, size_t((band.frequency + MORLET_SUPPORT * sigma) / binHz));
+        band.firstBin = low;
+        for (size_t k = low; k <= top; ++k)
+        {
+            double x = (k * binHz - band.frequency) / sigma;
+            band.gains.push_back(float(2.0 * exp(-0.5 * x * x)));
+        }
+        band.size = NextPowerOfTwo(std::max<size_t>(band.gains.size(), 2));
+    }
+}
+
+size_t MorletTransform::Grid(size_t hop) const
+{
+    return std::min(hop & (~hop + 1), size / 8);
+}
+
+size_t MorletTransform::Lead(size_t hop) const
+{
+    size_t grid = Grid(hop);
+    return (margin + grid - 1) / grid * grid;
+}
+
+size_t MorletTransform::BlockColumns(size_t hop) const
+{
+    return (size - 2 * Lead(hop) - 1) / hop + 1;
+}
+
+void MorletTransform::Columns(const SampleHistory &history, size_t first, size_t hop, size_t count, float *out) const
+{
+    size_t scales = bands.size();
+    size_t lead = Lead(hop);
+    size_t grid = Grid(hop);
+    size_t perBlock = BlockColumns(hop);
+    std::vector<float> block(size);
+    std::vector<std::complex<float>> spectrum(size);
+
+    // a scale costs about an inverse transform of its size; the costliest go first, each to the
+    // share with the least work so far, and the shares are laid out one after another
+    auto inverseSize = [&](size_t s) { return std::max(bands[s].size, size / grid); };
+    size_t shares = std::min(pool.Threads(), scales);
+    std::vector<size_t> byCost(scales);
+    for (size_t s = 0; s < scales; ++s)
+    {
+        byCost[s] = s;
+    }
+    std::sort(byCost.begin(), byCost.end(), [&](size_t a, size_t b) { return inverseSize(a) > inverseSize(b); });
+    std::vector<std::vector<size_t>> share(shares);
+    std::vector<double> shareCost(shares, 0.0);
+    for (size_t s : byCost)
+    {
+        size_t least = size_t(std::min_element(shareCost.begin(), shareCost.end()) - shareCost.begin());
+        share[least].push_back(s);
+        shareCost[least] += inverseSize(s) * log2(double(inverseSize(s))) + bands[s].gains.size();
+    }
+    std::vector<size_t> order;
+    std::vector<size_t> shareStart;
+    for (size_t t = 0; t < shares; ++t)
+    {
+        shareStart.push_back(order.size());
+        order.insert(order.end(), share[t].begin(), share[t].end());
+    }
+    shareStart.push_back(order.size());
+
+    for (size_t c0 = 0; c0 < count; c0 += perBlock)
+    {
+        size_t c1 = std::min(count, c0 + perBlock);
+        // the block starts lead samples before its first column, silence before the history
+        size_t position = first + c0 * hop;
+        size_t skip = position < lead ? lead - position : 0;
+        std::fill(block.begin(), block.begin() + skip, 0.0f);
+        history.Read(position + skip - lead, size - skip, block.data() + skip);
+        for (size_t i = 0; i < size; ++i)
+        {
+            spectrum[i] = std::complex<float>(block[i], 0.0f);
+        }
+        fft.Forward(spectrum.data());
+
+        // one share per thread
+        pool.Run(shares, [&](size_t begin, size_t end) {
+            std::vector<std::complex<float>> band(size);
+            for (size_t n = shareStart[begin]; n < shareStart[end]; ++n)
+            {
+                size_t s = order[n];
+                const Band &b = bands[s];
+                // a band of at most m bins at bin k alias to k mod m without overlap, so an
+                // inverse of size m gives the convolution at every size / m samples
+                size_t m = std::max(b.size, size / grid);
+                std::fill(band.begin(), band.begin() + m, std::complex<float>());
+                for (size_t i = 0; i < b.gains.size(); ++i)
+                {
+                    band[(b.firstBin + i) % m] = spectrum[b.firstBin + i] * b.gains[i];
+                }
+                inverses.at(m).Inverse(band.data());
+                float scale = float(m) / size;
+                for (size_t c = c0; c < c1; ++c)
+                {
+                    size_t index = (lead + (c - c0) * hop) / (size / m);
+                    out[c * scales + s] = 20.0f * log10f(std::abs(band[index]) * scale + 1e-12f);
+                }
+            }
+        });
+    }
+}
+
+// Maximum spectrogram columns computed per frame, keeps frame time bounded while tiles fill in
+const size_t SPECTROGRAM_COLUMN_BUDGET = 512;
+// Reassigned spectrogram. Besides the Hann windowed transform of each frame, the transforms with
+// the window times time and with the window's derivative give every bin's group delay and
+// instantaneous frequency (Auger and Flandrin), and the bin's energy is added to the column and bin
+// found there instead of where it was measured, so tones and transients stay sharp. Both extra
+// transforms are of real signals and share one complex FFT.
+class ReassignedStft
+{
+public:
+    ReassignedStft(size_t fftSize);
+
+    size_t Bins() const { return size / 2; }
+    // Samples a column needs after its centre, for the last frame that can move energy into it
+    size_t Margin(size_t hop) const { return LeadFrames(hop) * hop + size / 2; }
+
+    // Power in dB relative to a full scale sine of count columns of hop samples centred on samples
+    // first + c * hop, the bins of a column adjacent and lowest first
+    void Columns(const SampleHistory &history, size_t first, size_t hop, size_t count, float *out);
+
+private:
+    // Frames on either side of a column that can move energy into it, energy moves at most half a
+    // window from its frame
+    size_t LeadFrames(size_t hop) const { return (size / 2 + hop / 2 + hop - 1) / hop - 1; }
+    // Adds the energy of the last frame's bins to the grid where it was reassigned to, offset being
+    // the frame's centre in samples from the start of the first column
+    void Reassign(double offset, size_t hop, size_t count);
+
+    size_t size;
+    Fft fft;
+    std::vector<float> window;
+    std::vector<float> timeWindow;
+    std::vector<float> derivativeWindow;
+    // scales |X(k)|^2 so the bins of a full scale sine sum to 1
+    float powerScale;
+    std::vector<float> samples;
+    std::vector<std::complex<float>> spectrum;
+    std::vector<std::complex<float>> extra;
+    std::vector<std::complex<float>> timeSpectrum;
+    std::vector<std::complex<float>> derivativeSpectrum;
+    std::vector<float> grid;
+};
+
+ReassignedStft::ReassignedStft(size_t fftSize)
+    : size(fftSize), fft(fftSize), window(fftSize), timeWindow(fftSize), derivativeWindow(fftSize), samples(fftSize),
+      spectrum(fftSize), extra(fftSize), timeSpectrum(fftSize / 2), derivativeSpectrum(fftSize / 2)
+{
+    // Hann window, time measured in samples from its centre, derivative per sample
+    double sum = 0.0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        double phase = 2.0 * M_PI * i / size;
+        window[i] = float(0.5 - 0.5 * cos(phase));
+        timeWindow[i] = float((double(i) - size / 2.0) * window[i]);
+        derivativeWindow[i] = float(M_PI / size * sin(phase));
+        sum += double(window[i]) * window[i];
+    }
+    powerScale = float(4.0 / (size * sum));
+}
+
+void ReassignedStft::Columns(const SampleHistory &history, size_t first, size_t hop, size_t count, float *out)
+{
+    size_t bins = Bins();
+    grid.assign(count * bins, 0.0f);
+    long lead = long(LeadFrames(hop));
+    for (long frame = -lead; frame < long(count) + lead; ++frame)
+    {
+        // frames are centred on the columns, silence before the history
+        long start = long(first) + frame * long(hop) - long(size / 2);
+        size_t skip = size_t(std::max(-start, 0L));
+        std::fill(samples.begin(), samples.begin() + std::min(skip, size), 0.0f);
+        if (skip < size)
+        {
+            history.Read(size_t(start + long(skip)), size - skip, samples.data() + skip);
+        }
+        for (size_t i = 0; i < size; ++i)
+        {
+            spectrum[i] = std::complex<float>(samples[i] * window[i], 0.0f);
+            extra[i] = std::complex<float>(samples[i] * timeWindow[i], samples[i] * derivativeWindow[i]);
+        }
+        fft.Forward(spectrum.data());
+        fft.Forward(extra.data());
+        // with Z = X + iY of real x and y, X(k) = (Z(k) + conj(Z(-k))) / 2 and Y(k) = (Z(k) - conj(Z(-k))) / 2i
+        for (size_t k = 0; k < bins; ++k)
+        {
+            std::complex<float> a = extra[k], b = std::conj(extra[(size - k) & (size - 1)]);
+            timeSpectrum[k] = (a + b) * 0.5f;
+            derivativeSpectrum[k] = std::complex<float>((a - b).imag() * 0.5f, -(a - b).real() * 0.5f);
+        }
+        Reassign(double(frame * long(hop)) + hop / 2.0, hop, count);
+    }
+    // empty cells read as the floor of any display, log10 of 0 would be -inf
+    for (size_t i = 0; i < count * bins; ++i)
+    {
+        out[i] = 10.0f * log10f(grid[i] + 1e-12f);
+    }
+}
+
+void ReassignedStft::Reassign(double offset, size_t hop, size_t count)
+{
+    // the group delay Re(Xt / X) moves energy in time, the instantaneous frequency offset
+    // -Im(Xd / X) in frequency; coordinates are worked out four bins at a time where SSE2 is
+    // available and the energy is then added to its cell one bin at a time
+    size_t bins = Bins();
+    const float *h = reinterpret_cast<const float *>(spectrum.data());
+    const float *t = reinterpret_cast<const float *>(timeSpectrum.data());
+    const float *d = reinterpret_cast<const float *>(derivativeSpectrum.data());
+    float binsPerRadian = float(size / (2.0 * M_PI));
+    float columnOffset = float(offset / hop) + 1.0f;
+    float columnsPerSample = 1.0f / hop;
+    float power[4];
+    int32_t column[4], bin[4];
+    size_t k = 0;
+    auto scatter = [&](size_t lanes) {
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            // columns were computed one too high so truncation rounds down for the first negative one
+            if (column[lane] >= 1 && size_t(column[lane]) <= count && bin[lane] >= 0 && size_t(bin[lane]) < bins)
+            {
+                grid[(column[lane] - 1) * bins + bin[lane]] += power[lane];
+            }
+        }
+    };
+#ifdef __SSE2__
+    __m128 tiny = _mm_set1_ps(1e-30f);
+    __m128 scale = _mm_set1_ps(powerScale);
+    __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    for (; k + 4 <= bins; k += 4)
+    {
+        // two complex values per load, split into real and imaginary parts of four bins
+        __m128 h0 = _mm_loadu_ps(h + 2 * k), h1 = _mm_loadu_ps(h + 2 * k + 4);
+        __m128 t0 = _mm_loadu_ps(t + 2 * k), t1 = _mm_loadu_ps(t + 2 * k + 4);
+        __m128 d0 = _mm_loadu_ps(d + 2 * k), d1 = _mm_loadu_ps(d + 2 * k + 4);
+        __m128 hr = _mm_shuffle_ps(h0, h1, _MM_SHUFFLE(2, 0, 2, 0)), hi = _mm_shuffle_ps(h0, h1, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 tr = _mm_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 2, 0)), ti = _mm_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 dr = _mm_shuffle_ps(d0, d1, _MM_SHUFFLE(2, 0, 2, 0)), di = _mm_shuffle_ps(d0, d1, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 norm = _mm_add_ps(_mm_mul_ps(hr, hr), _mm_mul_ps(hi, hi));
+        __m128 inverse = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(norm, tiny));
+        __m128 delay = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(tr, hr), _mm_mul_ps(ti, hi)), inverse);
+        __m128 shift = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(di, hr), _mm_mul_ps(dr, hi)), inverse);
+        __m128 x = _mm_add_ps(_mm_set1_ps(columnOffset), _mm_mul_ps(delay, _mm_set1_ps(columnsPerSample)));
+        __m128 y = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(float(k)), lane), _mm_mul_ps(shift, _mm_set1_ps(binsPerRadian)));
+        // beyond the range of int32 both convert to INT32_MIN, which is out of the grid
+        _mm_storeu_ps(power, _mm_mul_ps(norm, scale));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(column), _mm_cvttps_epi32(_mm_max_ps(x, _mm_setzero_ps())));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(bin), _mm_cvtps_epi32(y));
+        scatter(4);
+    }
+#endif
+    for (; k < bins; ++k)
+    {
+        float hr = h[2 * k], hi = h[2 * k + 1];
+        float norm = hr * hr + hi * hi;
+        float inverse = 1.0f / std::max(norm, 1e-30f);
+        float delay = (t[2 * k] * hr + t[2 * k + 1] * hi) * inverse;
+        float shift = (d[2 * k + 1] * hr - d[2 * k] * hi) * inverse;
+        float x = columnOffset + delay * columnsPerSample;
+        float y = float(k) - shift * binsPerRadian;
+        power[0] = norm * powerScale;
+        column[0] = x > 0.0f && x < 2e9f ? int32_t(x) : 0;
+        bin[0] = y > -1.0f && y < 2e9f ? int32_t(floorf(y + 0.5f)) : -1;
+        scatter(1);
+    }
+}
+
+// Maximum scalogram blocks computed per frame, each one forward transform and one inverse per scale
+const size_t SCALOGRAM_BLOCK_BUDGET = 4;
+// Main thread time per frame spent on reassigned spectrogram columns, each costs two transforms
+// (about 60 us with the default FFT size, so some 64 columns a frame)
+const double REASSIGNED_FRAME_SECONDS = 0.004;
+// Tiles kept in memory (128 KiB each with default parameters)
+const size_t SPECTROGRAM_CPU_TILES = 256;
+// Atlas layout in tile slots (4x8 slots of 512x256 texels)
+const size_t SPECTROGRAM_ATLAS_SLOTS_X = 4;
+const size_t SPECTROGRAM_ATLAS_SLOTS_Y = 8;
+
+// Zoomable spectrogram of a sample history, computed tile by tile on demand. Tiles live in a CPU
+// LRU cache, a GPU texture atlas and, for file sources, a persistent disk cache. The GL objects
+// may be shared by several contexts, each drawing with its own vertex array. Params with scales
+// make it a Morlet wavelet scalogram with one row per scale, reassigned params a reassigned
+// spectrogram.
+class SpectrogramView
+{
+public:
+    SpectrogramView(const SpectrogramParams &params, uint64_t sourceHash) noexcept(false);
+    ~SpectrogramView();
+
+    // Creates a vertex array for drawing in the current context
+    GLuint CreateVertexArray() noexcept(false);
+    // Starts a frame; every Draw until the next call shares the frame's column budget and atlas slots
+    void BeginFrame();
+    // Draws samples [viewStart, viewStart + viewLength) of the history across the viewport, with a
+    // vertex array created for the current context
+    void Draw(const SampleHistory &history, double viewStart, double viewLength, int widthPixels, GLuint vao);
+
+    SpectrogramView(const SpectrogramView &) = delete;
+    SpectrogramView &operator=(const SpectrogramView &) = delete;
+
+private:
+    struct TileVertex
+    {
+        glm::vec2 position;
+        glm::vec2 texCoord;
+    };
+
+    // Coarsest level with at least one column per pixel
+    size_t ChooseLevel(double viewLength, int widthPixels) const;
+    std::shared_ptr<SpectrogramTile> FetchTile(const TileKey &key);
+    // Computes missing columns that the history can supply, up to the frame's budget
+    void ComputeColumns(SpectrogramTile &tile, const SampleHistory &history);
+
+    SpectrogramParams params;
+    Fft fft;
+    std::vector<float> window;
+    float magnitudeScale;
+    std::vector<float> samples;
+    std::vector<std::complex<float>> spectrum;
+    // columns, or blocks of columns for a scalogram, left to compute this frame
+    size_t columnBudget = 0;
+    // running average of the time a reassigned column takes, which sets its budget
+    double reassignedColumnSeconds = 60e-6;
+    // created with the first history, whose sample rate it depends on
+    std::unique_ptr<MorletTransform> morlet;
+    std::unique_ptr<ReassignedStft> reassignment;
+    std::vector<float> magnitudes;
+
+    TileCache cache;
+    DiskTileCache disk;
+    TileAtlas atlas;
+
+    GLuint program = 0;
+    GLuint vbo = 0;
+    std::vector<TileVertex> vertices;
+};
+
+SpectrogramView::SpectrogramView(const SpectrogramParams &params, uint64_t sourceHash)
+    : params(params), fft(params.fftSize), window(params.fftSize), samples(params.fftSize),
+      spectrum(params.fftSize), cache(SPECTROGRAM_CPU_TILES), disk(sourceHash, params),
+      atlas(params.Bins(), params.tileColumns, SPECTROGRAM_ATLAS_SLOTS_X, SPECTROGRAM_ATLAS_SLOTS_Y)
+{
+    // Hann window, magnitudes scaled so a full scale sine reads 0 dB
+    float sum = 0.0f;
+    for (size_t i = 0; i < params.fftSize; ++i)
+    {
+        window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / params.fftSize);
+        sum += window[i];
+    }
+    magnitudeScale = 2.0f / sum;
+
+    // texCoord.x selects the bin and texCoord.y the column, since columns are stored as texture rows
+    const char *vertSrc =
+        "#version 330 core\n"
+        "in vec2 position;\n"
+        "in vec2 texCoord;\n"
+        "out vec2 uv;\n"
+        "void main(){\n"
+        "   uv = texCoord;\n"
+        "   gl_Position = vec4(position, 0.0f, 1.0f);\n"
+        "}\n";
+
+    const char *fragSrc =
+        "#version 330 core\n"
+        "in vec2 uv;\n"
+        "out vec4 fragColor;\n"
+        "uniform sampler2D atlas;\n"
+        "void main(){\n"
+        "   float m = texture(atlas, uv).r;\n"
+        "   vec3 c = mix(vec3(0.0f, 0.0f, 0.1f), vec3(0.5f, 0.0f, 0.6f), smoothstep(0.0f, 0.4f, m));\n"
+        "   c = mix(c, vec3(1.0f, 0.5f, 0.0f), smoothstep(0.4f, 0.75f, m));\n"
+        "   c = mix(c, vec3(1.0f, 1.0f, 0.8f), smoothstep(0.75f, 1.0f, m));\n"
+        "   fragColor = vec4(c, 1.0f);\n"
+        "}\n";
+
+    GLuint vertShader = CreateShader(GL_VERTEX_SHADER, vertSrc);
+    if (INVALID_GL_ID(vertShader) || !ShaderIsCompiled(vertShader))
+    {
+        PrintShaderLog(std::cerr, vertShader);
+        throw std::runtime_error("spectrogram vertex shader failed to compile");
+    }
+    GLuint fragShader = CreateShader(GL_FRAGMENT_SHADER, fragSrc);
+    if (INVALID_GL_ID(fragShader) || !ShaderIsCompiled(fragShader))
+    {
+        PrintShaderLog(std::cerr, fragShader);
+        throw std::runtime_error("spectrogram fragment shader failed to compile");
+    }
+    program = CreateProgram(vertShader, fragShader);
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+    if (INVALID_GL_ID(program) || !ProgramIsLinked(program))
+    {
+        PrintProgramLog(std::cerr, program);
+        throw std::runtime_error("spectrogram program failed to link");
+    }
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "atlas"), 0);
+    glUseProgram(0);
+
+    glGenBuffers(1, &vbo);
+    if (INVALID_GL_ID(vbo))
+    {
+        throw std::runtime_error("spectrogram vbo created with id 0");
+    }
+}
+
+SpectrogramView::~SpectrogramView()
+{
+    glDeleteBuffers(1, &vbo);
+    glDeleteProgram(program);
+}
+
+GLuint SpectrogramView::CreateVertexArray()
+{
+    GLuint vao = 0;
+    glGenVertexArrays(1, &vao);
+    if (INVALID_GL_ID(vao))
+    {
+        throw std::runtime_error("spectrogram vao created with id 0");
+    }
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    GLint positionAttrib = glGetAttribLocation(program, "position");
+    glVertexAttribPointer(positionAttrib, 2, GL_FLOAT, GL_FALSE, sizeof(TileVertex), nullptr);
+    glEnableVertexAttribArray(positionAttrib);
+    GLint texCoordAttrib = glGetAttribLocation(program, "texCoord");
+    glVertexAttribPointer(texCoordAttrib, 2, GL_FLOAT, GL_FALSE, sizeof(TileVertex), (void *)sizeof(glm::vec2));
+    glEnableVertexAttribArray(texCoordAttrib);
+    glBindVertexArray(0);
+    return vao;
+}
+
+void SpectrogramView::BeginFrame()
+{
+    atlas.BeginFrame();
+    columnBudget = params.scales       ? SCALOGRAM_BLOCK_BUDGET
+                   : params.reassigned ? std::max<size_t>(1, size_t(REASSIGNED_FRAME_SECONDS / reassignedColumnSeconds))
+                                       : SPECTROGRAM_COLUMN_BUDGET;
+}
+
+size_t SpectrogramView::ChooseLevel(double viewLength, int widthPixels) const
+{
+    size_t level = 0;
+    while (level + 1 < params.levels && params.Hop(level) * double(std::max(widthPixels, 1)) < viewLength)
+    {
+        ++level;
+    }
+    return level;
+}
+
+std::shared_ptr<SpectrogramTile> SpectrogramView::FetchTile(const TileKey &key)
+{
+    std::shared_ptr<SpectrogramTile> tile = cache.Find(key);
+    if (!tile)
+    {
+        tile = std::make_shared<SpectrogramTile>();
+        tile->key = key;
+        if (!disk.Load(*tile))
+        {
+            tile->validColumns = 0;
+            tile->data.assign(params.TileBytes(), 0);
+        }
+        cache.Insert(tile);
+    }
+    return tile;
+}
+
+void SpectrogramView::ComputeColumns(SpectrogramTile &tile, const SampleHistory &history)
+{
+    size_t hop = params.Hop(tile.key.level);
+    size_t tileStart = tile.key.index * params.TileSpan(tile.key.level);
+    size_t bins = params.Bins();
+    bool wasComplete = tile.validColumns == params.tileColumns;
+
+    if ((params.scales || params.reassigned) && columnBudget > 0)
+    {
+        if (params.scales && !morlet)
+        {
+            morlet.reset(new MorletTransform(double(history.SampleRate()), params.scales, params.fftSize));
+        }
+        if (params.reassigned && !reassignment)
+        {
+            reassignment.reset(new ReassignedStft(params.fftSize));
+        }
+        // a column sits in the middle of its span, live ones wait for the lowest wavelet's support or
+        // for the last frame that can move energy into them
+        size_t margin = morlet ? morlet->Margin() : reassignment->Margin(hop);
+        size_t perBudget = morlet ? morlet->BlockColumns(hop) : 1;
+        size_t first = tileStart + tile.validColumns * hop + hop / 2;
+        size_t end = history.IsComplete() ? history.Size() + hop / 2 : history.Size() - std::min(history.Size(), margin);
+        size_t count = first < end ? (end - first + hop - 1) / hop : 0;
+        count = std::min(std::min(count, params.tileColumns - tile.validColumns), columnBudget * perBudget);
+        if (count > 0)
+        {
+            magnitudes.resize(count * bins);
+            if (morlet)
+            {
+                morlet->Columns(history, first, hop, count, magnitudes.data());
+            }
+            else
+            {
+                double start = SecondsNow();
+                reassignment->Columns(history, first, hop, count, magnitudes.data());
+                double perColumn = (SecondsNow() - start) / count;
+                reassignedColumnSeconds = 0.8 * reassignedColumnSeconds + 0.2 * perColumn;
+            }
+            uint8_t *column = tile.data.data() + tile.validColumns * bins;
+            for (size_t i = 0; i < count * bins; ++i)
+            {
+                float level = (magnitudes[i] - params.floorDb) / -params.floorDb;
+                column[i] = uint8_t(std::min(std::max(level, 0.0f), 1.0f) * 255.0f);
+            }
+            tile.validColumns += count;
+            columnBudget -= (count + perBudget - 1) / perBudget;
+        }
+    }
+
+    while (!params.scales && !params.reassigned && tile.validColumns < params.tileColumns && columnBudget > 0)
+    {
+        size_t columnStart = tileStart + tile.validColumns * hop;
+        // live columns wait for their full window so they never change once computed
+        bool ready = history.IsComplete() ? columnStart < history.Size()
+                                          : columnStart + params.fftSize <= history.Size();
+        if (!ready)
+        {
+            break;
+        }
+        history.Read(columnStart, params.fftSize, samples.data());
+        for (size_t i = 0; i < params.fftSize; ++i)
+        {
+            spectrum[i] = std::complex<float>(samples[i] * window[i], 0.0f);
+        }
+        fft.Forward(spectrum.data());
+
+        uint8_t *column = tile.data.data() + tile.validColumns * bins;
+        for (size_t bin = 0; bin < bins; ++bin)
+        {
+            float magnitude = std::abs(spectrum[bin]) * magnitudeScale;
+            float db = 20.0f * log10f(magnitude + 1e-12f);
+            float level = (db - params.floorDb) / -params.floorDb;
+            column[bin] = uint8_t(std::min(std::max(level, 0.0f), 1.0f) * 255.0f);
+        }
+        ++tile.validColumns;
+        --columnBudget;
+    }
+
+    // a file tile past the end of the history stays short, fill it with silence so it can complete
+    if (history.IsComplete() && tileStart + tile.validColumns * hop >= history.Size())
+    {
+        tile.validColumns = params.tileColumns;
+    }
+    if (!wasComplete && tile.validColumns == params.tileColumns)
+    {
+        disk.Store(tile);
+    }
+}
+
+void SpectrogramView::Draw(const SampleHistory &history, double viewStart, double viewLength, int widthPixels,
+                           GLuint vao)
+{
+    size_t level = ChooseLevel(viewLength, widthPixels);
+    size_t span = params.TileSpan(level);
+    double viewEnd = std::min(viewStart + viewLength, double(history.Size()));
+    double first = std::max(viewStart, double(history.First()));
+    if (viewEnd <= first)
+    {
+        return;
+    }
+
+    vertices.clear();
+
+    for (size_t index = size_t(first) / span; index * double(span) < viewEnd; ++index)
+    {
+        TileKey key = {level, index};
+        std::shared_ptr<SpectrogramTile> tile = FetchTile(key);
+        ComputeColumns(*tile, history);
+        if (tile->validColumns == 0)
+        {
+            continue;
+        }
+        size_t slot = atlas.Acquire(*tile);
+        if (slot == SIZE_MAX)
+        {
+            break;
+        }
+
+        glm::vec4 rect;
+        atlas.SlotRect(slot, rect);
+        // only the computed part of a live edge tile is drawn
+        double tileStart = double(index) * span;
+        double tileEnd = tileStart + double(tile->validColumns) * params.Hop(level);
+        float v1 = rect.y + (rect.w - rect.y) * float(tile->validColumns) / params.tileColumns;
+        float x0 = float(-1.0 + 2.0 * (tileStart - viewStart) / viewLength);
+        float x1 = float(-1.0 + 2.0 * (tileEnd - viewStart) / viewLength);
+
+        TileVertex quad[] = {
+            {{x0, -1.0f}, {rect.x, rect.y}},
+            {{x1, -1.0f}, {rect.x, v1}},
+            {{x0, 1.0f}, {rect.z, rect.y}},
+            {{x0, 1.0f}, {rect.z, rect.y}},
+            {{x1, -1.0f}, {rect.x, v1}},
+            {{x1, 1.0f}, {rect.z, v1}},
+        };
+        vertices.insert(vertices.end(), quad, quad + 6);
+    }
+
+    // every visible tile is drawn from the atlas with a single draw call
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(TileVertex) * vertices.size(), vertices.data(), GL_STREAM_DRAW);
+    glUseProgram(program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, atlas.Texture());
+    glBindVertexArray(vao);
+    glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+// Stereo panorama: frequency rows log spaced from PANORAMA_LOW_HZ to Nyquist against columns of pan
+// position from hard left to hard right, each cell holding the decaying power of the bins there
+const size_t PANORAMA_ROWS = 128;
+const size_t PANORAMA_COLUMNS = 128;
+const double PANORAMA_LOW_HZ = 20.0;
+const size_t PANORAMA_FFT_SIZE = 2048;
+const size_t PANORAMA_HOP = 512;
+// Heat decays by 1/e over this much audio
+const double PANORAMA_DECAY_SECONDS = 0.25;
+// After a jump the heat is rebuilt from the frames of this many decay times before the view's end
+const double PANORAMA_SETTLE_DECAYS = 4.0;
+// Steps of the right channel's share of a bin's power looked up for its pan column
+const size_t PANORAMA_PAN_STEPS = 1024;
+// Average power per bin mapped to the bottom of the colour ramp, in dB relative to a full scale sine
+const float PANORAMA_FLOOR_DB = -90.0f;
+
+// Position of a cell's heat on the colour ramp, as in the panorama fragment shader
+float PanoramaLevel(float heat)
+{
+    float db = 10.0f * log10f(std::max(heat, 1e-30f));
+    return std::min(std::max((db - PANORAMA_FLOOR_DB) / -PANORAMA_FLOOR_DB, 0.0f), 1.0f);
+}
+
+// Per bin stereo analysis. Both channels go through one complex FFT of left + i right and are told
+// apart by its symmetry; the same pass over the bins measures each bin's power in either channel,
+// so its pan position under the constant power law, the angle atan(|R| / |L|), which only depends
+// on the level difference between the channels. The bin's power is then added to the heat of its
+// rows at that pan column. Powers and pan steps are worked out four bins at a time where SSE2 is
+// available, the heat is added one bin at a time.
+class StereoPanorama
+{
+public:
+    StereoPanorama(double sampleRate);
+
+    size_t HopSamples() const { return PANORAMA_HOP; }
+    // Factor heat decays by over a number of samples
+    double Decay(double samples) const { return exp(-samples / (PANORAMA_DECAY_SECONDS * rate)); }
+
+    // Adds the frames ending at multiples of HopSamples() in (after, end] to heat, PANORAMA_ROWS rows
+    // of PANORAMA_COLUMNS from the lowest frequency up. Each frame is decayed by the audio between
+    // it and the last one and scaled so that steady input settles at its average power per bin.
+    // Returns the end of the last frame added, after if there was none.
+    size_t Accumulate(const SampleHistory &history, size_t after, size_t end, float *heat);
+    // Level difference in dB of the left over the right channel in the last frame
+    double BalanceDb() const { return balanceDb; }
+    // Average seconds one frame took
+    double FrameSeconds() const { return frames ? frameSeconds / frames : 0.0; }
+
+private:
+    void AddFrame(const SampleHistory &history, size_t end, float weight, float *heat);
+
+    double rate;
+    Fft fft;
+    std::vector<float> window;
+    // scales the squared magnitude of a bin of either channel to the power of a full scale sine, 1
+    float powerScale;
+    std::vector<float> left;
+    std::vector<float> right;
+    std::vector<std::complex<float>> spectrum;
+    // bins from firstBin below Nyquist each cover rows [rowFirst, rowEnd), where each gets the bin's
+    // power times its rowWeight, one over the bins sharing the row
+    size_t firstBin;
+    std::vector<uint16_t> rowFirst;
+    std::vector<uint16_t> rowEnd;
+    std::vector<float> rowWeight;
+    std::vector<uint16_t> panColumn;
+    double balanceDb = 0.0;
+    double frameSeconds = 0.0;
+    size_t frames = 0;
+};
+
+StereoPanorama::StereoPanorama(double sampleRate)
+    : rate(sampleRate), fft(PANORAMA_FFT_SIZE), window(PANORAMA_FFT_SIZE), left(PANORAMA_FFT_SIZE),
+      right(PANORAMA_FFT_SIZE), spectrum(PANORAMA_FFT_SIZE), rowFirst(PANORAMA_FFT_SIZE / 2),
+      rowEnd(PANORAMA_FFT_SIZE / 2), rowWeight(PANORAMA_ROWS), panColumn(PANORAMA_PAN_STEPS)
+{
+    const size_t size = PANORAMA_FFT_SIZE;
+    double sum = 0.0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / size);
+        sum += window[i];
+    }
+    // a full scale sine's bin has a magnitude of sum / 2, the split channels are twice their size
+    powerScale = float(1.0 / (sum * sum));
+
+    // a bin covers the rows whose centre frequency falls in it, or else the row holding its centre
+    double binHz = rate / size;
+    double rowsPerLog = PANORAMA_ROWS / log(rate / 2.0 / PANORAMA_LOW_HZ);
+    auto row = [&](double hz) { return log(hz / PANORAMA_LOW_HZ) * rowsPerLog; };
+    firstBin = std::max<size_t>(1, size_t(ceil(PANORAMA_LOW_HZ / binHz)));
+    std::vector<size_t> binsPerRow(PANORAMA_ROWS);
+    for (size_t k = firstBin; k < size / 2; ++k)
+    {
+        long first = long(ceil(row((k - 0.5) * binHz) - 0.5)), end = long(ceil(row((k + 0.5) * binHz) - 0.5));
+        if (end <= first)
+        {
+            first = long(row(k * binHz));
+            end = first + 1;
+        }
+        rowFirst[k] = uint16_t(std::min(std::max(first, 0L), long(PANORAMA_ROWS)));
+        rowEnd[k] = uint16_t(std::min(std::max(end, 0L), long(PANORAMA_ROWS)));
+        for (size_t r = rowFirst[k]; r < rowEnd[k]; ++r)
+        {
+            ++binsPerRow[r];
+        }
+    }
+    for (size_t r = 0; r < PANORAMA_ROWS; ++r)
+    {
+        rowWeight[r] = binsPerRow[r] ? 1.0f / binsPerRow[r] : 0.0f;
+    }
+
+    // the right channel's share of the power is sin^2 of the pan angle
+    for (size_t i = 0; i < PANORAMA_PAN_STEPS; ++i)
+    {
+        double angle = asin(sqrt(double(i) / (PANORAMA_PAN_STEPS - 1))) / M_PI_2;
+        panColumn[i] = uint16_t(std::min(size_t(angle * PANORAMA_COLUMNS), PANORAMA_COLUMNS - 1));
+    }
+}
+
+size_t StereoPanorama::Accumulate(const SampleHistory &history, size_t after, size_t end, float *heat)
+{
+    size_t first = (after / PANORAMA_HOP + 1) * PANORAMA_HOP, last = end / PANORAMA_HOP * PANORAMA_HOP;
+    if (last < first)
+    {
+        return after;
+    }
+    double start = SecondsNow();
+    double steady = 1.0 - Decay(double(PANORAMA_HOP));
+    for (size_t frameEnd = first; frameEnd <= last; frameEnd += PANORAMA_HOP)
+    {
+        AddFrame(history, frameEnd, float(steady * Decay(double(last - frameEnd))), heat);
+    }
+    frameSeconds += SecondsNow() - start;
+    frames += (last - first) / PANORAMA_HOP + 1;
+    return last;
+}
+
+void StereoPanorama::AddFrame(const SampleHistory &history, size_t end, float weight, float *heat)
+{
+    const size_t size = PANORAMA_FFT_SIZE;
+    // the first frames reach back before the start of the history, which is silence
+    size_t count = std::min(end, size);
+    std::fill(left.begin(), left.end() - count, 0.0f);
+    std::fill(right.begin(), right.end() - count, 0.0f);
+    history.ReadChannel(0, end - count, count, left.data() + size - count);
+    history.ReadChannel(1, end - count, count, right.data() + size - count);
+    for (size_t i = 0; i < size; ++i)
+    {
+        spectrum[i] = std::complex<float>(left[i] * window[i], right[i] * window[i]);
+    }
+    fft.Forward(spectrum.data());
+
+    // with a = Z(k) and b = Z(N - k), L(k) = (a + conj(b)) / 2 and R(k) = (a - conj(b)) / 2i
+    const float *z = reinterpret_cast<const float *>(spectrum.data());
+    float scale = powerScale * weight;
+    float power[4];
+    int32_t step[4];
+    double sumLeft = 0.0, sumRight = 0.0;
+    size_t k = firstBin;
+    auto scatter = [&](size_t lanes) {
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            float *cell = heat + panColumn[step[lane]];
+            for (size_t r = rowFirst[k + lane]; r < rowEnd[k + lane]; ++r)
+            {
+                cell[r * PANORAMA_COLUMNS] += power[lane] * rowWeight[r];
+            }
+        }
+    };
+#ifdef __SSE2__
+    __m128 tiny = _mm_set1_ps(1e-30f);
+    __m128 steps = _mm_set1_ps(float(PANORAMA_PAN_STEPS - 1));
+    __m128 totalLeft = _mm_setzero_ps(), totalRight = _mm_setzero_ps();
+    for (; k + 4 <= size / 2; k += 4)
+    {
+        // bins k to k + 3 and, loaded backwards, their mirrors N - k to N - k - 3
+        __m128 a0 = _mm_loadu_ps(z + 2 * k), a1 = _mm_loadu_ps(z + 2 * k + 4);
+        __m128 b0 = _mm_loadu_ps(z + 2 * (size - k - 3)), b1 = _mm_loadu_ps(z + 2 * (size - k - 1));
+        __m128 ar = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0)), ai = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 br = _mm_shuffle_ps(b1, b0, _MM_SHUFFLE(0, 2, 0, 2)), bi = _mm_shuffle_ps(b1, b0, _MM_SHUFFLE(1, 3, 1, 3));
+        __m128 lr = _mm_add_ps(ar, br), li = _mm_sub_ps(ai, bi);
+        __m128 rr = _mm_add_ps(ai, bi), ri = _mm_sub_ps(ar, br);
+        __m128 pl = _mm_add_ps(_mm_mul_ps(lr, lr), _mm_mul_ps(li, li));
+        __m128 pr = _mm_add_ps(_mm_mul_ps(rr, rr), _mm_mul_ps(ri, ri));
+        __m128 total = _mm_add_ps(pl, pr);
+        __m128 share = _mm_div_ps(pr, _mm_max_ps(total, tiny));
+        totalLeft = _mm_add_ps(totalLeft, pl);
+        totalRight = _mm_add_ps(totalRight, pr);
+        _mm_storeu_ps(power, _mm_mul_ps(total, _mm_set1_ps(scale)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(step), _mm_cvtps_epi32(_mm_mul_ps(share, steps)));
+        scatter(4);
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, totalLeft);
+    sumLeft = double(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_ps(lanes, totalRight);
+    sumRight = double(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; k < size / 2; ++k)
+    {
+        float ar = z[2 * k], ai = z[2 * k + 1], br = z[2 * (size - k)], bi = z[2 * (size - k) + 1];
+        float pl = (ar + br) * (ar + br) + (ai - bi) * (ai - bi);
+        float pr = (ai + bi) * (ai + bi) + (ar - br) * (ar - br);
+        sumLeft += pl;
+        sumRight += pr;
+        power[0] = (pl + pr) * scale;
+        step[0] = int32_t(pr / std::max(pl + pr, 1e-30f) * (PANORAMA_PAN_STEPS - 1) + 0.5f);
+        scatter(1);
+    }
+    balanceDb = 10.0 * log10(std::max(sumLeft, 1e-30) / std::max(sumRight, 1e-30));
+}
+
+// Live panorama of a stereo history. The heat of each window lives on the GPU in a float texture of
+// a framebuffer: frames the view's end moved past are added up on the CPU, uploaded, and blended
+// into the heat while the blend's constant factor decays what was there, so the heat costs one
+// small upload and two quads per frame however long it has been building up.
+class PanoramaView
+{
+public:
+    PanoramaView() noexcept(false);
+    ~PanoramaView();
+
+    // Creates the heat, framebuffer and vertex array of a window in the current context, returns its
+    // index for Draw
+    size_t CreateTarget() noexcept(false);
+    // Deletes the objects of a window, with its context current
+    void DeleteTarget(size_t target);
+    // Brings the window's heat up to sample viewStart + viewLength of the history and draws it
+    // across the viewport
+    void Draw(const SampleHistory &history, double viewStart, double viewLength, size_t target);
+    // Figures of the analysis, null before the first draw
+    const StereoPanorama *Panorama() const { return panorama.get(); }
+
+    PanoramaView(const PanoramaView &) = delete;
+    PanoramaView &operator=(const PanoramaView &) = delete;
+
+private:
+    struct Target
+    {
+        GLuint vao;
+        GLuint framebuffer;
+        GLuint heat;
+        // end of the last frame in the heat, SIZE_MAX while the heat is empty
+        size_t analysed;
+    };
+
+    // created with the first history, whose sample rate it depends on
+    std::unique_ptr<StereoPanorama> panorama;
+    std::vector<float> fresh;
+    std::vector<Target> targets;
+    GLuint program = 0;
+    GLint accumulateUniform = -1;
+    GLuint vbo = 0;
+    // frames added this draw, uploaded before they are blended into a window's heat
+    GLuint freshTexture = 0;
+};
+
+// Creates an empty PANORAMA_COLUMNS by PANORAMA_ROWS float texture
+GLuint CreatePanoramaTexture(GLenum filter) noexcept(false)
+{
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    if (INVALID_GL_ID(texture))
+    {
+        throw std::runtime_error("panorama texture created with id 0");
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, PANORAMA_COLUMNS, PANORAMA_ROWS, 0, GL_RED, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+PanoramaView::PanoramaView() : fresh(PANORAMA_ROWS * PANORAMA_COLUMNS)
+{
+    // one quad over the viewport, which is the heat itself while accumulating
+    const char *vertSrc =
+        "#version 330 core\n"
+        "in vec2 position;\n"
+        "out vec2 uv;\n"
+        "void main(){\n"
+        "   uv = position * 0.5f + 0.5f;\n"
+        "   gl_Position = vec4(position, 0.0f, 1.0f);\n"
+        "}\n";
+
+    // passes the fresh heat through to be blended, or shows the heat in dB on the spectrogram's ramp
+    const char *fragSrc =
+        "#version 330 core\n"
+        "in vec2 uv;\n"
+        "out vec4 fragColor;\n"
+        "uniform sampler2D heat;\n"
+        "uniform bool accumulate;\n"
+        "uniform float floorDb;\n"
+        "void main(){\n"
+        "   float h = texture(heat, uv).r;\n"
+        "   if (accumulate) {\n"
+        "       fragColor = vec4(h, 0.0f, 0.0f, 1.0f);\n"
+        "       return;\n"
+        "   }\n"
+        "   float m = clamp((10.0f * log2(max(h, 1e-30f)) * 0.30103f - floorDb) / -floorDb, 0.0f, 1.0f);\n"
+        "   vec3 c = mix(vec3(0.0f, 0.0f, 0.1f), vec3(0.5f, 0.0f, 0.6f), smoothstep(0.0f, 0.4f, m));\n"
+        "   c = mix(c, vec3(1.0f, 0.5f, 0.0f), smoothstep(0.4f, 0.75f, m));\n"
+        "   c = mix(c, vec3(1.0f, 1.0f, 0.8f), smoothstep(0.75f, 1.0f, m));\n"
+        "   fragColor = vec4(c, 1.0f);\n"
+        "}\n";
+
+    GLuint vertShader = CreateShader(GL_VERTEX_SHADER, vertSrc);
+    if (INVALID_GL_ID(vertShader) || !ShaderIsCompiled(vertShader))
+    {
+        PrintShaderLog(std::cerr, vertShader);
+        throw std::runtime_error("panorama vertex shader failed to compile");
+    }
+    GLuint fragShader = CreateShader(GL_FRAGMENT_SHADER, fragSrc);
+    if (INVALID_GL_ID(fragShader) || !ShaderIsCompiled(fragShader))
+    {
+        PrintShaderLog(std::cerr, fragShader);
+        throw std::runtime_error("panorama fragment shader failed to compile");
+    }
+    program = CreateProgram(vertShader, fragShader);
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+    if (INVALID_GL_ID(program) || !ProgramIsLinked(program))
+    {
+        PrintProgramLog(std::cerr, program);
+        throw std::runtime_error("panorama program failed to link");
+    }
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "heat"), 0);
+    glUniform1f(glGetUniformLocation(program, "floorDb"), PANORAMA_FLOOR_DB);
+    accumulateUniform = glGetUniformLocation(program, "accumulate");
+    glUseProgram(0);
+
+    glGenBuffers(1, &vbo);
+    if (INVALID_GL_ID(vbo))
+    {
+        throw std::runtime_error("panorama vbo created with id 0");
+    }
+    const float quad[] = {-1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f};
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    freshTexture = CreatePanoramaTexture(GL_NEAREST);
+}
+
+PanoramaView::~PanoramaView()
+{
+    glDeleteTextures(1, &freshTexture);
+    glDeleteBuffers(1, &vbo);
+    glDeleteProgram(program);
+}
+
+size_t PanoramaView::CreateTarget()
+{
+    Target target = {0, 0, 0, SIZE_MAX};
+    glGenVertexArrays(1, &target.vao);
+    if (INVALID_GL_ID(target.vao))
+    {
+        throw std::runtime_error("panorama vao created with id 0");
+    }
+    glBindVertexArray(target.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    GLint positionAttrib = glGetAttribLocation(program, "position");
+    glVertexAttribPointer(positionAttrib, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), nullptr);
+    glEnableVertexAttribArray(positionAttrib);
+    glBindVertexArray(0);
+
+    target.heat = CreatePanoramaTexture(GL_LINEAR);
+    glGenFramebuffers(1, &target.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.heat, 0);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete)
+    {
+        throw std::runtime_error("panorama framebuffer incomplete");
+    }
+    targets.push_back(target);
+    return targets.size() - 1;
+}
+
+void PanoramaView::DeleteTarget(size_t target)
+{
+    glDeleteFramebuffers(1, &targets[target].framebuffer);
+    glDeleteTextures(1, &targets[target].heat);
+    glDeleteVertexArrays(1, &targets[target].vao);
+}
+
+void PanoramaView::Draw(const SampleHistory &history, double viewStart, double viewLength, size_t target)
+{
+    if (!panorama)
+    {
+        panorama.reset(new StereoPanorama(double(history.SampleRate())));
+    }
+    Target &t = targets[target];
+    size_t end = size_t(std::min(std::max(viewStart + viewLength, 0.0), double(history.Size())));
+
+    // going back or far ahead starts the heat over from the frames that still show
+    double settle = PANORAMA_SETTLE_DECAYS * PANORAMA_DECAY_SECONDS * history.SampleRate();
+    bool restart = t.analysed == SIZE_MAX || end < t.analysed || double(end - t.analysed) > settle;
+    size_t after = restart ? size_t(std::max(double(end) - settle, 0.0)) : t.analysed;
+    std::fill(fresh.begin(), fresh.end(), 0.0f);
+    size_t last = panorama->Accumulate(history, after, end, fresh.data());
+
+    glUseProgram(program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(t.vao);
+    if (restart || last != after)
+    {
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glBindTexture(GL_TEXTURE_2D, freshTexture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, PANORAMA_COLUMNS, PANORAMA_ROWS, GL_RED, GL_FLOAT, fresh.data());
+
+        // heat = fresh + heat * decay since the last frame in it
+        glBindFramebuffer(GL_FRAMEBUFFER, t.framebuffer);
+        glViewport(0, 0, PANORAMA_COLUMNS, PANORAMA_ROWS);
+        if (restart)
+        {
+            const GLfloat zero[] = {0.0f, 0.0f, 0.0f, 0.0f};
+            glClearBufferfv(GL_COLOR, 0, zero);
+        }
+        glEnable(GL_BLEND);
+        glBlendColor(0.0f, 0.0f, 0.0f, restart ? 0.0f : float(panorama->Decay(double(last - after))));
+        glBlendFunc(GL_ONE, GL_CONSTANT_ALPHA);
+        glUniform1i(accumulateUniform, 1);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glDisable(GL_BLEND);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        t.analysed = last;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, t.heat);
+    glUniform1i(accumulateUniform, 0);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+// Most points of a line drawn over a view
+const size_t LINE_OVERLAY_POINTS = 1024;
+
+// Line strip over the current view in normalized device coordinates, such as the LPC envelope over
+// a spectrogram. The points are uploaded to one shared buffer each draw.
+class LineOverlay
+{
+public:
+    LineOverlay() noexcept(false);
+    ~LineOverlay();
+
+    // Creates a vertex array for drawing in the current context
+    GLuint CreateVertexArray() noexcept(false);
+    // Draws the first LINE_OVERLAY_POINTS points, with a vertex array created for the current context
+    void Draw(const std::vector<glm::vec2> &points, GLuint vao);
+
+    LineOverlay(const LineOverlay &) = delete;
+    LineOverlay &operator=(const LineOverlay &) = delete;
+
+private:
+    GLuint program = 0;
+    GLuint vbo = 0;
+};
+
+LineOverlay::LineOverlay()
+{
+    const char *vertSrc =
+        "#version 330 core\n"
+        "in vec2 position;\n"
+        "void main(){\n"
+        "   gl_Position = vec4(position, 0.0f, 1.0f);\n"
+        "}\n";
+
+    // white, like FORMANT_COLOR in exported images
+    const char *fragSrc =
+        "#version 330 core\n"
+        "out vec4 fragColor;\n"
+        "void main(){\n"
+        "   fragColor = vec4(1.0f, 1.0f, 1.0f, 1.0f);\n"
+        "}\n";
+
+    GLuint vertShader = CreateShader(GL_VERTEX_SHADER, vertSrc);
+    if (INVALID_GL_ID(vertShader) || !ShaderIsCompiled(vertShader))
+    {
+        PrintShaderLog(std::cerr, vertShader);
+        throw std::runtime_error("line vertex shader failed to compile");
+    }
+    GLuint fragShader = CreateShader(GL_FRAGMENT_SHADER, fragSrc);
+    if (INVALID_GL_ID(fragShader) || !ShaderIsCompiled(fragShader))
+    {
+        PrintShaderLog(std::cerr, fragShader);
+        throw std::runtime_error("line fragment shader failed to compile");
+    }
+    program = CreateProgram(vertShader, fragShader);
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+    if (INVALID_GL_ID(program) || !ProgramIsLinked(program))
+    {
+        PrintProgramLog(std::cerr, program);
+        throw std::runtime_error("line program failed to link");
+    }
+
+    glGenBuffers(1, &vbo);
+    if (INVALID_GL_ID(vbo))
+    {
+        throw std::runtime_error("line vbo created with id 0");
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, LINE_OVERLAY_POINTS * sizeof(glm::vec2), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+LineOverlay::~LineOverlay()
+{
+    glDeleteBuffers(1, &vbo);
+    glDeleteProgram(program);
+}
+
+GLuint LineOverlay::CreateVertexArray()
+{
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    if (INVALID_GL_ID(vao))
+    {
+        throw std::runtime_error("line vao created with id 0");
+    }
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    GLint positionAttrib = glGetAttribLocation(program, "position");
+    glVertexAttribPointer(positionAttrib, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), nullptr);
+    glEnableVertexAttribArray(positionAttrib);
+    glBindVertexArray(0);
+    return vao;
+}
+
+void LineOverlay::Draw(const std::vector<glm::vec2> &points, GLuint vao)
+{
+    size_t count = std::min(points.size(), LINE_OVERLAY_POINTS);
+    if (count < 2)
+    {
+        return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    // orphaned, so the upload doesn't wait for the last draw from it
+    glBufferData(GL_ARRAY_BUFFER, LINE_OVERLAY_POINTS * sizeof(glm::vec2), nullptr, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(glm::vec2), points.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(program);
+    glBindVertexArray(vao);
+    glDrawArrays(GL_LINE_STRIP, 0, GLsizei(count));
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+// Smallest and largest sample of a span, one entry of a waveform pyramid level
+struct MinMax
+{
+    PCM16 min;
+    PCM16 max;
+};
+
+// Read-only view of a waveform min/max pyramid, level 0 has one entry per base samples and each
+// following level halves the one before
+struct WaveformPyramid
+{
+    const MinMax *entries = nullptr;
+    // first entry of each level, plus the total
+    const uint64_t *offsets = nullptr;
+    size_t levels = 0;
+    size_t base = 1;
+    // Set for the pyramid of a live history: entries appended to each level so far. Each level is
+    // then a ring holding the newest of them.
+    const uint64_t *appended = nullptr;
+
+    // Entries of a level that exist, including ones a ring has since overwritten
+    uint64_t Available(size_t level) const
+    {
+        return appended ? appended[level] : offsets[level + 1] - offsets[level];
+    }
+
+    const MinMax &Entry(size_t level, uint64_t index) const
+    {
+        uint64_t size = offsets[level + 1] - offsets[level];
+        return entries[offsets[level] + (appended ? index % size : index)];
+    }
+};
+
+// Builds the pyramid of a history into levels (finest first) and offsets. Level 0 is split across
+// threads when parallel is set; batch jobs that already run one file per core leave it unset.
+void BuildPyramid(const SampleHistory &history, size_t base, bool parallel, std::vector<MinMax> &levels,
+                  std::vector<uint64_t> &offsets)
+{
+    size_t samples = history.Size();
+    size_t entries = (samples + base - 1) / base;
+    levels.assign(entries, MinMax());
+    offsets.assign(1, 0);
+    auto buildLevel0 = [&](size_t begin, size_t end) {
+        std::vector<PCM16> block(base);
+        for (size_t i = begin; i < end; ++i)
+        {
+            size_t start = i * base;
+            size_t count = std::min(base, samples - start);
+            history.ReadPcm16(start, count, block.data());
+            MinMax entry = {block[0], block[0]};
+            for (size_t j = 1; j < count; ++j)
+            {
+                entry.min = std::min(entry.min, block[j]);
+                entry.max = std::max(entry.max, block[j]);
+            }
+            levels[i] = entry;
+        }
+    };
+    if (parallel)
+    {
+        ParallelFor(entries, buildLevel0);
+    }
+    else
+    {
+        buildLevel0(0, entries);
+    }
+    offsets.push_back(levels.size());
+
+    while (entries > 1)
+    {
+        size_t below = offsets[offsets.size() - 2];
+        size_t next = (entries + 1) / 2;
+        for (size_t i = 0; i < next; ++i)
+        {
+            const MinMax &a = levels[below + 2 * i];
+            const MinMax &b = levels[below + std::min(2 * i + 1, entries - 1)];
+            MinMax merged = {std::min(a.min, b.min), std::max(a.max, b.max)};
+            levels.push_back(merged);
+        }
+        entries = next;
+        offsets.push_back(levels.size());
+    }
+}
+
+// Min/max of each of width equal columns spanning samples [start, end). Reads the coarsest pyramid
+// level with at least one entry per column, or the samples themselves when zoomed in further.
+// Columns outside the history are left at zero.
+void PyramidColumns(const WaveformPyramid &pyramid, const SampleHistory &history, double start, double end,
+                    size_t width, std::vector<MinMax> &out)
+{
+    MinMax silence = {0, 0};
+    out.assign(width, silence);
+    double perColumn = (end - start) / width;
+    size_t level = 0;
+    while (level + 1 < pyramid.levels && double(pyramid.base << (level + 1)) <= perColumn)
+    {
+        ++level;
+    }
+    bool useSamples = pyramid.levels == 0 || perColumn < pyramid.base;
+    size_t entrySpan = useSamples ? 1 : pyramid.base << level;
+    size_t available = useSamples ? history.Size() : pyramid.Available(level);
+    size_t first = useSamples ? history.First() : (history.First() + entrySpan - 1) / entrySpan;
+
+    for (size_t x = 0; x < width; ++x)
+    {
+        double columnStart = std::max(start + x * perColumn, 0.0);
+        double columnEnd = start + (x + 1) * perColumn;
+        size_t begin = std::max(size_t(columnStart / entrySpan), first);
+        size_t finish = std::min(size_t(ceil(columnEnd / entrySpan)), available);
+        if (finish <= begin)
+        {
+            continue;
+        }
+        MinMax column;
+        if (useSamples)
+        {
+            PCM16 value;
+            history.ReadPcm16(begin, 1, &value);
+            column.min = column.max = value;
+            for (size_t i = begin + 1; i < finish; ++i)
+            {
+                history.ReadPcm16(i, 1, &value);
+                column.min = std::min(column.min, value);
+                column.max = std::max(column.max, value);
+            }
+        }
+        else
+        {
+            column = pyramid.Entry(level, begin);
+            for (size_t i = begin + 1; i < finish; ++i)
+            {
+                const MinMax &entry = pyramid.Entry(level, i);
+                column.min = std::min(column.min, entry.min);
+                column.max = std::max(column.max, entry.max);
+            }
+        }
+        out[x] = column;
+    }
+}
+
+// Waveform pyramid of a live history, updated as samples are appended. Every level is a ring with
+// room for the entries covering capacity samples, so it spans the same time as the history.
+class LivePyramid
+{
+public:
+    LivePyramid(size_t capacity, size_t base);
+
+    void Append(const PCM16 *values, size_t count);
+    WaveformPyramid View() const;
+
+private:
+    MinMax &Entry(size_t level, uint64_t index)
+    {
+        return entries[offsets[level] + index % (offsets[level + 1] - offsets[level])];
+    }
+
+    size_t base;
+    uint64_t samples = 0;
+    std::vector<MinMax> entries;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> appended;
+};
+
+LivePyramid::LivePyramid(size_t capacity, size_t base) : base(base), offsets(1, 0)
+{
+    // one extra entry per level for the partial entry at the live edge
+    for (size_t span = base;; span *= 2)
+    {
+        offsets.push_back(offsets.back() + (capacity + span - 1) / span + 1);
+        if (span >= capacity)
+        {
+            break;
+        }
+    }
+    entries.resize(offsets.back());
+    appended.assign(offsets.size() - 1, 0);
+}
+
+void LivePyramid::Append(const PCM16 *values, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    uint64_t firstChanged = samples / base;
+    for (size_t i = 0; i < count; ++i, ++samples)
+    {
+        MinMax &entry = Entry(0, samples / base);
+        if (samples % base == 0)
+        {
+            entry.min = entry.max = values[i];
+        }
+        else
+        {
+            entry.min = std::min(entry.min, values[i]);
+            entry.max = std::max(entry.max, values[i]);
+        }
+    }
+    appended[0] = (samples + base - 1) / base;
+
+    // rebuild the parents of the changed entries, level by level
+    for (size_t level = 1; level < appended.size(); ++level)
+    {
+        firstChanged /= 2;
+        appended[level] = (appended[level - 1] + 1) / 2;
+        for (uint64_t i = firstChanged; i < appended[level]; ++i)
+        {
+            const MinMax &a = Entry(level - 1, 2 * i);
+            const MinMax &b = Entry(level - 1, std::min(2 * i + 1, appended[level - 1] - 1));
+            MinMax merged = {std::min(a.min, b.min), std::max(a.max, b.max)};
+            Entry(level, i) = merged;
+        }
+    }
+}
+
+WaveformPyramid LivePyramid::View() const
+{
+    WaveformPyramid view;
+    view.entries = entries.data();
+    view.offsets = offsets.data();
+    view.levels = appended.size();
+    view.base = base;
+    view.appended = appended.data();
+    return view;
+}
+
+// Entries per chunk of the GPU waveform, plus one shared with the next chunk so line strips join
+const size_t WAVEFORM_CHUNK_ENTRIES = 1024;
+// Chunks resident on the GPU, reused least recently used first
+const size_t WAVEFORM_CHUNK_SLOTS = 32;
+// Coarsest level reduced from samples when there is no pyramid, a chunk then reads 2^20 samples
+const size_t WAVEFORM_MAX_SAMPLE_LEVEL = 10;
+
+// Zoomable waveform of a sample history. Level k of the view has one min/max entry per 2^k samples
+// and the level drawn keeps one to two entries per pixel, so the vertex count doesn't depend on the
+// zoom. Entries are uploaded in chunks into slots of a GPU buffer and stay resident while they're
+// reused; at the live edge only the entries that grew are uploaded again. Levels at least as coarse
+// as the pyramid's base are copied from the pyramid, finer ones are reduced from the samples.
+class WaveformLodView
+{
+public:
+    WaveformLodView() noexcept(false);
+    ~WaveformLodView();
+
+    // Creates a vertex array for drawing in the current context
+    GLuint CreateVertexArray() noexcept(false);
+    // Starts a frame; chunks used during the current frame are never evicted
+    void BeginFrame() { ++frame; }
+    // Draws samples [viewStart, viewStart + viewLength) of the history across the viewport, with a
+    // vertex array created for the current context
+    void Draw(const SampleHistory &history, const WaveformPyramid &pyramid, double viewStart, double viewLength,
+              int widthPixels, GLuint vao);
+
+    WaveformLodView(const WaveformLodView &) = delete;
+    WaveformLodView &operator=(const WaveformLodView &) = delete;
+
+private:
+    struct Slot
+    {
+        TileKey key;
+        bool used = false;
+        // entries [0, filled) hold their final values, the next one may have been partial
+        size_t filled = 0;
+        uint64_t lastUse = 0;
+    };
+
+    // Makes the chunk resident and current, returns its slot or SIZE_MAX if every slot is in use
+    size_t Acquire(const TileKey &key, const SampleHistory &history, const WaveformPyramid &pyramid);
+    // Level of the pyramid with one entry per 2^level samples, false if it has none
+    static bool PyramidLevel(const WaveformPyramid &pyramid, size_t level, size_t &pyramidLevel);
+    // Computes entries [begin, end) of a chunk into scratch
+    void ComputeEntries(const TileKey &key, size_t begin, size_t end, const SampleHistory &history,
+                        const WaveformPyramid &pyramid);
+
+    GLuint program = 0;
+    GLuint buffer = 0;
+    GLuint texture = 0;
+    GLint slotBaseUniform = -1, firstEntryUniform = -1, originUniform = -1, stepUniform = -1;
+    uint64_t frame = 0;
+    std::vector<Slot> slots;
+    std::unordered_map<TileKey, size_t, TileKeyHash> resident;
+    std::vector<MinMax> scratch;
+    std::vector<PCM16> samples;
+};
+
+WaveformLodView::WaveformLodView() : slots(WAVEFORM_CHUNK_SLOTS)
+{
+    // vertices alternate between the min and max of consecutive entries, fetched from the buffer
+    const char *vertSrc =
+        "#version 330 core\n"
+        "uniform isamplerBuffer entries;\n"
+        "uniform int slotBase;\n"
+        "uniform int firstEntry;\n"
+        "uniform float origin;\n"
+        "uniform float step;\n"
+        "void main(){\n"
+        "   int entry = firstEntry + gl_VertexID / 2;\n"
+        "   ivec4 minMax = texelFetch(entries, slotBase + entry);\n"
+        "   float value = float((gl_VertexID & 1) == 0 ? minMax.r : minMax.g);\n"
+        "   float y = ((value + 32768.0f) / 32767.5f - 1.0f) / 2.0f;\n"
+        "   gl_Position = vec4(origin + float(entry) * step, y, 0.0f, 1.0f);\n"
+        "}\n";
+
+    const char *fragSrc =
+        "#version 330 core\n"
+        "out vec4 fragColor;\n"
+        "uniform vec4 color;\n"
+        "void main(){\n"
+        "   fragColor = color;\n"
+        "}\n";
+
+    GLuint vertShader = CreateShader(GL_VERTEX_SHADER, vertSrc);
+    if (INVALID_GL_ID(vertShader) || !ShaderIsCompiled(vertShader))
+    {
+        PrintShaderLog(std::cerr, vertShader);
+        throw std::runtime_error("waveform vertex shader failed to compile");
+    }
+    GLuint fragShader = CreateShader(GL_FRAGMENT_SHADER, fragSrc);
+    if (INVALID_GL_ID(fragShader) || !ShaderIsCompiled(fragShader))
+    {
+        PrintShaderLog(std::cerr, fragShader);
+        throw std::runtime_error("waveform fragment shader failed to compile");
+    }
+    program = CreateProgram(vertShader, fragShader);
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+    if (INVALID_GL_ID(program) || !ProgramIsLinked(program))
+    {
+        PrintProgramLog(std::cerr, program);
+        throw std::runtime_error("waveform program failed to link");
+    }
+    slotBaseUniform = glGetUniformLocation(program, "slotBase");
+    firstEntryUniform = glGetUniformLocation(program, "firstEntry");
+    originUniform = glGetUniformLocation(program, "origin");
+    stepUniform = glGetUniformLocation(program, "step");
+    // use static blue color for lines
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "entries"), 0);
+    glUniform4f(glGetUniformLocation(program, "color"), 0.0f, 0.0f, 1.0f, 1.0f);
+    glUseProgram(0);
+
+    glGenBuffers(1, &buffer);
+    glGenTextures(1, &texture);
+    if (INVALID_GL_ID(buffer) || INVALID_GL_ID(texture))
+    {
+        throw std::runtime_error("waveform buffer/texture created with id 0");
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(MinMax) * (WAVEFORM_CHUNK_ENTRIES + 1) * WAVEFORM_CHUNK_SLOTS, nullptr,
+                 GL_DYNAMIC_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, texture);
+    // each texel is one MinMax
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RG16I, buffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+WaveformLodView::~WaveformLodView()
+{
+    glDeleteTextures(1, &texture);
+    glDeleteBuffers(1, &buffer);
+    glDeleteProgram(program);
+}
+
+GLuint WaveformLodView::CreateVertexArray()
+{
+    // nothing is sourced from attributes, but drawing needs a vertex array bound
+    GLuint vao = 0;
+    glGenVertexArrays(1, &vao);
+    if (INVALID_GL_ID(vao))
+    {
+        throw std::runtime_error("waveform vao created with id 0");
+    }
+    return vao;
+}
+
+bool WaveformLodView::PyramidLevel(const WaveformPyramid &pyramid, size_t level, size_t &pyramidLevel)
+{
+    size_t baseLevel = 0;
+    while ((size_t(1) << baseLevel) < pyramid.base)
+    {
+        ++baseLevel;
+    }
+    if (pyramid.levels == 0 || (size_t(1) << baseLevel) != pyramid.base || level < baseLevel ||
+        level - baseLevel >= pyramid.levels)
+    {
+        return false;
+    }
+    pyramidLevel = level - baseLevel;
+    return true;
+}
+
+void WaveformLodView::ComputeEntries(const TileKey &key, size_t begin, size_t end, const SampleHistory &history,
+                                     const WaveformPyramid &pyramid)
+{
+    MinMax silence = {0, 0};
+    scratch.assign(end - begin, silence);
+    uint64_t span = uint64_t(1) << key.level;
+    uint64_t firstEntry = uint64_t(key.index) * WAVEFORM_CHUNK_ENTRIES + begin;
+    size_t level;
+    if (PyramidLevel(pyramid, key.level, level))
+    {
+        uint64_t available = pyramid.Available(level);
+        for (size_t i = 0; i < scratch.size() && firstEntry + i < available; ++i)
+        {
+            scratch[i] = pyramid.Entry(level, firstEntry + i);
+        }
+        return;
+    }
+
+    uint64_t start = std::max<uint64_t>(firstEntry * span, history.First());
+    uint64_t finish = std::min<uint64_t>((firstEntry + scratch.size()) * span, history.Size());
+    if (finish <= start)
+    {
+        return;
+    }
+    samples.resize(finish - start);
+    history.ReadPcm16(start, samples.size(), samples.data());
+    for (uint64_t position = start; position < finish; ++position)
+    {
+        PCM16 value = samples[position - start];
+        MinMax &entry = scratch[position / span - firstEntry];
+        // the first sample of an entry replaces the silence it starts with
+        if (position % span == 0 || position == start)
+        {
+            entry.min = entry.max = value;
+        }
+        else
+        {
+            entry.min = std::min(entry.min, value);
+            entry.max = std::max(entry.max, value);
+        }
+    }
+}
+
+size_t WaveformLodView::Acquire(const TileKey &key, const SampleHistory &history, const WaveformPyramid &pyramid)
+{
+    size_t slot;
+    auto found = resident.find(key);
+    if (found != resident.end())
+    {
+        slot = found->second;
+    }
+    else
+    {
+        slot = 0;
+        for (size_t i = 1; i < slots.size(); ++i)
+        {
+            if (!slots[slot].used)
+            {
+                break;
+            }
+            if (!slots[i].used || slots[i].lastUse < slots[slot].lastUse)
+            {
+                slot = i;
+            }
+        }
+        if (slots[slot].used)
+        {
+            if (slots[slot].lastUse == frame)
+            {
+                return SIZE_MAX;
+            }
+            resident.erase(slots[slot].key);
+        }
+        slots[slot].key = key;
+        slots[slot].used = true;
+        slots[slot].filled = 0;
+        resident[key] = slot;
+    }
+
+    Slot &entry = slots[slot];
+    entry.lastUse = frame;
+    // entries of the chunk that have samples, and those of them no later sample can change
+    uint64_t chunkEntries = WAVEFORM_CHUNK_ENTRIES + 1;
+    uint64_t span = uint64_t(1) << key.level;
+    uint64_t firstEntry = uint64_t(key.index) * WAVEFORM_CHUNK_ENTRIES;
+    auto inChunk = [&](uint64_t entries) {
+        return entries > firstEntry ? std::min(entries - firstEntry, chunkEntries) : 0;
+    };
+    uint64_t available = history.IsComplete() ? chunkEntries : inChunk((history.Size() + span - 1) / span);
+    uint64_t complete = history.IsComplete() ? chunkEntries : inChunk(history.Size() / span);
+    if (available > entry.filled)
+    {
+        size_t begin = entry.filled;
+        ComputeEntries(key, begin, size_t(available), history, pyramid);
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, sizeof(MinMax) * (slot * chunkEntries + begin),
+                        sizeof(MinMax) * scratch.size(), scratch.data());
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        entry.filled = size_t(complete);
+    }
+    return slot;
+}
+
+void WaveformLodView::Draw(const SampleHistory &history, const WaveformPyramid &pyramid, double viewStart,
+                           double viewLength, int widthPixels, GLuint vao)
+{
+    // finest level with at most two entries per pixel
+    double perPixel = viewLength / std::max(widthPixels, 1);
+    size_t level = 0;
+    while (level < 62 && double(uint64_t(2) << level) <= perPixel)
+    {
+        ++level;
+    }
+    // levels coarser than the pyramid's top, or any level past the limit without a pyramid, only
+    // add entries per pixel
+    size_t pyramidLevel;
+    while (level > WAVEFORM_MAX_SAMPLE_LEVEL && !PyramidLevel(pyramid, level, pyramidLevel))
+    {
+        --level;
+    }
+
+    uint64_t span = uint64_t(1) << level;
+    double viewEnd = std::min(viewStart + viewLength, double(history.Size()));
+    double first = std::max(viewStart, double(history.First()));
+    if (viewEnd <= first)
+    {
+        return;
+    }
+    uint64_t firstEntry = uint64_t(first) / span;
+    uint64_t endEntry = uint64_t(ceil(viewEnd / span));
+
+    glUseProgram(program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, texture);
+    glBindVertexArray(vao);
+    glUniform1f(stepUniform, float(2.0 * span / viewLength));
+    for (uint64_t chunk = firstEntry / WAVEFORM_CHUNK_ENTRIES; chunk * WAVEFORM_CHUNK_ENTRIES < endEntry; ++chunk)
+    {
+        TileKey key = {level, size_t(chunk)};
+        size_t slot = Acquire(key, history, pyramid);
+        if (slot == SIZE_MAX)
+        {
+            break;
+        }
+        uint64_t chunkStart = chunk * WAVEFORM_CHUNK_ENTRIES;
+        uint64_t begin = std::max(firstEntry, chunkStart) - chunkStart;
+        // the entry shared with the next chunk joins the strips when it exists
+        uint64_t end = std::min(endEntry + 1, chunkStart + WAVEFORM_CHUNK_ENTRIES + 1);
+        end = std::min<uint64_t>(end, (history.Size() + span - 1) / span) - chunkStart;
+        if (end <= begin)
+        {
+            continue;
+        }
+        // x of the chunk's entry 0, at the center of its span
+        double origin = -1.0 + 2.0 * ((chunkStart + 0.5) * span - viewStart) / viewLength;
+        glUniform1i(slotBaseUniform, int(slot * (WAVEFORM_CHUNK_ENTRIES + 1)));
+        glUniform1i(firstEntryUniform, int(begin));
+        glUniform1f(originUniform, float(origin));
+        glDrawArrays(GL_LINE_STRIP, 0, GLsizei(2 * (end - begin)));
+    }
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+// Parameters of whole file analysis, cached results are discarded when their hash changes
+struct AnalysisParams
+{
+    // Samples per entry of the finest waveform pyramid level, each coarser level halves the entries
+    size_t pyramidBase = 64;
+    // Seconds between loudness measurements and the length of each (EBU R128 momentary loudness)
+    double loudnessHop = 0.1;
+    double loudnessWindow = 0.4;
+    // FFT size and hop of the feature and onset tracks
+    size_t featureFftSize = 1024;
+    size_t featureHop = 512;
+    // Shortest allowed time between beats in seconds
+    double minBeatInterval = 0.25;
+
+    uint64_t Hash() const
+    {
+        double values[] = {double(pyramidBase), loudnessHop, loudnessWindow, double(featureFftSize),
+                           double(featureHop), minBeatInterval};
+        return HashBytes(values, sizeof(values));
+    }
+};
+
+// Section identifiers of the analysis cache format
+enum AnalysisSectionId : uint32_t
+{
+    ANALYSIS_PYRAMID_OFFSETS = 1, // uint64 first entry of each pyramid level, plus the total
+    ANALYSIS_PYRAMID = 2,         // MinMax entries of all levels, finest first
+    ANALYSIS_LOUDNESS = 3,        // float momentary loudness in LUFS per loudness hop
+    ANALYSIS_RMS = 4,             // float RMS per feature hop
+    ANALYSIS_CENTROID = 5,        // float spectral centroid in Hz per feature hop
+    ANALYSIS_ONSET = 6,           // float spectral flux onset strength per feature hop
+    ANALYSIS_BEATS = 7,           // uint64 sample positions of detected beats
+};
+
+// Cache file header, followed by sectionCount AnalysisSection entries. All section data starts on
+// a 64 byte boundary so the file can be used in place through a read-only mapping.
+struct AnalysisHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t contentHash;
+    uint64_t paramsHash;
+    uint64_t sampleCount;
+    uint64_t sampleRate;
+    uint64_t pyramidBase;
+    uint64_t loudnessHop; // in samples
+    uint64_t featureHop;
+    uint32_t sectionCount;
+    uint32_t reserved;
+};
+
+struct AnalysisSection
+{
+    uint32_t id;
+    uint32_t elementSize;
+    uint64_t offset;
+    uint64_t count;
+};
+
+const char ANALYSIS_MAGIC[4] = {'H', 'P', 'A', 'N'};
+const uint32_t ANALYSIS_VERSION = 1;
+const size_t ANALYSIS_ALIGNMENT = 64;
+
+// An array to be stored as one section
+struct SectionData
+{
+    uint32_t id;
+    uint32_t elementSize;
+    const void *data;
+    size_t count;
+};
+
+// Lays out a header, the table of count sections and the section data, each section starting on an
+// ANALYSIS_ALIGNMENT boundary. Used by every memory mappable file format.
+void SerializeSections(const void *header, size_t headerSize, const SectionData *pending, size_t count,
+                       std::vector<uint8_t> &image)
+{
+    std::vector<AnalysisSection> sections(count);
+    size_t offset = headerSize + count * sizeof(AnalysisSection);
+    for (size_t i = 0; i < count; ++i)
+    {
+        offset = (offset + ANALYSIS_ALIGNMENT - 1) / ANALYSIS_ALIGNMENT * ANALYSIS_ALIGNMENT;
+        sections[i].id = pending[i].id;
+        sections[i].elementSize = pending[i].elementSize;
+        sections[i].offset = offset;
+        sections[i].count = pending[i].count;
+        offset += pending[i].count * pending[i].elementSize;
+    }
+
+    image.assign(offset, 0);
+    std::memcpy(image.data(), header, headerSize);
+    std::memcpy(image.data() + headerSize, sections.data(), count * sizeof(AnalysisSection));
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (pending[i].count > 0)
+        {
+            std::memcpy(image.data() + sections[i].offset, pending[i].data, pending[i].count * pending[i].elementSize);
+        }
+    }
+}
+
+// Read-only view of one cached array
+template <typename T>
+struct Track
+{
+    const T *data = nullptr;
+    size_t count = 0;
+};
+
+// Whole file analysis (waveform pyramid, loudness curve, feature and beat tracks). Results are
+// read from a memory mapped sidecar cache keyed by content hash, and computed in parallel and
+// written to the cache when missing or computed with different parameters.
+class FileAnalysis
+{
+public:
+    FileAnalysis(const SampleHistory &history, uint64_t contentHash, const AnalysisParams &params) noexcept(false);
+    ~FileAnalysis();
+
+    // Number of pyramid levels, level 0 has one entry per pyramidBase samples
+    size_t PyramidLevels() const { return pyramidOffsets.count - 1; }
+    Track<MinMax> PyramidLevel(size_t level) const;
+    WaveformPyramid Pyramid() const;
+
+    Track<float> Loudness() const { return loudness; }
+    Track<float> Rms() const { return rms; }
+    Track<float> Centroid() const { return centroid; }
+    Track<float> Onset() const { return onset; }
+    Track<uint64_t> Beats() const { return beats; }
+    const AnalysisParams &Params() const { return params; }
+
+    // True if results came from the cache instead of being computed
+    bool WasCached() const { return cached; }
+
+    FileAnalysis(const FileAnalysis &) = delete;
+    FileAnalysis &operator=(const FileAnalysis &) = delete;
+
+private:
+    // Maps the cache file, returns false if it's missing or stale
+    bool Load(const std::string &path);
+    // Computes every section and serializes them into image
+    void Analyze(const SampleHistory &history);
+    // Points the tracks at the sections of a mapped or in-memory image
+    bool Attach(const uint8_t *base, size_t size);
+
+    AnalysisParams params;
+    uint64_t contentHash;
+    uint64_t sampleRate;
+    bool cached = false;
+
+    void *mapping = MAP_FAILED;
+    size_t mappingSize = 0;
+    std::vector<uint8_t> image;
+
+    Track<uint64_t> pyramidOffsets;
+    Track<MinMax> pyramid;
+    Track<float> loudness, rms, centroid, onset;
+    Track<uint64_t> beats;
+};
+
+FileAnalysis::FileAnalysis(const SampleHistory &history, uint64_t contentHash, const AnalysisParams &params)
+    : params(params), contentHash(contentHash), sampleRate(history.SampleRate())
+{
+    std::string directory = CacheDirectory() + "/analysis";
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.hpa", (unsigned long long)contentHash);
+    std::string path = directory + name;
+
+    if (!CacheDirectory().empty() && Load(path))
+    {
+        cached = true;
+        return;
+    }
+
+    Analyze(history);
+
+    if (!CacheDirectory().empty() && MakeDirectories(directory))
+    {
+        std::string temp = path + ".tmp";
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(image.data()), image.size());
+        file.close();
+        if (file)
+        {
+            rename(temp.c_str(), path.c_str());
+        }
+    }
+    if (!Attach(image.data(), image.size()))
+    {
+        throw std::runtime_error("analysis image is malformed");
+    }
+}
+
+FileAnalysis::~FileAnalysis()
+{
+    if (mapping != MAP_FAILED)
+    {
+        munmap(mapping, mappingSize);
+    }
+}
+
+Track<MinMax> FileAnalysis::PyramidLevel(size_t level) const
+{
+    Track<MinMax> track;
+    track.data = pyramid.data + pyramidOffsets.data[level];
+    track.count = pyramidOffsets.data[level + 1] - pyramidOffsets.data[level];
+    return track;
+}
+
+WaveformPyramid FileAnalysis::Pyramid() const
+{
+    WaveformPyramid view;
+    view.entries = pyramid.data;
+    view.offsets = pyramidOffsets.data;
+    view.levels = PyramidLevels();
+    view.base = params.pyramidBase;
+    return view;
+}
+
+bool FileAnalysis::Load(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(AnalysisHeader))
+    {
+        close(fd);
+        return false;
+    }
+    mappingSize = info.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+    if (!Attach(static_cast<const uint8_t *>(mapping), mappingSize))
+    {
+        munmap(mapping, mappingSize);
+        mapping = MAP_FAILED;
+        return false;
+    }
+    return true;
+}
+
+// Size of one element of a section, 0 for identifiers this version doesn't know
+size_t AnalysisElementSize(uint32_t id)
+{
+    switch (id)
+    {
+    case ANALYSIS_PYRAMID_OFFSETS:
+    case ANALYSIS_BEATS:
+        return sizeof(uint64_t);
+    case ANALYSIS_PYRAMID:
+        return sizeof(MinMax);
+    case ANALYSIS_LOUDNESS:
+    case ANALYSIS_RMS:
+    case ANALYSIS_CENTROID:
+    case ANALYSIS_ONSET:
+        return sizeof(float);
+    }
+    return 0;
+}
+
+bool FileAnalysis::Attach(const uint8_t *base, size_t size)
+{
+    // only the header is compared, so changed parameters invalidate the cache without reading it
+    const AnalysisHeader *header = reinterpret_cast<const AnalysisHeader *>(base);
+    if (std::memcmp(header->magic, ANALYSIS_MAGIC, 4) != 0 || header->version != ANALYSIS_VERSION ||
+        header->contentHash != contentHash || header->paramsHash != params.Hash() ||
+        header->sectionCount > (size - sizeof(AnalysisHeader)) / sizeof(AnalysisSection))
+    {
+        return false;
+    }
+
+    const AnalysisSection *sections = reinterpret_cast<const AnalysisSection *>(header + 1);
+    for (size_t i = 0; i < header->sectionCount; ++i)
+    {
+        // divided rather than multiplied so a corrupt count can't wrap the bound around
+        const AnalysisSection &section = sections[i];
+        if (section.elementSize == 0 || section.offset > size ||
+            section.count > (size - section.offset) / section.elementSize ||
+            section.elementSize != AnalysisElementSize(section.id))
+        {
+            return false;
+        }
+        const void *data = base + section.offset;
+        switch (section.id)
+        {
+        case ANALYSIS_PYRAMID_OFFSETS:
+            pyramidOffsets.data = static_cast<const uint64_t *>(data);
+            pyramidOffsets.count = section.count;
+            break;
+        case ANALYSIS_PYRAMID:
+            pyramid.data = static_cast<const MinMax *>(data);
+            pyramid.count = section.count;
+            break;
+        case ANALYSIS_LOUDNESS:
+            loudness.data = static_cast<const float *>(data);
+            loudness.count = section.count;
+            break;
+        case ANALYSIS_RMS:
+            rms.data = static_cast<const float *>(data);
+            rms.count = section.count;
+            break;
+        case ANALYSIS_CENTROID:
+            centroid.data = static_cast<const float *>(data);
+            centroid.count = section.count;
+            break;
+        case ANALYSIS_ONSET:
+            onset.data = static_cast<const float *>(data);
+            onset.count = section.count;
+            break;
+        case ANALYSIS_BEATS:
+            beats.data = static_cast<const uint64_t *>(data);
+            beats.count = section.count;
+            break;
+        }
+    }
+    if (pyramidOffsets.count == 0 || pyramidOffsets.data[pyramidOffsets.count - 1] > pyramid.count)
+    {
+        return false;
+    }
+    // each level runs from its offset to the next one
+    for (size_t level = 0; level + 1 < pyramidOffsets.count; ++level)
+    {
+        if (pyramidOffsets.data[level] > pyramidOffsets.data[level + 1])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Biquad filter section in direct form I
+struct Biquad
+{
+    double b0, b1, b2, a1, a2;
+    double x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+
+    double Process(double x)
+    {
+        double y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+        return y;
+    }
+};
+
+// ITU-R BS.1770 K-weighting (high shelf followed by high pass) for any sample rate
+void KWeightingFilters(double sampleRate, Biquad &shelf, Biquad &highPass)
+{
+    double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / sampleRate);
+    double vh = pow(10.0, gain / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf.b1 = 2.0 * (k * k - vh) / a0;
+    shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / sampleRate);
+    a0 = 1.0 + k / q + k * k;
+    highPass.b0 = 1.0;
+    highPass.b1 = -2.0;
+    highPass.b2 = 1.0;
+    highPass.a1 = 2.0 * (k * k - 1.0) / a0;
+    highPass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+void FileAnalysis::Analyze(const SampleHistory &history)
+{
+    size_t samples = history.Size();
+
+    // Waveform pyramid
+    std::vector<MinMax> levels;
+    std::vector<uint64_t> offsets;
+    BuildPyramid(history, params.pyramidBase, true, levels, offsets);
+
+    // Momentary loudness from mean square energy per hop. The filters are run per chunk with a
+    // second of warm up, enough for their transients to die out.
+    size_t loudnessHop = std::max<size_t>(1, size_t(params.loudnessHop * sampleRate));
+    size_t hopsPerWindow = std::max<size_t>(1, size_t(params.loudnessWindow / params.loudnessHop + 0.5));
+    size_t hops = samples / loudnessHop;
+    std::vector<double> hopEnergy(hops);
+    ParallelFor(hops, [&](size_t begin, size_t end) {
+        Biquad shelf, highPass;
+        KWeightingFilters(sampleRate, shelf, highPass);
+        size_t warmup = std::min(begin * loudnessHop, size_t(sampleRate));
+        size_t start = begin * loudnessHop - warmup;
+        std::vector<float> block(loudnessHop);
+        for (size_t pos = start; pos < begin * loudnessHop; pos += block.size())
+        {
+            size_t count = std::min(block.size(), begin * loudnessHop - pos);
+            history.Read(pos, count, block.data());
+            for (size_t i = 0; i < count; ++i)
+            {
+                highPass.Process(shelf.Process(block[i]));
+            }
+        }
+        for (size_t hop = begin; hop < end; ++hop)
+        {
+            history.Read(hop * loudnessHop, loudnessHop, block.data());
+            double energy = 0.0;
+            for (size_t i = 0; i < loudnessHop; ++i)
+            {
+                double y = highPass.Process(shelf.Process(block[i]));
+                energy += y * y;
+            }
+            hopEnergy[hop] = energy;
+        }
+    });
+    std::vector<float> loudnessValues(hops);
+    double windowEnergy = 0.0;
+    for (size_t hop = 0; hop < hops; ++hop)
+    {
+        windowEnergy += hopEnergy[hop];
+        if (hop >= hopsPerWindow)
+        {
+            windowEnergy -= hopEnergy[hop - hopsPerWindow];
+        }
+        double meanSquare = std::max(windowEnergy, 0.0) / (loudnessHop * std::min(hop + 1, hopsPerWindow));
+        loudnessValues[hop] = float(-0.691 + 10.0 * log10(meanSquare + 1e-20));
+    }
+
+    // Feature tracks per FFT frame. Each chunk also transforms the frame before its first so the
+    // flux of every frame is computed against its real predecessor.
+    size_t frames = samples >= params.featureFftSize ? (samples - params.featureFftSize) / params.featureHop + 1 : 0;
+    size_t bins = params.featureFftSize / 2;
+    std::vector<float> rmsValues(frames), centroidValues(frames), onsetValues(frames);
+    ParallelFor(frames, [&](size_t begin, size_t end) {
+        Fft fft(params.featureFftSize);
+        std::vector<float> window(params.featureFftSize), block(params.featureFftSize);
+        for (size_t i = 0; i < window.size(); ++i)
+        {
+            window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / window.size());
+        }
+        std::vector<std::complex<float>> spectrum(params.featureFftSize);
+        std::vector<float> magnitude(bins), previous(bins, 0.0f);
+        for (size_t frame = begin > 0 ? begin - 1 : 0; frame < end; ++frame)
+        {
+            history.Read(frame * params.featureHop, params.featureFftSize, block.data());
+            double energy = 0.0;
+            for (size_t i = 0; i < block.size(); ++i)
+            {
+                energy += block[i] * block[i];
+                spectrum[i] = std::complex<float>(block[i] * window[i], 0.0f);
+            }
+            fft.Forward(spectrum.data());
+
+            double weighted = 0.0, total = 0.0, flux = 0.0;
+            for (size_t bin = 0; bin < bins; ++bin)
+            {
+                magnitude[bin] = std::abs(spectrum[bin]);
+                weighted += magnitude[bin] * bin;
+                total += magnitude[bin];
+                // log compressed flux, only increases in energy count towards onsets
+                float compressed = log1pf(100.0f * magnitude[bin]);
+                flux += std::max(compressed - previous[bin], 0.0f);
+                previous[bin] = compressed;
+            }
+            if (frame < begin)
+            {
+                continue;
+            }
+            rmsValues[frame] = float(sqrt(energy / block.size()));
+            centroidValues[frame] = total > 0.0 ? float(weighted / total * sampleRate / params.featureFftSize) : 0.0f;
+            onsetValues[frame] = frame > 0 ? float(flux) : 0.0f;
+        }
+    });
+
+    // Beats are onset peaks above the local mean, at least minBeatInterval apart
+    std::vector<uint64_t> beatPositions;
+    size_t radius = std::max<size_t>(1, size_t(0.5 * sampleRate / params.featureHop));
+    size_t minGap = std::max<size_t>(1, size_t(params.minBeatInterval * sampleRate / params.featureHop));
+    double localSum = 0.0;
+    size_t windowBegin = 0, windowEnd = 0, lastBeat = 0;
+    for (size_t frame = 1; frame + 1 < frames; ++frame)
+    {
+        while (windowEnd < std::min(frames, frame + radius + 1))
+        {
+            localSum += onsetValues[windowEnd++];
+        }
+        while (windowBegin + radius < frame)
+        {
+            localSum -= onsetValues[windowBegin++];
+        }
+        float value = onsetValues[frame];
+        double threshold = 1.5 * localSum / (windowEnd - windowBegin) + 1e-3;
+        if (value > threshold && value >= onsetValues[frame - 1] && value > onsetValues[frame + 1] &&
+            (beatPositions.empty() || frame - lastBeat >= minGap))
+        {
+            beatPositions.push_back(uint64_t(frame) * params.featureHop + params.featureFftSize / 2);
+            lastBeat = frame;
+        }
+    }
+
+    // Serialize: header, section table, then aligned section data
+    SectionData pending[] = {
+        {ANALYSIS_PYRAMID_OFFSETS, sizeof(uint64_t), offsets.data(), offsets.size()},
+        {ANALYSIS_PYRAMID, sizeof(MinMax), levels.data(), levels.size()},
+        {ANALYSIS_LOUDNESS, sizeof(float), loudnessValues.data(), loudnessValues.size()},
+        {ANALYSIS_RMS, sizeof(float), rmsValues.data(), rmsValues.size()},
+        {ANALYSIS_CENTROID, sizeof(float), centroidValues.data(), centroidValues.size()},
+        {ANALYSIS_ONSET, sizeof(float), onsetValues.data(), onsetValues.size()},
+        {ANALYSIS_BEATS, sizeof(uint64_t), beatPositions.data(), beatPositions.size()},
+    };
+    const size_t sectionCount = sizeof(pending) / sizeof(pending[0]);
+
+    AnalysisHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, ANALYSIS_MAGIC, 4);
+    header.version = ANALYSIS_VERSION;
+    header.contentHash = contentHash;
+    header.paramsHash = params.Hash();
+    header.sampleCount = samples;
+    header.sampleRate = sampleRate;
+    header.pyramidBase = params.pyramidBase;
+    header.loudnessHop = loudnessHop;
+    header.featureHop = params.featureHop;
+    header.sectionCount = sectionCount;
+    SerializeSections(&header, sizeof(header), pending, sectionCount, image);
+}
+
+// Packs 8 bit channels into an RGBA pixel as laid out in memory on a little endian host
+inline uint32_t Rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255)
+{
+    return uint32_t(r) | uint32_t(g) << 8 | uint32_t(b) << 16 | uint32_t(a) << 24;
+}
+
+// Same color ramp as the spectrogram fragment shader, for magnitudes in [0, 1]
+uint32_t SpectrogramColor(float m)
+{
+    auto smooth = [](float edge0, float edge1, float x) {
+        float t = std::min(std::max((x - edge0) / (edge1 - edge0), 0.0f), 1.0f);
+        return t * t * (3.0f - 2.0f * t);
+    };
+    auto mix = [](const float *a, const float *b, float t, float *out) {
+        for (int i = 0; i < 3; ++i)
+        {
+            out[i] = a[i] + (b[i] - a[i]) * t;
+        }
+    };
+    const float c0[] = {0.0f, 0.0f, 0.1f}, c1[] = {0.5f, 0.0f, 0.6f}, c2[] = {1.0f, 0.5f, 0.0f}, c3[] = {1.0f, 1.0f, 0.8f};
+    float c[3];
+    mix(c0, c1, smooth(0.0f, 0.4f, m), c);
+    mix(c, c2, smooth(0.4f, 0.75f, m), c);
+    mix(c, c3, smooth(0.75f, 1.0f, m), c);
+    return Rgba(uint8_t(c[0] * 255.0f + 0.5f), uint8_t(c[1] * 255.0f + 0.5f), uint8_t(c[2] * 255.0f + 0.5f));
+}
+
+// RGBA8 image in CPU memory, rows top to bottom
+class Image
+{
+public:
+    Image(size_t width, size_t height);
+
+    void Fill(uint32_t color);
+    // Fills rows [y0, y1] of column x, in either order and clipped to the image
+    void FillColumn(long x, long y0, long y1, uint32_t color);
+
+    uint32_t *Row(size_t y) { return pixels.data() + y * width; }
+    const uint32_t *Row(size_t y) const { return pixels.data() + y * width; }
+    size_t Width() const { return width; }
+    size_t Height() const { return height; }
+
+    // Writes an uncompressed (stored deflate blocks) PNG, returns false on I/O errors
+    bool WritePng(const std::string &path) const;
+
+private:
+    size_t width, height;
+    std::vector<uint32_t> pixels;
+};
+
+Image::Image(size_t width, size_t height) : width(width), height(height), pixels(width * height) {}
+
+void Image::Fill(uint32_t color)
+{
+    std::fill(pixels.begin(), pixels.end(), color);
+}
+
+void Image::FillColumn(long x, long y0, long y1, uint32_t color)
+{
+    if (y0 > y1)
+    {
+        std::swap(y0, y1);
+    }
+    if (x < 0 || x >= long(width) || y1 < 0 || y0 >= long(height))
+    {
+        return;
+    }
+    y0 = std::max(y0, 0L);
+    y1 = std::min(y1, long(height) - 1);
+    for (long y = y0; y <= y1; ++y)
+    {
+        pixels[y * width + x] = color;
+    }
+}
+
+// CRC-32 as used by PNG chunks
+uint32_t Crc32(const uint8_t *data, size_t size, uint32_t crc = 0)
+{
+    // built once, initialization of function statics is thread safe
+    static const std::vector<uint32_t> table = []() {
+        std::vector<uint32_t> entries(256);
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[n] = c;
+        }
+        return entries;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+bool Image::WritePng(const std::string &path) const
+{
+    auto put32 = [](std::vector<uint8_t> &out, uint32_t value) {
+        uint8_t bytes[] = {uint8_t(value >> 24), uint8_t(value >> 16), uint8_t(value >> 8), uint8_t(value)};
+        out.insert(out.end(), bytes, bytes + 4);
+    };
+    auto chunk = [&put32](std::vector<uint8_t> &out, const char *type, const std::vector<uint8_t> &data) {
+        put32(out, data.size());
+        size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data.begin(), data.end());
+        put32(out, Crc32(out.data() + start, out.size() - start));
+    };
+
+    std::vector<uint8_t> header;
+    put32(header, width);
+    put32(header, height);
+    uint8_t format[] = {8, 6, 0, 0, 0}; // 8 bit RGBA, no interlace
+    header.insert(header.end(), format, format + 5);
+
+    // raw scanlines, each prefixed with filter type 0
+    std::vector<uint8_t> raw;
+    raw.reserve(height * (width * 4 + 1));
+    for (size_t y = 0; y < height; ++y)
+    {
+        raw.push_back(0);
+        const uint8_t *row = reinterpret_cast<const uint8_t *>(Row(y));
+        raw.insert(raw.end(), row, row + width * 4);
+    }
+
+    // zlib stream made of stored blocks
+    std::vector<uint8_t> zlib = {0x78, 0x01};
+    uint32_t adlerA = 1, adlerB = 0;
+    for (size_t pos = 0; pos < raw.size() || pos == 0; pos += 65535)
+    {
+        size_t length = std::min<size_t>(65535, raw.size() - pos);
+        zlib.push_back(pos + length >= raw.size() ? 1 : 0);
+        uint8_t lengths[] = {uint8_t(length), uint8_t(length >> 8), uint8_t(~length), uint8_t(~length >> 8)};
+        zlib.insert(zlib.end(), lengths, lengths + 4);
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + length);
+        for (size_t i = pos; i < pos + length; ++i)
+        {
+            adlerA = (adlerA + raw[i]) % 65521;
+            adlerB = (adlerB + adlerA) % 65521;
+        }
+        if (length == 0)
+        {
+            break;
+        }
+    }
+    put32(zlib, adlerB << 16 | adlerA);
+
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    chunk(png, "IHDR", header);
+    chunk(png, "IDAT", zlib);
+    chunk(png, "IEND", std::vector<uint8_t>());
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(png.data()), png.size());
+    return bool(file);
+}
+
+// Colors shared by the offline renderers
+const uint32_t BACKGROUND_COLOR = Rgba(0, 0, 0);
+const uint32_t WAVEFORM_COLOR = Rgba(0, 0, 255);
+const uint32_t FORMANT_COLOR = Rgba(255, 255, 255);
+
+// Draws the min/max envelope of a whole history across the image
+void RenderWaveformOverview(const SampleHistory &history, const WaveformPyramid &pyramid, Image &image)
+{
+    std::vector<MinMax> columns;
+    PyramidColumns(pyramid, history, 0.0, double(history.Size()), image.Width(), columns);
+    image.Fill(BACKGROUND_COLOR);
+    // same vertical scale as the live waveform, full scale spans the middle half
+    double half = image.Height() / 2.0;
+    for (size_t x = 0; x < columns.size(); ++x)
+    {
+        long top = long(half - Pcm16ToFloat(columns[x].max) * half / 2.0);
+        long bottom = long(half - Pcm16ToFloat(columns[x].min) * half / 2.0);
+        image.FillColumn(x, top, bottom, WAVEFORM_COLOR);
+    }
+}
+
+// Draws one spectrum per image column, low frequencies at the bottom
+void RenderSpectrogramOverview(const SampleHistory &history, const SpectrogramParams &params, Image &image)
+{
+    Fft fft(params.fftSize);
+    std::vector<float> window(params.fftSize), block(params.fftSize);
+    float sum = 0.0f;
+    for (size_t i = 0; i < params.fftSize; ++i)
+    {
+        window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / params.fftSize);
+        sum += window[i];
+    }
+    std::vector<std::complex<float>> spectrum(params.fftSize);
+    size_t bins = params.Bins();
+    size_t height = image.Height();
+
+    for (size_t x = 0; x < image.Width(); ++x)
+    {
+        size_t start = size_t(double(x) * history.Size() / image.Width());
+        history.Read(start, params.fftSize, block.data());
+        for (size_t i = 0; i < params.fftSize; ++i)
+        {
+            spectrum[i] = std::complex<float>(block[i] * window[i], 0.0f);
+        }
+        fft.Forward(spectrum.data());
+        for (size_t y = 0; y < height; ++y)
+        {
+            // strongest bin among those mapped to this row
+            size_t firstBin = (height - 1 - y) * bins / height;
+            size_t lastBin = std::max(firstBin + 1, (height - y) * bins / height);
+            float magnitude = 0.0f;
+            for (size_t bin = firstBin; bin < lastBin; ++bin)
+            {
+                magnitude = std::max(magnitude, std::abs(spectrum[bin]));
+            }
+            float db = 20.0f * log10f(magnitude * 2.0f / sum + 1e-12f);
+            float level = std::min(std::max((db - params.floorDb) / -params.floorDb, 0.0f), 1.0f);
+            image.Row(y)[x] = SpectrogramColor(level);
+        }
+    }
+}
+
+// Recursively collects the audio files below directory (relative to root), sorted
+void FindAudioFiles(const std::string &root, const std::string &relative, std::vector<std::string> &out)
+{
+    std::string directory = relative.empty() ? root : root + "/" + relative;
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..")
+        {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string &name : names)
+    {
+        std::string path = relative.empty() ? name : relative + "/" + name;
+        struct stat info;
+        if (stat((root + "/" + path).c_str(), &info) != 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(info.st_mode))
+        {
+            FindAudioFiles(root, path, out);
+        }
+        else if (IsAudioFileName(name))
+        {
+            out.push_back(path);
+        }
+    }
+}
+
+// Thumbnail size used unless --size is given
+const size_t THUMBNAIL_WIDTH = 512;
+const size_t THUMBNAIL_HEIGHT = 128;
+
+// --thumbnails <input dir> <output dir> [--spectrogram] [--size WxH]
+// Renders an overview PNG for every wave file below the input directory, mirroring its layout in
+// the output directory. Files are claimed one at a time by a worker per core. Images are written
+// under a temporary name and renamed when complete, so an interrupted run resumes by skipping
+// every thumbnail that already exists.
+int RunThumbnails(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "usage: " << argv[0] << " --thumbnails <input dir> <output dir> [--spectrogram] [--size WxH]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string inputDir = argv[2];
+    std::string outputDir = argv[3];
+    bool spectrogram = false;
+    size_t width = THUMBNAIL_WIDTH, height = THUMBNAIL_HEIGHT;
+    for (int i = 4; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--spectrogram")
+        {
+            spectrogram = true;
+        }
+        else if (arg == "--size" && i + 1 < argc && sscanf(argv[i + 1], "%zux%zu", &width, &height) == 2)
+        {
+            ++i;
+        }
+        else
+        {
+            std::cerr << "unknown option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<std::string> files;
+    FindAudioFiles(inputDir, "", files);
+
+    std::atomic<size_t> next(0), rendered(0), skipped(0), failed(0);
+    boost::mutex logMutex;
+    auto start = std::chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        AnalysisParams analysisParams;
+        SpectrogramParams spectrogramParams;
+        Image image(width, height);
+        std::vector<MinMax> levels;
+        std::vector<uint64_t> offsets;
+        for (size_t index = next++; index < files.size(); index = next++)
+        {
+            std::string output = outputDir + "/" + files[index] + ".png";
+            struct stat info;
+            if (stat(output.c_str(), &info) == 0)
+            {
+                ++skipped;
+                continue;
+            }
+            try
+            {
+                std::unique_ptr<FileSource> file = OpenFileSource(inputDir + "/" + files[index]);
+                if (spectrogram)
+                {
+                    RenderSpectrogramOverview(file->History(), spectrogramParams, image);
+                }
+                else
+                {
+                    // one file per core already, so the pyramid is built on this thread
+                    BuildPyramid(file->History(), analysisParams.pyramidBase, false, levels, offsets);
+                    WaveformPyramid pyramid;
+                    pyramid.entries = levels.data();
+                    pyramid.offsets = offsets.data();
+                    pyramid.levels = offsets.size() - 1;
+                    pyramid.base = analysisParams.pyramidBase;
+                    RenderWaveformOverview(file->History(), pyramid, image);
+                }
+
+                std::string temp = output + ".tmp";
+                if (!MakeDirectories(output.substr(0, output.rfind('/'))) || !image.WritePng(temp) ||
+                    rename(temp.c_str(), output.c_str()) != 0)
+                {
+                    throw std::runtime_error("failed to write " + output);
+                }
+                ++rendered;
+            }
+            catch (const std::exception &e)
+            {
+                boost::lock_guard<boost::mutex> guard(logMutex);
+                std::cerr << files[index] << ": " << e.what() << std::endl;
+                ++failed;
+            }
+        }
+    };
+
+    boost::thread_group workers;
+    for (size_t t = 0; t < std::max(1u, boost::thread::hardware_concurrency()); ++t)
+    {
+        workers.create_thread(worker);
+    }
+    workers.join_all();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << files.size() << " files: " << rendered << " rendered, " << skipped << " already done, "
+              << failed << " failed in " << elapsed.count() << " s (" << rendered / std::max(elapsed.count(), 1e-9)
+              << " files/s)" << std::endl;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Bitmap font for overlay text, printable ASCII from ' ' to '~' rasterized from DejaVu Sans Mono.
+// One byte per row, most significant bit on the left.
+const size_t HUD_GLYPH_WIDTH = 8;
+const size_t HUD_GLYPH_HEIGHT = 12;
+const char HUD_FIRST_GLYPH = ' ';
+const size_t HUD_GLYPH_COUNT = 95;
+const uint8_t HUD_FONT[HUD_GLYPH_COUNT][HUD_GLYPH_HEIGHT] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // space
+    {0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x10, 0x00, 0x00, 0x00}, // !
+    {0x00, 0x28, 0x28, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // "
+    {0x00, 0x14, 0x24, 0x7e, 0x28, 0x28, 0xfc, 0x48, 0x50, 0x00, 0x00, 0x00}, // #
+    {0x00, 0x10, 0x3c, 0x50, 0x50, 0x38, 0x14, 0x14, 0x78, 0x10, 0x10, 0x00}, // $
+    {0x00, 0xe0, 0xa0, 0xe4, 0x18, 0x20, 0xdc, 0x14, 0x1c, 0x00, 0x00, 0x00}, // %
+    {0x00, 0x38, 0x20, 0x20, 0x30, 0x5a, 0x4a, 0x44, 0x3e, 0x00, 0x00, 0x00}, // &
+    {0x00, 0x10, 0x10, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '
+    {0x10, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x10, 0x00, 0x00}, // (
+    {0x20, 0x20, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x20, 0x20, 0x00, 0x00}, // )
+    {0x00, 0x10, 0x54, 0x38, 0x38, 0x54, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00}, // *
+    {0x00, 0x00, 0x00, 0x10, 0x10, 0x7c, 0x10, 0x10, 0x00, 0x00, 0x00, 0x00}, // +
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x10, 0x20, 0x00, 0x00}, // ,
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x38, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // -
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x10, 0x00, 0x00, 0x00}, // .
+    {0x00, 0x04, 0x08, 0x08, 0x10, 0x10, 0x10, 0x20, 0x20, 0x40, 0x00, 0x00}, // /
+    {0x00, 0x3c, 0x66, 0x42, 0x4a, 0x42, 0x42, 0x66, 0x3c, 0x00, 0x00, 0x00}, // 0
+    {0x00, 0x70, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x7c, 0x00, 0x00, 0x00}, // 1
+    {0x00, 0x3c, 0x42, 0x02, 0x06, 0x0c, 0x18, 0x20, 0x7e, 0x00, 0x00, 0x00}, // 2
+    {0x00, 0x3c, 0x42, 0x02, 0x3c, 0x06, 0x02, 0x42, 0x3c, 0x00, 0x00, 0x00}, // 3
+    {0x00, 0x0c, 0x0c, 0x14, 0x24, 0x64, 0x7e, 0x04, 0x04, 0x00, 0x00, 0x00}, // 4
+    {0x00, 0x7c, 0x40, 0x40, 0x7c, 0x06, 0x02, 0x02, 0x7c, 0x00, 0x00, 0x00}, // 5
+    {0x00, 0x1e, 0x20, 0x40, 0x5c, 0x62, 0x42, 0x42, 0x3c, 0x00, 0x00, 0x00}, // 6
+    {0x00, 0x7e, 0x04, 0x04, 0x08, 0x08, 0x10, 0x10, 0x20, 0x00, 0x00, 0x00}, // 7
+    {0x00, 0x3c, 0x42, 0x42, 0x3c, 0x42, 0x42, 0x42, 0x3c, 0x00, 0x00, 0x00}, // 8
+    {0x00, 0x3c, 0x42, 0x42, 0x42, 0x3e, 0x02, 0x04, 0x78, 0x00, 0x00, 0x00}, // 9
+    {0x00, 0x00, 0x00, 0x10, 0x10, 0x00, 0x00, 0x10, 0x10, 0x00, 0x00, 0x00}, // :
+    {0x00, 0x00, 0x00, 0x10, 0x10, 0x00, 0x00, 0x10, 0x10, 0x20, 0x00, 0x00}, // ;
+    {0x00, 0x00, 0x00, 0x02, 0x1c, 0x60, 0x38, 0x06, 0x00, 0x00, 0x00, 0x00}, // <
+    {0x00, 0x00, 0x00, 0x00, 0xfc, 0x00, 0xfc, 0x00, 0x00, 0x00, 0x00, 0x00}, // =
+    {0x00, 0x00, 0x00, 0x40, 0x38, 0x06, 0x1c, 0x60, 0x00, 0x00, 0x00, 0x00}, // >
+    {0x00, 0x38, 0x04, 0x0c, 0x18, 0x10, 0x10, 0x00, 0x10, 0x00, 0x00, 0x00}, // ?
+    {0x00, 0x1c, 0x26, 0x42, 0x4e, 0x52, 0x52, 0x4e, 0x60, 0x20, 0x1c, 0x00}, // @
+    {0x00, 0x18, 0x18, 0x18, 0x24, 0x24, 0x3c, 0x42, 0x42, 0x00, 0x00, 0x00}, // A
+    {0x00, 0x7c, 0x42, 0x42, 0x7c, 0x42, 0x42, 0x42, 0x7c, 0x00, 0x00, 0x00}, // B
+    {0x00, 0x1c, 0x22, 0x40, 0x40, 0x40, 0x40, 0x22, 0x1c, 0x00, 0x00, 0x00}, // C
+    {0x00, 0x78, 0x44, 0x42, 0x42, 0x42, 0x42, 0x44, 0x78, 0x00, 0x00, 0x00}, // D
+    {0x00, 0x7e, 0x40, 0x40, 0x7e, 0x40, 0x40, 0x40, 0x7e, 0x00, 0x00, 0x00}, // E
+    {0x00, 0x7e, 0x40, 0x40, 0x7e, 0x40, 0x40, 0x40, 0x40, 0x00, 0x00, 0x00}, // F
+    {0x00, 0x1c, 0x22, 0x40, 0x40, 0x46, 0x42, 0x22, 0x1c, 0x00, 0x00, 0x00}, // G
+    {0x00, 0x42, 0x42, 0x42, 0x7e, 0x42, 0x42, 0x42, 0x42, 0x00, 0x00, 0x00}, // H
+    {0x00, 0x7c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x7c, 0x00, 0x00, 0x00}, // I
+    {0x00, 0x1c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x44, 0x38, 0x00, 0x00, 0x00}, // J
+    {0x00, 0x44, 0x48, 0x50, 0x60, 0x50, 0x48, 0x44, 0x42, 0x00, 0x00, 0x00}, // K
+    {0x00, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x7e, 0x00, 0x00, 0x00}, // L
+    {0x00, 0x42, 0x66, 0x66, 0x5a, 0x5a, 0x42, 0x42, 0x42, 0x00, 0x00, 0x00}, // M
+    {0x00, 0x42, 0x62, 0x52, 0x52, 0x4a, 0x4a, 0x46, 0x42, 0x00, 0x00, 0x00}, // N
+    {0x00, 0x3c, 0x66, 0x42, 0x42, 0x42, 0x42, 0x66, 0x3c, 0x00, 0x00, 0x00}, // O
+    {0x00, 0x7c, 0x42, 0x42, 0x42, 0x7c, 0x40, 0x40, 0x40, 0x00, 0x00, 0x00}, // P
+    {0x00, 0x3c, 0x66, 0x42, 0x42, 0x42, 0x42, 0x66, 0x3c, 0x06, 0x00, 0x00}, // Q
+    {0x00, 0x7c, 0x42, 0x42, 0x42, 0x7c, 0x44, 0x42, 0x41, 0x00, 0x00, 0x00}, // R
+    {0x00, 0x3c, 0x42, 0x40, 0x78, 0x06, 0x02, 0x42, 0x3c, 0x00, 0x00, 0x00}, // S
+    {0x00, 0xfe, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x00, 0x00}, // T
+    {0x00, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x3c, 0x00, 0x00, 0x00}, // U
+    {0x00, 0x42, 0x42, 0x24, 0x24, 0x24, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00}, // V
+    {0x00, 0x82, 0x92, 0x92, 0xaa, 0x6c, 0x6c, 0x44, 0x44, 0x00, 0x00, 0x00}, // W
+    {0x00, 0x42, 0x24, 0x24, 0x18, 0x18, 0x24, 0x24, 0x42, 0x00, 0x00, 0x00}, // X
+    {0x00, 0xc6, 0x44, 0x28, 0x38, 0x10, 0x10, 0x10, 0x10, 0x00, 0x00, 0x00}, // Y
+    {0x00, 0x7e, 0x04, 0x04, 0x08, 0x10, 0x30, 0x20, 0x7e, 0x00, 0x00, 0x00}, // Z
+    {0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x30, 0x00, 0x00}, // [
+    {0x00, 0x40, 0x20, 0x20, 0x10, 0x10, 0x10, 0x08, 0x08, 0x04, 0x00, 0x00}, // backslash
+    {0x30, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x30, 0x00, 0x00}, // ]
+    {0x00, 0x30, 0x48, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ^
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfe}, // _
+    {0x10, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // `
+    {0x00, 0x00, 0x00, 0x78, 0x04, 0x3c, 0x44, 0x44, 0x3c, 0x00, 0x00, 0x00}, // a
+    {0x40, 0x40, 0x40, 0x78, 0x44, 0x44, 0x44, 0x44, 0x78, 0x00, 0x00, 0x00}, // b
+    {0x00, 0x00, 0x00, 0x3c, 0x60, 0x40, 0x40, 0x60, 0x3c, 0x00, 0x00, 0x00}, // c
+    {0x04, 0x04, 0x04, 0x3c, 0x44, 0x44, 0x44, 0x44, 0x3c, 0x00, 0x00, 0x00}, // d
+    {0x00, 0x00, 0x00, 0x38, 0x44, 0x7c, 0x40, 0x40, 0x3c, 0x00, 0x00, 0x00}, // e
+    {0x0c, 0x10, 0x10, 0x7c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x00, 0x00}, // f
+    {0x00, 0x00, 0x00, 0x3c, 0x44, 0x44, 0x44, 0x44, 0x3c, 0x04, 0x38, 0x00}, // g
+    {0x40, 0x40, 0x40, 0x58, 0x64, 0x44, 0x44, 0x44, 0x44, 0x00, 0x00, 0x00}, // h
+    {0x10, 0x00, 0x00, 0x70, 0x10, 0x10, 0x10, 0x10, 0x7c, 0x00, 0x00, 0x00}, // i
+    {0x10, 0x00, 0x00, 0x70, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x60, 0x00}, // j
+    {0x40, 0x40, 0x40, 0x48, 0x50, 0x60, 0x50, 0x48, 0x44, 0x00, 0x00, 0x00}, // k
+    {0xe0, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x18, 0x00, 0x00, 0x00}, // l
+    {0x00, 0x00, 0x00, 0x7c, 0x54, 0x54, 0x54, 0x54, 0x54, 0x00, 0x00, 0x00}, // m
+    {0x00, 0x00, 0x00, 0x58, 0x64, 0x44, 0x44, 0x44, 0x44, 0x00, 0x00, 0x00}, // n
+    {0x00, 0x00, 0x00, 0x38, 0x44, 0x44, 0x44, 0x44, 0x38, 0x00, 0x00, 0x00}, // o
+    {0x00, 0x00, 0x00, 0x78, 0x44, 0x44, 0x44, 0x44, 0x78, 0x40, 0x40, 0x00}, // p
+    {0x00, 0x00, 0x00, 0x3c, 0x44, 0x44, 0x44, 0x44, 0x3c, 0x04, 0x04, 0x00}, // q
+    {0x00, 0x00, 0x00, 0x3c, 0x24, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00}, // r
+    {0x00, 0x00, 0x00, 0x3c, 0x40, 0x70, 0x0c, 0x04, 0x78, 0x00, 0x00, 0x00}, // s
+    {0x00, 0x20, 0x20, 0xf8, 0x20, 0x20, 0x20, 0x20, 0x38, 0x00, 0x00, 0x00}, // t
+    {0x00, 0x00, 0x00, 0x44, 0x44, 0x44, 0x44, 0x44, 0x3c, 0x00, 0x00, 0x00}, // u
+    {0x00, 0x00, 0x00, 0x44, 0x44, 0x28, 0x28, 0x28, 0x10, 0x00, 0x00, 0x00}, // v
+    {0x00, 0x00, 0x00, 0x82, 0x82, 0x54, 0x54, 0x28, 0x28, 0x00, 0x00, 0x00}, // w
+    {0x00, 0x00, 0x00, 0x6c, 0x28, 0x10, 0x10, 0x28, 0x6c, 0x00, 0x00, 0x00}, // x
+    {0x00, 0x00, 0x00, 0x44, 0x48, 0x28, 0x28, 0x30, 0x10, 0x20, 0x60, 0x00}, // y
+    {0x00, 0x00, 0x00, 0x7c, 0x08, 0x18, 0x30, 0x20, 0x7c, 0x00, 0x00, 0x00}, // z
+    {0x1c, 0x10, 0x10, 0x10, 0x60, 0x10, 0x10, 0x10, 0x10, 0x1c, 0x00, 0x00}, // {
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00}, // |
+    {0x70, 0x10, 0x10, 0x10, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x70, 0x00, 0x00}, // }
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x70, 0x0e, 0x00, 0x00, 0x00, 0x00, 0x00}, // ~
+};
+
+// Font glyph of a character, unprintable characters map to the space glyph 0
+inline size_t HudGlyph(char c)
+{
+    size_t glyph = size_t(uint8_t(c)) - size_t(HUD_FIRST_GLYPH);
+    return glyph < HUD_GLYPH_COUNT ? glyph : 0;
+}
+
+// Overlay text colors; the background is only drawn behind characters other than spaces
+const uint32_t HUD_TEXT_COLOR = Rgba(255, 255, 255);
+const uint32_t HUD_BACKGROUND_COLOR = Rgba(0, 0, 0, 160);
+
+// Horizontal band of an image that one worker draws into. Every primitive is clipped to the band,
+// so bands can be drawn concurrently without synchronization.
+class RasterTile
+{
+public:
+    RasterTile(Image &image, long y0, long y1);
+
+    void Clear(uint32_t color);
+    // Fills [x0, x1) x [y0, y1) in pixels
+    void FillRect(long x0, long y0, long x1, long y1, uint32_t color);
+    // Fills rows [y0, y1] of column x, in either order
+    void FillColumn(long x, long y0, long y1, uint32_t color);
+    // One pixel wide line between pixel centers (Bresenham)
+    void Line(long x0, long y0, long x1, long y1, uint32_t color);
+    // Connected line through points in normalized device coordinates, like GL_LINE_STRIP.
+    // Segments advancing along x are drawn as one vertical span per column.
+    void LineStrip(const glm::vec2 *points, size_t count, uint32_t color);
+    // Maps an 8 bit grid through a color table, nearest sampled across [x0, x1) x [y0, y1).
+    // values[column * rows + row] with row 0 at the bottom, as spectrogram columns are stored.
+    void Blit(const uint8_t *values, size_t columns, size_t rows, const uint32_t *lut, long x0, long y0, long x1, long y1);
+    // Draws text with the HUD font, its top left at pixel (x, y), over a translucent background
+    void Text(long x, long y, const std::string &text, uint32_t color, uint32_t background);
+
+    long Width() const { return long(image.Width()); }
+    long Height() const { return long(image.Height()); }
+    // Pixel coordinates of normalized device coordinates
+    float PixelX(float x) const { return (x + 1.0f) * 0.5f * Width(); }
+    float PixelY(float y) const { return (1.0f - y) * 0.5f * Height(); }
+
+private:
+    // Fills [x0, x1) of row y, four pixels per store where SSE2 is available
+    void FillRow(long y, long x0, long x1, uint32_t color);
+
+    Image &image;
+    long clipY0, clipY1;
+};
+
+RasterTile::RasterTile(Image &image, long y0, long y1) : image(image), clipY0(y0), clipY1(y1) {}
+
+void RasterTile::FillRow(long y, long x0, long x1, uint32_t color)
+{
+    x0 = std::max(x0, 0L);
+    x1 = std::min(x1, Width());
+    if (y < clipY0 || y >= clipY1 || x0 >= x1)
+    {
+        return;
+    }
+    uint32_t *row = image.Row(y);
+    long x = x0;
+#ifdef __SSE2__
+    __m128i fill = _mm_set1_epi32(int(color));
+    for (; x + 4 <= x1; x += 4)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(row + x), fill);
+    }
+#endif
+    for (; x < x1; ++x)
+    {
+        row[x] = color;
+    }
+}
+
+void RasterTile::Clear(uint32_t color)
+{
+    FillRect(0, clipY0, Width(), clipY1, color);
+}
+
+void RasterTile::FillRect(long x0, long y0, long x1, long y1, uint32_t color)
+{
+    for (long y = std::max(y0, clipY0); y < std::min(y1, clipY1); ++y)
+    {
+        FillRow(y, x0, x1, color);
+    }
+}
+
+void RasterTile::FillColumn(long x, long y0, long y1, uint32_t color)
+{
+    if (y0 > y1)
+    {
+        std::swap(y0, y1);
+    }
+    if (x < 0 || x >= Width())
+    {
+        return;
+    }
+    for (long y = std::max(y0, clipY0); y <= std::min(y1, clipY1 - 1); ++y)
+    {
+        image.Row(y)[x] = color;
+    }
+}
+
+void RasterTile::Line(long x0, long y0, long x1, long y1, uint32_t color)
+{
+    long dx = labs(x1 - x0), dy = -labs(y1 - y0);
+    long sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+    long error = dx + dy;
+    while (true)
+    {
+        if (x0 >= 0 && x0 < Width() && y0 >= clipY0 && y0 < clipY1)
+        {
+            image.Row(y0)[x0] = color;
+        }
+        if (x0 == x1 && y0 == y1)
+        {
+            break;
+        }
+        long doubled = 2 * error;
+        if (doubled >= dy)
+        {
+            error += dy;
+            x0 += sx;
+        }
+        if (doubled <= dx)
+        {
+            error += dx;
+            y0 += sy;
+        }
+    }
+}
+
+void RasterTile::LineStrip(const glm::vec2 *points, size_t count, uint32_t color)
+{
+    for (size_t i = 0; i + 1 < count; ++i)
+    {
+        float ax = PixelX(points[i].x), ay = PixelY(points[i].y);
+        float bx = PixelX(points[i + 1].x), by = PixelY(points[i + 1].y);
+        if (bx < ax)
+        {
+            // going backwards (wrapped around), nothing like a waveform segment
+            Line(long(ax), long(ay), long(bx), long(by), color);
+            continue;
+        }
+        // each column covered by the segment gets the span of y the segment passes through in it
+        long first = long(ax), last = long(bx);
+        for (long x = first; x <= last; ++x)
+        {
+            float t0 = first == last ? 0.0f : std::max((float(x) - ax) / (bx - ax), 0.0f);
+            float t1 = first == last ? 1.0f : std::min((float(x + 1) - ax) / (bx - ax), 1.0f);
+            FillColumn(x, long(ay + (by - ay) * t0), long(ay + (by - ay) * t1), color);
+        }
+    }
+}
+
+void RasterTile::Blit(const uint8_t *values, size_t columns, size_t rows, const uint32_t *lut, long x0, long y0,
+                      long x1, long y1)
+{
+    if (x1 <= x0 || y1 <= y0)
+    {
+        return;
+    }
+    long left = std::max(x0, 0L), right = std::min(x1, Width());
+    std::vector<size_t> columnOffsets(std::max(right - left, 0L));
+    for (long x = left; x < right; ++x)
+    {
+        columnOffsets[x - left] = std::min(size_t((x - x0) * columns / (x1 - x0)), columns - 1) * rows;
+    }
+    for (long y = std::max(y0, clipY0); y < std::min(y1, clipY1); ++y)
+    {
+        size_t row = std::min(size_t((y1 - 1 - y) * rows / (y1 - y0)), rows - 1);
+        uint32_t *pixels = image.Row(y);
+        for (long x = left; x < right; ++x)
+        {
+            pixels[x] = lut[values[columnOffsets[x - left] + row]];
+        }
+    }
+}
+
+void RasterTile::Text(long x, long y, const std::string &text, uint32_t color, uint32_t background)
+{
+    uint32_t alpha = background >> 24;
+    for (long row = std::max(y, clipY0); row < std::min(y + long(HUD_GLYPH_HEIGHT), clipY1); ++row)
+    {
+        uint32_t *pixels = image.Row(row);
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            size_t glyph = HudGlyph(text[i]);
+            if (glyph == 0)
+            {
+                continue;
+            }
+            uint8_t bits = HUD_FONT[glyph][row - y];
+            for (long col = 0; col < long(HUD_GLYPH_WIDTH); ++col)
+            {
+                long px = x + long(i * HUD_GLYPH_WIDTH) + col;
+                if (px < 0 || px >= Width())
+                {
+                    continue;
+                }
+                if (bits & (0x80 >> col))
+                {
+                    pixels[px] = color;
+                    continue;
+                }
+                // blend each channel towards the background by its alpha
+                uint32_t blended = 0xff000000;
+                for (int shift = 0; shift < 24; shift += 8)
+                {
+                    uint32_t under = (pixels[px] >> shift) & 0xff, over = (background >> shift) & 0xff;
+                    blended |= ((under * (255 - alpha) + over * alpha) / 255) << shift;
+                }
+                pixels[px] = blended;
+            }
+        }
+    }
+}
+
+// Image height in rows of each band handed to a worker
+const long RASTER_TILE_ROWS = 32;
+
+// Draws scenes into an image with every core, one band of rows at a time
+class SoftwareRasterizer
+{
+public:
+    SoftwareRasterizer(Image &image);
+
+    // Calls draw once per band, on worker threads, each call clipped to its band. draw must only
+    // read shared state.
+    void Render(const std::function<void(RasterTile &)> &draw);
+
+private:
+    Image &image;
+};
+
+SoftwareRasterizer::SoftwareRasterizer(Image &image) : image(image) {}
+
+void SoftwareRasterizer::Render(const std::function<void(RasterTile &)> &draw)
+{
+    size_t bands = (image.Height() + RASTER_TILE_ROWS - 1) / RASTER_TILE_ROWS;
+    ParallelFor(bands, [&](size_t begin, size_t end) {
+        for (size_t band = begin; band < end; ++band)
+        {
+            long y0 = long(band) * RASTER_TILE_ROWS;
+            RasterTile tile(image, y0, std::min(y0 + RASTER_TILE_ROWS, long(image.Height())));
+            draw(tile);
+        }
+    });
+}
+
+// 8 bit spectrogram magnitudes of width columns evenly spread over [start, end), row 0 lowest
+void ComputeSpectrogramColumns(const SampleHistory &history, const SpectrogramParams &params, double start,
+                               double end, size_t width, std::vector<uint8_t> &out)
+{
+    size_t bins = params.Bins();
+    out.assign(width * bins, 0);
+    ParallelFor(width, [&](size_t begin, size_t finish) {
+        Fft fft(params.fftSize);
+        std::vector<float> window(params.fftSize), block(params.fftSize);
+        float sum = 0.0f;
+        for (size_t i = 0; i < params.fftSize; ++i)
+        {
+            window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / params.fftSize);
+            sum += window[i];
+        }
+        std::vector<std::complex<float>> spectrum(params.fftSize);
+        for (size_t x = begin; x < finish; ++x)
+        {
+            double position = start + (end - start) * x / width;
+            if (position < 0.0 || position >= double(history.Size()))
+            {
+                continue;
+            }
+            // frames are centred on the columns like the reassigned and scalogram ones, silence
+            // before the history
+            long first = long(position) - long(params.fftSize / 2);
+            size_t skip = size_t(std::max(-first, 0L));
+            std::fill(block.begin(), block.begin() + std::min(skip, params.fftSize), 0.0f);
+            if (skip < params.fftSize)
+            {
+                history.Read(size_t(first + long(skip)), params.fftSize - skip, block.data() + skip);
+            }
+            for (size_t i = 0; i < params.fftSize; ++i)
+            {
+                spectrum[i] = std::complex<float>(block[i] * window[i], 0.0f);
+            }
+            fft.Forward(spectrum.data());
+            for (size_t bin = 0; bin < bins; ++bin)
+            {
+                float db = 20.0f * log10f(std::abs(spectrum[bin]) * 2.0f / sum + 1e-12f);
+                float level = std::min(std::max((db - params.floorDb) / -params.floorDb, 0.0f), 1.0f);
+                out[x * bins + bin] = uint8_t(level * 255.0f);
+            }
+        }
+    });
+}
+
+// 8 bit reassigned spectrogram magnitudes of width columns evenly spread over [start, end), row 0
+// lowest. Columns are computed at the largest power of two hop within the pixel spacing, a range of
+// them per core, and each pixel shows the strongest of those it covers so no transient is lost.
+void ComputeReassignedColumns(const SampleHistory &history, const SpectrogramParams &params, double start, double end,
+                              size_t width, std::vector<uint8_t> &out)
+{
+    size_t bins = params.Bins();
+    out.assign(width * bins, 0);
+    double first = std::max(start, 0.0), last = std::min(end, double(history.Size()));
+    if (width == 0 || last <= first)
+    {
+        return;
+    }
+    size_t hop = 1;
+    while (hop * 2 <= (end - start) / width)
+    {
+        hop *= 2;
+    }
+    size_t origin = size_t(first) / hop * hop;
+    size_t count = (size_t(ceil(last)) - origin + hop - 1) / hop;
+    std::vector<float> magnitudes(count * bins);
+    ParallelFor(count, [&](size_t begin, size_t finish) {
+        ReassignedStft transform(params.fftSize);
+        transform.Columns(history, origin + begin * hop + hop / 2, hop, finish - begin, magnitudes.data() + begin * bins);
+    });
+
+    for (size_t x = 0; x < width; ++x)
+    {
+        double x0 = start + (end - start) * x / width, x1 = start + (end - start) * (x + 1) / width;
+        if (x1 <= first || x0 >= last)
+        {
+            continue;
+        }
+        size_t c0 = std::min(size_t(std::max(x0 - origin, 0.0) / hop), count - 1);
+        size_t c1 = std::max(std::min(size_t(std::max(x1 - origin, 0.0) / hop), count), c0 + 1);
+        for (size_t bin = 0; bin < bins; ++bin)
+        {
+            float db = params.floorDb;
+            for (size_t c = c0; c < c1; ++c)
+            {
+                db = std::max(db, magnitudes[c * bins + bin]);
+            }
+            float level = (db - params.floorDb) / -params.floorDb;
+            out[x * bins + bin] = uint8_t(std::min(std::max(level, 0.0f), 1.0f) * 255.0f);
+        }
+    }
+}
+
+// 8 bit scalogram magnitudes of width columns evenly spread over [start, end), row 0 the lowest
+// scale. Columns are computed at the largest power of two hop within the pixel spacing, like a zoom
+// level of the live view, and each pixel takes the nearest.
+void ComputeScalogramColumns(const SampleHistory &history, const SpectrogramParams &params, double start, double end,
+                             size_t width, std::vector<uint8_t> &out)
+{
+    MorletTransform transform(double(history.SampleRate()), params.scales, params.fftSize);
+    size_t scales = transform.Scales();
+    out.assign(width * scales, 0);
+    double first = std::max(start, 0.0), last = std::min(end, double(history.Size()));
+    if (width == 0 || last <= first)
+    {
+        return;
+    }
+    size_t hop = 1;
+    while (hop * 2 <= (end - start) / width)
+    {
+        hop *= 2;
+    }
+    size_t origin = size_t(first) / hop * hop;
+    size_t count = (size_t(ceil(last)) - origin + hop - 1) / hop;
+    std::vector<float> magnitudes(count * scales);
+    transform.Columns(history, origin + hop / 2, hop, count, magnitudes.data());
+
+    for (size_t x = 0; x < width; ++x)
+    {
+        double position = start + (end - start) * (x + 0.5) / width;
+        if (position < first || position >= last)
+        {
+            continue;
+        }
+        size_t c = std::min(size_t((position - origin) / hop), count - 1);
+        for (size_t s = 0; s < scales; ++s)
+        {
+            float level = (magnitudes[c * scales + s] - params.floorDb) / -params.floorDb;
+            out[x * scales + s] = uint8_t(std::min(std::max(level, 0.0f), 1.0f) * 255.0f);
+        }
+    }
+}
+
+// Log spaced spectrum bands of the fftSize samples ending at position, levels in [0, 1]
+void ComputeBars(const SampleHistory &history, const SpectrogramParams &params, double position, size_t bands,
+                 std::vector<float> &out)
+{
+    Fft fft(params.fftSize);
+    std::vector<float> block(params.fftSize);
+    std::vector<std::complex<float>> spectrum(params.fftSize);
+    size_t start = position > params.fftSize ? size_t(position) - params.fftSize : 0;
+    history.Read(start, params.fftSize, block.data());
+    float sum = 0.0f;
+    for (size_t i = 0; i < params.fftSize; ++i)
+    {
+        float window = 0.5f - 0.5f * cosf(2.0f * M_PI * i / params.fftSize);
+        spectrum[i] = std::complex<float>(block[i] * window, 0.0f);
+        sum += window;
+    }
+    fft.Forward(spectrum.data());
+
+    // bands from 20 Hz to Nyquist, each covering at least one bin
+    double lowBin = 20.0 * params.fftSize / history.SampleRate();
+    double ratio = pow(params.Bins() / lowBin, 1.0 / bands);
+    out.assign(bands, 0.0f);
+    for (size_t band = 0; band < bands; ++band)
+    {
+        size_t first = size_t(lowBin * pow(ratio, double(band)));
+        size_t last = std::max(first + 1, std::min(size_t(lowBin * pow(ratio, double(band + 1))), params.Bins()));
+        float magnitude = 0.0f;
+        for (size_t bin = first; bin < last; ++bin)
+        {
+            magnitude = std::max(magnitude, std::abs(spectrum[bin]));
+        }
+        float db = 20.0f * log10f(magnitude * 2.0f / sum + 1e-12f);
+        out[band] = std::min(std::max((db - params.floorDb) / -params.floorDb, 0.0f), 1.0f);
+    }
+}
+
+// Formant tracking by linear prediction. Audio is decimated to about FORMANT_ANALYSIS_HZ, so an
+// all-pole model of FORMANT_ORDER poles covers the formant range without modelling harmonics.
+const double FORMANT_ANALYSIS_HZ = 11025.0;
+const size_t FORMANT_ORDER = 12;
+const double FORMANT_WINDOW_SECONDS = 0.025;
+const double FORMANT_HOP_SECONDS = 0.01;
+// Corner of the pre-emphasis that flattens the glottal roll-off
+const double FORMANT_PREEMPHASIS_HZ = 50.0;
+// Poles below this frequency or broader than this bandwidth aren't formants
+const double FORMANT_MIN_HZ = 90.0;
+const double FORMANT_MAX_BANDWIDTH_HZ = 400.0;
+// Formants reported, F1 to F3
+const size_t FORMANT_COUNT = 3;
+// Windows quieter than this (dB relative to a full scale sine) are not analysed
+const double FORMANT_SILENCE_DB = -60.0;
+
+// LPC model and formants of one analysis window. Frequencies and bandwidths are 0 where fewer
+// formants were found.
+struct FormantFrame
+{
+    bool valid = false;
+    float frequency[FORMANT_COUNT] = {};
+    float bandwidth[FORMANT_COUNT] = {};
+    // predictor x[n] = sum of coefficients[k] x[n - 1 - k], and its error power per sample
+    double coefficients[FORMANT_ORDER] = {};
+    double error = 0.0;
+};
+
+// Formant tracker: the audio is low pass filtered and decimated as it streams in, so overlapping
+// windows share the work; per window the decimated audio is pre-emphasized and Hamming windowed,
+// its autocorrelation solved for the predictor by Levinson-Durbin and the roots of the predictor
+// polynomial found by Durand-Kerner iteration, starting from the previous window's roots. Each root
+// above the real axis is a resonance at its angle with a bandwidth from its distance to the unit
+// circle.
+class FormantTracker
+{
+public:
+    FormantTracker(double sampleRate);
+
+    // Source samples between analyses, an analysis covers the last WindowSamples()
+    size_t HopSamples() const { return hop * factor; }
+    size_t WindowSamples() const { return window.size() * factor; }
+    double AnalysisRate() const { return rate / factor; }
+
+    // Adds samples of a stream and analyses every hop once a window is filled. Returns the number of
+    // new frames, which are appended to frames if given.
+    size_t Process(const float *samples, size_t count, std::vector<FormantFrame> *frames = nullptr);
+    const FormantFrame &Frame() const { return latest; }
+    // Average seconds one analysis took, the streaming decimation included
+    double AnalysisSeconds() const { return analyses ? analysisSeconds / analyses : 0.0; }
+
+    // Level in dB of the model's spectral envelope at a frequency below AnalysisRate() / 2, with the
+    // pre-emphasis taken out again
+    double EnvelopeDb(const FormantFrame &frame, double frequency) const;
+
+private:
+    void Analyze();
+
+    double rate;
+    size_t factor;
+    // decimated samples between analyses
+    size_t hop;
+    double preemphasis;
+    std::vector<float> lowpass;
+    std::vector<float> window;
+
+    // the last lowpass.size() source samples, each stored twice so they can be read contiguously
+    std::vector<float> input;
+    size_t inputPosition = 0;
+    size_t phase = 0;
+    std::vector<float> ring;
+    size_t written = 0;
+    size_t sinceAnalysis = 0;
+    std::vector<double> frame;
+    FormantFrame latest;
+    // roots of the last analysis, the starting point of the next
+    std::complex<double> roots[FORMANT_ORDER];
+    bool rootsValid = false;
+    double analysisSeconds = 0.0;
+    size_t analyses = 0;
+};
+
+FormantTracker::FormantTracker(double sampleRate)
+    : rate(sampleRate), factor(std::max<size_t>(1, size_t(sampleRate / FORMANT_ANALYSIS_HZ)))
+{
+    double analysisRate = rate / factor;
+    hop = std::max<size_t>(1, size_t(FORMANT_HOP_SECONDS * analysisRate + 0.5));
+    preemphasis = exp(-2.0 * M_PI * FORMANT_PREEMPHASIS_HZ / analysisRate);
+
+    // Blackman windowed sinc with its cutoff below the decimated Nyquist frequency, unity at DC
+    size_t taps = factor > 1 ? 4 * factor + 1 : 1;
+    lowpass.resize(taps);
+    double cutoff = 0.45 / factor, sum = 0.0;
+    for (size_t i = 0; i < taps; ++i)
+    {
+        double x = double(i) - (taps - 1) / 2.0;
+        double sinc = x == 0.0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+        double w = taps > 1 ? 0.42 - 0.5 * cos(2.0 * M_PI * i / (taps - 1)) + 0.08 * cos(4.0 * M_PI * i / (taps - 1)) : 1.0;
+        lowpass[i] = float(sinc * w);
+        sum += lowpass[i];
+    }
+    for (float &tap : lowpass)
+    {
+        tap = float(tap / sum);
+    }
+    input.assign(2 * taps, 0.0f);
+
+    window.resize(std::max<size_t>(size_t(FORMANT_WINDOW_SECONDS * analysisRate), 2 * FORMANT_ORDER));
+    for (size_t i = 0; i < window.size(); ++i)
+    {
+        window[i] = float(0.54 - 0.46 * cos(2.0 * M_PI * i / (window.size() - 1)));
+    }
+    ring.resize(window.size());
+    frame.resize(window.size());
+}
+
+size_t FormantTracker::Process(const float *samples, size_t count, std::vector<FormantFrame> *frames)
+{
+    double start = SecondsNow();
+    size_t taps = lowpass.size();
+    size_t produced = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        input[inputPosition] = input[inputPosition + taps] = samples[i];
+        inputPosition = (inputPosition + 1) % taps;
+        if (++phase < factor)
+        {
+            continue;
+        }
+        phase = 0;
+        // the oldest sample is at inputPosition
+        const float *x = input.data() + inputPosition;
+        float sum = 0.0f;
+        for (size_t t = 0; t < taps; ++t)
+        {
+            sum += lowpass[t] * x[t];
+        }
+        ring[written++ % ring.size()] = sum;
+        if (++sinceAnalysis >= hop && written >= ring.size())
+        {
+            Analyze();
+            sinceAnalysis = 0;
+            ++produced;
+            if (frames)
+            {
+                frames->push_back(latest);
+            }
+        }
+    }
+    analysisSeconds += SecondsNow() - start;
+    analyses += produced;
+    return produced;
+}
+
+void FormantTracker::Analyze()
+{
+    FormantFrame &out = latest;
+    out = FormantFrame();
+    size_t n = window.size();
+    // the oldest decimated sample is at written % n
+    size_t oldest = written % n;
+    double previous = ring[oldest], energy = 0.0;
+    for (size_t j = 0; j < n; ++j)
+    {
+        double x = ring[j < n - oldest ? oldest + j : oldest + j - n];
+        energy += x * x;
+        frame[j] = (x - preemphasis * previous) * window[j];
+        previous = x;
+    }
+    // a full scale sine has a mean square of 1/2
+    if (10.0 * log10(std::max(2.0 * energy / n, 1e-30)) < FORMANT_SILENCE_DB)
+    {
+        rootsValid = false;
+        return;
+    }
+
+    double autocorrelation[FORMANT_ORDER + 1];
+    for (size_t lag = 0; lag <= FORMANT_ORDER; ++lag)
+    {
+        double sum = 0.0;
+        for (size_t i = lag; i < n; ++i)
+        {
+            sum += frame[i] * frame[i - lag];
+        }
+        autocorrelation[lag] = sum;
+    }
+    // a touch of white noise keeps the recursion stable on pure tones
+    autocorrelation[0] *= 1.0 + 1e-9;
+
+    // Levinson-Durbin recursion
+    double *a = out.coefficients;
+    double next[FORMANT_ORDER];
+    double error = autocorrelation[0];
+    for (size_t order = 1; order <= FORMANT_ORDER; ++order)
+    {
+        double acc = autocorrelation[order];
+        for (size_t j = 0; j + 1 < order; ++j)
+        {
+            acc -= a[j] * autocorrelation[order - 1 - j];
+        }
+        double reflection = acc / error;
+        for (size_t j = 0; j + 1 < order; ++j)
+        {
+            next[j] = a[j] - reflection * a[order - 2 - j];
+        }
+        next[order - 1] = reflection;
+        std::copy(next, next + order, a);
+        error *= 1.0 - reflection * reflection;
+    }
+    out.error = error / n;
+
+    // Durand-Kerner on z^p - a1 z^(p-1) - ... - ap, all roots at once. A fresh start spreads the
+    // points around a circle just inside the unit circle where resonances lie; when the iteration
+    // from the last window's roots fails to settle it starts over from there.
+    for (int attempt = rootsValid ? 0 : 1; attempt < 2; ++attempt)
+    {
+        if (attempt == 1)
+        {
+            for (size_t i = 0; i < FORMANT_ORDER; ++i)
+            {
+                roots[i] = std::polar(0.9, 2.0 * M_PI * (i + 0.25) / FORMANT_ORDER);
+            }
+        }
+        // the complex arithmetic is written out by hand, std::complex checks every product for infinities
+        double change = HUGE_VAL;
+        for (int iteration = 0; iteration < 200 && change >= 1e-18; ++iteration)
+        {
+            change = 0.0;
+            for (size_t i = 0; i < FORMANT_ORDER; ++i)
+            {
+                double zr = roots[i].real(), zi = roots[i].imag();
+                double vr = 1.0, vi = 0.0, pr = 1.0, pi = 0.0;
+                for (size_t k = 0; k < FORMANT_ORDER; ++k)
+                {
+                    double r = vr * zr - vi * zi - a[k];
+                    vi = vr * zi + vi * zr;
+                    vr = r;
+                    if (k != i)
+                    {
+                        double dr = zr - roots[k].real(), di = zi - roots[k].imag();
+                        r = pr * dr - pi * di;
+                        pi = pr * di + pi * dr;
+                        pr = r;
+                    }
+                }
+                double norm = std::max(pr * pr + pi * pi, 1e-300);
+                double sr = (vr * pr + vi * pi) / norm, si = (vi * pr - vr * pi) / norm;
+                roots[i] = std::complex<double>(zr - sr, zi - si);
+                change = std::max(change, sr * sr + si * si);
+            }
+        }
+        rootsValid = change < 1e-18;
+        if (rootsValid)
+        {
+            break;
+        }
+    }
+
+    double analysisRate = AnalysisRate();
+    std::pair<double, double> poles[FORMANT_ORDER];
+    size_t found = 0;
+    for (size_t i = 0; i < FORMANT_ORDER && rootsValid; ++i)
+    {
+        double frequency = std::arg(roots[i]) * analysisRate / (2.0 * M_PI);
+        double bandwidth = -log(std::max(std::abs(roots[i]), 1e-12)) * analysisRate / M_PI;
+        if (roots[i].imag() > 0.0 && frequency > FORMANT_MIN_HZ && frequency < analysisRate / 2.0 - FORMANT_MIN_HZ &&
+            bandwidth < FORMANT_MAX_BANDWIDTH_HZ)
+        {
+            poles[found++] = std::make_pair(frequency, bandwidth);
+        }
+    }
+    std::sort(poles, poles + found);
+    for (size_t i = 0; i < FORMANT_COUNT && i < found; ++i)
+    {
+        out.frequency[i] = float(poles[i].first);
+        out.bandwidth[i] = float(poles[i].second);
+    }
+    out.valid = true;
+}
+
+double FormantTracker::EnvelopeDb(const FormantFrame &frame, double frequency) const
+{
+    double omega = 2.0 * M_PI * frequency / AnalysisRate();
+    std::complex<double> z = std::polar(1.0, -omega), power(1.0, 0.0), sum(1.0, 0.0);
+    for (size_t k = 0; k < FORMANT_ORDER; ++k)
+    {
+        power *= z;
+        sum -= frame.coefficients[k] * power;
+    }
+    double emphasis = std::norm(1.0 - preemphasis * z);
+    return 10.0 * log10(std::max(frame.error / (std::norm(sum) * emphasis), 1e-30));
+}
+
+// Tracks formants through a history from sample from on until count frames came out or the history
+// ends. Frame j covers samples [from + j * HopSamples(), from + j * HopSamples() + WindowSamples()).
+void TrackFormants(FormantTracker &tracker, const SampleHistory &history, size_t from, size_t count,
+                   std::vector<FormantFrame> &frames)
+{
+    frames.clear();
+    std::vector<float> samples(16 * tracker.HopSamples());
+    for (size_t position = from; position < history.Size() && frames.size() < count; position += samples.size())
+    {
+        size_t n = std::min(samples.size(), history.Size() - position);
+        history.Read(position, n, samples.data());
+        tracker.Process(samples.data(), n, &frames);
+    }
+    frames.resize(std::min(frames.size(), count));
+}
+
+// Points and level range of the LPC envelope drawn over a live spectrogram
+const size_t FORMANT_ENVELOPE_POINTS = 128;
+const double FORMANT_ENVELOPE_RANGE_DB = 60.0;
+
+// LPC envelope of a frame as a line in normalized device coordinates over a linear spectrogram of
+// audio at sampleRate: each point at the height of its frequency, its level moving it from the middle
+// of the view at FORMANT_ENVELOPE_RANGE_DB below the envelope's peak to the right edge at the peak
+std::vector<glm::vec2> FormantEnvelopeLine(const FormantTracker &tracker, const FormantFrame &frame,
+                                           double sampleRate)
+{
+    std::vector<double> levels(FORMANT_ENVELOPE_POINTS);
+    double top = tracker.AnalysisRate() / 2.0;
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        levels[i] = tracker.EnvelopeDb(frame, top * i / (levels.size() - 1));
+    }
+    double peakDb = *std::max_element(levels.begin(), levels.end());
+    std::vector<glm::vec2> points(levels.size());
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        double level = std::max(1.0 + (levels[i] - peakDb) / FORMANT_ENVELOPE_RANGE_DB, 0.0);
+        points[i].x = float(level);
+        points[i].y = float(4.0 * top * i / (levels.size() - 1) / sampleRate - 1.0);
+    }
+    return points;
+}
+
+// Visualizations the software renderer can export
+enum ExportView
+{
+    EXPORT_WAVEFORM,
+    EXPORT_SPECTROGRAM,
+    EXPORT_BARS,
+    EXPORT_SCALOGRAM,
+    EXPORT_REASSIGNED,
+    EXPORT_PANORAMA,
+};
+
+// Number of bars drawn by the bars view
+const size_t BAR_COUNT = 64;
+
+// Renders samples [start, start + length) of a history in the given view, matching the window's
+// layout: the waveform at half scale as a line strip when there are few samples per pixel and as a
+// min/max envelope otherwise, the spectrograms and scalogram over the full height, the panorama as it
+// stands at the end of the range. With formants,
+// the linear spectrograms get a dot per tracked formant and the bars the LPC envelope of their window.
+// The panorama is analysed by panorama if one is given, which then holds the figures of the analysis.
+void RenderExport(const SampleHistory &history, const WaveformPyramid &pyramid, ExportView view, double start,
+                  double length, Image &image, bool formants = false, StereoPanorama *panorama = nullptr)
+{
+    SoftwareRasterizer rasterizer(image);
+    SpectrogramParams spectrogramParams;
+    long width = long(image.Width()), height = long(image.Height());
+
+    if (view == EXPORT_SCALOGRAM)
+    {
+        spectrogramParams.fftSize = SCALOGRAM_FFT_SIZE;
+        spectrogramParams.scales = SCALOGRAM_SCALES;
+    }
+    spectrogramParams.reassigned = view == EXPORT_REASSIGNED;
+
+    if (view == EXPORT_SPECTROGRAM || view == EXPORT_SCALOGRAM || view == EXPORT_REASSIGNED)
+    {
+        std::vector<uint8_t> columns;
+        if (view == EXPORT_SCALOGRAM)
+        {
+            ComputeScalogramColumns(history, spectrogramParams, start, start + length, image.Width(), columns);
+        }
+        else if (view == EXPORT_REASSIGNED)
+        {
+            ComputeReassignedColumns(history, spectrogramParams, start, start + length, image.Width(), columns);
+        }
+        else
+        {
+            ComputeSpectrogramColumns(history, spectrogramParams, start, start + length, image.Width(), columns);
+        }
+        uint32_t lut[256];
+        for (int i = 0; i < 256; ++i)
+        {
+            lut[i] = SpectrogramColor(i / 255.0f);
+        }
+
+        // a 2x2 dot per formant on the linear frequency axis, at the centre of its frame like the
+        // columns underneath
+        std::vector<long> dots;
+        if (formants && view != EXPORT_SCALOGRAM)
+        {
+            FormantTracker tracker(double(history.SampleRate()));
+            double half = tracker.WindowSamples() / 2.0, hop = double(tracker.HopSamples());
+            size_t from = size_t(std::max(start - half, 0.0));
+            size_t count = size_t(std::max(start + length - from - half, 0.0) / hop) + 1;
+            std::vector<FormantFrame> frames;
+            TrackFormants(tracker, history, from, count, frames);
+            double nyquist = history.SampleRate() / 2.0;
+            for (size_t j = 0; j < frames.size(); ++j)
+            {
+                long x = long((from + half + j * hop - start) * width / length);
+                for (size_t f = 0; f < FORMANT_COUNT && frames[j].valid; ++f)
+                {
+                    if (frames[j].frequency[f] > 0.0f)
+                    {
+                        dots.push_back(x);
+                        dots.push_back(long(height * (1.0 - frames[j].frequency[f] / nyquist)));
+                    }
+                }
+            }
+        }
+        rasterizer.Render([&](RasterTile &tile) {
+            tile.Blit(columns.data(), image.Width(), spectrogramParams.Bins(), lut, 0, 0, width, height);
+            for (size_t i = 0; i < dots.size(); i += 2)
+            {
+                tile.FillRect(dots[i] - 1, dots[i + 1] - 1, dots[i] + 1, dots[i + 1] + 1, FORMANT_COLOR);
+            }
+        });
+    }
+    else if (view == EXPORT_PANORAMA)
+    {
+        std::unique_ptr<StereoPanorama> own;
+        if (!panorama)
+        {
+            own.reset(new StereoPanorama(double(history.SampleRate())));
+            panorama = own.get();
+        }
+        std::vector<float> heat(PANORAMA_ROWS * PANORAMA_COLUMNS);
+        double end = std::min(std::max(start + length, 0.0), double(history.Size()));
+        double settle = PANORAMA_SETTLE_DECAYS * PANORAMA_DECAY_SECONDS * history.SampleRate();
+        panorama->Accumulate(history, size_t(std::max(end - settle, 0.0)), size_t(end), heat.data());
+        // Blit takes the cells column by column, a column being a pan position
+        std::vector<uint8_t> cells(heat.size());
+        for (size_t column = 0; column < PANORAMA_COLUMNS; ++column)
+        {
+            for (size_t row = 0; row < PANORAMA_ROWS; ++row)
+            {
+                float level = PanoramaLevel(heat[row * PANORAMA_COLUMNS + column]);
+                cells[column * PANORAMA_ROWS + row] = uint8_t(level * 255.0f + 0.5f);
+            }
+        }
+        uint32_t lut[256];
+        for (int i = 0; i < 256; ++i)
+        {
+            lut[i] = SpectrogramColor(i / 255.0f);
+        }
+        rasterizer.Render([&](RasterTile &tile) {
+            tile.Blit(cells.data(), PANORAMA_COLUMNS, PANORAMA_ROWS, lut, 0, 0, width, height);
+        });
+    }
+    else if (view == EXPORT_BARS)
+    {
+        std::vector<float> bars;
+        ComputeBars(history, spectrogramParams, start + length, BAR_COUNT, bars);
+
+        // the LPC envelope of the last window at the centre of each bar, its peak level with the highest bar
+        std::vector<glm::vec2> envelope;
+        if (formants)
+        {
+            FormantTracker tracker(double(history.SampleRate()));
+            double end = std::min(start + length, double(history.Size()));
+            size_t from = size_t(std::max(end - tracker.WindowSamples() - tracker.HopSamples(), 0.0));
+            std::vector<FormantFrame> frames;
+            TrackFormants(tracker, history, from, 2, frames);
+            if (!frames.empty() && frames.back().valid)
+            {
+                double ratio = pow(history.SampleRate() / 2.0 / 20.0, 1.0 / bars.size());
+                std::vector<double> levels;
+                for (size_t i = 0; i < bars.size(); ++i)
+                {
+                    double frequency = 20.0 * pow(ratio, i + 0.5);
+                    if (frequency >= tracker.AnalysisRate() / 2.0)
+                    {
+                        break;
+                    }
+                    levels.push_back(tracker.EnvelopeDb(frames.back(), frequency));
+                }
+                double peakDb = levels.empty() ? 0.0 : *std::max_element(levels.begin(), levels.end());
+                float peakBar = *std::max_element(bars.begin(), bars.end());
+                envelope.resize(levels.size());
+                for (size_t i = 0; i < levels.size(); ++i)
+                {
+                    double level = std::max(peakBar + (levels[i] - peakDb) / -spectrogramParams.floorDb, 0.0);
+                    envelope[i].x = float(-1.0 + 2.0 * (i + 0.5) / bars.size());
+                    envelope[i].y = float(2.0 * level - 1.0);
+                }
+            }
+        }
+        rasterizer.Render([&](RasterTile &tile) {
+            tile.Clear(BACKGROUND_COLOR);
+            for (size_t i = 0; i < bars.size(); ++i)
+            {
+                long x0 = long(i * width / bars.size());
+                long x1 = long((i + 1) * width / bars.size()) - 1;
+                tile.FillRect(x0, long(height * (1.0f - bars[i])), x1, height, WAVEFORM_COLOR);
+            }
+            tile.LineStrip(envelope.data(), envelope.size(), FORMANT_COLOR);
+        });
+    }
+    else if (length / width > 2.0)
+    {
+        std::vector<MinMax> columns;
+        PyramidColumns(pyramid, history, start, start + length, image.Width(), columns);
+        rasterizer.Render([&](RasterTile &tile) {
+            tile.Clear(BACKGROUND_COLOR);
+            for (size_t x = 0; x < columns.size(); ++x)
+            {
+                long top = long(tile.PixelY(Pcm16ToFloat(columns[x].max) / 2.0f));
+                long bottom = long(tile.PixelY(Pcm16ToFloat(columns[x].min) / 2.0f));
+                tile.FillColumn(x, top, bottom, WAVEFORM_COLOR);
+            }
+        });
+    }
+    else
+    {
+        size_t first = size_t(std::max(start, 0.0));
+        size_t count = size_t(std::min(start + length, double(history.Size()))) - std::min(first, history.Size());
+        std::vector<float> samples(count);
+        history.Read(first, count, samples.data());
+        std::vector<glm::vec2> points(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            points[i].x = float(-1.0 + 2.0 * (first + i - start) / length);
+            points[i].y = samples[i] / 2.0f;
+        }
+        rasterizer.Render([&](RasterTile &tile) {
+            tile.Clear(BACKGROUND_COLOR);
+            tile.LineStrip(points.data(), points.size(), WAVEFORM_COLOR);
+        });
+    }
+}
+
+// --render <file.wav> <out.png> [--view waveform|spectrogram|reassigned|scalogram|panorama|bars] [--size WxH]
+// [--start s] [--length s] [--formants]
+// Renders a view of a wave file to a PNG without a window or GL context
+int RunRender(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "usage: " << argv[0]
+                  << " --render <file.wav> <out.png> [--view waveform|spectrogram|reassigned|scalogram|panorama|bars]"
+                  << " [--size WxH] [--start seconds] [--length seconds] [--formants]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    ExportView view = EXPORT_WAVEFORM;
+    bool formants = false;
+    size_t width = WIN_WIDTH, height = WIN_HEIGHT;
+    double startSeconds = 0.0, lengthSeconds = -1.0;
+    for (int i = 4; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--formants")
+        {
+            formants = true;
+            continue;
+        }
+        if (arg == "--view" && (value == "waveform" || value == "spectrogram" || value == "reassigned" ||
+                                value == "scalogram" || value == "panorama" || value == "bars"))
+        {
+            view = value == "waveform"      ? EXPORT_WAVEFORM
+                   : value == "spectrogram" ? EXPORT_SPECTROGRAM
+                   : value == "reassigned"  ? EXPORT_REASSIGNED
+                   : value == "scalogram"   ? EXPORT_SCALOGRAM
+                   : value == "panorama"    ? EXPORT_PANORAMA
+                                            : EXPORT_BARS;
+        }
+        else if (arg == "--size" && sscanf(value.c_str(), "%zux%zu", &width, &height) == 2)
+        {
+        }
+        else if (arg == "--start" && sscanf(value.c_str(), "%lf", &startSeconds) == 1)
+        {
+        }
+        else if (arg == "--length" && sscanf(value.c_str(), "%lf", &lengthSeconds) == 1)
+        {
+        }
+        else
+        {
+            std::cerr << "bad option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+        ++i;
+    }
+
+    std::unique_ptr<FileSource> file = OpenFileSource(argv[2]);
+    SampleHistory &history = file->History();
+    FileAnalysis analysis(history, file->ContentHash(), AnalysisParams());
+    double rate = double(history.SampleRate());
+    double length = lengthSeconds > 0.0 ? lengthSeconds * rate : double(history.Size());
+
+    Image image(width, height);
+    auto start = std::chrono::steady_clock::now();
+    RenderExport(history, analysis.Pyramid(), view, startSeconds * rate, std::max(length, 1.0), image, formants);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (!image.WritePng(argv[3]))
+    {
+        std::cerr << "failed to write " << argv[3] << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Rendered " << width << "x" << height << " in " << elapsed.count() * 1000.0 << " ms" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// --scalogram-bench <file.wav> [--threads n]
+// Computes the scalogram of a whole file at the live view's finest zoom level and reports how many
+// times faster than real time that is
+int RunScalogramBench(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " --scalogram-bench <file.wav> [--threads n]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    size_t threads = 0;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--threads" && sscanf(value.c_str(), "%zu", &threads) == 1)
+        {
+        }
+        else
+        {
+            std::cerr << "bad option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+        ++i;
+    }
+
+    std::unique_ptr<FileSource> file = OpenFileSource(argv[2]);
+    SampleHistory &history = file->History();
+    double rate = double(history.SampleRate());
+    SpectrogramParams params;
+    MorletTransform transform(rate, SCALOGRAM_SCALES, SCALOGRAM_FFT_SIZE, threads);
+    size_t hop = params.Hop(0);
+    size_t count = (history.Size() + hop - 1) / hop;
+    std::vector<float> magnitudes(count * transform.Scales());
+
+    auto start = std::chrono::steady_clock::now();
+    transform.Columns(history, hop / 2, hop, count, magnitudes.data());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double seconds = history.Size() / rate;
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%zu scales from %.1f to %.1f Hz, %zu columns of %.1f s at %.0f Hz in %.3f s, %.1f times real time on %zu threads",
+             transform.Scales(), transform.Frequency(0), transform.Frequency(transform.Scales() - 1), count, seconds, rate,
+             elapsed.count(), seconds / std::max(elapsed.count(), 1e-9),
+             threads ? threads : size_t(boost::thread::hardware_concurrency()));
+    std::cout << line << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Capture archive format: PCM16 audio in independently decodable blocks. Each channel of a block is
+// stored as a constant, as verbatim samples or as the residual of a fixed polynomial or quantized
+// LPC predictor in partitioned Rice codes (the FLAC scheme). The block index and a trailer at the
+// end of the file let readers seek to any block without touching the ones before it.
+const char ARCHIVE_MAGIC[4] = {'H', 'P', 'A', 'C'};
+const uint32_t ARCHIVE_VERSION = 1;
+// Frames per block, the unit of parallel encoding and of random access
+const size_t ARCHIVE_BLOCK_FRAMES = 4096;
+// Largest block a reader accepts, which bounds what a corrupt header can make it allocate
+const size_t ARCHIVE_MAX_BLOCK_FRAMES = 1 << 16;
+// Highest LPC order considered and the precision of quantized coefficients in bits
+const size_t ARCHIVE_MAX_LPC_ORDER = 12;
+const int ARCHIVE_LPC_PRECISION = 12;
+// Highest Rice partition order, residuals are split into at most 2^order partitions
+const int ARCHIVE_MAX_PARTITION_ORDER = 6;
+// Encoding workers of a live recording, enough to keep up with one capture stream many times over
+const size_t ARCHIVE_LIVE_WORKERS = 2;
+
+struct ArchiveHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t channels;
+    uint32_t sampleRate;
+    uint32_t blockFrames;
+    uint32_t reserved;
+};
+
+// Index entry of one block, the index is written after the last block
+struct ArchiveBlockEntry
+{
+    uint64_t offset;
+    uint64_t firstFrame;
+    uint32_t frames;
+    uint32_t size;
+    // CRC-32 of the decoded interleaved samples
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+// Last bytes of the file
+struct ArchiveTrailer
+{
+    uint64_t indexOffset;
+    uint64_t blockCount;
+    uint64_t frames;
+    char magic[4];
+    uint32_t reserved;
+};
+
+// Representations of a channel within a block, stored in 2 bits
+enum ArchiveSubframe : uint32_t
+{
+    ARCHIVE_CONSTANT = 0, // one 16 bit value
+    ARCHIVE_VERBATIM = 1, // 16 bits per sample
+    ARCHIVE_FIXED = 2,    // 3 bit order, warmup samples, residual
+    ARCHIVE_LPC = 3,      // 5 bit order - 1, 4 bit precision - 1, 4 bit shift, warmup, coefficients, residual
+};
+
+// Appends most significant bit first fields to a byte vector
+class BitWriter
+{
+public:
+    BitWriter(std::vector<uint8_t> &out) : out(out) {}
+
+    // Writes the low count (at most 32) bits of value
+    void Write(uint32_t value, int count)
+    {
+        accumulator = accumulator << count | (value & ((uint64_t(1) << count) - 1));
+        bits += count;
+        while (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back(uint8_t(accumulator >> bits));
+        }
+    }
+    // Writes value as a Rice code: value >> k in unary (zeros ended by a one), then the low k bits
+    void WriteRice(uint32_t value, int k)
+    {
+        uint32_t quotient = value >> k;
+        for (; quotient >= 32; quotient -= 32)
+        {
+            Write(0, 32);
+        }
+        Write(1, quotient + 1);
+        Write(value, k);
+    }
+    // Pads the last byte with zeros
+    void Flush()
+    {
+        if (bits > 0)
+        {
+            Write(0, 8 - bits);
+        }
+    }
+
+private:
+    std::vector<uint8_t> &out;
+    uint64_t accumulator = 0;
+    int bits = 0;
+};
+
+// Reads the fields written by BitWriter. Reading past the end yields zeros and makes Overrun() true.
+class BitReader
+{
+public:
+    BitReader(const uint8_t *data, size_t size) : data(data), size(size) {}
+
+    // Reads count (at most 32) bits
+    uint32_t Read(int count)
+    {
+        if (bits < count)
+        {
+            Refill();
+        }
+        bits -= count;
+        return uint32_t(accumulator >> bits) & uint32_t((uint64_t(1) << count) - 1);
+    }
+    // Reads count bits as a two's complement value
+    int32_t ReadSigned(int count)
+    {
+        return int32_t(Read(count) << (32 - count)) >> (32 - count);
+    }
+    uint32_t ReadRice(int k)
+    {
+        uint32_t quotient = 0;
+        for (;;)
+        {
+            if (bits == 0)
+            {
+                // zeros past the end would never end the code
+                if (pos >= size)
+                {
+                    pos += 8;
+                    return 0;
+                }
+                Refill();
+            }
+            // pending bits moved to the top, the leading zeros are part of the unary quotient
+            uint64_t pending = accumulator << (64 - bits);
+            if (pending == 0)
+            {
+                quotient += bits;
+                bits = 0;
+                continue;
+            }
+            int zeros = __builtin_clzll(pending);
+            quotient += zeros;
+            bits -= zeros + 1;
+            break;
+        }
+        return quotient << k | Read(k);
+    }
+    // True if more bits were read than the data holds; the refill reads ahead of the fields
+    bool Overrun() const { return pos * 8 - bits > size * 8; }
+
+private:
+    void Refill()
+    {
+        while (bits <= 56)
+        {
+            accumulator = accumulator << 8 | (pos < size ? data[pos] : 0);
+            ++pos;
+            bits += 8;
+        }
+    }
+
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
+    uint64_t accumulator = 0;
+    int bits = 0;
+};
+
+inline uint32_t Zigzag(int32_t value)
+{
+    return uint32_t(value) << 1 ^ uint32_t(value >> 31);
+}
+
+inline int32_t Unzigzag(uint32_t value)
+{
+    return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+// CPU time used by the calling thread, for per core throughput that isn't skewed by preemption
+double ThreadCpuSeconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Quantized linear predictor: x[i] is predicted as sum(coefficients[j] * x[i - 1 - j]) >> shift
+struct LpcPredictor
+{
+    size_t order = 0;
+    int shift = 0;
+    int32_t coefficients[ARCHIVE_MAX_LPC_ORDER];
+};
+
+// Compresses blocks of interleaved samples, keeping scratch buffers between blocks. Not thread
+// safe, every encoding thread owns one.
+class ArchiveEncoder
+{
+public:
+    // Replaces out with the encoded block
+    void Encode(const PCM16 *interleaved, size_t frames, size_t channels, std::vector<uint8_t> &out);
+
+private:
+    // Writes one channel with whichever representation takes the fewest bits
+    void EncodeChannel(const int32_t *x, size_t count, BitWriter &writer);
+    // Estimated bits of the residual codes for samples [order, count), with the partition order and
+    // Rice parameters that achieve them
+    uint64_t PlanResidual(const int32_t *residual, size_t count, size_t order, int &partitionOrder,
+                          std::vector<int> &parameters);
+    void WriteResidual(const int32_t *residual, size_t count, size_t order, int partitionOrder,
+                       const std::vector<int> &parameters, BitWriter &writer);
+    // Quantized predictor of the LPC order with the smallest estimated size, false for silence
+    bool FindLpc(const int32_t *x, size_t count, LpcPredictor &predictor);
+
+    std::vector<int32_t> samples, residual, bestResidual;
+    std::vector<uint64_t> sums;
+    std::vector<int> parameters, bestParameters, trialParameters;
+    std::vector<double> windowed;
+};
+
+void ArchiveEncoder::Encode(const PCM16 *interleaved, size_t frames, size_t channels, std::vector<uint8_t> &out)
+{
+    out.clear();
+    out.reserve(frames * channels * sizeof(PCM16) / 2);
+    BitWriter writer(out);
+    samples.resize(frames);
+    for (size_t c = 0; c < channels; ++c)
+    {
+        for (size_t i = 0; i < frames; ++i)
+        {
+            samples[i] = interleaved[i * channels + c];
+        }
+        EncodeChannel(samples.data(), frames, writer);
+    }
+    writer.Flush();
+}
+
+// Residual of the fixed polynomial predictor of an order from 0 to 4, for samples [order, count)
+void FixedResidual(const int32_t *x, size_t count, size_t order, int32_t *residual)
+{
+    for (size_t i = order; i < count; ++i)
+    {
+        switch (order)
+        {
+        case 0:
+            residual[i] = x[i];
+            break;
+        case 1:
+            residual[i] = x[i] - x[i - 1];
+            break;
+        case 2:
+            residual[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+            break;
+        case 3:
+            residual[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+            break;
+        default:
+            residual[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+            break;
+        }
+    }
+}
+
+// Prediction of x[i] from the order samples before it
+inline int32_t LpcPredict(const LpcPredictor &predictor, const int32_t *x, size_t i)
+{
+    int64_t sum = 0;
+    for (size_t j = 0; j < predictor.order; ++j)
+    {
+        sum += int64_t(predictor.coefficients[j]) * x[i - 1 - j];
+    }
+    return int32_t(sum >> predictor.shift);
+}
+
+void ArchiveEncoder::EncodeChannel(const int32_t *x, size_t count, BitWriter &writer)
+{
+    if (std::all_of(x, x + count, [x](int32_t value) { return value == x[0]; }))
+    {
+        writer.Write(ARCHIVE_CONSTANT, 2);
+        writer.Write(uint32_t(x[0]), 16);
+        return;
+    }
+
+    residual.resize(count);
+    bestResidual.resize(count);
+    uint64_t bestBits = 2 + 16 * uint64_t(count);
+    ArchiveSubframe best = ARCHIVE_VERBATIM;
+    size_t bestOrder = 0;
+    int bestPartitionOrder = 0;
+
+    for (size_t order = 0; order <= 4 && order < count; ++order)
+    {
+        FixedResidual(x, count, order, residual.data());
+        int partitionOrder;
+        uint64_t bits = 2 + 3 + 16 * order + PlanResidual(residual.data(), count, order, partitionOrder, parameters);
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            best = ARCHIVE_FIXED;
+            bestOrder = order;
+            bestPartitionOrder = partitionOrder;
+            residual.swap(bestResidual);
+            parameters.swap(bestParameters);
+        }
+    }
+
+    LpcPredictor predictor;
+    if (FindLpc(x, count, predictor))
+    {
+        for (size_t i = predictor.order; i < count; ++i)
+        {
+            residual[i] = x[i] - LpcPredict(predictor, x, i);
+        }
+        int partitionOrder;
+        uint64_t bits = 2 + 5 + 4 + 4 + (16 + ARCHIVE_LPC_PRECISION) * predictor.order +
+                        PlanResidual(residual.data(), count, predictor.order, partitionOrder, parameters);
+        if (bits < bestBits)
+        {
+            best = ARCHIVE_LPC;
+            bestOrder = predictor.order;
+            bestPartitionOrder = partitionOrder;
+            residual.swap(bestResidual);
+            parameters.swap(bestParameters);
+        }
+    }
+
+    writer.Write(best, 2);
+    if (best == ARCHIVE_VERBATIM)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            writer.Write(uint32_t(x[i]), 16);
+        }
+        return;
+    }
+    if (best == ARCHIVE_FIXED)
+    {
+        writer.Write(bestOrder, 3);
+    }
+    else
+    {
+        writer.Write(bestOrder - 1, 5);
+        writer.Write(ARCHIVE_LPC_PRECISION - 1, 4);
+        writer.Write(predictor.shift, 4);
+    }
+    for (size_t i = 0; i < bestOrder; ++i)
+    {
+        writer.Write(uint32_t(x[i]), 16);
+    }
+    if (best == ARCHIVE_LPC)
+    {
+        for (size_t j = 0; j < bestOrder; ++j)
+        {
+            writer.Write(uint32_t(predictor.coefficients[j]), ARCHIVE_LPC_PRECISION);
+        }
+    }
+    WriteResidual(bestResidual.data(), count, bestOrder, bestPartitionOrder, bestParameters, writer);
+}
+
+// Bits of Rice coding count values summing to sum with the parameter picked for their mean
+inline uint64_t RiceBits(uint64_t sum, size_t count, int &parameter)
+{
+    int k = 0;
+    while (k < 30 && uint64_t(count) << (k + 1) <= sum)
+    {
+        ++k;
+    }
+    parameter = k;
+    return uint64_t(count) * (k + 1) + (sum >> k);
+}
+
+uint64_t ArchiveEncoder::PlanResidual(const int32_t *residual, size_t count, size_t order, int &partitionOrder,
+                                      std::vector<int> &parameters)
+{
+    // every partition has to hold at least one residual after the warmup samples
+    int finest = 0;
+    while (finest < ARCHIVE_MAX_PARTITION_ORDER && count % (size_t(2) << finest) == 0 &&
+           (count >> (finest + 1)) > order)
+    {
+        ++finest;
+    }
+    size_t partitions = size_t(1) << finest;
+    size_t partitionSize = count >> finest;
+    sums.assign(partitions, 0);
+    for (size_t p = 0; p < partitions; ++p)
+    {
+        for (size_t i = std::max(p * partitionSize, order); i < (p + 1) * partitionSize; ++i)
+        {
+            sums[p] += Zigzag(residual[i]);
+        }
+    }
+
+    // coarser orders merge neighbouring sums, so every order is estimated from one pass over the residual
+    uint64_t bestBits = UINT64_MAX;
+    for (int level = finest; level >= 0; --level)
+    {
+        partitions = size_t(1) << level;
+        partitionSize = count >> level;
+        trialParameters.resize(partitions);
+        uint64_t bits = 4;
+        for (size_t p = 0; p < partitions; ++p)
+        {
+            bits += 5 + RiceBits(sums[p], partitionSize - (p == 0 ? order : 0), trialParameters[p]);
+        }
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            partitionOrder = level;
+            parameters = trialParameters;
+        }
+        for (size_t p = 0; p < partitions / 2; ++p)
+        {
+            sums[p] = sums[2 * p] + sums[2 * p + 1];
+        }
+    }
+    return bestBits;
+}
+
+void ArchiveEncoder::WriteResidual(const int32_t *residual, size_t count, size_t order, int partitionOrder,
+                                   const std::vector<int> &parameters, BitWriter &writer)
+{
+    writer.Write(partitionOrder, 4);
+    size_t partitionSize = count >> partitionOrder;
+    for (size_t p = 0; p < parameters.size(); ++p)
+    {
+        writer.Write(parameters[p], 5);
+        for (size_t i = std::max(p * partitionSize, order); i < (p + 1) * partitionSize; ++i)
+        {
+            writer.WriteRice(Zigzag(residual[i]), parameters[p]);
+        }
+    }
+}
+
+bool ArchiveEncoder::FindLpc(const int32_t *x, size_t count, LpcPredictor &predictor)
+{
+    size_t maxOrder = std::min(ARCHIVE_MAX_LPC_ORDER, count / 4);
+    if (maxOrder == 0)
+    {
+        return false;
+    }
+
+    // autocorrelation of the Welch windowed block
+    windowed.resize(count);
+    double center = (count - 1) / 2.0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        double t = (i - center) / (center + 1.0);
+        windowed[i] = x[i] * (1.0 - t * t);
+    }
+    double autocorrelation[ARCHIVE_MAX_LPC_ORDER + 1];
+    for (size_t lag = 0; lag <= maxOrder; ++lag)
+    {
+        double sum = 0.0;
+        for (size_t i = lag; i < count; ++i)
+        {
+            sum += windowed[i] * windowed[i - lag];
+        }
+        autocorrelation[lag] = sum;
+    }
+    if (autocorrelation[0] <= 0.0)
+    {
+        return false;
+    }
+
+    // Levinson-Durbin recursion, keeping the order whose residual is estimated to code smallest
+    double coefficients[ARCHIVE_MAX_LPC_ORDER] = {}, next[ARCHIVE_MAX_LPC_ORDER];
+    double best[ARCHIVE_MAX_LPC_ORDER];
+    double error = autocorrelation[0];
+    double bestBits = HUGE_VAL;
+    size_t bestOrder = 0;
+    for (size_t order = 1; order <= maxOrder; ++order)
+    {
+        double acc = autocorrelation[order];
+        for (size_t j = 0; j + 1 < order; ++j)
+        {
+            acc -= coefficients[j] * autocorrelation[order - 1 - j];
+        }
+        double reflection = acc / error;
+        for (size_t j = 0; j + 1 < order; ++j)
+        {
+            next[j] = coefficients[j] - reflection * coefficients[order - 2 - j];
+        }
+        next[order - 1] = reflection;
+        std::copy(next, next + order, coefficients);
+        error *= 1.0 - reflection * reflection;
+        if (error <= 0.0)
+        {
+            break;
+        }
+        // a Laplacian residual of this mean square error takes about 0.5 log2(error) bits per sample
+        double bits = std::max(0.0, 0.5 * std::log2(error / count)) * (count - order) +
+                      double(order) * (16 + ARCHIVE_LPC_PRECISION);
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            bestOrder = order;
+            std::copy(coefficients, coefficients + order, best);
+        }
+    }
+    if (bestOrder == 0)
+    {
+        return false;
+    }
+
+    // scale the largest coefficient to the top of the precision, carrying each rounding error into the next
+    double largest = 0.0;
+    for (size_t j = 0; j < bestOrder; ++j)
+    {
+        largest = std::max(largest, std::fabs(best[j]));
+    }
+    int exponent;
+    std::frexp(largest, &exponent);
+    int shift = ARCHIVE_LPC_PRECISION - 1 - exponent;
+    if (largest <= 0.0 || shift < 0)
+    {
+        return false;
+    }
+    shift = std::min(shift, 15);
+    int32_t limit = 1 << (ARCHIVE_LPC_PRECISION - 1);
+    double carried = 0.0;
+    for (size_t j = 0; j < bestOrder; ++j)
+    {
+        carried += best[j] * (1 << shift);
+        long quantized = std::min<long>(std::max<long>(lround(carried), -limit), limit - 1);
+        predictor.coefficients[j] = int32_t(quantized);
+        carried -= quantized;
+    }
+    predictor.order = bestOrder;
+    predictor.shift = shift;
+    return true;
+}
+
+// Decodes a block of frames interleaved samples, false if the data is corrupt
+bool DecodeArchiveBlock(const uint8_t *data, size_t size, size_t frames, size_t channels, PCM16 *out)
+{
+    BitReader reader(data, size);
+    for (size_t c = 0; c < channels; ++c)
+    {
+        PCM16 *x = out + c;
+        uint32_t type = reader.Read(2);
+        if (type == ARCHIVE_CONSTANT)
+        {
+            PCM16 value = PCM16(reader.ReadSigned(16));
+            for (size_t i = 0; i < frames; ++i)
+            {
+                x[i * channels] = value;
+            }
+            continue;
+        }
+        if (type == ARCHIVE_VERBATIM)
+        {
+            for (size_t i = 0; i < frames; ++i)
+            {
+                x[i * channels] = PCM16(reader.ReadSigned(16));
+            }
+            continue;
+        }
+
+        LpcPredictor predictor;
+        size_t order;
+        if (type == ARCHIVE_FIXED)
+        {
+            order = reader.Read(3);
+            if (order > 4 || order > frames)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < order; ++i)
+            {
+                x[i * channels] = PCM16(reader.ReadSigned(16));
+            }
+        }
+        else
+        {
+            order = reader.Read(5) + 1;
+            int precision = reader.Read(4) + 1;
+            predictor.shift = reader.Read(4);
+            predictor.order = order;
+            if (order > ARCHIVE_MAX_LPC_ORDER || order > frames)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < order; ++i)
+            {
+                x[i * channels] = PCM16(reader.ReadSigned(16));
+            }
+            for (size_t j = 0; j < order; ++j)
+            {
+                predictor.coefficients[j] = reader.ReadSigned(precision);
+            }
+        }
+
+        int partitionOrder = reader.Read(4);
+        size_t partitionSize = frames >> partitionOrder;
+        if (partitionOrder > ARCHIVE_MAX_PARTITION_ORDER || partitionSize << partitionOrder != frames ||
+            partitionSize <= order)
+        {
+            return false;
+        }
+        // the window of previous samples of the predictor, newest first
+        int32_t history[ARCHIVE_MAX_LPC_ORDER + 1];
+        for (size_t j = 0; j < order; ++j)
+        {
+            history[j] = x[(order - 1 - j) * channels];
+        }
+        for (size_t p = 0; p < (size_t(1) << partitionOrder); ++p)
+        {
+            int k = reader.Read(5);
+            for (size_t i = std::max(p * partitionSize, order); i < (p + 1) * partitionSize; ++i)
+            {
+                int32_t residual = Unzigzag(reader.ReadRice(k));
+                int32_t value;
+                if (type == ARCHIVE_FIXED)
+                {
+                    switch (order)
+                    {
+                    case 0:
+                        value = residual;
+                        break;
+                    case 1:
+                        value = residual + history[0];
+                        break;
+                    case 2:
+                        value = residual + 2 * history[0] - history[1];
+                        break;
+                    case 3:
+                        value = residual + 3 * history[0] - 3 * history[1] + history[2];
+                        break;
+                    default:
+                        value = residual + 4 * history[0] - 6 * history[1] + 4 * history[2] - history[3];
+                        break;
+                    }
+                }
+                else
+                {
+                    int64_t sum = 0;
+                    for (size_t j = 0; j < order; ++j)
+                    {
+                        sum += int64_t(predictor.coefficients[j]) * history[j];
+                    }
+                    value = residual + int32_t(sum >> predictor.shift);
+                }
+                if (value < INT16_MIN || value > INT16_MAX)
+                {
+                    return false;
+                }
+                x[i * channels] = PCM16(value);
+                for (size_t j = order; j > 0; --j)
+                {
+                    history[j] = history[j - 1];
+                }
+                history[0] = value;
+            }
+        }
+    }
+    return !reader.Overrun();
+}
+
+// Kinds of events found while archiving, in the order their lists are stored
+enum ArchiveEventType : uint32_t
+{
+    EVENT_CLIPPING, // runs of full scale frames, value is the run length in frames
+    EVENT_SILENCE,  // spans below SILENCE_THRESHOLD_DB of at least SILENCE_SECONDS, value is the peak in dBFS
+    EVENT_LOUD,     // momentary loudness above EVENT_LOUDNESS_LIMIT, value is the maximum in LUFS
+    EVENT_ONSET,    // spectral flux peaks, value is the onset strength
+    EVENT_BEAT,     // onsets at least minBeatInterval apart
+    EVENT_TYPE_COUNT,
+};
+
+const char *const EVENT_TYPE_NAMES[EVENT_TYPE_COUNT] = {"clipping", "silence", "loud", "onsets", "beats"};
+
+// Shortest run of full scale frames that counts as clipping
+const size_t EVENT_CLIP_RUN = 3;
+// Momentary loudness above which a loudness violation is recorded
+const float EVENT_LOUDNESS_LIMIT = -10.0f;
+
+// Frames [start, end) of an event, start == end for instants such as onsets
+struct ArchiveEvent
+{
+    uint64_t start;
+    uint64_t end;
+    float value;
+    uint32_t reserved;
+};
+
+// Zone map entry of one archive block, level queries skip blocks whose range can't match
+struct ArchiveZone
+{
+    PCM16 min;
+    PCM16 max;
+    // range of the momentary loudness of the hops overlapping the block
+    float loudnessMin;
+    float loudnessMax;
+    uint32_t clippedFrames;
+};
+
+// Section identifiers of the event index, stored in the layout of the analysis cache
+enum EventSectionId : uint32_t
+{
+    EVENT_OFFSETS = 1,  // uint64 first event of each type, plus the total
+    EVENT_LIST = 2,     // ArchiveEvent grouped by type, sorted by start within a type
+    EVENT_ZONES = 3,    // ArchiveZone per archive block
+    EVENT_LOUDNESS = 4, // float momentary loudness in LUFS per hop
+};
+
+struct EventIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    // wall clock time of the first frame in seconds since the epoch
+    double startTime;
+    uint64_t frames;
+    uint32_t sampleRate;
+    uint32_t hopFrames;
+    uint32_t blockFrames;
+    uint32_t sectionCount;
+};
+
+const char EVENT_INDEX_MAGIC[4] = {'H', 'P', 'E', 'V'};
+const uint32_t EVENT_INDEX_VERSION = 1;
+
+// Event index written next to an archive
+std::string EventIndexPath(const std::string &archivePath)
+{
+    return archivePath + ".events";
+}
+
+// Read-only view of the tables of an event index, memory mapped or held by a detector
+struct EventTables
+{
+    double startTime = 0.0;
+    uint64_t frames = 0;
+    size_t sampleRate = 0;
+    size_t hopFrames = 1;
+    size_t blockFrames = 1;
+    Track<uint64_t> offsets;
+    Track<ArchiveEvent> events;
+    Track<ArchiveZone> zones;
+    Track<float> loudness;
+
+    Track<ArchiveEvent> OfType(ArchiveEventType type) const
+    {
+        Track<ArchiveEvent> list;
+        list.data = events.data + offsets.data[type];
+        list.count = offsets.data[type + 1] - offsets.data[type];
+        return list;
+    }
+};
+
+// A list of events, or the regions where momentary loudness is above a level
+struct EventQuery
+{
+    ArchiveEventType type = EVENT_CLIPPING;
+    bool loudness = false;
+    float aboveLufs = 0.0f;
+};
+
+// Parses an event type name or "above:<LUFS>"
+bool ParseEventQuery(const std::string &text, EventQuery &query)
+{
+    if (text.compare(0, 6, "above:") == 0)
+    {
+        query.loudness = true;
+        return sscanf(text.c_str() + 6, "%f", &query.aboveLufs) == 1;
+    }
+    for (uint32_t type = 0; type < EVENT_TYPE_COUNT; ++type)
+    {
+        if (text == EVENT_TYPE_NAMES[type])
+        {
+            query.type = ArchiveEventType(type);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds the results of a query overlapping frames [begin, end) in start order without touching the
+// audio. Event lists are binary searched; level queries read the loudness hops of only those blocks
+// whose zone can hold a match. Returns the number of blocks that had to be read.
+size_t RunEventQuery(const EventTables &tables, const EventQuery &query, uint64_t begin, uint64_t end,
+                     std::vector<ArchiveEvent> &out)
+{
+    out.clear();
+    if (!query.loudness)
+    {
+        // events of a type don't overlap, so their ends are sorted as well
+        Track<ArchiveEvent> list = tables.OfType(query.type);
+        const ArchiveEvent *first = std::lower_bound(list.data, list.data + list.count, begin,
+                                                     [](const ArchiveEvent &event, uint64_t frame) {
+                                                         return std::max(event.end, event.start + 1) <= frame;
+                                                     });
+        for (const ArchiveEvent *event = first; event < list.data + list.count && event->start < end; ++event)
+        {
+            out.push_back(*event);
+        }
+        return 0;
+    }
+
+    size_t scanned = 0;
+    size_t nextHop = 0;
+    size_t lastBlock = std::min<uint64_t>(tables.zones.count, (end + tables.blockFrames - 1) / tables.blockFrames);
+    for (size_t block = begin / tables.blockFrames; block < lastBlock; ++block)
+    {
+        if (!(tables.zones.data[block].loudnessMax > query.aboveLufs))
+        {
+            continue;
+        }
+        ++scanned;
+        uint64_t blockStart = std::max<uint64_t>(block * tables.blockFrames, begin);
+        uint64_t blockEnd = std::min<uint64_t>((block + 1) * tables.blockFrames, end);
+        size_t hop = std::max<size_t>(nextHop, blockStart / tables.hopFrames);
+        size_t hopEnd = std::min<size_t>(tables.loudness.count, (blockEnd + tables.hopFrames - 1) / tables.hopFrames);
+        for (; hop < hopEnd; ++hop)
+        {
+            float lufs = tables.loudness.data[hop];
+            if (lufs <= query.aboveLufs)
+            {
+                continue;
+            }
+            if (!out.empty() && out.back().end == hop * tables.hopFrames)
+            {
+                out.back().end += tables.hopFrames;
+                out.back().value = std::max(out.back().value, lufs);
+            }
+            else
+            {
+                ArchiveEvent region = {hop * tables.hopFrames, (hop + 1) * tables.hopFrames, lufs, 0};
+                out.push_back(region);
+            }
+        }
+        nextHop = std::max(nextHop, hopEnd);
+    }
+    return scanned;
+}
+
+// Finds events in a stream of interleaved audio fed one archive block at a time, and builds the zone
+// map and loudness track of its event index. Loudness and silence are measured per loudness hop of
+// the analysis parameters, onsets and beats the way whole file analysis finds them. Copies are
+// independent snapshots.
+class EventDetector
+{
+public:
+    EventDetector(size_t channels, size_t sampleRate, size_t blockFrames);
+
+    // Processes the next block of frames, adding its zone
+    void Process(const PCM16 *interleaved, size_t frames);
+    // Ends the spans still open and picks the last onsets
+    void Finish();
+    // Views of the results, valid until the detector changes
+    EventTables Tables(double startTime);
+
+private:
+    void EndClip();
+    void EndHop();
+    void EndQuiet();
+    // Picks onsets among the flux values whose surroundings are known, or all of them when final
+    void PickOnsets(bool final);
+
+    size_t channels;
+    size_t sampleRate;
+    size_t blockFrames;
+    AnalysisParams params;
+    uint64_t position = 0;
+
+    std::vector<ArchiveEvent> lists[EVENT_TYPE_COUNT];
+    std::vector<ArchiveZone> zones;
+    std::vector<float> loudness;
+    // lists joined in type order by Tables()
+    std::vector<ArchiveEvent> joined;
+    std::vector<uint64_t> offsets;
+
+    uint64_t clipStart = 0;
+    size_t clipLength = 0;
+
+    // K-weighting (shelf, high pass) per channel and the hop being summed
+    std::vector<Biquad> filters;
+    size_t hopFrames;
+    size_t hopsPerWindow;
+    size_t hopFill = 0;
+    double hopEnergy = 0.0;
+    int hopPeak = 0;
+    std::deque<double> windowHops;
+    double windowEnergy = 0.0;
+    bool loudOpen = false;
+    uint64_t quietStart = 0;
+    size_t quietHops = 0;
+    float quietPeak = 0.0f;
+
+    // mono mix waiting for the next FFT frame, and flux values whose peaks aren't decided yet
+    std::shared_ptr<const Fft> fft;
+    std::vector<float> window;
+    std::vector<float> mono;
+    std::vector<float> previous;
+    std::vector<std::complex<float>> spectrum;
+    std::deque<float> flux;
+    size_t fluxBase = 0;
+    size_t fluxFrames = 0;
+    size_t nextPick = 1;
+    size_t radius;
+    size_t minGap;
+    size_t lastBeat = 0;
+};
+
+EventDetector::EventDetector(size_t channels, size_t sampleRate, size_t blockFrames)
+    : channels(channels), sampleRate(sampleRate), blockFrames(blockFrames), filters(2 * channels),
+      fft(new Fft(AnalysisParams().featureFftSize))
+{
+    for (size_t c = 0; c < channels; ++c)
+    {
+        KWeightingFilters(sampleRate, filters[2 * c], filters[2 * c + 1]);
+    }
+    hopFrames = std::max<size_t>(1, size_t(params.loudnessHop * sampleRate));
+    hopsPerWindow = std::max<size_t>(1, size_t(params.loudnessWindow / params.loudnessHop + 0.5));
+    window.resize(params.featureFftSize);
+    for (size_t i = 0; i < window.size(); ++i)
+    {
+        window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / window.size());
+    }
+    previous.assign(params.featureFftSize / 2, 0.0f);
+    spectrum.resize(params.featureFftSize);
+    radius = std::max<size_t>(1, size_t(0.5 * sampleRate / params.featureHop));
+    minGap = std::max<size_t>(1, size_t(params.minBeatInterval * sampleRate / params.featureHop));
+}
+
+void EventDetector::Process(const PCM16 *interleaved, size_t frames)
+{
+    ArchiveZone zone = {INT16_MAX, INT16_MIN, HUGE_VALF, -HUGE_VALF, 0};
+    zones.push_back(zone);
+    for (size_t i = 0; i < frames; ++i, ++position)
+    {
+        const PCM16 *frame = interleaved + i * channels;
+        bool clipped = false;
+        float sum = 0.0f;
+        for (size_t c = 0; c < channels; ++c)
+        {
+            PCM16 value = frame[c];
+            zones.back().min = std::min(zones.back().min, value);
+            zones.back().max = std::max(zones.back().max, value);
+            clipped = clipped || value == INT16_MAX || value == INT16_MIN;
+            hopPeak = std::max(hopPeak, std::abs(int(value)));
+            float sample = Pcm16ToFloat(value);
+            double y = filters[2 * c + 1].Process(filters[2 * c].Process(sample));
+            hopEnergy += y * y;
+            sum += sample;
+        }
+
+        if (clipped)
+        {
+            clipStart = clipLength == 0 ? position : clipStart;
+            ++clipLength;
+            ++zones.back().clippedFrames;
+        }
+        else
+        {
+            EndClip();
+        }
+        if (++hopFill == hopFrames)
+        {
+            EndHop();
+        }
+
+        mono.push_back(sum / channels);
+        if (mono.size() == params.featureFftSize)
+        {
+            double change = 0.0;
+            for (size_t k = 0; k < mono.size(); ++k)
+            {
+                spectrum[k] = std::complex<float>(mono[k] * window[k], 0.0f);
+            }
+            fft->Forward(spectrum.data());
+            for (size_t bin = 0; bin < previous.size(); ++bin)
+            {
+                float compressed = log1pf(100.0f * std::abs(spectrum[bin]));
+                change += std::max(compressed - previous[bin], 0.0f);
+                previous[bin] = compressed;
+            }
+            flux.push_back(fluxFrames > 0 ? float(change) : 0.0f);
+            ++fluxFrames;
+            mono.erase(mono.begin(), mono.begin() + params.featureHop);
+            PickOnsets(false);
+        }
+    }
+}
+
+void EventDetector::EndClip()
+{
+    if (clipLength >= EVENT_CLIP_RUN)
+    {
+        ArchiveEvent event = {clipStart, clipStart + clipLength, float(clipLength), 0};
+        lists[EVENT_CLIPPING].push_back(event);
+    }
+    clipLength = 0;
+}
+
+void EventDetector::EndHop()
+{
+    // momentary loudness over the last hopsPerWindow hops, channel energies summed as in BS.1770
+    windowHops.push_back(hopEnergy);
+    windowEnergy += hopEnergy;
+    if (windowHops.size() > hopsPerWindow)
+    {
+        windowEnergy -= windowHops.front();
+        windowHops.pop_front();
+    }
+    double meanSquare = std::max(windowEnergy, 0.0) / (hopFrames * windowHops.size());
+    float lufs = float(-0.691 + 10.0 * log10(meanSquare + 1e-20));
+    size_t hop = loudness.size();
+    loudness.push_back(lufs);
+
+    uint64_t start = uint64_t(hop) * hopFrames, end = start + hopFrames;
+    for (size_t block = start / blockFrames; block <= (end - 1) / blockFrames && block < zones.size(); ++block)
+    {
+        zones[block].loudnessMin = std::min(zones[block].loudnessMin, lufs);
+        zones[block].loudnessMax = std::max(zones[block].loudnessMax, lufs);
+    }
+
+    if (lufs > EVENT_LOUDNESS_LIMIT)
+    {
+        if (loudOpen)
+        {
+            lists[EVENT_LOUD].back().end = end;
+            lists[EVENT_LOUD].back().value = std::max(lists[EVENT_LOUD].back().value, lufs);
+        }
+        else
+        {
+            ArchiveEvent event = {start, end, lufs, 0};
+            lists[EVENT_LOUD].push_back(event);
+        }
+    }
+    loudOpen = lufs > EVENT_LOUDNESS_LIMIT;
+
+    float peak = Pcm16ToDecibels(PCM16(std::min(hopPeak, int(INT16_MAX))));
+    if (peak < SILENCE_THRESHOLD_DB)
+    {
+        quietStart = quietHops == 0 ? start : quietStart;
+        quietPeak = quietHops == 0 ? peak : std::max(quietPeak, peak);
+        ++quietHops;
+    }
+    else
+    {
+        EndQuiet();
+    }
+
+    hopFill = 0;
+    hopEnergy = 0.0;
+    hopPeak = 0;
+}
+
+void EventDetector::EndQuiet()
+{
+    if (quietHops * hopFrames >= SILENCE_SECONDS * sampleRate)
+    {
+        ArchiveEvent event = {quietStart, quietStart + quietHops * hopFrames, quietPeak, 0};
+        lists[EVENT_SILENCE].push_back(event);
+    }
+    quietHops = 0;
+}
+
+void EventDetector::PickOnsets(bool final)
+{
+    // same rule as whole file analysis: a peak above 1.5 times the mean within radius frames
+    for (; nextPick + 1 < fluxFrames && (final || nextPick + radius < fluxFrames); ++nextPick)
+    {
+        size_t windowBegin = nextPick > radius ? nextPick - radius : 0;
+        size_t windowEnd = std::min(fluxFrames, nextPick + radius + 1);
+        double localSum = 0.0;
+        for (size_t frame = windowBegin; frame < windowEnd; ++frame)
+        {
+            localSum += flux[frame - fluxBase];
+        }
+        float value = flux[nextPick - fluxBase];
+        double threshold = 1.5 * localSum / (windowEnd - windowBegin) + 1e-3;
+        if (value > threshold && value >= flux[nextPick - 1 - fluxBase] && value > flux[nextPick + 1 - fluxBase])
+        {
+            uint64_t at = uint64_t(nextPick) * params.featureHop + params.featureFftSize / 2;
+            ArchiveEvent event = {at, at, value, 0};
+            lists[EVENT_ONSET].push_back(event);
+            if (lists[EVENT_BEAT].empty() || nextPick - lastBeat >= minGap)
+            {
+                lists[EVENT_BEAT].push_back(event);
+                lastBeat = nextPick;
+            }
+        }
+    }
+    // keep what the next windows still need
+    while (fluxBase + radius + 1 < nextPick)
+    {
+        flux.pop_front();
+        ++fluxBase;
+    }
+}
+
+void EventDetector::Finish()
+{
+    EndClip();
+    EndQuiet();
+    PickOnsets(true);
+}
+
+EventTables EventDetector::Tables(double startTime)
+{
+    joined.clear();
+    offsets.clear();
+    for (size_t type = 0; type < EVENT_TYPE_COUNT; ++type)
+    {
+        offsets.push_back(joined.size());
+        joined.insert(joined.end(), lists[type].begin(), lists[type].end());
+    }
+    offsets.push_back(joined.size());
+
+    EventTables tables;
+    tables.startTime = startTime;
+    tables.frames = position;
+    tables.sampleRate = sampleRate;
+    tables.hopFrames = hopFrames;
+    tables.blockFrames = blockFrames;
+    tables.offsets.data = offsets.data();
+    tables.offsets.count = offsets.size();
+    tables.events.data = joined.data();
+    tables.events.count = joined.size();
+    tables.zones.data = zones.data();
+    tables.zones.count = zones.size();
+    tables.loudness.data = loudness.data();
+    tables.loudness.count = loudness.size();
+    return tables;
+}
+
+// Writes an event index under a temporary name and renames it when complete
+bool WriteEventIndex(const std::string &path, const EventTables &tables)
+{
+    SectionData pending[] = {
+        {EVENT_OFFSETS, sizeof(uint64_t), tables.offsets.data, tables.offsets.count},
+        {EVENT_LIST, sizeof(ArchiveEvent), tables.events.data, tables.events.count},
+        {EVENT_ZONES, sizeof(ArchiveZone), tables.zones.data, tables.zones.count},
+        {EVENT_LOUDNESS, sizeof(float), tables.loudness.data, tables.loudness.count},
+    };
+    const size_t sectionCount = sizeof(pending) / sizeof(pending[0]);
+
+    EventIndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, EVENT_INDEX_MAGIC, 4);
+    header.version = EVENT_INDEX_VERSION;
+    header.startTime = tables.startTime;
+    header.frames = tables.frames;
+    header.sampleRate = tables.sampleRate;
+    header.hopFrames = tables.hopFrames;
+    header.blockFrames = tables.blockFrames;
+    header.sectionCount = sectionCount;
+    std::vector<uint8_t> image;
+    SerializeSections(&header, sizeof(header), pending, sectionCount, image);
+
+    std::string temp = path + ".tmp";
+    std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(image.data()), image.size());
+    file.close();
+    return file && rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// Event index of an archive, used in place through a read-only memory mapping
+class EventIndex
+{
+public:
+    EventIndex(const std::string &path) noexcept(false);
+    ~EventIndex();
+
+    const EventTables &Tables() const { return tables; }
+
+    EventIndex(const EventIndex &) = delete;
+    EventIndex &operator=(const EventIndex &) = delete;
+
+private:
+    void *mapping = MAP_FAILED;
+    size_t mappingSize = 0;
+    EventTables tables;
+};
+
+EventIndex::EventIndex(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("failed to open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(EventIndexHeader))
+    {
+        close(fd);
+        throw std::runtime_error("not an event index: " + path);
+    }
+    mappingSize = info.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map " + path);
+    }
+
+    const uint8_t *base = static_cast<const uint8_t *>(mapping);
+    const EventIndexHeader *header = reinterpret_cast<const EventIndexHeader *>(base);
+    bool valid = std::memcmp(header->magic, EVENT_INDEX_MAGIC, 4) == 0 && header->version == EVENT_INDEX_VERSION &&
+                 header->hopFrames > 0 && header->blockFrames > 0 &&
+                 header->sectionCount <= (mappingSize - sizeof(EventIndexHeader)) / sizeof(AnalysisSection);
+    const AnalysisSection *sections = reinterpret_cast<const AnalysisSection *>(header + 1);
+    for (size_t i = 0; valid && i < header->sectionCount; ++i)
+    {
+        // divided rather than multiplied so a corrupt count can't wrap the bound around
+        const AnalysisSection &section = sections[i];
+        valid = section.elementSize > 0 && section.offset <= mappingSize &&
+                section.count <= (mappingSize - section.offset) / section.elementSize;
+        const void *data = base + section.offset;
+        switch (section.id)
+        {
+        case EVENT_OFFSETS:
+            valid = valid && section.elementSize == sizeof(uint64_t);
+            tables.offsets.data = static_cast<const uint64_t *>(data);
+            tables.offsets.count = section.count;
+            break;
+        case EVENT_LIST:
+            valid = valid && section.elementSize == sizeof(ArchiveEvent);
+            tables.events.data = static_cast<const ArchiveEvent *>(data);
+            tables.events.count = section.count;
+            break;
+        case EVENT_ZONES:
+            valid = valid && section.elementSize == sizeof(ArchiveZone);
+            tables.zones.data = static_cast<const ArchiveZone *>(data);
+            tables.zones.count = section.count;
+            break;
+        case EVENT_LOUDNESS:
+            valid = valid && section.elementSize == sizeof(float);
+            tables.loudness.data = static_cast<const float *>(data);
+            tables.loudness.count = section.count;
+            break;
+        }
+    }
+    valid = valid && tables.offsets.count == EVENT_TYPE_COUNT + 1 &&
+            tables.offsets.data[EVENT_TYPE_COUNT] <= tables.events.count;
+    // each type's events run from its offset to the next one
+    for (size_t type = 0; valid && type < EVENT_TYPE_COUNT; ++type)
+    {
+        valid = tables.offsets.data[type] <= tables.offsets.data[type + 1];
+    }
+    if (!valid)
+    {
+        munmap(mapping, mappingSize);
+        throw std::runtime_error("malformed event index: " + path);
+    }
+    tables.startTime = header->startTime;
+    tables.frames = header->frames;
+    tables.sampleRate = header->sampleRate;
+    tables.hopFrames = header->hopFrames;
+    tables.blockFrames = header->blockFrames;
+}
+
+EventIndex::~EventIndex()
+{
+    munmap(mapping, mappingSize);
+}
+
+// Writes a capture archive and its event index. Append only copies into the current block; full
+// blocks are queued for a pool of workers and written in order by whichever worker finishes the next
+// one, which also runs them through the event detector. The thread feeding audio never waits for
+// compression, detection or disk writes.
+class ArchiveWriter
+{
+public:
+    // workers = 0 starts one per core
+    ArchiveWriter(const std::string &path, size_t channels, size_t sampleRate, size_t workers) noexcept(false);
+    ~ArchiveWriter();
+
+    // Appends interleaved frames
+    void Append(const PCM16 *interleaved, size_t frames);
+    // Encodes the partial last block, waits for the workers and writes the block and event indices.
+    // False on write errors.
+    bool Close();
+
+    // Copy of the event detector as of the last written block, for queries while recording
+    EventDetector SnapshotEvents();
+    // Wall clock time of the first frame in seconds since the epoch
+    double StartTime() const { return startTime; }
+
+    size_t Workers() const { return workerCount; }
+    // Totals of the blocks written so far, safe to read while recording
+    uint64_t WrittenFrames() const { return writtenFrames; }
+    uint64_t EncodedBytes() const { return encodedBytes; }
+    // CPU seconds spent encoding, summed over all workers
+    double EncodeSeconds();
+
+    ArchiveWriter(const ArchiveWriter &) = delete;
+    ArchiveWriter &operator=(const ArchiveWriter &) = delete;
+
+private:
+    struct Block
+    {
+        uint64_t sequence = 0;
+        uint64_t firstFrame = 0;
+        uint32_t frames = 0;
+        uint32_t crc = 0;
+        std::vector<PCM16> samples;
+        std::vector<uint8_t> encoded;
+    };
+
+    // Queues the current block for encoding
+    void Submit();
+    void Work();
+    // Writes finished blocks for as long as the next one in sequence is done
+    void WriteCompleted();
+
+    std::string path;
+    std::ofstream file;
+    size_t channels;
+    size_t workerCount;
+    double startTime;
+    bool closed = false;
+    bool succeeded = false;
+
+    // filled by Append
+    Block current;
+    uint64_t submitted = 0;
+    uint64_t submittedFrames = 0;
+
+    boost::mutex queueMutex;
+    boost::condition_variable queueReady;
+    std::deque<Block> queue;
+    bool closing = false;
+
+    boost::mutex doneMutex;
+    std::map<uint64_t, Block> done;
+    double encodeSeconds = 0.0;
+
+    // file, index, written and detector are only touched with writeMutex held
+    boost::mutex writeMutex;
+    EventDetector detector;
+    uint64_t offset = 0;
+    uint64_t written = 0;
+    std::vector<ArchiveBlockEntry> index;
+    std::atomic<uint64_t> writtenFrames{0};
+    std::atomic<uint64_t> encodedBytes{0};
+
+    boost::thread_group workers;
+};
+
+ArchiveWriter::ArchiveWriter(const std::string &path, size_t channels, size_t sampleRate, size_t workers)
+    : path(path), file(path, std::ios::binary | std::ios::trunc), channels(channels),
+      workerCount(workers ? workers : std::max(1u, boost::thread::hardware_concurrency())),
+      startTime(std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count()),
+      detector(channels, sampleRate, ARCHIVE_BLOCK_FRAMES)
+{
+    if (!file)
+    {
+        throw std::runtime_error("failed to create " + path);
+    }
+    ArchiveHeader header = {};
+    std::memcpy(header.magic, ARCHIVE_MAGIC, 4);
+    header.version = ARCHIVE_VERSION;
+    header.channels = channels;
+    header.sampleRate = sampleRate;
+    header.blockFrames = ARCHIVE_BLOCK_FRAMES;
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    offset = sizeof(header);
+
+    current.samples.reserve(ARCHIVE_BLOCK_FRAMES * channels);
+    for (size_t t = 0; t < workerCount; ++t)
+    {
+        this->workers.create_thread([this]() { Work(); });
+    }
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    Close();
+}
+
+void ArchiveWriter::Append(const PCM16 *interleaved, size_t frames)
+{
+    while (frames > 0)
+    {
+        size_t take = std::min(frames, ARCHIVE_BLOCK_FRAMES - current.samples.size() / channels);
+        current.samples.insert(current.samples.end(), interleaved, interleaved + take * channels);
+        interleaved += take * channels;
+        frames -= take;
+        if (current.samples.size() == ARCHIVE_BLOCK_FRAMES * channels)
+        {
+            Submit();
+        }
+    }
+}
+
+void ArchiveWriter::Submit()
+{
+    if (current.samples.empty())
+    {
+        return;
+    }
+    current.sequence = submitted++;
+    current.firstFrame = submittedFrames;
+    current.frames = current.samples.size() / channels;
+    submittedFrames += current.frames;
+    {
+        boost::lock_guard<boost::mutex> guard(queueMutex);
+        queue.push_back(std::move(current));
+    }
+    queueReady.notify_one();
+    current = Block();
+    current.samples.reserve(ARCHIVE_BLOCK_FRAMES * channels);
+}
+
+void ArchiveWriter::Work()
+{
+    ArchiveEncoder encoder;
+    for (;;)
+    {
+        Block block;
+        {
+            boost::unique_lock<boost::mutex> lock(queueMutex);
+            while (queue.empty() && !closing)
+            {
+                queueReady.wait(lock);
+            }
+            if (queue.empty())
+            {
+                return;
+            }
+            block = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        double start = ThreadCpuSeconds();
+        encoder.Encode(block.samples.data(), block.frames, channels, block.encoded);
+        block.crc = Crc32(reinterpret_cast<const uint8_t *>(block.samples.data()), block.samples.size() * sizeof(PCM16));
+        double elapsed = ThreadCpuSeconds() - start;
+        {
+            boost::lock_guard<boost::mutex> guard(doneMutex);
+            encodeSeconds += elapsed;
+            uint64_t sequence = block.sequence;
+            done[sequence] = std::move(block);
+        }
+        WriteCompleted();
+    }
+}
+
+void ArchiveWriter::WriteCompleted()
+{
+    boost::lock_guard<boost::mutex> writeGuard(writeMutex);
+    for (;;)
+    {
+        Block block;
+        {
+            boost::lock_guard<boost::mutex> guard(doneMutex);
+            auto found = done.find(written);
+            if (found == done.end())
+            {
+                return;
+            }
+            block = std::move(found->second);
+            done.erase(found);
+        }
+        ArchiveBlockEntry entry = {offset, block.firstFrame, block.frames, uint32_t(block.encoded.size()), block.crc, 0};
+        file.write(reinterpret_cast<const char *>(block.encoded.data()), block.encoded.size());
+        index.push_back(entry);
+        detector.Process(block.samples.data(), block.frames);
+        offset += block.encoded.size();
+        ++written;
+        writtenFrames += block.frames;
+        encodedBytes += block.encoded.size();
+    }
+}
+
+bool ArchiveWriter::Close()
+{
+    if (closed)
+    {
+        return succeeded;
+    }
+    closed = true;
+    Submit();
+    {
+        boost::lock_guard<boost::mutex> guard(queueMutex);
+        closing = true;
+    }
+    queueReady.notify_all();
+    workers.join_all();
+
+    ArchiveTrailer trailer = {};
+    trailer.indexOffset = offset;
+    trailer.blockCount = index.size();
+    trailer.frames = writtenFrames;
+    std::memcpy(trailer.magic, ARCHIVE_MAGIC, 4);
+    file.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(ArchiveBlockEntry));
+    file.write(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+    file.close();
+
+    detector.Finish();
+    bool indexed = WriteEventIndex(EventIndexPath(path), detector.Tables(startTime));
+    succeeded = file && indexed;
+    return succeeded;
+}
+
+EventDetector ArchiveWriter::SnapshotEvents()
+{
+    boost::lock_guard<boost::mutex> guard(writeMutex);
+    return detector;
+}
+
+double ArchiveWriter::EncodeSeconds()
+{
+    boost::lock_guard<boost::mutex> guard(doneMutex);
+    return encodeSeconds;
+}
+
+// Random access reader of a capture archive through a read-only memory mapping. Blocks decode
+// independently, so any number of threads may decode at once.
+class ArchiveReader
+{
+public:
+    ArchiveReader(const std::string &path) noexcept(false);
+    ~ArchiveReader();
+
+    size_t Channels() const { return header.channels; }
+    size_t SampleRate() const { return header.sampleRate; }
+    // Most frames any block holds
+    size_t BlockFrames() const { return header.blockFrames; }
+    uint64_t Frames() const { return frames; }
+    uint64_t FileSize() const { return mappingSize; }
+    size_t Blocks() const { return index.size(); }
+    const ArchiveBlockEntry &Block(size_t block) const { return index[block]; }
+    // Index of the block holding frame, which must be below Frames()
+    size_t FindBlock(uint64_t frame) const;
+
+    // Decodes a block's Block(block).frames interleaved frames into out, false if it's corrupt
+    bool DecodeBlock(size_t block, PCM16 *out) const;
+    // Decodes count interleaved frames starting at frame, frames past the end read as silence
+    bool Read(uint64_t frame, size_t count, PCM16 *out) const;
+
+    ArchiveReader(const ArchiveReader &) = delete;
+    ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+private:
+    void *mapping = MAP_FAILED;
+    size_t mappingSize = 0;
+    ArchiveHeader header;
+    uint64_t frames = 0;
+    std::vector<ArchiveBlockEntry> index;
+};
+
+ArchiveReader::ArchiveReader(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("failed to open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(ArchiveHeader) + sizeof(ArchiveTrailer))
+    {
+        close(fd);
+        throw std::runtime_error("not an archive: " + path);
+    }
+    mappingSize = info.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map " + path);
+    }
+
+    // fields are copied out, the index follows variable sized blocks and may not be aligned
+    const uint8_t *bytes = static_cast<const uint8_t *>(mapping);
+    ArchiveTrailer trailer;
+    std::memcpy(&header, bytes, sizeof(header));
+    std::memcpy(&trailer, bytes + mappingSize - sizeof(trailer), sizeof(trailer));
+    bool valid = std::memcmp(header.magic, ARCHIVE_MAGIC, 4) == 0 && header.version == ARCHIVE_VERSION &&
+                 header.channels > 0 && header.blockFrames > 0 && header.blockFrames <= ARCHIVE_MAX_BLOCK_FRAMES &&
+                 std::memcmp(trailer.magic, ARCHIVE_MAGIC, 4) == 0 && trailer.indexOffset >= sizeof(header) &&
+                 trailer.indexOffset <= mappingSize - sizeof(trailer) &&
+                 trailer.blockCount == (mappingSize - sizeof(trailer) - trailer.indexOffset) / sizeof(ArchiveBlockEntry);
+    if (valid)
+    {
+        index.resize(trailer.blockCount);
+        std::memcpy(index.data(), bytes + trailer.indexOffset, index.size() * sizeof(ArchiveBlockEntry));
+        for (const ArchiveBlockEntry &entry : index)
+        {
+            // subtracted rather than added so a corrupt offset can't wrap the bound around
+            valid = valid && entry.firstFrame == frames && entry.frames > 0 && entry.frames <= header.blockFrames &&
+                    entry.offset >= sizeof(header) && entry.offset <= trailer.indexOffset &&
+                    entry.size <= trailer.indexOffset - entry.offset;
+            frames += entry.frames;
+        }
+    }
+    if (!valid || frames != trailer.frames)
+    {
+        munmap(mapping, mappingSize);
+        throw std::runtime_error("malformed archive: " + path);
+    }
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    munmap(mapping, mappingSize);
+}
+
+size_t ArchiveReader::FindBlock(uint64_t frame) const
+{
+    auto after = std::upper_bound(index.begin(), index.end(), frame,
+                                  [](uint64_t value, const ArchiveBlockEntry &entry) { return value < entry.firstFrame; });
+    return after - index.begin() - 1;
+}
+
+bool ArchiveReader::DecodeBlock(size_t block, PCM16 *out) const
+{
+    const ArchiveBlockEntry &entry = index[block];
+    const uint8_t *data = static_cast<const uint8_t *>(mapping) + entry.offset;
+    return DecodeArchiveBlock(data, entry.size, entry.frames, header.channels, out) &&
+           Crc32(reinterpret_cast<const uint8_t *>(out), size_t(entry.frames) * header.channels * sizeof(PCM16)) ==
+               entry.crc;
+}
+
+bool ArchiveReader::Read(uint64_t frame, size_t count, PCM16 *out) const
+{
+    std::vector<PCM16> decoded(header.blockFrames * header.channels);
+    while (count > 0 && frame < frames)
+    {
+        size_t block = FindBlock(frame);
+        const ArchiveBlockEntry &entry = index[block];
+        if (!DecodeBlock(block, decoded.data()))
+        {
+            return false;
+        }
+        size_t skip = frame - entry.firstFrame;
+        size_t take = std::min<size_t>(count, entry.frames - skip);
+        std::copy(decoded.begin() + skip * header.channels, decoded.begin() + (skip + take) * header.channels, out);
+        out += take * header.channels;
+        frame += take;
+        count -= take;
+    }
+    std::fill(out, out + count * header.channels, 0);
+    return true;
+}
+
+#ifdef HAVE_SNDFILE
+// Frames of a file a libsndfile worker decodes per step
+const size_t SNDFILE_CHUNK_FRAMES = 1 << 16;
+#endif
+
+// Capture archive decoded into memory. Blocks decode independently, so they're spread over one
+// worker per core, each decoding straight into the block's place in the sample buffer.
+class ArchiveFileSource : public FileSource
+{
+public:
+    ArchiveFileSource(const std::string &path) noexcept(false);
+
+private:
+    std::vector<PCM16> decoded;
+};
+
+ArchiveFileSource::ArchiveFileSource(const std::string &path) : FileSource(path)
+{
+    double start = SecondsNow();
+    ArchiveReader reader(path);
+    decoded.resize(reader.Frames() * reader.Channels());
+    std::atomic<bool> intact(true);
+    ParallelFor(reader.Blocks(), [&](size_t begin, size_t end) {
+        for (size_t block = begin; block < end && intact; ++block)
+        {
+            if (!reader.DecodeBlock(block, decoded.data() + reader.Block(block).firstFrame * reader.Channels()))
+            {
+                intact = false;
+            }
+        }
+    });
+    if (!intact)
+    {
+        throw std::runtime_error("corrupt block in " + path);
+    }
+    decodeSeconds = SecondsNow() - start;
+    Attach(decoded.data(), reader.Channels(), reader.Frames(), reader.SampleRate(),
+           HashBytes(decoded.data(), decoded.size() * sizeof(PCM16)));
+}
+
+#ifdef HAVE_SNDFILE
+// FLAC, Ogg/Vorbis and the other formats libsndfile reads, decoded into memory. Seekable files are
+// split into one range of frames per core; every worker opens the file on its own, seeks to its
+// range and decodes it straight into place.
+class SndFileSource : public FileSource
+{
+public:
+    SndFileSource(const std::string &path) noexcept(false);
+
+private:
+    std::vector<PCM16> decoded;
+};
+
+SndFileSource::SndFileSource(const std::string &path) : FileSource(path)
+{
+    double start = SecondsNow();
+    SF_INFO info;
+    std::memset(&info, 0, sizeof(info));
+    SNDFILE *probe = sf_open(path.c_str(), SFM_READ, &info);
+    if (!probe)
+    {
+        throw std::runtime_error(path + ": " + sf_strerror(nullptr));
+    }
+    sf_close(probe);
+    size_t channels = info.channels;
+    size_t frames = info.frames;
+    decoded.resize(frames * channels);
+
+    std::atomic<bool> intact(true);
+    auto decode = [&](size_t begin, size_t end) {
+        SF_INFO own;
+        std::memset(&own, 0, sizeof(own));
+        SNDFILE *file = sf_open(path.c_str(), SFM_READ, &own);
+        size_t first = begin * SNDFILE_CHUNK_FRAMES, last = std::min(frames, end * SNDFILE_CHUNK_FRAMES);
+        if (!file || (first > 0 && sf_seek(file, first, SEEK_SET) != sf_count_t(first)))
+        {
+            intact = false;
+        }
+        for (size_t frame = first; intact && frame < last; frame += SNDFILE_CHUNK_FRAMES)
+        {
+            sf_count_t count = std::min(SNDFILE_CHUNK_FRAMES, last - frame);
+            intact = sf_readf_short(file, decoded.data() + frame * channels, count) == count;
+        }
+        if (file)
+        {
+            sf_close(file);
+        }
+    };
+    size_t chunks = (frames + SNDFILE_CHUNK_FRAMES - 1) / SNDFILE_CHUNK_FRAMES;
+    if (info.seekable)
+    {
+        ParallelFor(chunks, decode);
+    }
+    else
+    {
+        decode(0, chunks);
+    }
+    if (!intact)
+    {
+        throw std::runtime_error("failed to decode " + path);
+    }
+    decodeSeconds = SecondsNow() - start;
+    Attach(decoded.data(), channels, frames, info.samplerate, HashBytes(decoded.data(), decoded.size() * sizeof(PCM16)));
+}
+#endif
+
+std::unique_ptr<FileSource> OpenFileSource(const std::string &path)
+{
+    char magic[4] = {};
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("failed to open " + path);
+    }
+    file.read(magic, sizeof(magic));
+    if (std::memcmp(magic, "RIFF", 4) == 0)
+    {
+        return std::unique_ptr<FileSource>(new WaveFileSource(path));
+    }
+    if (std::memcmp(magic, ARCHIVE_MAGIC, 4) == 0)
+    {
+        return std::unique_ptr<FileSource>(new ArchiveFileSource(path));
+    }
+#ifdef HAVE_SNDFILE
+    return std::unique_ptr<FileSource>(new SndFileSource(path));
+#else
+    throw std::runtime_error("unsupported format (built without libsndfile): " + path);
+#endif
+}
+
+bool IsAudioFileName(const std::string &name)
+{
+    static const char *const extensions[] = {
+        ".wav", ".hpac",
+#ifdef HAVE_SNDFILE
+        ".flac", ".ogg", ".oga", ".aif", ".aiff", ".caf", ".w64",
+#endif
+    };
+    for (const char *extension : extensions)
+    {
+        size_t length = strlen(extension);
+        if (name.size() > length && strcasecmp(name.c_str() + name.size() - length, extension) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// --compress <file.wav> <out.hpac> [--workers n]
+// Encodes every channel of a wave file into a capture archive on a worker pool, then decodes the
+// archive again in parallel and compares it with the source, reporting the compression ratio and
+// the encode and decode throughput in total and per core.
+int RunCompress(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "usage: " << argv[0] << " --compress <file.wav> <out.hpac> [--workers n]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    size_t workerCount = 0;
+    for (int i = 4; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc && sscanf(argv[i + 1], "%zu", &workerCount) == 1)
+        {
+            ++i;
+        }
+        else
+        {
+            std::cerr << "unknown option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::unique_ptr<FileSource> file = OpenFileSource(argv[2]);
+    size_t channels = file->Channels();
+    size_t frames = file->Frames();
+    double rate = double(file->History().SampleRate());
+    double rawMegabytes = frames * channels * sizeof(PCM16) / 1e6;
+    double audioSeconds = frames / rate;
+
+    auto start = std::chrono::steady_clock::now();
+    double encodeCpu;
+    {
+        ArchiveWriter writer(argv[3], channels, size_t(rate), workerCount);
+        // fed in capture sized pieces like a live recording
+        size_t piece = AUDIO_FRAMEBUF_SIZE / sizeof(PCM16);
+        for (size_t pos = 0; pos < frames; pos += piece)
+        {
+            writer.Append(file->Samples() + pos * channels, std::min(piece, frames - pos));
+        }
+        if (!writer.Close())
+        {
+            std::cerr << "failed to write " << argv[3] << std::endl;
+            return EXIT_FAILURE;
+        }
+        encodeCpu = writer.EncodeSeconds();
+        workerCount = writer.Workers();
+    }
+    std::chrono::duration<double> encodeElapsed = std::chrono::steady_clock::now() - start;
+
+    ArchiveReader reader(argv[3]);
+    std::atomic<size_t> mismatched(0);
+    boost::mutex cpuMutex;
+    double decodeCpu = 0.0;
+    start = std::chrono::steady_clock::now();
+    ParallelFor(reader.Blocks(), [&](size_t begin, size_t end) {
+        double threadStart = ThreadCpuSeconds();
+        std::vector<PCM16> decoded(reader.BlockFrames() * channels);
+        for (size_t block = begin; block < end; ++block)
+        {
+            const ArchiveBlockEntry &entry = reader.Block(block);
+            if (!reader.DecodeBlock(block, decoded.data()) ||
+                !std::equal(decoded.begin(), decoded.begin() + entry.frames * channels,
+                            file->Samples() + entry.firstFrame * channels))
+            {
+                ++mismatched;
+            }
+        }
+        boost::lock_guard<boost::mutex> guard(cpuMutex);
+        decodeCpu += ThreadCpuSeconds() - threadStart;
+    });
+    std::chrono::duration<double> decodeElapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << frames << " frames x " << channels << " channels: " << size_t(rawMegabytes * 1e6) << " -> "
+              << reader.FileSize() << " bytes, ratio " << rawMegabytes * 1e6 / reader.FileSize() << std::endl;
+    std::cout << "encode " << rawMegabytes / encodeElapsed.count() << " MB/s on " << workerCount << " workers, "
+              << rawMegabytes / encodeCpu << " MB/s (" << audioSeconds / encodeCpu << "x realtime) per core"
+              << std::endl;
+    std::cout << "decode " << rawMegabytes / decodeElapsed.count() << " MB/s, " << rawMegabytes / decodeCpu
+              << " MB/s (" << audioSeconds / decodeCpu << "x realtime) per core" << std::endl;
+    if (mismatched > 0 || reader.Frames() != frames)
+    {
+        std::cerr << mismatched << " of " << reader.Blocks() << " blocks don't match the source" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "all " << reader.Blocks() << " blocks verified" << std::endl;
+
+    EventIndex events(EventIndexPath(argv[3]));
+    std::cout << "events:";
+    for (uint32_t type = 0; type < EVENT_TYPE_COUNT; ++type)
+    {
+        std::cout << " " << events.Tables().OfType(ArchiveEventType(type)).count << " " << EVENT_TYPE_NAMES[type];
+    }
+    std::cout << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Formats seconds since the epoch as local date and time with milliseconds
+std::string FormatWallTime(double seconds)
+{
+    time_t whole = time_t(seconds);
+    struct tm local;
+    localtime_r(&whole, &local);
+    char text[32];
+    size_t length = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+    snprintf(text + length, sizeof(text) - length, ".%03d", int((seconds - whole) * 1000.0));
+    return text;
+}
+
+// Results listed by --query unless --limit is given
+const size_t QUERY_LIMIT = 20;
+
+// --query <archive.hpac> <clipping|silence|loud|onsets|beats|above:LUFS> [--last hours] [--limit n]
+// Answers a query from the memory mapped event index of an archive, without decoding any audio
+int RunQuery(int argc, char *argv[])
+{
+    EventQuery query;
+    if (argc < 4 || !ParseEventQuery(argv[3], query))
+    {
+        std::cerr << "usage: " << argv[0] << " --query <archive.hpac> <clipping|silence|loud|onsets|beats|above:LUFS>"
+                  << " [--last hours] [--limit n]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    double lastHours = -1.0;
+    size_t limit = QUERY_LIMIT;
+    for (int i = 4; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--last" && sscanf(value.c_str(), "%lf", &lastHours) == 1)
+        {
+        }
+        else if (arg == "--limit" && sscanf(value.c_str(), "%zu", &limit) == 1)
+        {
+        }
+        else
+        {
+            std::cerr << "bad option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+        ++i;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    EventIndex index(EventIndexPath(argv[2]));
+    const EventTables &tables = index.Tables();
+    double rate = double(tables.sampleRate);
+    uint64_t begin = 0;
+    if (lastHours >= 0.0)
+    {
+        double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+        double from = (now - lastHours * 3600.0 - tables.startTime) * rate;
+        begin = uint64_t(std::min(std::max(from, 0.0), double(tables.frames)));
+    }
+    std::vector<ArchiveEvent> results;
+    size_t scanned = RunEventQuery(tables, query, begin, tables.frames, results);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    for (size_t i = 0; i < results.size() && i < limit; ++i)
+    {
+        const ArchiveEvent &event = results[i];
+        char line[128];
+        snprintf(line, sizeof(line), "%s  at %.3f s  length %.3f s  value %.2f",
+                 FormatWallTime(tables.startTime + event.start / rate).c_str(), event.start / rate,
+                 (event.end - event.start) / rate, event.value);
+        std::cout << line << std::endl;
+    }
+    if (results.size() > limit)
+    {
+        std::cout << "... " << results.size() - limit << " more" << std::endl;
+    }
+    std::cout << results.size() << " results in " << elapsed.count() * 1000.0 << " ms";
+    if (query.loudness)
+    {
+        std::cout << ", read the loudness of " << scanned << " of " << tables.zones.count << " blocks";
+    }
+    std::cout << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Columnar export format for analysis results. A header and schema describe the columns; the
+// values follow in column chunks of up to rowsPerChunk rows, each on a 64 byte boundary so readers
+// can use uncompressed chunks in place through a read-only mapping. Chunks of different columns
+// interleave in the order a streaming writer fills them, the chunk directory at the end says where
+// each one is.
+const char COLUMN_MAGIC[4] = {'H', 'P', 'C', 'O'};
+const uint32_t COLUMN_VERSION = 1;
+const size_t COLUMN_ALIGNMENT = 64;
+// Rows per chunk unless the writer is given another count
+const size_t COLUMN_ROWS_PER_CHUNK = 16384;
+// Values per Rice partition of a compressed chunk
+const size_t COLUMN_PARTITION = 256;
+// Rice parameter marking a partition stored as raw 32 bit words
+const int COLUMN_ESCAPE = 31;
+
+enum ColumnType : uint32_t
+{
+    COLUMN_UINT8 = 0,
+    COLUMN_INT16 = 1,
+    COLUMN_INT32 = 2,
+    COLUMN_UINT64 = 3,
+    COLUMN_FLOAT32 = 4,
+    COLUMN_FLOAT64 = 5,
+};
+
+const char *const COLUMN_TYPE_NAMES[] = {"uint8", "int16", "int32", "uint64", "float32", "float64"};
+
+inline size_t ColumnTypeSize(ColumnType type)
+{
+    static const size_t sizes[] = {1, 2, 4, 8, 4, 8};
+    return sizes[type];
+}
+
+// Chunks of compressible columns are stored compressed whenever that makes them smaller
+const uint32_t COLUMN_COMPRESSIBLE = 1;
+
+// Schema entry of one column
+struct ColumnSchema
+{
+    char name[40];
+    uint32_t type;
+    // values per row, e.g. the bins of a spectrum
+    uint32_t width;
+    // rows per second, 0 if rows aren't evenly spaced in time
+    double rate;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// Describes a column for a writer
+ColumnSchema MakeColumn(const std::string &name, ColumnType type, size_t width, double rate,
+                        uint32_t flags = COLUMN_COMPRESSIBLE)
+{
+    ColumnSchema column;
+    std::memset(&column, 0, sizeof(column));
+    strncpy(column.name, name.c_str(), sizeof(column.name) - 1);
+    column.type = type;
+    column.width = width;
+    column.rate = rate;
+    column.flags = flags;
+    return column;
+}
+
+// File header, followed by columnCount ColumnSchema entries
+struct ColumnFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t columnCount;
+    uint32_t rowsPerChunk;
+};
+
+enum ColumnCodec : uint16_t
+{
+    COLUMN_RAW = 0,
+    // each value minus (integers) or xor (floats) the same value of the previous row, zigzag
+    // mapped and Rice coded in partitions of COLUMN_PARTITION values
+    COLUMN_DELTA_RICE = 1,
+};
+
+// Directory entry of one column chunk
+struct ColumnChunkEntry
+{
+    uint64_t offset;
+    uint64_t size;
+    uint64_t firstRow;
+    uint32_t rows;
+    uint16_t column;
+    uint16_t codec;
+    // CRC-32 of the stored bytes
+    uint32_t crc;
+    uint32_t reserved;
+    // smallest and largest value in the chunk, lets readers skip chunks without decoding them
+    double min;
+    double max;
+};
+
+// Last bytes of the file
+struct ColumnFileTrailer
+{
+    uint64_t directoryOffset;
+    uint64_t chunkCount;
+    char magic[4];
+    uint32_t reserved;
+};
+
+// Value i of a chunk as a 32 bit word: the bits of a float, the sign extended value of an integer
+inline uint32_t ColumnWord(const uint8_t *data, ColumnType type, size_t i)
+{
+    switch (type)
+    {
+    case COLUMN_UINT8:
+        return data[i];
+    case COLUMN_INT16:
+    {
+        int16_t value;
+        std::memcpy(&value, data + 2 * i, 2);
+        return uint32_t(int32_t(value));
+    }
+    default:
+    {
+        uint32_t value;
+        std::memcpy(&value, data + 4 * i, 4);
+        return value;
+    }
+    }
+}
+
+inline void SetColumnWord(uint8_t *data, ColumnType type, size_t i, uint32_t word)
+{
+    switch (type)
+    {
+    case COLUMN_UINT8:
+        data[i] = uint8_t(word);
+        break;
+    case COLUMN_INT16:
+    {
+        int16_t value = int16_t(word);
+        std::memcpy(data + 2 * i, &value, 2);
+        break;
+    }
+    default:
+        std::memcpy(data + 4 * i, &word, 4);
+        break;
+    }
+}
+
+inline double ColumnValue(const uint8_t *data, ColumnType type, size_t i)
+{
+    switch (type)
+    {
+    case COLUMN_UINT64:
+    {
+        uint64_t value;
+        std::memcpy(&value, data + 8 * i, 8);
+        return double(value);
+    }
+    case COLUMN_FLOAT32:
+    {
+        float value;
+        std::memcpy(&value, data + 4 * i, 4);
+        return value;
+    }
+    case COLUMN_FLOAT64:
+    {
+        double value;
+        std::memcpy(&value, data + 8 * i, 8);
+        return value;
+    }
+    default:
+        return double(int32_t(ColumnWord(data, type, i)));
+    }
+}
+
+// Change of value i against the same value of the previous row, as a zigzag code
+inline uint32_t ColumnDelta(uint32_t word, uint32_t previous, ColumnType type)
+{
+    return type == COLUMN_FLOAT32 ? word ^ previous : Zigzag(int32_t(word - previous));
+}
+
+inline uint32_t ColumnUndelta(uint32_t code, uint32_t previous, ColumnType type)
+{
+    return type == COLUMN_FLOAT32 ? code ^ previous : previous + uint32_t(Unzigzag(code));
+}
+
+// Encodes count values of a chunk with COLUMN_DELTA_RICE. False if the type can't be compressed or
+// the result isn't smaller than the raw values.
+bool EncodeColumnChunk(const uint8_t *data, ColumnType type, size_t width, size_t count, std::vector<uint8_t> &out)
+{
+    if (ColumnTypeSize(type) > 4)
+    {
+        return false;
+    }
+    std::vector<uint32_t> codes(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        codes[i] = ColumnDelta(ColumnWord(data, type, i), i >= width ? ColumnWord(data, type, i - width) : 0, type);
+    }
+
+    out.clear();
+    BitWriter writer(out);
+    for (size_t begin = 0; begin < count; begin += COLUMN_PARTITION)
+    {
+        size_t end = std::min(count, begin + COLUMN_PARTITION);
+        uint64_t sum = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            sum += codes[i];
+        }
+        // exact cost, a few large codes would otherwise blow up the unary part
+        int k;
+        RiceBits(sum, end - begin, k);
+        uint64_t bits = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            bits += (codes[i] >> k) + 1 + k;
+        }
+        if (bits < 32 * (end - begin))
+        {
+            writer.Write(k, 5);
+            for (size_t i = begin; i < end; ++i)
+            {
+                writer.WriteRice(codes[i], k);
+            }
+        }
+        else
+        {
+            writer.Write(COLUMN_ESCAPE, 5);
+            for (size_t i = begin; i < end; ++i)
+            {
+                writer.Write(codes[i], 32);
+            }
+        }
+    }
+    writer.Flush();
+    return out.size() < count * ColumnTypeSize(type);
+}
+
+// Decodes count values of a COLUMN_DELTA_RICE chunk into out, false if the data is corrupt
+bool DecodeColumnChunk(const uint8_t *data, size_t size, ColumnType type, size_t width, size_t count, uint8_t *out)
+{
+    if (ColumnTypeSize(type) > 4)
+    {
+        return false;
+    }
+    BitReader reader(data, size);
+    for (size_t begin = 0; begin < count; begin += COLUMN_PARTITION)
+    {
+        size_t end = std::min(count, begin + COLUMN_PARTITION);
+        int k = reader.Read(5);
+        for (size_t i = begin; i < end; ++i)
+        {
+            uint32_t code = k == COLUMN_ESCAPE ? reader.Read(32) : reader.ReadRice(k);
+            uint32_t previous = i >= width ? ColumnWord(out, type, i - width) : 0;
+            SetColumnWord(out, type, i, ColumnUndelta(code, previous, type));
+        }
+    }
+    return !reader.Overrun();
+}
+
+// Streams rows into a columnar export file. Columns fill independently; a column's chunk is written
+// as soon as it holds rowsPerChunk rows, so memory stays bounded however long the export runs.
+class ColumnWriter
+{
+public:
+    ColumnWriter(const std::string &path, const std::vector<ColumnSchema> &columns,
+                 size_t rowsPerChunk = COLUMN_ROWS_PER_CHUNK) noexcept(false);
+    ~ColumnWriter();
+
+    // Appends rows to a column, values holds rows * width values of the column's type
+    void Append(size_t column, const void *values, size_t rows);
+    // Writes the partial chunks, the directory and the trailer. False on write errors.
+    bool Close();
+
+    uint64_t Rows(size_t column) const { return rows[column] + pending[column].size() / RowBytes(column); }
+    uint64_t Bytes() const { return offset; }
+
+    ColumnWriter(const ColumnWriter &) = delete;
+    ColumnWriter &operator=(const ColumnWriter &) = delete;
+
+private:
+    size_t RowBytes(size_t column) const
+    {
+        return ColumnTypeSize(ColumnType(columns[column].type)) * columns[column].width;
+    }
+    void WriteChunk(size_t column);
+    void Pad();
+
+    std::ofstream file;
+    std::vector<ColumnSchema> columns;
+    size_t rowsPerChunk;
+    std::vector<std::vector<uint8_t>> pending;
+    std::vector<uint64_t> rows;
+    std::vector<ColumnChunkEntry> directory;
+    std::vector<uint8_t> encoded;
+    uint64_t offset = 0;
+    bool closed = false;
+};
+
+ColumnWriter::ColumnWriter(const std::string &path, const std::vector<ColumnSchema> &columns, size_t rowsPerChunk)
+    : file(path, std::ios::binary | std::ios::trunc), columns(columns), rowsPerChunk(rowsPerChunk),
+      pending(columns.size()), rows(columns.size(), 0)
+{
+    if (!file)
+    {
+        throw std::runtime_error("failed to create " + path);
+    }
+    for (const ColumnSchema &column : columns)
+    {
+        if (column.width == 0)
+        {
+            throw std::runtime_error("column " + std::string(column.name) + " has no values per row");
+        }
+    }
+    ColumnFileHeader header;
+    std::memcpy(header.magic, COLUMN_MAGIC, 4);
+    header.version = COLUMN_VERSION;
+    header.columnCount = columns.size();
+    header.rowsPerChunk = rowsPerChunk;
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(columns.data()), columns.size() * sizeof(ColumnSchema));
+    offset = sizeof(header) + columns.size() * sizeof(ColumnSchema);
+}
+
+ColumnWriter::~ColumnWriter()
+{
+    Close();
+}
+
+void ColumnWriter::Append(size_t column, const void *values, size_t count)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(values);
+    size_t rowBytes = RowBytes(column);
+    std::vector<uint8_t> &buffer = pending[column];
+    while (count > 0)
+    {
+        size_t take = std::min(count, rowsPerChunk - buffer.size() / rowBytes);
+        buffer.insert(buffer.end(), bytes, bytes + take * rowBytes);
+        bytes += take * rowBytes;
+        count -= take;
+        if (buffer.size() == rowsPerChunk * rowBytes)
+        {
+            WriteChunk(column);
+        }
+    }
+}
+
+void ColumnWriter::Pad()
+{
+    static const char zeros[COLUMN_ALIGNMENT] = {};
+    size_t padding = (COLUMN_ALIGNMENT - offset % COLUMN_ALIGNMENT) % COLUMN_ALIGNMENT;
+    file.write(zeros, padding);
+    offset += padding;
+}
+
+void ColumnWriter::WriteChunk(size_t column)
+{
+    std::vector<uint8_t> &buffer = pending[column];
+    ColumnType type = ColumnType(columns[column].type);
+    size_t count = buffer.size() / ColumnTypeSize(type);
+
+    ColumnChunkEntry entry;
+    std::memset(&entry, 0, sizeof(entry));
+    entry.firstRow = rows[column];
+    entry.rows = buffer.size() / RowBytes(column);
+    entry.column = column;
+    entry.min = HUGE_VAL;
+    entry.max = -HUGE_VAL;
+    for (size_t i = 0; i < count; ++i)
+    {
+        double value = ColumnValue(buffer.data(), type, i);
+        entry.min = std::min(entry.min, value);
+        entry.max = std::max(entry.max, value);
+    }
+
+    const std::vector<uint8_t> *data = &buffer;
+    if (columns[column].flags & COLUMN_COMPRESSIBLE &&
+        EncodeColumnChunk(buffer.data(), type, columns[column].width, count, encoded))
+    {
+        entry.codec = COLUMN_DELTA_RICE;
+        data = &encoded;
+    }
+    Pad();
+    entry.offset = offset;
+    entry.size = data->size();
+    entry.crc = Crc32(data->data(), data->size());
+    file.write(reinterpret_cast<const char *>(data->data()), data->size());
+    offset += data->size();
+    directory.push_back(entry);
+    rows[column] += entry.rows;
+    buffer.clear();
+}
+
+bool ColumnWriter::Close()
+{
+    if (closed)
+    {
+        return bool(file);
+    }
+    closed = true;
+    for (size_t column = 0; column < columns.size(); ++column)
+    {
+        if (!pending[column].empty())
+        {
+            WriteChunk(column);
+        }
+    }
+    Pad();
+    ColumnFileTrailer trailer;
+    std::memset(&trailer, 0, sizeof(trailer));
+    trailer.directoryOffset = offset;
+    trailer.chunkCount = directory.size();
+    std::memcpy(trailer.magic, COLUMN_MAGIC, 4);
+    file.write(reinterpret_cast<const char *>(directory.data()), directory.size() * sizeof(ColumnChunkEntry));
+    file.write(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+    offset += directory.size() * sizeof(ColumnChunkEntry) + sizeof(trailer);
+    file.close();
+    return bool(file);
+}
+
+// Reads a columnar export file through a read-only memory mapping. Uncompressed chunks are used in
+// place, compressed ones are decoded into the caller's buffer.
+class ColumnReader
+{
+public:
+    ColumnReader(const std::string &path) noexcept(false);
+    ~ColumnReader();
+
+    size_t Columns() const { return schema.size(); }
+    const ColumnSchema &Schema(size_t column) const { return schema[column]; }
+    // Index of the named column, Columns() if there is none
+    size_t Find(const std::string &name) const;
+    uint64_t Rows(size_t column) const;
+    size_t Chunks(size_t column) const { return chunks[column].size(); }
+    const ColumnChunkEntry &Chunk(size_t column, size_t chunk) const { return chunks[column][chunk]; }
+
+    // Values of an uncompressed chunk in the mapping, nullptr if the chunk is compressed. Unlike
+    // ReadChunk this doesn't check the CRC.
+    const void *MappedChunk(size_t column, size_t chunk) const;
+    // Copies or decodes the rows * width values of a chunk into out, false if it's corrupt
+    bool ReadChunk(size_t column, size_t chunk, void *out) const;
+    // Reads a whole column, T must have the size of the column's type
+    template <typename T>
+    bool ReadColumn(size_t column, std::vector<T> &out) const;
+
+    ColumnReader(const ColumnReader &) = delete;
+    ColumnReader &operator=(const ColumnReader &) = delete;
+
+private:
+    void *mapping = MAP_FAILED;
+    size_t mappingSize = 0;
+    std::vector<ColumnSchema> schema;
+    // directory entries per column in row order
+    std::vector<std::vector<ColumnChunkEntry>> chunks;
+};
+
+ColumnReader::ColumnReader(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("failed to open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(ColumnFileHeader) + sizeof(ColumnFileTrailer))
+    {
+        close(fd);
+        throw std::runtime_error("not a column file: " + path);
+    }
+    mappingSize = info.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map " + path);
+    }
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(mapping);
+    ColumnFileHeader header;
+    ColumnFileTrailer trailer;
+    std::memcpy(&header, bytes, sizeof(header));
+    std::memcpy(&trailer, bytes + mappingSize - sizeof(trailer), sizeof(trailer));
+    bool valid = std::memcmp(header.magic, COLUMN_MAGIC, 4) == 0 && header.version == COLUMN_VERSION &&
+                 std::memcmp(trailer.magic, COLUMN_MAGIC, 4) == 0 &&
+                 sizeof(header) + header.columnCount * sizeof(ColumnSchema) <= trailer.directoryOffset &&
+                 trailer.directoryOffset <= mappingSize - sizeof(trailer) &&
+                 trailer.chunkCount == (mappingSize - sizeof(trailer) - trailer.directoryOffset) / sizeof(ColumnChunkEntry);
+    if (valid)
+    {
+        schema.resize(header.columnCount);
+        std::memcpy(schema.data(), bytes + sizeof(header), schema.size() * sizeof(ColumnSchema));
+        chunks.resize(schema.size());
+        const ColumnChunkEntry *directory = reinterpret_cast<const ColumnChunkEntry *>(bytes + trailer.directoryOffset);
+        for (size_t i = 0; valid && i < trailer.chunkCount; ++i)
+        {
+            // subtracted rather than added so a corrupt offset can't wrap the bound around
+            const ColumnChunkEntry &entry = directory[i];
+            valid = entry.column < schema.size() && schema[entry.column].type <= COLUMN_FLOAT64 &&
+                    schema[entry.column].width > 0 && entry.codec <= COLUMN_DELTA_RICE &&
+                    entry.offset <= trailer.directoryOffset && entry.size <= trailer.directoryOffset - entry.offset &&
+                    entry.offset % COLUMN_ALIGNMENT == 0 && entry.firstRow == Rows(entry.column);
+            if (valid && entry.codec == COLUMN_RAW)
+            {
+                // raw chunks are handed out in place, so their rows must fill them exactly
+                size_t rowBytes = ColumnTypeSize(ColumnType(schema[entry.column].type)) * schema[entry.column].width;
+                valid = entry.rows <= entry.size / rowBytes && entry.size == entry.rows * rowBytes;
+            }
+            if (valid)
+            {
+                chunks[entry.column].push_back(entry);
+            }
+        }
+    }
+    if (!valid)
+    {
+        munmap(mapping, mappingSize);
+        throw std::runtime_error("malformed column file: " + path);
+    }
+}
+
+ColumnReader::~ColumnReader()
+{
+    munmap(mapping, mappingSize);
+}
+
+size_t ColumnReader::Find(const std::string &name) const
+{
+    for (size_t column = 0; column < schema.size(); ++column)
+    {
+        if (strncmp(schema[column].name, name.c_str(), sizeof(schema[column].name)) == 0)
+        {
+            return column;
+        }
+    }
+    return schema.size();
+}
+
+uint64_t ColumnReader::Rows(size_t column) const
+{
+    return chunks[column].empty() ? 0 : chunks[column].back().firstRow + chunks[column].back().rows;
+}
+
+const void *ColumnReader::MappedChunk(size_t column, size_t chunk) const
+{
+    const ColumnChunkEntry &entry = chunks[column][chunk];
+    return entry.codec == COLUMN_RAW ? static_cast<const uint8_t *>(mapping) + entry.offset : nullptr;
+}
+
+bool ColumnReader::ReadChunk(size_t column, size_t chunk, void *out) const
+{
+    const ColumnChunkEntry &entry = chunks[column][chunk];
+    ColumnType type = ColumnType(schema[column].type);
+    size_t count = size_t(entry.rows) * schema[column].width;
+    const uint8_t *data = static_cast<const uint8_t *>(mapping) + entry.offset;
+    if (Crc32(data, entry.size) != entry.crc)
+    {
+        return false;
+    }
+    if (entry.codec == COLUMN_RAW)
+    {
+        if (entry.size != count * ColumnTypeSize(type))
+        {
+            return false;
+        }
+        std::memcpy(out, data, entry.size);
+        return true;
+    }
+    return entry.codec == COLUMN_DELTA_RICE &&
+           DecodeColumnChunk(data, entry.size, type, schema[column].width, count, static_cast<uint8_t *>(out));
+}
+
+template <typename T>
+bool ColumnReader::ReadColumn(size_t column, std::vector<T> &out) const
+{
+    if (sizeof(T) != ColumnTypeSize(ColumnType(schema[column].type)))
+    {
+        return false;
+    }
+    out.resize(Rows(column) * schema[column].width);
+    for (size_t chunk = 0; chunk < chunks[column].size(); ++chunk)
+    {
+        if (!ReadChunk(column, chunk, out.data() + chunks[column][chunk].firstRow * schema[column].width))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Spectrum columns computed per slice of an export, bounds the memory of long files
+const size_t EXPORT_SPECTRUM_SLICE = 4096;
+
+// --export <file.wav> <out.hpcol> [--spectra] [--formants] [--raw]
+// Writes the whole file analysis (waveform min/max, momentary loudness, RMS, spectral centroid,
+// onset strength, beat positions and optionally the spectrum of every feature hop in dB steps) as
+// columns, compressed unless --raw is given. --formants adds the formants_hz and formant_bw_hz
+// columns, F1 to F3 and their bandwidths every formant hop.
+int RunExport(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "usage: " << argv[0] << " --export <file.wav> <out.hpcol> [--spectra] [--formants] [--raw]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    bool spectra = false;
+    bool formants = false;
+    uint32_t flags = COLUMN_COMPRESSIBLE;
+    for (int i = 4; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--spectra")
+        {
+            spectra = true;
+        }
+        else if (arg == "--formants")
+        {
+            formants = true;
+        }
+        else if (arg == "--raw")
+        {
+            flags = 0;
+        }
+        else
+        {
+            std::cerr << "unknown option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<FileSource> file = OpenFileSource(argv[2]);
+    SampleHistory &history = file->History();
+    FileAnalysis analysis(history, file->ContentHash(), AnalysisParams());
+    const AnalysisParams &params = analysis.Params();
+    double rate = double(history.SampleRate());
+    double featureRate = rate / params.featureHop;
+    SpectrogramParams spectrumParams;
+    spectrumParams.fftSize = params.featureFftSize;
+
+    std::vector<ColumnSchema> columns = {
+        MakeColumn("waveform", COLUMN_INT16, 2, rate / params.pyramidBase, flags),
+        MakeColumn("loudness_lufs", COLUMN_FLOAT32, 1, 1.0 / params.loudnessHop, flags),
+        MakeColumn("rms", COLUMN_FLOAT32, 1, featureRate, flags),
+        MakeColumn("centroid_hz", COLUMN_FLOAT32, 1, featureRate, flags),
+        MakeColumn("onset", COLUMN_FLOAT32, 1, featureRate, flags),
+        MakeColumn("beats", COLUMN_UINT64, 1, 0.0, flags),
+    };
+    if (spectra)
+    {
+        columns.push_back(MakeColumn("spectrum", COLUMN_UINT8, spectrumParams.Bins(), featureRate, flags));
+    }
+    size_t formantColumn = columns.size();
+    FormantTracker formantShape(rate);
+    if (formants)
+    {
+        double formantRate = rate / formantShape.HopSamples();
+        columns.push_back(MakeColumn("formants_hz", COLUMN_FLOAT32, FORMANT_COUNT, formantRate, flags));
+        columns.push_back(MakeColumn("formant_bw_hz", COLUMN_FLOAT32, FORMANT_COUNT, formantRate, flags));
+    }
+
+    ColumnWriter writer(argv[3], columns);
+    Track<MinMax> waveform = analysis.PyramidLevel(0);
+    writer.Append(0, waveform.data, waveform.count);
+    writer.Append(1, analysis.Loudness().data, analysis.Loudness().count);
+    writer.Append(2, analysis.Rms().data, analysis.Rms().count);
+    writer.Append(3, analysis.Centroid().data, analysis.Centroid().count);
+    writer.Append(4, analysis.Onset().data, analysis.Onset().count);
+    writer.Append(5, analysis.Beats().data, analysis.Beats().count);
+    if (spectra)
+    {
+        // one spectrum per feature hop, in the spectrogram's 0-255 steps of the dB range
+        std::vector<uint8_t> slice;
+        size_t hops = analysis.Rms().count;
+        for (size_t first = 0; first < hops; first += EXPORT_SPECTRUM_SLICE)
+        {
+            size_t count = std::min(EXPORT_SPECTRUM_SLICE, hops - first);
+            ComputeSpectrogramColumns(history, spectrumParams, double(first * params.featureHop),
+                                      double((first + count) * params.featureHop), count, slice);
+            writer.Append(6, slice.data(), count);
+        }
+    }
+    if (formants)
+    {
+        // frame k covers the window ending at WindowSamples() + k * HopSamples(); ranges of frames are
+        // tracked on all cores, each by its own tracker starting a frame early to warm up the roots
+        size_t window = formantShape.WindowSamples(), hop = formantShape.HopSamples();
+        size_t frames = history.Size() >= window ? (history.Size() - window) / hop + 1 : 0;
+        std::vector<float> frequencies(frames * FORMANT_COUNT), bandwidths(frames * FORMANT_COUNT);
+        auto formantStart = std::chrono::steady_clock::now();
+        ParallelFor(frames, [&](size_t first, size_t last) {
+            FormantTracker tracker(rate);
+            size_t lead = first > 0 ? 1 : 0;
+            std::vector<FormantFrame> track;
+            TrackFormants(tracker, history, (first - lead) * hop, last - first + lead, track);
+            for (size_t k = first; k < last && k - first + lead < track.size(); ++k)
+            {
+                const FormantFrame &frame = track[k - first + lead];
+                std::copy(frame.frequency, frame.frequency + FORMANT_COUNT, &frequencies[k * FORMANT_COUNT]);
+                std::copy(frame.bandwidth, frame.bandwidth + FORMANT_COUNT, &bandwidths[k * FORMANT_COUNT]);
+            }
+        });
+        std::chrono::duration<double> formantElapsed = std::chrono::steady_clock::now() - formantStart;
+        writer.Append(formantColumn, frequencies.data(), frames);
+        writer.Append(formantColumn + 1, bandwidths.data(), frames);
+        std::cout << "Tracked formants in " << frames << " frames in " << formantElapsed.count() << " s, "
+                  << history.Size() / rate / std::max(formantElapsed.count(), 1e-9) << " times real time"
+                  << std::endl;
+    }
+    if (!writer.Close())
+    {
+        std::cerr << "failed to write " << argv[3] << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    uint64_t raw = 0;
+    for (size_t column = 0; column < columns.size(); ++column)
+    {
+        raw += writer.Rows(column) * ColumnTypeSize(ColumnType(columns[column].type)) * columns[column].width;
+    }
+    std::cout << "Exported " << columns.size() << " columns in " << elapsed.count() << " s: " << raw << " bytes of values in "
+              << writer.Bytes() << " bytes (ratio " << double(raw) / writer.Bytes() << ")" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// --columns <file.hpcol>
+// Lists the schema of a column file with row counts, value ranges from the chunk directory and the
+// time it takes to read every column
+int RunColumns(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " --columns <file.hpcol>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto start = std::chrono::steady_clock::now();
+    ColumnReader reader(argv[2]);
+    uint64_t bytes = 0;
+    bool intact = true;
+    for (size_t column = 0; column < reader.Columns(); ++column)
+    {
+        const ColumnSchema &schema = reader.Schema(column);
+        size_t rowBytes = ColumnTypeSize(ColumnType(schema.type)) * schema.width;
+        std::vector<uint8_t> values(reader.Rows(column) * rowBytes);
+        double min = HUGE_VAL, max = -HUGE_VAL;
+        size_t compressed = 0;
+        for (size_t chunk = 0; chunk < reader.Chunks(column); ++chunk)
+        {
+            const ColumnChunkEntry &entry = reader.Chunk(column, chunk);
+            intact = reader.ReadChunk(column, chunk, values.data() + entry.firstRow * rowBytes) && intact;
+            min = std::min(min, entry.min);
+            max = std::max(max, entry.max);
+            compressed += entry.codec != COLUMN_RAW;
+        }
+        bytes += values.size();
+        char line[160];
+        snprintf(line, sizeof(line), "%-16s %-7s x%-4u %10.3f rows/s %10llu rows  %zu/%zu chunks compressed  range %g to %g",
+                 schema.name, COLUMN_TYPE_NAMES[schema.type], schema.width, schema.rate,
+                 (unsigned long long)reader.Rows(column), compressed, reader.Chunks(column), min, max);
+        std::cout << line << std::endl;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "read " << bytes << " bytes of values in " << elapsed.count() * 1000.0 << " ms" << std::endl;
+    if (!intact)
+    {
+        std::cerr << "corrupt chunks in " << argv[2] << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Columns of a live level log, one row per audio frame of frameSamples samples
+std::vector<ColumnSchema> LevelColumns(double sampleRate, size_t frameSamples)
+{
+    double rate = sampleRate / frameSamples;
+    return {MakeColumn("waveform", COLUMN_INT16, 2, rate), MakeColumn("peak_dbfs", COLUMN_FLOAT32, 1, rate),
+            MakeColumn("rms_dbfs", COLUMN_FLOAT32, 1, rate)};
+}
+
+// Appends the row of one audio frame to a live level log
+void AppendLevels(ColumnWriter &writer, const PCM16 *samples, size_t count)
+{
+    MinMax range = {samples[0], samples[0]};
+    double sum = 0.0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        range.min = std::min(range.min, samples[i]);
+        range.max = std::max(range.max, samples[i]);
+        sum += double(samples[i]) * samples[i];
+    }
+    float peak = 20.0f * log10f(std::max(std::max(-float(range.min), float(range.max)), 1.0f) / 32768.0f);
+    float rms = 10.0f * log10f(float(std::max(sum / count, 1.0)) / (32768.0f * 32768.0f));
+    writer.Append(0, &range, 1);
+    writer.Append(1, &peak, 1);
+    writer.Append(2, &rms, 1);
+}
+
+// Live bits used figures come from windows of this much audio
+const double HISTOGRAM_WINDOW_SECONDS = 10.0;
+// Samples per value the values around zero need before their spread tells the resolution
+const double HISTOGRAM_DENSE_SAMPLES = 4.0;
+
+// What a histogram of PCM16 values says about the resolution of the audio in it
+struct BitUsage
+{
+    uint64_t samples = 0;
+    PCM16 min = 0;
+    PCM16 max = 0;
+    // distinct values that occurred
+    size_t levels = 0;
+    // low bits never set in any sample, e.g. 8 for 8 bit audio padded to 16
+    int unusedLowBits = 16;
+    // bits the sample range needs, sign included
+    int peakBits = 0;
+    // resolution the values around zero are spread at: 16 where every value occurs, n where only
+    // every 2^(16 - n)th does, as in upconverted or scaled low resolution audio; 0 if there are
+    // too few samples to tell
+    double effectiveBits = 0.0;
+};
+
+// Histogram of PCM16 values, one bin per value. Each frame's smallest and largest value and the OR
+// of all its values are found eight samples at a time with SSE2 where available, the counting is
+// scalar. Threads count into histograms of their own, merged once they're done.
+class SampleHistogram
+{
+public:
+    SampleHistogram() : counts(65536) {}
+
+    void Add(const PCM16 *values, size_t count);
+    void Merge(const SampleHistogram &other);
+    void Clear();
+
+    uint64_t Count(PCM16 value) const { return counts[uint16_t(value) ^ 0x8000]; }
+    uint64_t Samples() const { return samples; }
+    // Figures of the bits used meter, from a scan of every bin
+    BitUsage Usage() const;
+
+private:
+    // bins from -32768 up
+    std::vector<uint64_t> counts;
+    uint64_t samples = 0;
+    PCM16 min = 32767;
+    PCM16 max = -32768;
+    uint16_t bits = 0;
+};
+
+void SampleHistogram::Add(const PCM16 *values, size_t count)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i low = _mm_set1_epi16(min), high = _mm_set1_epi16(max), set = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i));
+        low = _mm_min_epi16(low, x);
+        high = _mm_max_epi16(high, x);
+        set = _mm_or_si128(set, x);
+    }
+    int16_t lows[8], highs[8], sets[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lows), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(highs), high);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(sets), set);
+    for (size_t lane = 0; lane < 8; ++lane)
+    {
+        min = std::min(min, lows[lane]);
+        max = std::max(max, highs[lane]);
+        bits |= uint16_t(sets[lane]);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        min = std::min(min, values[i]);
+        max = std::max(max, values[i]);
+        bits |= uint16_t(values[i]);
+    }
+    for (i = 0; i < count; ++i)
+    {
+        ++counts[uint16_t(values[i]) ^ 0x8000];
+    }
+    samples += count;
+}
+
+void SampleHistogram::Merge(const SampleHistogram &other)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= counts.size(); i += 2)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&counts[i]));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&other.counts[i]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&counts[i]), _mm_add_epi64(a, b));
+    }
+#endif
+    for (; i < counts.size(); ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+    samples += other.samples;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    bits |= other.bits;
+}
+
+void SampleHistogram::Clear()
+{
+    std::fill(counts.begin(), counts.end(), 0);
+    samples = 0;
+    min = 32767;
+    max = -32768;
+    bits = 0;
+}
+
+BitUsage SampleHistogram::Usage() const
+{
+    BitUsage usage;
+    usage.samples = samples;
+    if (samples == 0)
+    {
+        return usage;
+    }
+    usage.min = min;
+    usage.max = max;
+    for (uint64_t count : counts)
+    {
+        usage.levels += count != 0;
+    }
+    usage.unusedLowBits = bits ? __builtin_ctz(bits) : 16;
+    usage.peakBits = 1;
+    while (min < -(1L << (usage.peakBits - 1)) || max > (1L << (usage.peakBits - 1)) - 1)
+    {
+        ++usage.peakBits;
+    }
+
+    // the values around zero holding half the samples; where they are dense enough for every value
+    // to occur, the share that did is the resolution
+    const long zero = 0x8000;
+    uint64_t core = counts[zero];
+    size_t occupied = counts[zero] != 0;
+    long radius = 0;
+    while (core < (samples + 1) / 2 && radius < 32767)
+    {
+        ++radius;
+        core += counts[zero - radius] + counts[zero + radius];
+        occupied += (counts[zero - radius] != 0) + (counts[zero + radius] != 0);
+    }
+    double span = 2.0 * radius + 1.0;
+    if (radius > 0 && core >= HISTOGRAM_DENSE_SAMPLES * span)
+    {
+        usage.effectiveBits = 16.0 - log2(span / occupied);
+    }
+    return usage;
+}
+
+// One line verdict of the bits used meter
+std::string DescribeBitUsage(const BitUsage &usage)
+{
+    char text[96];
+    if (usage.levels <= 1)
+    {
+        snprintf(text, sizeof(text), usage.samples ? "constant %d" : "no samples", int(usage.min));
+    }
+    else if (usage.unusedLowBits > 0)
+    {
+        snprintf(text, sizeof(text), "padded, low %d bits unused: %d bit audio", usage.unusedLowBits,
+                 16 - usage.unusedLowBits);
+    }
+    else if (usage.effectiveBits > 0.0 && usage.effectiveBits < 15.5)
+    {
+        snprintf(text, sizeof(text), "upconverted or scaled, about %.1f bits of resolution", usage.effectiveBits);
+    }
+    else if (usage.effectiveBits > 0.0)
+    {
+        snprintf(text, sizeof(text), "full 16 bit resolution");
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "too few samples near zero to tell the resolution");
+    }
+    return text;
+}
+
+// --histogram <file.wav> [--threads n]
+// Counts every sample value of every channel of a file, one histogram per thread, and prints what
+// the bits used meter makes of them
+int RunHistogram(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " --histogram <file.wav> [--threads n]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    size_t threads = 0;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            threads = size_t(std::max(atoi(argv[++i]), 1));
+        }
+        else
+        {
+            std::cerr << "unknown option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::unique_ptr<FileSource> file = OpenFileSource(argv[2]);
+    const PCM16 *samples = file->Samples();
+    size_t total = file->Frames() * file->Channels();
+
+    auto start = std::chrono::steady_clock::now();
+    size_t parts = std::max<size_t>(1, threads ? threads : boost::thread::hardware_concurrency());
+    std::vector<SampleHistogram> partial(parts);
+    ParallelFor(
+        parts,
+        [&](size_t begin, size_t end) {
+            for (size_t p = begin; p < end; ++p)
+            {
+                size_t first = total * p / parts;
+                partial[p].Add(samples + first, total * (p + 1) / parts - first);
+            }
+        },
+        parts);
+    for (size_t p = 1; p < parts; ++p)
+    {
+        partial[0].Merge(partial[p]);
+    }
+    BitUsage usage = partial[0].Usage();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    char line[256];
+    snprintf(line, sizeof(line), "%llu samples from %d to %d, %zu levels, peak %d bits, low %d bits unused, %.1f bits effective",
+             (unsigned long long)usage.samples, int(usage.min), int(usage.max), usage.levels, usage.peakBits,
+             usage.unusedLowBits, usage.effectiveBits);
+    std::cout << line << std::endl << DescribeBitUsage(usage) << std::endl;
+    double seconds = std::max(elapsed.count(), 1e-9);
+    std::cout << "counted in " << seconds * 1000.0 << " ms on " << parts << " thread(s), " << total / seconds / 1e6
+              << " Msamples/s, " << file->Frames() / double(file->History().SampleRate()) / seconds
+              << " times real time" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Landmark fingerprinting. Peaks of a spectrogram that are the largest in their neighbourhood are
+// paired with the next few peaks after them; each pair's frequencies and time difference form a
+// hash that survives noise, level changes and the loss of many other peaks.
+const size_t FINGERPRINT_FFT_SIZE = 1024;
+const size_t FINGERPRINT_HOP = 512;
+// A peak is the largest value within this many hops and bins on every side
+const size_t FINGERPRINT_PEAK_HOPS = 6;
+const size_t FINGERPRINT_PEAK_BINS = 12;
+// Peaks below this level (dBFS) are ignored
+const float FINGERPRINT_FLOOR_DB = -60.0f;
+// Strongest peaks kept per hop
+const size_t FINGERPRINT_PEAKS_PER_HOP = 5;
+// Anchors pair with up to FANOUT peaks 1 to PAIR_HOPS hops later and within PAIR_BINS bins
+const size_t FINGERPRINT_FANOUT = 5;
+const size_t FINGERPRINT_PAIR_HOPS = 32;
+const size_t FINGERPRINT_PAIR_BINS = 96;
+// Bits of a landmark hash: 9 per frequency bin and 6 for the time difference
+const size_t FINGERPRINT_HASH_BITS = 24;
+// Votes for one clip at one time offset (give or take a hop) that confirm a match
+const uint32_t FINGERPRINT_MIN_VOTES = 15;
+// Hops after which a candidate offset without new votes is forgotten
+const uint32_t FINGERPRINT_FORGET_HOPS = 400;
+
+// Hash of a peak pair and the hop of its anchor
+struct Landmark
+{
+    uint32_t hash;
+    uint32_t hop;
+};
+
+// Turns mono audio into landmarks as it streams in. A landmark is final once the peaks of
+// FINGERPRINT_PAIR_HOPS + FINGERPRINT_PEAK_HOPS later hops are known.
+class LandmarkExtractor
+{
+public:
+    LandmarkExtractor();
+
+    // Appends the landmarks completed by count more samples to out
+    void Process(const float *samples, size_t count, std::vector<Landmark> &out);
+    // Appends the landmarks still waiting for later audio at the end of the input
+    void Finish(std::vector<Landmark> &out);
+
+    // Spectra computed so far
+    uint32_t Hops() const { return hops; }
+
+private:
+    struct Peak
+    {
+        uint32_t hop;
+        uint32_t bin;
+        float level;
+    };
+
+    void AddColumn();
+    // Picks the peaks of the oldest undecided hop from the columns around it
+    void PickPeaks();
+    // Pairs the anchors whose target zone is complete, all of them when final
+    void EmitPairs(bool final, std::vector<Landmark> &out);
+
+    std::shared_ptr<const Fft> fft;
+    std::vector<float> window;
+    std::vector<float> pending;
+    std::vector<std::complex<float>> spectrum;
+    // level and the maximum over +-FINGERPRINT_PEAK_BINS of the newest hops, starting at hop columnBase
+    std::deque<std::vector<float>> levels, spread;
+    uint32_t columnBase = 0;
+    uint32_t hops = 0;
+    // hops whose peaks are decided
+    uint32_t decided = 0;
+    std::vector<Peak> candidates;
+    std::deque<Peak> peaks;
+    uint32_t nextAnchor = 0;
+};
+
+LandmarkExtractor::LandmarkExtractor()
+    : fft(std::make_shared<const Fft>(FINGERPRINT_FFT_SIZE)), window(FINGERPRINT_FFT_SIZE),
+      spectrum(FINGERPRINT_FFT_SIZE)
+{
+    for (size_t i = 0; i < window.size(); ++i)
+    {
+        window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / window.size());
+    }
+    pending.reserve(FINGERPRINT_FFT_SIZE);
+}
+
+void LandmarkExtractor::Process(const float *samples, size_t count, std::vector<Landmark> &out)
+{
+    while (count > 0)
+    {
+        size_t take = std::min(count, FINGERPRINT_FFT_SIZE - pending.size());
+        pending.insert(pending.end(), samples, samples + take);
+        samples += take;
+        count -= take;
+        if (pending.size() == FINGERPRINT_FFT_SIZE)
+        {
+            AddColumn();
+            pending.erase(pending.begin(), pending.begin() + FINGERPRINT_HOP);
+            if (hops > FINGERPRINT_PEAK_HOPS)
+            {
+                PickPeaks();
+                EmitPairs(false, out);
+            }
+        }
+    }
+}
+
+void LandmarkExtractor::Finish(std::vector<Landmark> &out)
+{
+    while (decided < hops)
+    {
+        PickPeaks();
+    }
+    EmitPairs(true, out);
+}
+
+void LandmarkExtractor::AddColumn()
+{
+    for (size_t i = 0; i < FINGERPRINT_FFT_SIZE; ++i)
+    {
+        spectrum[i] = std::complex<float>(pending[i] * window[i], 0.0f);
+    }
+    fft->Forward(spectrum.data());
+
+    // a full scale sine reads about 0 dB
+    size_t bins = FINGERPRINT_FFT_SIZE / 2;
+    std::vector<float> level(bins), maximum(bins);
+    float scale = 4.0f / FINGERPRINT_FFT_SIZE;
+    for (size_t bin = 0; bin < bins; ++bin)
+    {
+        level[bin] = 20.0f * log10f(std::abs(spectrum[bin]) * scale + 1e-9f);
+    }
+    for (size_t bin = 0; bin < bins; ++bin)
+    {
+        size_t first = bin > FINGERPRINT_PEAK_BINS ? bin - FINGERPRINT_PEAK_BINS : 0;
+        size_t last = std::min(bins, bin + FINGERPRINT_PEAK_BINS + 1);
+        maximum[bin] = *std::max_element(level.begin() + first, level.begin() + last);
+    }
+    levels.push_back(std::move(level));
+    spread.push_back(std::move(maximum));
+    ++hops;
+}
+
+void LandmarkExtractor::PickPeaks()
+{
+    uint32_t hop = decided++;
+    const std::vector<float> &level = levels[hop - columnBase];
+    size_t last = std::min<size_t>(hops, hop + FINGERPRINT_PEAK_HOPS + 1) - columnBase;
+    candidates.clear();
+    // bins 0 and 1 hold DC and rumble
+    for (size_t bin = 2; bin < level.size(); ++bin)
+    {
+        float value = level[bin];
+        if (value < FINGERPRINT_FLOOR_DB || value < spread[hop - columnBase][bin])
+        {
+            continue;
+        }
+        bool largest = true;
+        for (size_t column = 0; largest && column < last; ++column)
+        {
+            largest = spread[column][bin] <= value;
+        }
+        if (largest)
+        {
+            candidates.push_back({hop, uint32_t(bin), value});
+        }
+    }
+    size_t keep = std::min(candidates.size(), FINGERPRINT_PEAKS_PER_HOP);
+    std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(),
+                      [](const Peak &a, const Peak &b) { return a.level > b.level; });
+    peaks.insert(peaks.end(), candidates.begin(), candidates.begin() + keep);
+
+    // the next hop to decide needs columns from FINGERPRINT_PEAK_HOPS before it
+    while (columnBase + FINGERPRINT_PEAK_HOPS < decided)
+    {
+        levels.pop_front();
+        spread.pop_front();
+        ++columnBase;
+    }
+}
+
+void LandmarkExtractor::EmitPairs(bool final, std::vector<Landmark> &out)
+{
+    while (!peaks.empty() && (final || peaks.front().hop + FINGERPRINT_PAIR_HOPS < decided))
+    {
+        const Peak &anchor = peaks.front();
+        size_t paired = 0;
+        for (size_t i = 1; i < peaks.size() && paired < FINGERPRINT_FANOUT; ++i)
+        {
+            const Peak &target = peaks[i];
+            if (target.hop > anchor.hop + FINGERPRINT_PAIR_HOPS)
+            {
+                break;
+            }
+            if (target.hop == anchor.hop || std::abs(int(target.bin) - int(anchor.bin)) > int(FINGERPRINT_PAIR_BINS))
+            {
+                continue;
+            }
+            out.push_back({anchor.bin << 15 | target.bin << 6 | (target.hop - anchor.hop), anchor.hop});
+            ++paired;
+        }
+        peaks.pop_front();
+    }
+}
+
+// A reference clip and where its landmarks start in the posting list
+struct FingerprintClip
+{
+    std::string name;
+    uint32_t hops;
+};
+
+// Occurrence of a hash: the clip and the hop of its anchor
+struct FingerprintPosting
+{
+    uint32_t clip;
+    uint32_t hop;
+};
+
+// Inverted index from landmark hash to the clips and times it occurs at. Keys live in an open
+// addressing table with linear probing that points into one array of postings grouped by hash, so
+// a lookup is usually one cache line for the slot and one contiguous run of postings.
+class FingerprintIndex
+{
+public:
+    // Fingerprints every wave file below directory, one file per core at a time. Files at another
+    // sample rate than sampleRate are skipped.
+    FingerprintIndex(const std::string &directory, size_t sampleRate) noexcept(false);
+
+    // Postings of a hash, count is 0 if it's unknown
+    const FingerprintPosting *Find(uint32_t hash, size_t &count) const;
+
+    size_t Clips() const { return clips.size(); }
+    const FingerprintClip &Clip(size_t clip) const { return clips[clip]; }
+    size_t Postings() const { return postings.size(); }
+    size_t Keys() const { return keys; }
+    size_t Bytes() const { return slots.size() * sizeof(Slot) + postings.size() * sizeof(FingerprintPosting); }
+    // Seconds spent fingerprinting the references and building the table
+    double BuildSeconds() const { return buildSeconds; }
+
+private:
+    struct Slot
+    {
+        uint32_t hash;
+        uint32_t begin;
+        // 0 marks an empty slot
+        uint32_t count;
+    };
+
+    size_t Home(uint32_t hash) const { return (hash * 2654435761u) >> shift & mask; }
+    // Slot holding hash, or the empty slot where it belongs
+    Slot &Probe(uint32_t hash);
+
+    std::vector<FingerprintClip> clips;
+    std::vector<Slot> slots;
+    size_t mask = 0;
+    int shift = 0;
+    size_t keys = 0;
+    std::vector<FingerprintPosting> postings;
+    double buildSeconds = 0.0;
+};
+
+FingerprintIndex::FingerprintIndex(const std::string &directory, size_t sampleRate)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> files;
+    FindAudioFiles(directory, "", files);
+    if (files.empty())
+    {
+        throw std::runtime_error("no wave files in " + directory);
+    }
+
+    std::vector<std::vector<Landmark>> landmarks(files.size());
+    std::vector<uint32_t> fileHops(files.size(), 0);
+    std::atomic<size_t> next(0);
+    boost::mutex logMutex;
+    auto worker = [&]() {
+        std::vector<float> samples;
+        for (size_t index = next++; index < files.size(); index = next++)
+        {
+            try
+            {
+                std::unique_ptr<FileSource> file = OpenFileSource(directory + "/" + files[index]);
+                if (file->History().SampleRate() != sampleRate)
+                {
+                    throw std::runtime_error("sample rate isn't " + std::to_string(sampleRate));
+                }
+                samples.resize(file->History().Size());
+                file->History().Read(0, samples.size(), samples.data());
+                LandmarkExtractor extractor;
+                extractor.Process(samples.data(), samples.size(), landmarks[index]);
+                extractor.Finish(landmarks[index]);
+                fileHops[index] = extractor.Hops();
+            }
+            catch (const std::exception &e)
+            {
+                boost::lock_guard<boost::mutex> guard(logMutex);
+                std::cerr << files[index] << ": " << e.what() << std::endl;
+            }
+        }
+    };
+    boost::thread_group workers;
+    for (size_t t = 0; t < std::max(1u, boost::thread::hardware_concurrency()); ++t)
+    {
+        workers.create_thread(worker);
+    }
+    workers.join_all();
+
+    // hashes are small enough to count the distinct ones with a bitmap, and a table at most 70% full
+    // keeps linear probe sequences short
+    size_t total = 0;
+    std::vector<bool> seen(size_t(1) << FINGERPRINT_HASH_BITS);
+    for (const std::vector<Landmark> &list : landmarks)
+    {
+        for (const Landmark &landmark : list)
+        {
+            keys += !seen[landmark.hash];
+            seen[landmark.hash] = true;
+        }
+        total += list.size();
+    }
+    size_t capacity = 1024;
+    while (capacity * 7 < keys * 10)
+    {
+        capacity *= 2;
+    }
+    slots.assign(capacity, Slot{0, 0, 0});
+    mask = capacity - 1;
+    shift = std::max(0, 32 - __builtin_ctzll(capacity));
+
+    // count the postings of every hash, lay the lists out in slot order, then fill them
+    for (const std::vector<Landmark> &list : landmarks)
+    {
+        for (const Landmark &landmark : list)
+        {
+            Slot &slot = Probe(landmark.hash);
+            slot.hash = landmark.hash;
+            ++slot.count;
+        }
+    }
+    uint32_t begin = 0;
+    for (Slot &slot : slots)
+    {
+        slot.begin = begin;
+        begin += slot.count;
+        // counts again while filling
+        slot.count = 0;
+    }
+    postings.resize(total);
+    for (size_t index = 0; index < files.size(); ++index)
+    {
+        if (fileHops[index] == 0)
+        {
+            continue;
+        }
+        uint32_t clip = clips.size();
+        clips.push_back({files[index], fileHops[index]});
+        for (const Landmark &landmark : landmarks[index])
+        {
+            Slot &slot = Probe(landmark.hash);
+            slot.hash = landmark.hash;
+            postings[slot.begin + slot.count++] = {clip, landmark.hop};
+        }
+        std::vector<Landmark>().swap(landmarks[index]);
+    }
+    if (clips.empty())
+    {
+        throw std::runtime_error("no usable reference clips in " + directory);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    buildSeconds = elapsed.count();
+}
+
+FingerprintIndex::Slot &FingerprintIndex::Probe(uint32_t hash)
+{
+    size_t i = Home(hash);
+    while (slots[i].count != 0 && slots[i].hash != hash)
+    {
+        i = (i + 1) & mask;
+    }
+    return slots[i];
+}
+
+const FingerprintPosting *FingerprintIndex::Find(uint32_t hash, size_t &count) const
+{
+    for (size_t i = Home(hash);; i = (i + 1) & mask)
+    {
+        const Slot &slot = slots[i];
+        if (slot.count == 0 || slot.hash == hash)
+        {
+            count = slot.count;
+            return postings.data() + slot.begin;
+        }
+    }
+}
+
+// A reference clip recognised in a stream
+struct FingerprintMatch
+{
+    uint32_t clip;
+    // sample of the stream where the clip started, counted from the first sample processed
+    int64_t start;
+    uint32_t votes;
+};
+
+// Finds the reference clips of an index in a stream. Every landmark of the stream votes for the
+// clips and time offsets its hash occurs at; a clip played in the stream piles up votes at one
+// offset while chance hits scatter.
+class FingerprintMatcher
+{
+public:
+    FingerprintMatcher(const FingerprintIndex &index);
+
+    // Appends the matches confirmed by count more mono samples to out
+    void Process(const float *samples, size_t count, std::vector<FingerprintMatch> &out);
+    // Appends the matches confirmed by the end of the stream
+    void Finish(std::vector<FingerprintMatch> &out);
+
+    uint32_t Hops() const { return extractor.Hops(); }
+    uint64_t Lookups() const { return lookups; }
+    // Seconds spent looking up hashes and counting votes
+    double LookupSeconds() const { return lookupSeconds; }
+
+private:
+    struct Candidate
+    {
+        uint32_t votes;
+        uint32_t lastHop;
+    };
+
+    void Vote(std::vector<FingerprintMatch> &out);
+    uint32_t Votes(uint64_t key) const;
+
+    const FingerprintIndex &index;
+    LandmarkExtractor extractor;
+    std::vector<Landmark> landmarks;
+    // keyed by clip and offset (stream hop minus clip hop, biased to stay positive)
+    std::unordered_map<uint64_t, Candidate> candidates;
+    // offset of the last match of every clip, repeats must start at least half a clip later
+    std::vector<int64_t> lastMatch;
+    uint32_t lastPrune = 0;
+    uint64_t lookups = 0;
+    double lookupSeconds = 0.0;
+};
+
+FingerprintMatcher::FingerprintMatcher(const FingerprintIndex &index)
+    : index(index), lastMatch(index.Clips(), INT64_MIN / 2)
+{
+}
+
+void FingerprintMatcher::Process(const float *samples, size_t count, std::vector<FingerprintMatch> &out)
+{
+    extractor.Process(samples, count, landmarks);
+    Vote(out);
+}
+
+void FingerprintMatcher::Finish(std::vector<FingerprintMatch> &out)
+{
+    extractor.Finish(landmarks);
+    Vote(out);
+}
+
+uint32_t FingerprintMatcher::Votes(uint64_t key) const
+{
+    auto found = candidates.find(key);
+    return found != candidates.end() ? found->second.votes : 0;
+}
+
+void FingerprintMatcher::Vote(std::vector<FingerprintMatch> &out)
+{
+    double start = SecondsNow();
+    const int64_t bias = int64_t(1) << 31;
+    for (const Landmark &landmark : landmarks)
+    {
+        size_t count;
+        const FingerprintPosting *posting = index.Find(landmark.hash, count);
+        ++lookups;
+        for (size_t i = 0; i < count; ++i)
+        {
+            int64_t offset = int64_t(landmark.hop) - posting[i].hop;
+            uint64_t key = uint64_t(posting[i].clip) << 32 | uint64_t(offset + bias);
+            Candidate &candidate = candidates[key];
+            ++candidate.votes;
+            candidate.lastHop = landmark.hop;
+            // hops of the stream and the reference don't line up, so peaks land a hop either way
+            uint32_t votes = candidate.votes + Votes(key - 1) + Votes(key + 1);
+            if (votes >= FINGERPRINT_MIN_VOTES &&
+                offset - lastMatch[posting[i].clip] >= int64_t(index.Clip(posting[i].clip).hops / 2))
+            {
+                lastMatch[posting[i].clip] = offset;
+                out.push_back({posting[i].clip, offset * int64_t(FINGERPRINT_HOP), votes});
+            }
+        }
+    }
+    landmarks.clear();
+
+    uint32_t hop = extractor.Hops();
+    if (hop - lastPrune >= FINGERPRINT_FORGET_HOPS)
+    {
+        lastPrune = hop;
+        for (auto i = candidates.begin(); i != candidates.end();)
+        {
+            i = i->second.lastHop + FINGERPRINT_FORGET_HOPS < hop ? candidates.erase(i) : std::next(i);
+        }
+    }
+    lookupSeconds += SecondsNow() - start;
+}
+
+// --fingerprint <reference dir> <file.wav>
+// Builds the fingerprint index of the reference clips and lists where they occur in a file
+int RunFingerprint(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "usage: " << argv[0] << " --fingerprint <reference dir> <file.wav>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::unique_ptr<FileSource> file = OpenFileSource(argv[3]);
+    SampleHistory &history = file->History();
+    FingerprintIndex index(argv[2], history.SampleRate());
+    std::cout << index.Clips() << " reference clips, " << index.Postings() << " hashes (" << index.Keys()
+              << " distinct) in " << index.Bytes() / 1048576.0 << " MiB, built in " << index.BuildSeconds() << " s"
+              << std::endl;
+
+    // fed in chunks like a live stream
+    FingerprintMatcher matcher(index);
+    std::vector<FingerprintMatch> matches;
+    std::vector<float> samples(SAMPLE_RATE);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t position = 0; position < history.Size(); position += samples.size())
+    {
+        size_t count = std::min(samples.size(), history.Size() - position);
+        history.Read(position, count, samples.data());
+        matcher.Process(samples.data(), count, matches);
+    }
+    matcher.Finish(matches);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double rate = double(history.SampleRate());
+    for (const FingerprintMatch &match : matches)
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "%10.2f s  %s (%u votes)", match.start / rate,
+                 index.Clip(match.clip).name.c_str(), match.votes);
+        std::cout << line << std::endl;
+    }
+    std::cout << matches.size() << " matches in " << history.Size() / rate << " s of audio, scanned in "
+              << elapsed.count() << " s; " << matcher.Lookups() << " lookups, "
+              << matcher.LookupSeconds() * 1e6 / std::max<uint32_t>(matcher.Hops(), 1) << " us per hop" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Amplitude of the measurement sweep (-6 dBFS), leaving headroom for the system's gain
+const double SWEEP_LEVEL = 0.5;
+// Raised cosine fades at both ends of the sweep, so it doesn't start or stop with a click
+const double SWEEP_FADE_SECONDS = 0.05;
+// Recorded beyond the sweep and the tail for the latency of the playback and capture path
+const double SWEEP_LATENCY_MARGIN = 0.5;
+// Highest harmonic whose distortion is reported
+const size_t SWEEP_HARMONICS = 5;
+// Largest FFT over the linear impulse response for the frequency response
+const size_t SWEEP_RESPONSE_FFT = 65536;
+// Log spaced points of the plotted frequency response
+const size_t SWEEP_RESPONSE_POINTS = 256;
+// Frames per read and write of the measurement streams
+const size_t SWEEP_CHUNK_FRAMES = 4096;
+
+// Exponential sine sweep (Farina): the frequency rises exponentially from startHz to endHz, so
+// convolving the recording with the inverse filter moves every harmonic's impulse response to a
+// fixed time before the linear one.
+class SineSweep
+{
+public:
+    SineSweep(double sampleRate, double seconds, double startHz, double endHz);
+
+    const std::vector<float> &Signal() const { return signal; }
+    // Time reversed sweep falling 6 dB per octave, scaled so the sweep convolved with it is a unit
+    // impulse at the geometric mean frequency
+    const std::vector<float> &Inverse() const { return inverse; }
+    // Samples by which the impulse response of a harmonic order (2 for the second) precedes the linear one
+    double HarmonicLead(size_t order) const { return rate * rateConstant * log(double(order)); }
+    double SampleRate() const { return rate; }
+    double StartHz() const { return startHz; }
+    double EndHz() const { return endHz; }
+
+private:
+    double rate, startHz, endHz;
+    // seconds per e-fold of frequency
+    double rateConstant;
+    std::vector<float> signal, inverse;
+};
+
+SineSweep::SineSweep(double sampleRate, double seconds, double startHz, double endHz)
+    : rate(sampleRate), startHz(startHz), endHz(endHz), rateConstant(seconds / log(endHz / startHz)),
+      signal(size_t(seconds * sampleRate)), inverse(signal.size())
+{
+    size_t count = signal.size();
+    size_t fade = std::min(size_t(SWEEP_FADE_SECONDS * rate), count / 2);
+    for (size_t i = 0; i < count; ++i)
+    {
+        double t = i / rate;
+        double gain = SWEEP_LEVEL;
+        if (std::min(i, count - 1 - i) < fade)
+        {
+            gain *= 0.5 - 0.5 * cos(M_PI * std::min(i, count - 1 - i) / fade);
+        }
+        signal[i] = float(gain * sin(2.0 * M_PI * startHz * rateConstant * (exp(t / rateConstant) - 1.0)));
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        // the amplitude follows the frequency, evening out the sweep's falling energy per octave
+        double t = (count - 1 - i) / rate;
+        inverse[i] = float(signal[count - 1 - i] * exp((t - seconds) / rateConstant));
+    }
+
+    // the gain of sweep and inverse at one frequency by direct DFT, the rest of the band follows it
+    double omega = 2.0 * M_PI * sqrt(startHz * endHz) / rate;
+    std::complex<double> forward, backward;
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::complex<double> w = std::polar(1.0, -omega * double(i));
+        forward += double(signal[i]) * w;
+        backward += double(inverse[i]) * w;
+    }
+    float scale = float(1.0 / (std::abs(forward) * std::abs(backward)));
+    for (float &value : inverse)
+    {
+        value *= scale;
+    }
+}
+
+// Linear convolution of a recording with an inverse filter by FFT. Both real signals go through one
+// complex transform, as its real and imaginary part, and are separated by conjugate symmetry.
+std::vector<float> Deconvolve(const std::vector<float> &recording, const std::vector<float> &inverse)
+{
+    size_t length = recording.size() + inverse.size() - 1;
+    size_t size = 2;
+    while (size < length)
+    {
+        size <<= 1;
+    }
+    Fft fft(size);
+    std::vector<std::complex<float>> data(size);
+    for (size_t i = 0; i < recording.size(); ++i)
+    {
+        data[i].real(recording[i]);
+    }
+    for (size_t i = 0; i < inverse.size(); ++i)
+    {
+        data[i].imag(inverse[i]);
+    }
+    fft.Forward(data.data());
+
+    // with Z = X + iY, X(k) Y(k) = (Z(k)^2 - conj(Z(-k))^2) / 4i, and the product of real signals is
+    // hermitian, so each pair of bins is computed once
+    for (size_t k = 0; k <= size / 2; ++k)
+    {
+        size_t mirror = (size - k) & (size - 1);
+        std::complex<float> a = data[k], b = std::conj(data[mirror]);
+        std::complex<float> square = a * a - b * b;
+        std::complex<float> product(square.imag() * 0.25f, -square.real() * 0.25f);
+        data[k] = product;
+        data[mirror] = std::conj(product);
+    }
+    fft.Inverse(data.data());
+
+    std::vector<float> out(length);
+    for (size_t i = 0; i < length; ++i)
+    {
+        out[i] = data[i].real();
+    }
+    return out;
+}
+
+// What a sweep measurement found
+struct SweepMeasurement
+{
+    double sampleRate = 0.0;
+    // the deconvolved recording, with the linear impulse response's peak at peak and the
+    // harmonics' responses before it
+    std::vector<float> response;
+    size_t peak = 0;
+    // seconds from the start of playback to the peak
+    double latency = 0.0;
+    // level of the peak and mean level of the noise, in dB
+    double peakDb = 0.0;
+    double noiseDb = 0.0;
+    // decay time from a -5 to -25 dB fit of the Schroeder curve, negative if the decay sinks into
+    // the noise before -25 dB
+    double rt60 = -1.0;
+    // energy of harmonics 2 to SWEEP_HARMONICS relative to the linear response, in dB, and the THD
+    // over all of them in percent
+    std::vector<double> harmonicDb;
+    double thd = 0.0;
+    // frequency response of the linear impulse response in dB
+    std::vector<float> frequencies;
+    std::vector<float> magnitudeDb;
+    // seconds the deconvolution took
+    double deconvolveSeconds = 0.0;
+};
+
+// Deconvolves a recording of the sweep and analyses the impulse responses in it. tailSeconds is
+// how much of the decay was recorded after the sweep.
+SweepMeasurement MeasureSweep(const SineSweep &sweep, const std::vector<float> &recording, double tailSeconds)
+{
+    SweepMeasurement result;
+    double rate = sweep.SampleRate();
+    result.sampleRate = rate;
+    auto start = std::chrono::steady_clock::now();
+    result.response = Deconvolve(recording, sweep.Inverse());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.deconvolveSeconds = elapsed.count();
+
+    // the linear response is the strongest, time zero of the playback is at the inverse's length
+    const std::vector<float> &h = result.response;
+    auto energy = [&h](long begin, long end) {
+        double sum = 0.0;
+        for (long i = std::max(begin, 0L); i < std::min(end, long(h.size())); ++i)
+        {
+            sum += double(h[i]) * h[i];
+        }
+        return sum;
+    };
+    for (size_t i = 0; i < h.size(); ++i)
+    {
+        result.peak = fabs(h[i]) > fabs(h[result.peak]) ? i : result.peak;
+    }
+    result.latency = (double(result.peak) - double(sweep.Inverse().size() - 1)) / rate;
+    result.peakDb = 20.0 * log10(std::max(fabs(double(h[result.peak])), 1e-12));
+
+    // far enough before the peak even for twice the reported harmonics there is only noise
+    long peak = long(result.peak);
+    long noiseEnd = peak - long(sweep.HarmonicLead(2 * SWEEP_HARMONICS));
+    long noiseBegin = std::max(noiseEnd - long(0.1 * rate), 0L);
+    double noise = noiseEnd > noiseBegin ? energy(noiseBegin, noiseEnd) / (noiseEnd - noiseBegin) : 1e-24;
+    result.noiseDb = 10.0 * log10(std::max(noise, 1e-24));
+
+    // harmonics compared over equal windows, as long as the spacing of the two highest ones
+    long window = long(sweep.HarmonicLead(SWEEP_HARMONICS + 1) - sweep.HarmonicLead(SWEEP_HARMONICS));
+    long lead = window / 16;
+    double linear = std::max(energy(peak - lead, peak - lead + window), 1e-24);
+    double harmonics = 0.0;
+    for (size_t order = 2; order <= SWEEP_HARMONICS; ++order)
+    {
+        long position = peak - long(sweep.HarmonicLead(order) + 0.5);
+        double e = energy(position - lead, position - lead + window);
+        harmonics += e;
+        result.harmonicDb.push_back(10.0 * log10(std::max(e / linear, 1e-24)));
+    }
+    result.thd = 100.0 * sqrt(harmonics / linear);
+
+    // Schroeder integral of the decay, cut where 10 ms blocks sink to within 3 dB of the noise
+    long block = std::max(long(0.01 * rate), 1L);
+    long end = std::min(peak + long(tailSeconds * rate), long(h.size()));
+    for (long i = peak + block; i + block <= end; i += block)
+    {
+        if (energy(i, i + block) / block < 2.0 * noise)
+        {
+            end = i;
+            break;
+        }
+    }
+    std::vector<double> decay(std::max(end - peak, 1L));
+    double sum = 0.0;
+    for (long i = end - 1; i >= peak; --i)
+    {
+        sum += double(h[i]) * h[i];
+        decay[i - peak] = sum;
+    }
+    double n = 0.0, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+    long first = -1, last = -1;
+    for (size_t i = 0; i < decay.size() && decay[0] > 0.0; ++i)
+    {
+        double db = 10.0 * log10(std::max(decay[i] / decay[0], 1e-30));
+        if (db > -5.0)
+        {
+            continue;
+        }
+        if (db < -25.0)
+        {
+            last = long(i);
+            break;
+        }
+        first = first < 0 ? long(i) : first;
+        double x = i / rate;
+        n += 1.0;
+        sx += x;
+        sy += db;
+        sxx += x * x;
+        sxy += x * db;
+    }
+    if (last >= 0 && n >= 2.0 && n * sxx - sx * sx > 0.0)
+    {
+        double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+        result.rt60 = slope < 0.0 ? -60.0 / slope : -1.0;
+    }
+    else if (last >= 0)
+    {
+        // dropped by 20 dB within a sample or two, no reverberation to speak of
+        result.rt60 = 3.0 * (last - std::max(first, 0L) + 1) / rate;
+    }
+
+    // frequency response of the linear response alone, faded out before the next harmonic
+    size_t size = 2;
+    while (size * 2 <= std::min<size_t>(window, SWEEP_RESPONSE_FFT))
+    {
+        size <<= 1;
+    }
+    Fft fft(size);
+    std::vector<std::complex<float>> spectrum(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        long index = peak - lead + long(i);
+        float value = index >= 0 && index < long(h.size()) ? h[index] : 0.0f;
+        if (i >= size * 3 / 4)
+        {
+            value *= float(0.5 + 0.5 * cos(M_PI * (i - size * 3 / 4) / (size / 4)));
+        }
+        spectrum[i] = value;
+    }
+    fft.Forward(spectrum.data());
+    double ratio = sweep.EndHz() / sweep.StartHz();
+    for (size_t p = 0; p < SWEEP_RESPONSE_POINTS; ++p)
+    {
+        // the power of the bins between the neighbouring points, at least the nearest bin
+        double f = sweep.StartHz() * pow(ratio, (p + 0.5) / SWEEP_RESPONSE_POINTS);
+        size_t low = size_t(sweep.StartHz() * pow(ratio, double(p) / SWEEP_RESPONSE_POINTS) * size / rate);
+        size_t high = size_t(sweep.StartHz() * pow(ratio, double(p + 1) / SWEEP_RESPONSE_POINTS) * size / rate);
+        low = std::min(low, size / 2);
+        high = std::min(std::max(high, low + 1), size / 2 + 1);
+        double power = 0.0;
+        for (size_t k = low; k < high; ++k)
+        {
+            power += std::norm(spectrum[k]);
+        }
+        result.frequencies.push_back(float(f));
+        result.magnitudeDb.push_back(float(10.0 * log10(std::max(power / (high - low), 1e-24))));
+    }
+    return result;
+}
+
+// Plays the sweep while recording, and returns the recording: the sweep, tailSeconds of decay and
+// a margin for the latency. Empty device names use the default sink and source.
+std::vector<float> RecordSweep(const std::string &name, const SineSweep &sweep, double tailSeconds,
+                               const std::string &sink, const std::string &source) noexcept(false)
+{
+    pa_sample_spec spec = {PA_SAMPLE_FLOAT32LE, uint32_t(sweep.SampleRate()), 1};
+    if (!pa_sample_spec_valid(&spec))
+    {
+        throw std::runtime_error("can't measure at " + std::to_string(spec.rate) + " Hz");
+    }
+    // capture runs before the first sample is played, so nothing of it is missed
+    PaSimpleStream capture(name, "sweep capture", spec, PA_STREAM_RECORD, NULL, source);
+    PaSimpleStream playback(name, "sweep", spec, PA_STREAM_PLAYBACK, NULL, sink);
+    const std::vector<float> &signal = sweep.Signal();
+    size_t total = signal.size() + size_t((tailSeconds + SWEEP_LATENCY_MARGIN) * sweep.SampleRate());
+
+    // the sweep and then silence for as long as the capture runs, from a thread of its own
+    std::atomic<bool> stopping{false};
+    std::string playbackError;
+    boost::scoped_thread<> player(boost::thread([&]() {
+        std::vector<float> silence(SWEEP_CHUNK_FRAMES, 0.0f);
+        int error = 0;
+        for (size_t written = 0; written < total && !stopping;)
+        {
+            size_t count = std::min(SWEEP_CHUNK_FRAMES, total - written);
+            const float *data = written < signal.size() ? signal.data() + written : silence.data();
+            count = written < signal.size() ? std::min(count, signal.size() - written) : count;
+            if (pa_simple_write(playback, data, count * sizeof(float), &error) < 0)
+            {
+                playbackError = pa_strerror(error);
+                return;
+            }
+            written += count;
+        }
+        pa_simple_drain(playback, &error);
+    }));
+
+    std::vector<float> recording(total);
+    for (size_t read = 0; read < total;)
+    {
+        size_t count = std::min(SWEEP_CHUNK_FRAMES, total - read);
+        int error = 0;
+        if (pa_simple_read(capture, recording.data() + read, count * sizeof(float), &error) < 0)
+        {
+            stopping = true;
+            throw std::runtime_error(std::string("capture failed: ") + pa_strerror(error));
+        }
+        read += count;
+    }
+    player = boost::scoped_thread<>();
+    if (!playbackError.empty())
+    {
+        throw std::runtime_error("playback failed: " + playbackError);
+    }
+    return recording;
+}
+
+// Colors of the measurement plots
+const uint32_t PLOT_GRID_COLOR = Rgba(60, 60, 60);
+const uint32_t PLOT_HARMONIC_COLOR = Rgba(255, 128, 0);
+
+// Draws the impulse responses as a level over time (top) and the frequency response (bottom), with
+// the figures in text
+void RenderSweepMeasurement(const SineSweep &sweep, const SweepMeasurement &m, double tailSeconds, Image &image)
+{
+    const std::vector<float> &h = m.response;
+    double rate = m.sampleRate;
+    long width = long(image.Width()), half = long(image.Height()) / 2;
+
+    // the envelope in dB from before the highest harmonic to the end of the tail
+    long begin = std::max(long(m.peak) - long(sweep.HarmonicLead(SWEEP_HARMONICS + 1)), 0L);
+    long end = std::min(long(m.peak) + long(tailSeconds * rate), long(h.size()));
+    double top = m.peakDb + 5.0, bottom = std::min(m.noiseDb - 5.0, m.peakDb - 40.0);
+    std::vector<long> levels(width);
+    std::vector<bool> linear(width);
+    for (long x = 0; x < width; ++x)
+    {
+        long i0 = begin + (end - begin) * x / width, i1 = std::max(begin + (end - begin) * (x + 1) / width, i0 + 1);
+        float peak = 0.0f;
+        for (long i = i0; i < i1; ++i)
+        {
+            peak = std::max(peak, fabsf(h[i]));
+        }
+        double db = 20.0 * log10(std::max(double(peak), 1e-12));
+        levels[x] = long((top - std::max(db, bottom)) / (top - bottom) * (half - 1));
+        linear[x] = i1 > long(m.peak) - long(sweep.HarmonicLead(2)) / 2;
+    }
+
+    // the response against log frequency, 60 dB below its highest point
+    float highest = *std::max_element(m.magnitudeDb.begin(), m.magnitudeDb.end());
+    std::vector<glm::vec2> curve(m.magnitudeDb.size());
+    double ratio = sweep.EndHz() / sweep.StartHz();
+    for (size_t p = 0; p < curve.size(); ++p)
+    {
+        float x = float(log(m.frequencies[p] / sweep.StartHz()) / log(ratio)) * 2.0f - 1.0f;
+        float y = std::max((m.magnitudeDb[p] - highest + 60.0f) / 70.0f, 0.0f) - 1.0f;
+        curve[p].x = x;
+        curve[p].y = y;
+    }
+
+    std::vector<std::string> lines;
+    char line[128];
+    snprintf(line, sizeof(line), "latency %.1f ms  peak %.1f dB  noise %.1f dB", m.latency * 1000.0, m.peakDb,
+             m.noiseDb);
+    lines.push_back(line);
+    if (m.rt60 >= 0.0)
+    {
+        snprintf(line, sizeof(line), "RT60 %.3f s  THD %.3f %%", m.rt60, m.thd);
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "RT60 n/a (decay below noise)  THD %.3f %%", m.thd);
+    }
+    lines.push_back(line);
+    int length = 0;
+    for (size_t k = 0; k < m.harmonicDb.size(); ++k)
+    {
+        length += snprintf(line + length, sizeof(line) - length, "%sHD%zu %.1f dB", k ? "  " : "", k + 2, m.harmonicDb[k]);
+        length = std::min(length, int(sizeof(line)) - 1);
+    }
+    lines.push_back(line);
+    snprintf(line, sizeof(line), "%.0f-%.0f Hz, top %.1f dB, 10 dB per line", sweep.StartHz(), sweep.EndHz(),
+             highest + 10.0);
+    std::string responseLabel = line;
+
+    SoftwareRasterizer rasterizer(image);
+    rasterizer.Render([&](RasterTile &tile) {
+        tile.Clear(BACKGROUND_COLOR);
+        // decades of frequency and 10 dB steps of level
+        for (double f = 10.0; f < sweep.EndHz(); f *= 10.0)
+        {
+            long x = long(log(f / sweep.StartHz()) / log(ratio) * width);
+            tile.FillColumn(x, half, 2 * half - 1, PLOT_GRID_COLOR);
+        }
+        for (int db = 10; db < 70; db += 10)
+        {
+            long y = half + long(db / 70.0 * half);
+            tile.FillRect(0, y, width, y + 1, PLOT_GRID_COLOR);
+        }
+        tile.FillRect(0, half, width, half + 1, HUD_TEXT_COLOR);
+        for (long x = 0; x < width; ++x)
+        {
+            tile.FillColumn(x, levels[x], half - 1, linear[x] ? WAVEFORM_COLOR : PLOT_HARMONIC_COLOR);
+        }
+        tile.LineStrip(curve.data(), curve.size(), WAVEFORM_COLOR);
+        for (size_t i = 0; i < lines.size(); ++i)
+        {
+            tile.Text(2, 2 + long(i * HUD_GLYPH_HEIGHT), lines[i], HUD_TEXT_COLOR, HUD_BACKGROUND_COLOR);
+        }
+        tile.Text(2, half + 2, responseLabel, HUD_TEXT_COLOR, HUD_BACKGROUND_COLOR);
+    });
+}
+
+int RunMeasure(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " --measure <out.png> [--seconds s] [--rate hz] [--from hz] [--to hz]"
+                  << " [--tail s] [--sink name] [--source name]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    double seconds = 10.0, rate = 48000.0, startHz = 20.0, endHz = -1.0, tailSeconds = 2.0;
+    std::string sink, source;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--seconds" && sscanf(value.c_str(), "%lf", &seconds) == 1)
+        {
+        }
+        else if (arg == "--rate" && sscanf(value.c_str(), "%lf", &rate) == 1)
+        {
+        }
+        else if (arg == "--from" && sscanf(value.c_str(), "%lf", &startHz) == 1)
+        {
+        }
+        else if (arg == "--to" && sscanf(value.c_str(), "%lf", &endHz) == 1)
+        {
+        }
+        else if (arg == "--tail" && sscanf(value.c_str(), "%lf", &tailSeconds) == 1)
+        {
+        }
+        else if (arg == "--sink" && !value.empty())
+        {
+            sink = value;
+        }
+        else if (arg == "--source" && !value.empty())
+        {
+            source = value;
+        }
+        else
+        {
+            std::cerr << "bad option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+        ++i;
+    }
+    // up to 20 kHz, or just below Nyquist at lower rates
+    endHz = endHz > 0.0 ? endHz : std::min(20000.0, 0.45 * rate);
+    if (seconds < 0.5 || startHz <= 0.0 || endHz <= startHz || endHz >= 0.5 * rate || tailSeconds < 0.0)
+    {
+        std::cerr << "bad sweep " << startHz << "-" << endHz << " Hz over " << seconds << " s at " << rate << " Hz"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    SineSweep sweep(rate, seconds, startHz, endHz);
+    std::vector<float> recording;
+    try
+    {
+        std::cout << "Playing a " << seconds << " s sweep from " << startHz << " to " << endHz << " Hz" << std::endl;
+        recording = RecordSweep(argv[0], sweep, tailSeconds, sink, source);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    SweepMeasurement m = MeasureSweep(sweep, recording, tailSeconds);
+    std::cout << "Deconvolved " << recording.size() / rate << " s in " << m.deconvolveSeconds * 1000.0 << " ms"
+              << std::endl;
+    std::cout << "latency " << m.latency * 1000.0 << " ms, peak " << m.peakDb << " dB, noise " << m.noiseDb << " dB"
+              << std::endl;
+    if (m.rt60 >= 0.0)
+    {
+        std::cout << "RT60 " << m.rt60 << " s" << std::endl;
+    }
+    else
+    {
+        std::cout << "RT60 not measurable, the decay sinks into the noise above -25 dB" << std::endl;
+    }
+    for (size_t k = 0; k < m.harmonicDb.size(); ++k)
+    {
+        std::cout << "HD" << k + 2 << " " << m.harmonicDb[k] << " dB" << std::endl;
+    }
+    std::cout << "THD " << m.thd << " %" << std::endl;
+
+    Image image(WIN_WIDTH, WIN_HEIGHT);
+    RenderSweepMeasurement(sweep, m, tailSeconds, image);
+    if (!image.WritePng(argv[2]))
+    {
+        std::cerr << "failed to write " << argv[2] << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// FFT size of the distortion analyser, 2.7 Hz bins at 44.1 kHz
+const size_t DISTORTION_FFT_SIZE = 16384;
+// Analyses per second of audio, each costs one transform of DISTORTION_FFT_SIZE
+const size_t DISTORTION_UPDATES_PER_SECOND = 5;
+// Bins on either side of a tone's peak holding its energy under the Blackman-Harris window
+const long DISTORTION_TONE_BINS = 9;
+// Highest harmonic counted as distortion
+const size_t DISTORTION_HARMONICS = 10;
+// Band the analyser measures over; DC and rumble below it and ultrasonics above it are ignored
+const double DISTORTION_LOW_HZ = 20.0;
+const double DISTORTION_HIGH_HZ = 20000.0;
+// Centre of the lowest octave band of the noise floor, the bands are octaves of 1 kHz
+const double DISTORTION_FIRST_BAND_HZ = 31.25;
+
+// Figures of one distortion analysis. Levels are in dB relative to a full scale sine.
+struct DistortionResult
+{
+    bool valid = false;
+    double fundamentalHz = 0.0;
+    double fundamentalDb = 0.0;
+    // harmonics and harmonics plus noise relative to the fundamental, as ratios
+    double thd = 0.0;
+    double thdn = 0.0;
+    double sinadDb = 0.0;
+    // everything but the fundamental and its harmonics, across the band
+    double noiseDb = 0.0;
+    // the same per octave band
+    std::vector<double> bandHz;
+    std::vector<double> bandNoiseDb;
+};
+
+// Distortion analyser for a test tone. A 7 term Blackman-Harris window keeps the leakage of a full
+// scale tone summed over an octave far below the noise of 16 bit audio. The strongest peak is taken
+// as the fundamental, and its bins and those of its harmonics are removed from the spectrum; what is
+// left is noise.
+class DistortionAnalyzer
+{
+public:
+    DistortionAnalyzer(double sampleRate);
+
+    // Adds mono samples, returns true if a new result is available
+    bool Process(const float *samples, size_t count);
+    const DistortionResult &Result() const { return result; }
+    // Average seconds one analysis took
+    double AnalysisSeconds() const { return analyses ? analysisSeconds / analyses : 0.0; }
+
+private:
+    void Analyze();
+
+    double rate;
+    Fft fft;
+    std::vector<float> window;
+    // scales |X(k)|^2 to the power of a one sided bin
+    double binScale;
+    std::vector<float> ring;
+    size_t written = 0;
+    size_t hop;
+    size_t sinceAnalysis = 0;
+    std::vector<std::complex<float>> spectrum;
+    std::vector<double> power;
+    std::vector<bool> tone;
+    DistortionResult result;
+    double analysisSeconds = 0.0;
+    size_t analyses = 0;
+};
+
+DistortionAnalyzer::DistortionAnalyzer(double sampleRate)
+    : rate(sampleRate), fft(DISTORTION_FFT_SIZE), window(DISTORTION_FFT_SIZE), ring(DISTORTION_FFT_SIZE),
+      hop(std::max<size_t>(size_t(sampleRate) / DISTORTION_UPDATES_PER_SECOND, 1)), spectrum(DISTORTION_FFT_SIZE),
+      power(DISTORTION_FFT_SIZE / 2), tone(DISTORTION_FFT_SIZE / 2)
+{
+    const double terms[] = {0.27105140069342, -0.43329793923448, 0.21812299954311, -0.06592544638803,
+                            0.01081174209837, -0.00077658482522, 0.00001388721735};
+    double sum = 0.0;
+    for (size_t i = 0; i < DISTORTION_FFT_SIZE; ++i)
+    {
+        double value = 0.0;
+        for (size_t t = 0; t < sizeof(terms) / sizeof(terms[0]); ++t)
+        {
+            value += terms[t] * cos(2.0 * M_PI * t * i / DISTORTION_FFT_SIZE);
+        }
+        window[i] = float(value);
+        sum += value * value;
+    }
+    binScale = 2.0 / (DISTORTION_FFT_SIZE * sum);
+}
+
+bool DistortionAnalyzer::Process(const float *samples, size_t count)
+{
+    bool updated = false;
+    for (size_t i = 0; i < count; ++i)
+    {
+        ring[written++ % DISTORTION_FFT_SIZE] = samples[i];
+        if (++sinceAnalysis >= hop && written >= DISTORTION_FFT_SIZE)
+        {
+            Analyze();
+            sinceAnalysis = 0;
+            updated = true;
+        }
+    }
+    return updated;
+}
+
+void DistortionAnalyzer::Analyze()
+{
+    double start = SecondsNow();
+    const size_t size = DISTORTION_FFT_SIZE;
+    for (size_t i = 0; i < size; ++i)
+    {
+        spectrum[i] = std::complex<float>(ring[(written + i) % size] * window[i], 0.0f);
+    }
+    fft.Forward(spectrum.data());
+    for (size_t k = 0; k < size / 2; ++k)
+    {
+        power[k] = std::norm(spectrum[k]) * binScale;
+        tone[k] = false;
+    }
+
+    // a full scale sine has a power of 1/2
+    auto decibels = [](double p) { return 10.0 * log10(std::max(2.0 * p, 1e-30)); };
+    long low = std::max(long(DISTORTION_LOW_HZ * size / rate), DISTORTION_TONE_BINS);
+    long high = std::min(long(DISTORTION_HIGH_HZ * size / rate), long(size / 2) - 1);
+    long peak = low;
+    for (long k = low; k <= high; ++k)
+    {
+        peak = power[k] > power[peak] ? k : peak;
+    }
+    // sums the bins of a tone around centre that no other tone claimed
+    auto claim = [&](long centre) {
+        double sum = 0.0;
+        for (long k = std::max(centre - DISTORTION_TONE_BINS, low); k <= std::min(centre + DISTORTION_TONE_BINS, high); ++k)
+        {
+            sum += tone[k] ? 0.0 : power[k];
+            tone[k] = true;
+        }
+        return sum;
+    };
+
+    // the peak's fraction of a bin from the parabola through the log magnitudes around it
+    double offset = 0.0;
+    if (peak > low && peak < high)
+    {
+        double a = log(power[peak - 1] + 1e-30), b = log(power[peak] + 1e-30), c = log(power[peak + 1] + 1e-30);
+        offset = a - 2.0 * b + c < 0.0 ? 0.5 * (a - c) / (a - 2.0 * b + c) : 0.0;
+    }
+    double fundamental = claim(peak);
+    double harmonics = 0.0;
+    for (size_t order = 2; order <= DISTORTION_HARMONICS; ++order)
+    {
+        long centre = long(order * (peak + offset) + 0.5);
+        if (centre > high)
+        {
+            break;
+        }
+        harmonics += claim(centre);
+    }
+    double noise = 0.0;
+    for (long k = low; k <= high; ++k)
+    {
+        noise += tone[k] ? 0.0 : power[k];
+    }
+
+    result.valid = fundamental > 0.0;
+    result.fundamentalHz = (peak + offset) * rate / size;
+    result.fundamentalDb = decibels(fundamental);
+    result.thd = sqrt(harmonics / std::max(fundamental, 1e-30));
+    result.thdn = sqrt((harmonics + noise) / std::max(fundamental, 1e-30));
+    result.sinadDb = 10.0 * log10((fundamental + harmonics + noise) / std::max(harmonics + noise, 1e-30));
+    result.noiseDb = decibels(noise);
+
+    // the noise left in each octave band, empty bins of removed tones don't count towards it
+    result.bandHz.clear();
+    result.bandNoiseDb.clear();
+    for (double centre = DISTORTION_FIRST_BAND_HZ; centre * M_SQRT2 <= std::min(DISTORTION_HIGH_HZ, 0.5 * rate);
+         centre *= 2.0)
+    {
+        long first = std::max(long(centre / M_SQRT2 * size / rate), low);
+        long last = std::min(long(centre * M_SQRT2 * size / rate), high + 1);
+        double sum = 0.0;
+        long bins = 0;
+        for (long k = first; k < last; ++k)
+        {
+            sum += tone[k] ? 0.0 : power[k];
+            bins += tone[k] ? 0 : 1;
+        }
+        // scaled up to the whole band where tones were removed from it, bands of tones alone are left out
+        if (bins > 0)
+        {
+            result.bandHz.push_back(centre);
+            result.bandNoiseDb.push_back(decibels(sum * (last - first) / bins));
+        }
+    }
+
+    analysisSeconds += SecondsNow() - start;
+    ++analyses;
+}
+
+int RunDistortion(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " --thdn <file.wav>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::unique_ptr<FileSource> file = OpenFileSource(argv[2]);
+    SampleHistory &history = file->History();
+    double rate = double(history.SampleRate());
+    DistortionAnalyzer analyzer(rate);
+
+    // one line per second of audio, from the analysis closest to its end
+    std::vector<float> samples(history.SampleRate());
+    for (size_t position = 0; position < history.Size(); position += samples.size())
+    {
+        size_t count = std::min(samples.size(), history.Size() - position);
+        history.Read(position, count, samples.data());
+        analyzer.Process(samples.data(), count);
+        const DistortionResult &r = analyzer.Result();
+        if (!r.valid)
+        {
+            continue;
+        }
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "%8.1f s  %9.2f Hz %7.2f dB  THD %.4f %%  THD+N %.4f %%  SINAD %6.2f dB  noise %7.2f dB",
+                 (position + count) / rate, r.fundamentalHz, r.fundamentalDb, r.thd * 100.0, r.thdn * 100.0,
+                 r.sinadDb, r.noiseDb);
+        std::cout << line << std::endl;
+    }
+
+    const DistortionResult &r = analyzer.Result();
+    if (!r.valid)
+    {
+        std::cerr << "shorter than one analysis of " << DISTORTION_FFT_SIZE << " samples" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "noise per octave band:";
+    for (size_t b = 0; b < r.bandHz.size(); ++b)
+    {
+        char band[64];
+        snprintf(band, sizeof(band), "  %g Hz %.1f dB", r.bandHz[b], r.bandNoiseDb[b]);
+        std::cout << band;
+    }
+    std::cout << std::endl << "analysis " << analyzer.AnalysisSeconds() * 1000.0 << " ms" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Samples per partition of the pre-filter, which is also its latency
+const size_t PREFILTER_BLOCK = 256;
+// Longest pre-filter in taps
+const size_t PREFILTER_MAX_TAPS = 65536;
+// Taps of a filter designed from a curve unless --filter-taps is given
+const size_t PREFILTER_DEFAULT_TAPS = 8191;
+
+// FIR filter by uniformly partitioned overlap-save convolution. The taps are cut into partitions of
+// one block, each transformed once up front; every block of input is transformed once, kept in a
+// delay line of spectra and multiplied with the partitions, so a long filter costs one transform
+// pair per block plus one complex multiply per bin and partition, with one block of latency.
+class PartitionedConvolver
+{
+public:
+    PartitionedConvolver(const std::vector<float> &taps, size_t blockSize = PREFILTER_BLOCK);
+
+    // Filters count samples, out lags in by BlockSize() samples. in and out may be the same buffer.
+    void Process(const float *in, float *out, size_t count);
+
+    size_t BlockSize() const { return block; }
+    size_t Partitions() const { return partitions.size(); }
+    size_t Taps() const { return taps; }
+
+private:
+    void ProcessBlock();
+
+    size_t block;
+    size_t taps;
+    Fft fft;
+    // bins 0 to block of each partition's spectrum, the rest follows by symmetry
+    std::vector<std::vector<std::complex<float>>> partitions;
+    // spectra of the latest blocks of input, newest first counting from newest
+    std::vector<std::vector<std::complex<float>>> delayLine;
+    size_t newest = 0;
+    // the previous and the current block of input, and the output of the previous block
+    std::vector<float> input;
+    std::vector<float> output;
+    size_t fill = 0;
+    std::vector<std::complex<float>> work;
+    std::vector<std::complex<float>> sum;
+};
+
+PartitionedConvolver::PartitionedConvolver(const std::vector<float> &taps, size_t blockSize)
+    : block(blockSize), taps(taps.size()), fft(2 * blockSize), input(2 * blockSize), output(blockSize),
+      work(2 * blockSize), sum(blockSize + 1)
+{
+    size_t count = std::max<size_t>((taps.size() + block - 1) / block, 1);
+    partitions.resize(count);
+    delayLine.assign(count, std::vector<std::complex<float>>(block + 1));
+    for (size_t p = 0; p < count; ++p)
+    {
+        std::fill(work.begin(), work.end(), std::complex<float>());
+        for (size_t i = 0; i < block && p * block + i < taps.size(); ++i)
+        {
+            work[i] = taps[p * block + i];
+        }
+        fft.Forward(work.data());
+        partitions[p].assign(work.begin(), work.begin() + block + 1);
+    }
+}
+
+void PartitionedConvolver::Process(const float *in, float *out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        input[block + fill] = in[i];
+        out[i] = output[fill];
+        if (++fill == block)
+        {
+            ProcessBlock();
+            fill = 0;
+        }
+    }
+}
+
+void PartitionedConvolver::ProcessBlock()
+{
+    // the spectrum of the last two blocks of input joins the delay line
+    for (size_t i = 0; i < 2 * block; ++i)
+    {
+        work[i] = input[i];
+    }
+    fft.Forward(work.data());
+    newest = (newest + delayLine.size() - 1) % delayLine.size();
+    std::copy(work.begin(), work.begin() + block + 1, delayLine[newest].begin());
+    std::copy(input.begin() + block, input.end(), input.begin());
+
+    // partition p meets the input of p blocks ago; the multiply is written out by hand, as in Fft
+    std::fill(sum.begin(), sum.end(), std::complex<float>());
+    for (size_t p = 0; p < partitions.size(); ++p)
+    {
+        const std::complex<float> *x = delayLine[(newest + p) % delayLine.size()].data();
+        const std::complex<float> *h = partitions[p].data();
+        for (size_t k = 0; k <= block; ++k)
+        {
+            float re = x[k].real() * h[k].real() - x[k].imag() * h[k].imag();
+            float im = x[k].real() * h[k].imag() + x[k].imag() * h[k].real();
+            sum[k] = std::complex<float>(sum[k].real() + re, sum[k].imag() + im);
+        }
+    }
+    for (size_t k = 0; k <= block; ++k)
+    {
+        work[k] = sum[k];
+        work[(2 * block - k) % (2 * block)] = std::conj(sum[k]);
+    }
+    fft.Inverse(work.data());
+
+    // the first half wrapped around (overlap-save), the second is this block's output
+    for (size_t i = 0; i < block; ++i)
+    {
+        output[i] = work[block + i].real();
+    }
+}
+
+// Linear phase FIR with an odd number of taps, at most taps but no fewer than 3, following a magnitude
+// response in dB, designed by sampling the response densely, transforming it to a zero phase impulse and
+// windowing that
+std::vector<float> DesignLinearPhase(const std::function<double(double)> &gainDb, double sampleRate, size_t taps)
+{
+    // the window needs two ends and a middle
+    taps = (std::max<size_t>(taps, 4) - 1) | 1;
+    size_t size = 2;
+    while (size < 4 * taps)
+    {
+        size <<= 1;
+    }
+    std::vector<std::complex<float>> response(size);
+    for (size_t k = 0; k <= size / 2; ++k)
+    {
+        float gain = float(pow(10.0, gainDb(k * sampleRate / size) / 20.0));
+        response[k] = gain;
+        response[(size - k) % size] = gain;
+    }
+    Fft(size).Inverse(response.data());
+
+    // the impulse is centered on sample 0, the filter delays it by half its length
+    std::vector<float> out(taps);
+    long half = long(taps / 2);
+    for (long i = 0; i < long(taps); ++i)
+    {
+        double window = 0.42 - 0.5 * cos(2.0 * M_PI * i / (taps - 1)) + 0.08 * cos(4.0 * M_PI * i / (taps - 1));
+        out[i] = float(response[(i - half + long(size)) % long(size)].real() * window);
+    }
+    return out;
+}
+
+// Gain in dB of the A and C frequency weightings (IEC 61672)
+double AWeightingDb(double f)
+{
+    double f2 = f * f;
+    double r = 12194.0 * 12194.0 * f2 * f2 /
+               ((f2 + 20.6 * 20.6) * sqrt((f2 + 107.7 * 107.7) * (f2 + 737.9 * 737.9)) * (f2 + 12194.0 * 12194.0));
+    return 20.0 * log10(std::max(r, 1e-10)) + 2.0;
+}
+
+double CWeightingDb(double f)
+{
+    double f2 = f * f;
+    double r = 12194.0 * 12194.0 * f2 / ((f2 + 20.6 * 20.6) * (f2 + 12194.0 * 12194.0));
+    return 20.0 * log10(std::max(r, 1e-10)) + 0.06;
+}
+
+// Taps of a pre-filter: a-weighting or c-weighting, or a text file holding either one tap per line or
+// an EQ curve as lines of frequency and gain in dB. Curves are interpolated over log frequency and
+// designed as a linear phase filter of the given taps. # starts a comment.
+std::vector<float> LoadPrefilter(const std::string &spec, double sampleRate, size_t taps) noexcept(false)
+{
+    std::vector<float> out;
+    if (spec == "a-weighting" || spec == "c-weighting")
+    {
+        out = DesignLinearPhase(spec == "a-weighting" ? AWeightingDb : CWeightingDb, sampleRate, taps);
+    }
+    else
+    {
+        std::ifstream file(spec);
+        if (!file)
+        {
+            throw std::runtime_error("failed to open " + spec);
+        }
+        std::vector<std::pair<double, double>> curve;
+        std::string line;
+        while (std::getline(file, line))
+        {
+            line = line.substr(0, line.find('#'));
+            double a, b;
+            int fields = sscanf(line.c_str(), "%lf %lf", &a, &b);
+            if (fields == 2)
+            {
+                curve.push_back(std::make_pair(a, b));
+            }
+            else if (fields == 1)
+            {
+                out.push_back(float(a));
+            }
+            else if (line.find_first_not_of(" \t\r") != std::string::npos)
+            {
+                throw std::runtime_error("bad line in " + spec + ": " + line);
+            }
+        }
+        if (!curve.empty() && !out.empty())
+        {
+            throw std::runtime_error(spec + " mixes taps and curve points");
+        }
+        if (!curve.empty())
+        {
+            std::sort(curve.begin(), curve.end());
+            if (curve.front().first <= 0.0)
+            {
+                throw std::runtime_error("curve points in " + spec + " need frequencies above 0");
+            }
+            out = DesignLinearPhase(
+                [&curve](double f) {
+                    if (f <= curve.front().first)
+                    {
+                        return curve.front().second;
+                    }
+                    for (size_t i = 1; i < curve.size(); ++i)
+                    {
+                        if (f < curve[i].first)
+                        {
+                            double t = log(f / curve[i - 1].first) / log(curve[i].first / curve[i - 1].first);
+                            return curve[i - 1].second + t * (curve[i].second - curve[i - 1].second);
+                        }
+                    }
+                    return curve.back().second;
+                },
+                sampleRate, taps);
+        }
+    }
+    if (out.empty() || out.size() > PREFILTER_MAX_TAPS)
+    {
+        throw std::runtime_error(spec + " has " + std::to_string(out.size()) + " taps, 1 to " +
+                                 std::to_string(PREFILTER_MAX_TAPS) + " are supported");
+    }
+    for (float tap : out)
+    {
+        if (!std::isfinite(tap))
+        {
+            throw std::runtime_error(spec + " has a tap that isn't a number");
+        }
+    }
+    return out;
+}
+
+// Seconds of live audio kept for zooming back through
+const size_t LIVE_HISTORY_SECONDS = 600;
+// Shortest zoomable view in samples (about 6 ms)
+const double MIN_VIEW_LENGTH = 256.0;
+// Frames the low latency mode allows in flight unless --low-latency is given a count
+const size_t LOW_LATENCY_FRAMES = 1;
+// Longest wait for events while drawing is paused, bounds how far audio consumption falls behind
+const double IDLE_WAIT = 0.25;
+
+// Settings of the capture to display pipeline, shared by every window
+struct PipelineSettings
+{
+    // frames allowed in flight while the low latency mode is on (toggled with L)
+    bool lowLatency = false;
+    size_t framesInFlight = LOW_LATENCY_FRAMES;
+    // statistics overlay in the first window (toggled with H)
+    bool showHud = true;
+};
+
+// Visualizations of a window, in the order S cycles through them
+enum ViewMode
+{
+    VIEW_WAVEFORM,
+    VIEW_SPECTROGRAM,
+    VIEW_REASSIGNED,
+    VIEW_SCALOGRAM,
+    VIEW_PANORAMA,
+    VIEW_MODES,
+};
+
+// Visible region of the sample history and which visualization is shown in one window, changed by
+// input callbacks
+struct ViewState
+{
+    ViewMode mode = VIEW_WAVEFORM;
+    // keep the end of the view at the newest sample
+    bool followLive = true;
+    double start = 0.0;
+    double length = SAMPLE_RATE * 10.0;
+    // input or exposure changed the view, so a frame is drawn even while paused for silence
+    bool dirty = true;
+    // cursor x where a drag with the left button last moved the view, negative when not dragging
+    double dragX = -1.0;
+    // requested jump to the next (1) or previous (-1) result of the --find query
+    int jump = 0;
+    PipelineSettings *pipeline = nullptr;
+};
+
+// Scales the view length, keeping the sample at anchor (0 left edge, 1 right edge) in place
+void Zoom(ViewState &view, double factor, double anchor = 0.5)
+{
+    double length = std::max(view.length * factor, MIN_VIEW_LENGTH);
+    view.start += (view.length - length) * anchor;
+    view.length = length;
+}
+
+// GLFW key callback: S cycles the waveform, spectrogram, reassigned spectrogram, scalogram and stereo
+// panorama, +/- zoom, arrows pan, End returns to the live edge, L toggles the low latency mode, H the
+// statistics overlay
+void KeyCallback(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+    ViewState &view = *static_cast<ViewState *>(glfwGetWindowUserPointer(window));
+    if (action == GLFW_RELEASE)
+    {
+        return;
+    }
+    view.dirty = true;
+    switch (key)
+    {
+    case GLFW_KEY_S:
+        view.mode = ViewMode((view.mode + 1) % VIEW_MODES);
+        break;
+    case GLFW_KEY_EQUAL:
+        Zoom(view, 0.5);
+        break;
+    case GLFW_KEY_MINUS:
+        Zoom(view, 2.0);
+        break;
+    case GLFW_KEY_LEFT:
+        view.start -= view.length / 4.0;
+        view.followLive = false;
+        break;
+    case GLFW_KEY_RIGHT:
+        view.start += view.length / 4.0;
+        view.followLive = false;
+        break;
+    case GLFW_KEY_END:
+        view.followLive = true;
+        break;
+    case GLFW_KEY_L:
+        view.pipeline->lowLatency = !view.pipeline->lowLatency;
+        break;
+    case GLFW_KEY_H:
+        view.pipeline->showHud = !view.pipeline->showHud;
+        break;
+    case GLFW_KEY_N:
+        view.jump = 1;
+        break;
+    case GLFW_KEY_P:
+        view.jump = -1;
+        break;
+    }
+}
+
+// GLFW scroll callback: zooms around the cursor; when following live audio the newest sample stays
+// at the right edge
+void ScrollCallback(GLFWwindow *window, double xoffset, double yoffset)
+{
+    ViewState &view = *static_cast<ViewState *>(glfwGetWindowUserPointer(window));
+    double x, y;
+    int width, height;
+    glfwGetCursorPos(window, &x, &y);
+    glfwGetWindowSize(window, &width, &height);
+    double anchor = view.followLive ? 1.0 : std::min(std::max(x / std::max(width, 1), 0.0), 1.0);
+    Zoom(view, yoffset > 0 ? 0.8 : 1.25, anchor);
+    view.dirty = true;
+}
+
+// GLFW mouse button callback: the left button starts and ends dragging the view
+void MouseButtonCallback(GLFWwindow *window, int button, int action, int mods)
+{
+    ViewState &view = *static_cast<ViewState *>(glfwGetWindowUserPointer(window));
+    if (button != GLFW_MOUSE_BUTTON_LEFT)
+    {
+        return;
+    }
+    double x, y;
+    glfwGetCursorPos(window, &x, &y);
+    view.dragX = action == GLFW_PRESS ? x : -1.0;
+}
+
+// GLFW cursor callback: pans the view while dragging, by the samples under the distance moved
+void CursorPosCallback(GLFWwindow *window, double x, double y)
+{
+    ViewState &view = *static_cast<ViewState *>(glfwGetWindowUserPointer(window));
+    if (view.dragX < 0.0)
+    {
+        return;
+    }
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    view.start -= (x - view.dragX) / std::max(width, 1) * view.length;
+    view.followLive = false;
+    view.dragX = x;
+    view.dirty = true;
+}
+
+// GLFW refresh callback: the window was exposed or resized and needs its contents drawn again
+void RefreshCallback(GLFWwindow *window)
+{
+    static_cast<ViewState *>(glfwGetWindowUserPointer(window))->dirty = true;
+}
+
+// Seconds shown around a result the view jumps to, unless the result is longer
+const double JUMP_CONTEXT_SECONDS = 0.5;
+
+// Moves the view to the result of the query after (view.jump 1) or before (-1) its center, queried
+// from a snapshot of the recording's event detector. Recording and history start together, so
+// archive frames are history positions.
+void JumpToResult(ViewState &view, ArchiveWriter *recorder, const std::string &findText, const EventQuery &query,
+                  const SampleHistory &history)
+{
+    int direction = view.jump;
+    view.jump = 0;
+    if (!recorder || findText.empty())
+    {
+        std::cout << "jumping needs --record and --find" << std::endl;
+        return;
+    }
+    double queryStart = SecondsNow();
+    EventDetector snapshot = recorder->SnapshotEvents();
+    snapshot.Finish();
+    std::vector<ArchiveEvent> results;
+    RunEventQuery(snapshot.Tables(recorder->StartTime()), query, history.First(), history.Size(), results);
+    double queryMs = (SecondsNow() - queryStart) * 1000.0;
+
+    double center = view.start + view.length / 2.0;
+    auto middle = [](const ArchiveEvent &event) { return (event.start + event.end) / 2.0; };
+    const ArchiveEvent *found = nullptr;
+    size_t position = 0;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        if (direction > 0 ? middle(results[i]) > center + 0.5 : middle(results[i]) < center - 0.5)
+        {
+            found = &results[i];
+            position = i;
+            if (direction > 0)
+            {
+                break;
+            }
+        }
+    }
+    if (!found)
+    {
+        std::cout << "no " << (direction > 0 ? "later " : "earlier ") << findText << " results (" << queryMs
+                  << " ms)" << std::endl;
+        return;
+    }
+    view.followLive = false;
+    view.length = std::max(3.0 * (found->end - found->start), JUMP_CONTEXT_SECONDS * history.SampleRate());
+    view.start = middle(*found) - view.length / 2.0;
+    std::cout << findText << " result " << position + 1 << " of " << results.size() << " at "
+              << found->start / double(history.SampleRate()) << " s (" << queryMs << " ms)" << std::endl;
+}
+
+// Drawing backend of the live visualizer. The main loop converts audio and handles input, a
+// renderer owns every resource needed to draw the views and show the result.
+class Renderer
+{
+public:
+    virtual ~Renderer() {}
+
+    // Starts a frame with the first view selected and cleared
+    virtual void BeginFrame() = 0;
+    // Number of views (windows) shown, each drawn from its own ViewState
+    virtual size_t ViewCount() = 0;
+    // Clears a view and directs the following draws to it
+    virtual void SelectView(size_t view) = 0;
+    // Draws samples [start, start + length) of the history as a waveform, from the pyramid where
+    // zoomed out
+    virtual void DrawWaveform(const SampleHistory &history, const WaveformPyramid &pyramid, double start,
+                              double length) = 0;
+    // Draws samples [start, start + length) of the history as a spectrogram
+    virtual void DrawSpectrogram(const SampleHistory &history, double start, double length) = 0;
+    // Draws samples [start, start + length) of the history as a reassigned spectrogram
+    virtual void DrawReassigned(const SampleHistory &history, double start, double length) = 0;
+    // Draws samples [start, start + length) of the history as a wavelet scalogram
+    virtual void DrawScalogram(const SampleHistory &history, double start, double length) = 0;
+    // Draws the stereo panorama of the history up to sample start + length, decayed over time
+    virtual void DrawPanorama(const SampleHistory &history, double start, double length) = 0;
+    // Level difference in dB of the left over the right channel in the panorama's latest frame and
+    // the average seconds a frame took, false if the panorama wasn't analysed yet
+    virtual bool PanoramaFigures(double &balanceDb, double &frameSeconds) = 0;
+    // Draws a line strip through points in normalized device coordinates over the current view
+    virtual void DrawLine(const std::vector<glm::vec2> &points) = 0;
+    // Draws lines of statistics text over the top left of the current view
+    virtual void DrawHud(const std::vector<std::string> &lines) = 0;
+    // GPU time of a recent overlay draw, false if it isn't measured
+    virtual bool HudGpuSeconds(double &seconds) = 0;
+    // Shows the finished frame and handles any events of the output
+    virtual void Present() = 0;
+    // False once the output was closed
+    virtual bool IsOpen() = 0;
+    // False while nothing drawn could be seen, e.g. the window is iconified
+    virtual bool IsVisible() = 0;
+    // Handles events of the output, blocking until one arrives, Wake is called or timeout passes
+    virtual void WaitEvents(double timeout) = 0;
+    // Ends a WaitEvents early, may be called from any thread
+    virtual void Wake() = 0;
+
+    // Limits frames queued ahead of the display, 0 leaves queueing to the driver
+    virtual void SetFramesInFlight(size_t frames) = 0;
+    // Records the capture time of audio drawn in the current frame
+    virtual void MarkCapture(double captureTime) = 0;
+    // Average capture to present latency of frames finished since the last call, false if none
+    virtual bool TakeLatency(double &seconds) = 0;
+};
+
+// Running sum of capture to present latencies
+struct LatencyStats
+{
+    double sum = 0.0;
+    size_t count = 0;
+
+    void Add(double seconds)
+    {
+        sum += seconds;
+        ++count;
+    }
+
+    bool Take(double &average)
+    {
+        if (count == 0)
+        {
+            return false;
+        }
+        average = sum / count;
+        sum = 0.0;
+        count = 0;
+        return true;
+    }
+};
+
+// Fences kept when frames in flight aren't limited, older ones are dropped unmeasured
+const size_t MAX_TRACKED_FENCES = 8;
+
+// Overlay text layout: fixed slots per line, so a changed line is rewritten in place. Enough lines
+// for every analyser's figures at once, with the mode and the overlay's own cost below them.
+const size_t HUD_MAX_LINES = 20;
+const size_t HUD_LINE_CHARS = 64;
+// Pixels between the overlay and the top left corner of the view
+const float HUD_MARGIN = 4.0f;
+// Timer queries in flight, results are read a few frames after the draw they measured
+const size_t HUD_TIMER_QUERIES = 4;
+
+// Text overlay drawn with the GPU. Glyphs come from an atlas of the bitmap font and every character
+// is one instance of a single instanced draw; only lines that changed are uploaded. The GL objects
+// may be shared by several contexts, each drawing with its own vertex array, but timing queries
+// belong to the context that was current at construction.
+class HudOverlay
+{
+public:
+    HudOverlay() noexcept(false);
+    ~HudOverlay();
+
+    // Creates a vertex array for drawing in the current context
+    GLuint CreateVertexArray() noexcept(false);
+    // Replaces the text, one string per line; lines past HUD_MAX_LINES or characters past
+    // HUD_LINE_CHARS are dropped
+    void SetLines(const std::vector<std::string> &lines);
+    // Draws the text over the viewport of the given size in pixels
+    void Draw(GLuint vao, int width, int height, bool timed);
+    // GPU time of the latest measured draw, false if no measurement finished yet
+    bool GpuSeconds(double &seconds) const;
+
+    HudOverlay(const HudOverlay &) = delete;
+    HudOverlay &operator=(const HudOverlay &) = delete;
+
+private:
+    // One character: cell column and row, glyph index, unused
+    struct Instance
+    {
+        uint8_t column, row, glyph, unused;
+    };
+
+    GLuint program = 0;
+    GLuint atlas = 0;
+    GLuint instances = 0;
+    GLint viewportUniform = -1;
+    // lines currently in the instance buffer
+    std::vector<std::string> uploaded;
+    size_t lineCount = 0;
+
+    GLuint queries[HUD_TIMER_QUERIES];
+    bool pending[HUD_TIMER_QUERIES] = {};
+    size_t nextQuery = 0;
+    double gpuSeconds = -1.0;
+};
+
+HudOverlay::HudOverlay() : uploaded(HUD_MAX_LINES)
+{
+    // each instance expands to a quad from gl_VertexID; spaces are moved outside the clip volume
+    const char *vertSrc =
+        "#version 330 core\n"
+        "in uvec4 character;\n"
+        "uniform vec2 viewport;\n"
+        "uniform vec2 cellSize;\n"
+        "uniform float margin;\n"
+        "out vec2 cellUv;\n"
+        "flat out uint glyph;\n"
+        "void main(){\n"
+        "   vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+        "   vec2 pixel = margin + (vec2(character.xy) + corner) * cellSize;\n"
+        "   cellUv = corner;\n"
+        "   glyph = character.z;\n"
+        "   gl_Position = character.z == 0u ? vec4(2.0f, 2.0f, 2.0f, 1.0f)\n"
+        "       : vec4(pixel.x / viewport.x * 2.0f - 1.0f, 1.0f - pixel.y / viewport.y * 2.0f, 0.0f, 1.0f);\n"
+        "}\n";
+
+    const char *fragSrc =
+        "#version 330 core\n"
+        "in vec2 cellUv;\n"
+        "flat in uint glyph;\n"
+        "out vec4 fragColor;\n"
+        "uniform sampler2D font;\n"
+        "uniform vec2 cellSize;\n"
+        "uniform vec4 textColor;\n"
+        "uniform vec4 backgroundColor;\n"
+        "void main(){\n"
+        "   ivec2 texel = ivec2(min(cellUv * cellSize, cellSize - 1.0f));\n"
+        "   float bit = texelFetch(font, ivec2(int(glyph) * int(cellSize.x) + texel.x, texel.y), 0).r;\n"
+        "   fragColor = mix(backgroundColor, textColor, bit);\n"
+        "}\n";
+
+    GLuint vertShader = CreateShader(GL_VERTEX_SHADER, vertSrc);
+    if (INVALID_GL_ID(vertShader) || !ShaderIsCompiled(vertShader))
+    {
+        PrintShaderLog(std::cerr, vertShader);
+        throw std::runtime_error("hud vertex shader failed to compile");
+    }
+    GLuint fragShader = CreateShader(GL_FRAGMENT_SHADER, fragSrc);
+    if (INVALID_GL_ID(fragShader) || !ShaderIsCompiled(fragShader))
+    {
+        PrintShaderLog(std::cerr, fragShader);
+        throw std::runtime_error("hud fragment shader failed to compile");
+    }
+    program = CreateProgram(vertShader, fragShader);
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+    if (INVALID_GL_ID(program) || !ProgramIsLinked(program))
+    {
+        PrintProgramLog(std::cerr, program);
+        throw std::runtime_error("hud program failed to link");
+    }
+    auto color = [](uint32_t rgba, float *out) {
+        for (int i = 0; i < 4; ++i)
+        {
+            out[i] = ((rgba >> (8 * i)) & 0xff) / 255.0f;
+        }
+    };
+    float text[4], background[4];
+    color(HUD_TEXT_COLOR, text);
+    color(HUD_BACKGROUND_COLOR, background);
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "font"), 0);
+    glUniform2f(glGetUniformLocation(program, "cellSize"), float(HUD_GLYPH_WIDTH), float(HUD_GLYPH_HEIGHT));
+    glUniform1f(glGetUniformLocation(program, "margin"), HUD_MARGIN);
+    glUniform4fv(glGetUniformLocation(program, "textColor"), 1, text);
+    glUniform4fv(glGetUniformLocation(program, "backgroundColor"), 1, background);
+    viewportUniform = glGetUniformLocation(program, "viewport");
+    glUseProgram(0);
+
+    // the atlas is one row of glyphs, row 0 of the texture is the top row of each glyph
+    std::vector<uint8_t> texels(HUD_GLYPH_COUNT * HUD_GLYPH_WIDTH * HUD_GLYPH_HEIGHT);
+    size_t atlasWidth = HUD_GLYPH_COUNT * HUD_GLYPH_WIDTH;
+    for (size_t glyph = 0; glyph < HUD_GLYPH_COUNT; ++glyph)
+    {
+        for (size_t y = 0; y < HUD_GLYPH_HEIGHT; ++y)
+        {
+            for (size_t x = 0; x < HUD_GLYPH_WIDTH; ++x)
+            {
+                bool set = HUD_FONT[glyph][y] & (0x80 >> x);
+                texels[y * atlasWidth + glyph * HUD_GLYPH_WIDTH + x] = set ? 255 : 0;
+            }
+        }
+    }
+    glGenTextures(1, &atlas);
+    if (INVALID_GL_ID(atlas))
+    {
+        throw std::runtime_error("hud atlas texture created with id 0");
+    }
+    glBindTexture(GL_TEXTURE_2D, atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, atlasWidth, HUD_GLYPH_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, texels.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    std::vector<Instance> blank(HUD_MAX_LINES * HUD_LINE_CHARS);
+    for (size_t i = 0; i < blank.size(); ++i)
+    {
+        Instance instance = {uint8_t(i % HUD_LINE_CHARS), uint8_t(i / HUD_LINE_CHARS), 0, 0};
+        blank[i] = instance;
+    }
+    glGenBuffers(1, &instances);
+    if (INVALID_GL_ID(instances))
+    {
+        throw std::runtime_error("hud vbo created with id 0");
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, instances);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Instance) * blank.size(), blank.data(), GL_DYNAMIC_DRAW);
+
+    glGenQueries(HUD_TIMER_QUERIES, queries);
+}
+
+HudOverlay::~HudOverlay()
+{
+    glDeleteQueries(HUD_TIMER_QUERIES, queries);
+    glDeleteBuffers(1, &instances);
+    glDeleteTextures(1, &atlas);
+    glDeleteProgram(program);
+}
+
+GLuint HudOverlay::CreateVertexArray()
+{
+    GLuint vao = 0;
+    glGenVertexArrays(1, &vao);
+    if (INVALID_GL_ID(vao))
+    {
+        throw std::runtime_error("hud vao created with id 0");
+    }
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, instances);
+    GLint characterAttrib = glGetAttribLocation(program, "character");
+    glVertexAttribIPointer(characterAttrib, 4, GL_UNSIGNED_BYTE, sizeof(Instance), nullptr);
+    glVertexAttribDivisor(characterAttrib, 1);
+    glEnableVertexAttribArray(characterAttrib);
+    glBindVertexArray(0);
+    return vao;
+}
+
+void HudOverlay::SetLines(const std::vector<std::string> &lines)
+{
+    lineCount = std::min(lines.size(), HUD_MAX_LINES);
+    Instance row[HUD_LINE_CHARS];
+    for (size_t line = 0; line < lineCount; ++line)
+    {
+        std::string text = lines[line].substr(0, HUD_LINE_CHARS);
+        if (text == uploaded[line])
+        {
+            continue;
+        }
+        // rewrite only as many characters as either version of the line covers
+        size_t length = std::max(text.size(), uploaded[line].size());
+        for (size_t i = 0; i < length; ++i)
+        {
+            Instance instance = {uint8_t(i), uint8_t(line), uint8_t(i < text.size() ? HudGlyph(text[i]) : 0), 0};
+            row[i] = instance;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, instances);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(Instance) * line * HUD_LINE_CHARS, sizeof(Instance) * length, row);
+        uploaded[line] = text;
+    }
+}
+
+void HudOverlay::Draw(GLuint vao, int width, int height, bool timed)
+{
+    if (lineCount == 0)
+    {
+        return;
+    }
+
+    // collect finished measurements, a query still pending is skipped rather than waited on
+    GLuint query = queries[nextQuery];
+    if (timed && pending[nextQuery])
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+            gpuSeconds = nanoseconds / 1e9;
+            pending[nextQuery] = false;
+        }
+        else
+        {
+            timed = false;
+        }
+    }
+    if (timed)
+    {
+        glBeginQuery(GL_TIME_ELAPSED, query);
+    }
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(program);
+    glUniform2f(viewportUniform, float(width), float(height));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, atlas);
+    glBindVertexArray(vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, lineCount * HUD_LINE_CHARS);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glDisable(GL_BLEND);
+
+    if (timed)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        pending[nextQuery] = true;
+        nextQuery = (nextQuery + 1) % HUD_TIMER_QUERIES;
+    }
+}
+
+bool HudOverlay::GpuSeconds(double &seconds) const
+{
+    seconds = gpuSeconds;
+    return gpuSeconds >= 0.0;
+}
+
+// Renders with OpenGL 3.3 into one or more GLFW windows. Every window's context shares objects with
+// the first one, which must be current: the waveform buffer, spectrogram atlas and programs exist
+// once and are updated once per frame, only vertex arrays and context state are per window.
+class GlRenderer : public Renderer
+{
+public:
+    GlRenderer(const std::vector<GLFWwindow *> &windows, uint64_t sourceHash) noexcept(false);
+    ~GlRenderer();
+
+    virtual void BeginFrame() override;
+    virtual size_t ViewCount() override;
+    virtual void SelectView(size_t view) override;
+    virtual void DrawWaveform(const SampleHistory &history, const WaveformPyramid &pyramid, double start,
+                              double length) override;
+    virtual void DrawSpectrogram(const SampleHistory &history, double start, double length) override;
+    virtual void DrawReassigned(const SampleHistory &history, double start, double length) override;
+    virtual void DrawScalogram(const SampleHistory &history, double start, double length) override;
+    virtual void DrawPanorama(const SampleHistory &history, double start, double length) override;
+    virtual bool PanoramaFigures(double &balanceDb, double &frameSeconds) override;
+    virtual void DrawLine(const std::vector<glm::vec2> &points) override;
+    virtual void DrawHud(const std::vector<std::string> &lines) override;
+    virtual bool HudGpuSeconds(double &seconds) override;
+    virtual void Present() override;
+    virtual bool IsOpen() override;
+    virtual bool IsVisible() override;
+    virtual void WaitEvents(double timeout) override;
+    virtual void Wake() override;
+    virtual void SetFramesInFlight(size_t frames) override;
+    virtual void MarkCapture(double captureTime) override;
+    virtual bool TakeLatency(double &seconds) override;
+
+    GlRenderer(const GlRenderer &) = delete;
+    GlRenderer &operator=(const GlRenderer &) = delete;
+
+private:
+    // A window and the objects of its context that can't be shared
+    struct Target
+    {
+        GLFWwindow *window;
+        GLuint waveformVao;
+        GLuint spectrogramVao;
+        GLuint reassignedVao;
+        GLuint scalogramVao;
+        GLuint hudVao;
+        GLuint lineVao;
+        size_t panoramaTarget;
+    };
+
+    // Sets up the state of the current context and creates the target's vertex arrays
+    void InitializeTarget(Target &target);
+    // Makes a window's context current, flushing the previous one so its updates of shared objects
+    // are visible to the next
+    void MakeCurrent(size_t target);
+
+    std::vector<Target> targets;
+    // target whose context is current
+    size_t current = 0;
+    // target swapped with vsync, which paces the loop
+    size_t pacedTarget = 0;
+    std::unique_ptr<WaveformLodView> waveformView;
+    std::unique_ptr<SpectrogramView> spectrogramView;
+    std::unique_ptr<SpectrogramView> reassignedView;
+    std::unique_ptr<SpectrogramView> scalogramView;
+    std::unique_ptr<PanoramaView> panoramaView;
+    std::unique_ptr<LineOverlay> lineOverlay;
+    std::unique_ptr<HudOverlay> hud;
+
+    // Retires finished frames, recording their latency. Blocks on the oldest fences while more than
+    // keep frames are in flight.
+    void RetireFrames(size_t keep);
+
+    struct FrameFence
+    {
+        GLsync fence;
+        double captureTime;
+    };
+    // one fence per presented frame, oldest first
+    std::deque<FrameFence> fences;
+    size_t framesInFlight = 0;
+    double frameCapture = -1.0;
+    LatencyStats latency;
+};
+
+GlRenderer::GlRenderer(const std::vector<GLFWwindow *> &windows, uint64_t sourceHash)
+{
+    waveformView.reset(new WaveformLodView());
+    SpectrogramParams spectrogramParams;
+    spectrogramView.reset(new SpectrogramView(spectrogramParams, sourceHash));
+    SpectrogramParams reassignedParams;
+    reassignedParams.reassigned = true;
+    reassignedView.reset(new SpectrogramView(reassignedParams, sourceHash));
+    SpectrogramParams scalogramParams;
+    scalogramParams.fftSize = SCALOGRAM_FFT_SIZE;
+    scalogramParams.scales = SCALOGRAM_SCALES;
+    scalogramView.reset(new SpectrogramView(scalogramParams, sourceHash));
+    panoramaView.reset(new PanoramaView());
+    lineOverlay.reset(new LineOverlay());
+    hud.reset(new HudOverlay());
+
+    for (GLFWwindow *window : windows)
+    {
+        Target target = {window, 0, 0, 0, 0, 0, 0, 0};
+        targets.push_back(target);
+        MakeCurrent(targets.size() - 1);
+        InitializeTarget(targets.back());
+        // swapping every window with vsync would wait for one vblank per window
+        glfwSwapInterval(targets.size() == 1 ? 1 : 0);
+    }
+    MakeCurrent(0);
+}
+
+GlRenderer::~GlRenderer()
+{
+    for (size_t i = targets.size(); i-- > 0;)
+    {
+        MakeCurrent(i);
+        glDeleteVertexArrays(1, &targets[i].waveformVao);
+        glDeleteVertexArrays(1, &targets[i].spectrogramVao);
+        glDeleteVertexArrays(1, &targets[i].reassignedVao);
+        glDeleteVertexArrays(1, &targets[i].scalogramVao);
+        glDeleteVertexArrays(1, &targets[i].hudVao);
+        glDeleteVertexArrays(1, &targets[i].lineVao);
+        panoramaView->DeleteTarget(targets[i].panoramaTarget);
+    }
+    for (const FrameFence &frame : fences)
+    {
+        glDeleteSync(frame.fence);
+    }
+    hud.reset();
+    lineOverlay.reset();
+    panoramaView.reset();
+    scalogramView.reset();
+    reassignedView.reset();
+    spectrogramView.reset();
+    waveformView.reset();
+}
+
+void GlRenderer::InitializeTarget(Target &target)
+{
+    // Set lines to be thicker
+    glEnable(GL_LINE_SMOOTH);
+    glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
+    glLineWidth(0.5f);
+
+    // Use GL_LEQUAL for depth to allow later draw calls with equal depth to overwrite previous ones
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+
+    target.waveformVao = waveformView->CreateVertexArray();
+    target.spectrogramVao = spectrogramView->CreateVertexArray();
+    target.reassignedVao = reassignedView->CreateVertexArray();
+    target.scalogramVao = scalogramView->CreateVertexArray();
+    target.hudVao = hud->CreateVertexArray();
+    target.lineVao = lineOverlay->CreateVertexArray();
+    target.panoramaTarget = panoramaView->CreateTarget();
+}
+
+void GlRenderer::MakeCurrent(size_t target)
+{
+    if (glfwGetCurrentContext() != targets[target].window)
+    {
+        glFlush();
+        glfwMakeContextCurrent(targets[target].window);
+    }
+    current = target;
+}
+
+void GlRenderer::RetireFrames(size_t keep)
+{
+    while (!fences.empty())
+    {
+        FrameFence &frame = fences.front();
+        bool wait = fences.size() > keep;
+        // the flush makes sure the fence gets submitted, or waiting on it could never finish
+        GLenum status = glClientWaitSync(frame.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                         wait ? GLuint64(100000000) : 0);
+        bool signaled = status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+        if (status == GL_TIMEOUT_EXPIRED)
+        {
+            if (wait)
+            {
+                continue;
+            }
+            break;
+        }
+        if (signaled && frame.captureTime >= 0.0)
+        {
+            latency.Add(SecondsNow() - frame.captureTime);
+        }
+        glDeleteSync(frame.fence);
+        fences.pop_front();
+    }
+}
+
+void GlRenderer::BeginFrame()
+{
+    // Waiting here, before the main loop reads audio, means the audio is sampled as late as the
+    // frame limit allows
+    if (framesInFlight > 0)
+    {
+        RetireFrames(framesInFlight - 1);
+    }
+    else
+    {
+        RetireFrames(SIZE_MAX);
+    }
+    frameCapture = -1.0;
+    waveformView->BeginFrame();
+    spectrogramView->BeginFrame();
+    reassignedView->BeginFrame();
+    scalogramView->BeginFrame();
+    // shared objects are updated with the first context current
+    SelectView(0);
+}
+
+size_t GlRenderer::ViewCount()
+{
+    return targets.size();
+}
+
+void GlRenderer::SelectView(size_t view)
+{
+    MakeCurrent(view);
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(targets[current].window, &fbWidth, &fbHeight);
+    glViewport(0, 0, fbWidth, fbHeight);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void GlRenderer::DrawWaveform(const SampleHistory &history, const WaveformPyramid &pyramid, double start,
+                              double length)
+{
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(targets[current].window, &fbWidth, &fbHeight);
+    waveformView->Draw(history, pyramid, start, length, fbWidth, targets[current].waveformVao);
+}
+
+void GlRenderer::DrawSpectrogram(const SampleHistory &history, double start, double length)
+{
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(targets[current].window, &fbWidth, &fbHeight);
+    spectrogramView->Draw(history, start, length, fbWidth, targets[current].spectrogramVao);
+}
+
+void GlRenderer::DrawReassigned(const SampleHistory &history, double start, double length)
+{
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(targets[current].window, &fbWidth, &fbHeight);
+    reassignedView->Draw(history, start, length, fbWidth, targets[current].reassignedVao);
+}
+
+void GlRenderer::DrawScalogram(const SampleHistory &history, double start, double length)
+{
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(targets[current].window, &fbWidth, &fbHeight);
+    scalogramView->Draw(history, start, length, fbWidth, targets[current].scalogramVao);
+}
+
+void GlRenderer::DrawPanorama(const SampleHistory &history, double start, double length)
+{
+    panoramaView->Draw(history, start, length, targets[current].panoramaTarget);
+}
+
+void GlRenderer::DrawLine(const std::vector<glm::vec2> &points)
+{
+    lineOverlay->Draw(points, targets[current].lineVao);
+}
+
+bool GlRenderer::PanoramaFigures(double &balanceDb, double &frameSeconds)
+{
+    const StereoPanorama *panorama = panoramaView->Panorama();
+    if (!panorama)
+    {
+        return false;
+    }
+    balanceDb = panorama->BalanceDb();
+    frameSeconds = panorama->FrameSeconds();
+    return true;
+}
+
+void GlRenderer::DrawHud(const std::vector<std::string> &lines)
+{
+    hud->SetLines(lines);
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(targets[current].window, &fbWidth, &fbHeight);
+    // timer queries belong to the first context, where the overlay was created
+    hud->Draw(targets[current].hudVao, fbWidth, fbHeight, current == 0);
+}
+
+bool GlRenderer::HudGpuSeconds(double &seconds)
+{
+    return hud->GpuSeconds(seconds);
+}
+
+void GlRenderer::Present()
+{
+    // only the first open window waits for vsync, so it is swapped last
+    size_t first = 0;
+    while (first < targets.size() && !glfwGetWindowAttrib(targets[first].window, GLFW_VISIBLE))
+    {
+        ++first;
+    }
+    if (first < targets.size() && first != pacedTarget)
+    {
+        // the paced window was closed, hand vsync to the next one
+        MakeCurrent(first);
+        glfwSwapInterval(1);
+        pacedTarget = first;
+    }
+    for (size_t i = targets.size(); i-- > first;)
+    {
+        if (glfwGetWindowAttrib(targets[i].window, GLFW_VISIBLE))
+        {
+            MakeCurrent(i);
+            glfwSwapBuffers(targets[i].window);
+        }
+    }
+    // signals once the GPU is done with everything up to and including the swap
+    FrameFence frame = {glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), frameCapture};
+    fences.push_back(frame);
+    if (fences.size() > MAX_TRACKED_FENCES)
+    {
+        glDeleteSync(fences.front().fence);
+        fences.pop_front();
+    }
+    glfwPollEvents();
+}
+
+bool GlRenderer::IsOpen()
+{
+    // a closed window is only hidden, its context holds objects shared with the others
+    bool open = false;
+    for (const Target &target : targets)
+    {
+        if (glfwWindowShouldClose(target.window))
+        {
+            glfwHideWindow(target.window);
+        }
+        open = open || glfwGetWindowAttrib(target.window, GLFW_VISIBLE);
+    }
+    return open;
+}
+
+bool GlRenderer::IsVisible()
+{
+    // GLFW has no occlusion query, so an iconified or hidden window is the only one known to be unseen
+    for (const Target &target : targets)
+    {
+        if (!glfwGetWindowAttrib(target.window, GLFW_ICONIFIED) && glfwGetWindowAttrib(target.window, GLFW_VISIBLE))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void GlRenderer::WaitEvents(double timeout)
+{
+    glfwWaitEventsTimeout(timeout);
+}
+
+void GlRenderer::Wake()
+{
+    glfwPostEmptyEvent();
+}
+
+void GlRenderer::SetFramesInFlight(size_t frames)
+{
+    framesInFlight = std::min(frames, MAX_TRACKED_FENCES);
+}
+
+void GlRenderer::MarkCapture(double captureTime)
+{
+    frameCapture = std::max(frameCapture, captureTime);
+}
+
+bool GlRenderer::TakeLatency(double &seconds)
+{
+    return latency.Take(seconds);
+}
+
+// Set by SIGINT/SIGTERM to end a headless run
+volatile sig_atomic_t headlessInterrupted = 0;
+
+void HeadlessSignalHandler(int)
+{
+    headlessInterrupted = 1;
+}
+
+// Renders on the CPU for hosts without any GL driver. The latest frame is written to a PNG every
+// writeInterval seconds (atomically replaced); frames are rasterized only when they're written.
+class SoftwareRenderer : public Renderer
+{
+public:
+    // formants adds formant tracks to the linear spectrograms
+    SoftwareRenderer(size_t width, size_t height, const std::string &path, double writeInterval, bool formants);
+
+    virtual void BeginFrame() override;
+    virtual size_t ViewCount() override;
+    virtual void SelectView(size_t view) override;
+    virtual void DrawWaveform(const SampleHistory &history, const WaveformPyramid &pyramid, double start,
+                              double length) override;
+    virtual void DrawSpectrogram(const SampleHistory &history, double start, double length) override;
+    virtual void DrawReassigned(const SampleHistory &history, double start, double length) override;
+    virtual void DrawScalogram(const SampleHistory &history, double start, double length) override;
+    virtual void DrawPanorama(const SampleHistory &history, double start, double length) override;
+    virtual bool PanoramaFigures(double &balanceDb, double &frameSeconds) override;
+    virtual void DrawLine(const std::vector<glm::vec2> &points) override;
+    virtual void DrawHud(const std::vector<std::string> &lines) override;
+    virtual bool HudGpuSeconds(double &seconds) override;
+    virtual void Present() override;
+    virtual bool IsOpen() override;
+    virtual bool IsVisible() override;
+    virtual void WaitEvents(double timeout) override;
+    virtual void Wake() override;
+    virtual void SetFramesInFlight(size_t frames) override;
+    virtual void MarkCapture(double captureTime) override;
+    virtual bool TakeLatency(double &seconds) override;
+
+private:
+    Image image;
+    std::string path;
+    double writeInterval;
+    double lastWrite;
+    double nextFrame;
+    bool formants;
+
+    // view requested this frame, drawn in Present if the frame is written
+    ExportView view = EXPORT_WAVEFORM;
+    const SampleHistory *viewHistory = nullptr;
+    WaveformPyramid viewPyramid;
+    double viewStart = 0.0, viewLength = 0.0;
+    std::vector<glm::vec2> line;
+    std::vector<std::string> hudLines;
+    // analyses the panorama of written images, created with the first
+    std::unique_ptr<StereoPanorama> panorama;
+
+    double frameCapture = -1.0;
+    LatencyStats latency;
+
+    // set by Wake to end WaitEvents
+    boost::mutex wakeMutex;
+    boost::condition_variable wakeCondition;
+    bool woken = false;
+};
+
+SoftwareRenderer::SoftwareRenderer(size_t width, size_t height, const std::string &path, double writeInterval,
+                                   bool formants)
+    : image(width, height), path(path), writeInterval(writeInterval), lastWrite(SecondsNow() - writeInterval),
+      nextFrame(SecondsNow()), formants(formants)
+{
+    signal(SIGINT, HeadlessSignalHandler);
+    signal(SIGTERM, HeadlessSignalHandler);
+}
+
+void SoftwareRenderer::BeginFrame()
+{
+    viewHistory = nullptr;
+    line.clear();
+    hudLines.clear();
+    frameCapture = -1.0;
+}
+
+size_t SoftwareRenderer::ViewCount()
+{
+    return 1;
+}
+
+void SoftwareRenderer::SelectView(size_t view)
+{
+}
+
+void SoftwareRenderer::DrawWaveform(const SampleHistory &history, const WaveformPyramid &pyramid, double start,
+                                    double length)
+{
+    view = EXPORT_WAVEFORM;
+    viewHistory = &history;
+    viewPyramid = pyramid;
+    viewStart = start;
+    viewLength = length;
+}
+
+void SoftwareRenderer::DrawSpectrogram(const SampleHistory &history, double start, double length)
+{
+    view = EXPORT_SPECTROGRAM;
+    viewHistory = &history;
+    viewPyramid = WaveformPyramid();
+    viewStart = start;
+    viewLength = length;
+}
+
+void SoftwareRenderer::DrawReassigned(const SampleHistory &history, double start, double length)
+{
+    view = EXPORT_REASSIGNED;
+    viewHistory = &history;
+    viewPyramid = WaveformPyramid();
+    viewStart = start;
+    viewLength = length;
+}
+
+void SoftwareRenderer::DrawScalogram(const SampleHistory &history, double start, double length)
+{
+    view = EXPORT_SCALOGRAM;
+    viewHistory = &history;
+    viewPyramid = WaveformPyramid();
+    viewStart = start;
+    viewLength = length;
+}
+
+void SoftwareRenderer::DrawPanorama(const SampleHistory &history, double start, double length)
+{
+    view = EXPORT_PANORAMA;
+    viewHistory = &history;
+    viewPyramid = WaveformPyramid();
+    viewStart = start;
+    viewLength = length;
+}
+
+void SoftwareRenderer::DrawLine(const std::vector<glm::vec2> &points)
+{
+    line = points;
+}
+
+bool SoftwareRenderer::PanoramaFigures(double &balanceDb, double &frameSeconds)
+{
+    if (!panorama)
+    {
+        return false;
+    }
+    balanceDb = panorama->BalanceDb();
+    frameSeconds = panorama->FrameSeconds();
+    return true;
+}
+
+void SoftwareRenderer::DrawHud(const std::vector<std::string> &lines)
+{
+    hudLines = lines;
+}
+
+bool SoftwareRenderer::HudGpuSeconds(double &seconds)
+{
+    return false;
+}
+
+void SoftwareRenderer::Present()
+{
+    double now = SecondsNow();
+    if (now - lastWrite >= writeInterval)
+    {
+        lastWrite = now;
+        if (viewHistory)
+        {
+            if (view == EXPORT_PANORAMA && !panorama)
+            {
+                panorama.reset(new StereoPanorama(double(viewHistory->SampleRate())));
+            }
+            RenderExport(*viewHistory, viewPyramid, view, viewStart, viewLength, image, formants, panorama.get());
+        }
+        else
+        {
+            image.Fill(BACKGROUND_COLOR);
+        }
+        if (!line.empty())
+        {
+            SoftwareRasterizer rasterizer(image);
+            rasterizer.Render([this](RasterTile &tile) { tile.LineStrip(line.data(), line.size(), FORMANT_COLOR); });
+        }
+        if (!hudLines.empty())
+        {
+            SoftwareRasterizer rasterizer(image);
+            rasterizer.Render([this](RasterTile &tile) {
+                for (size_t line = 0; line < std::min(hudLines.size(), HUD_MAX_LINES); ++line)
+                {
+                    tile.Text(long(HUD_MARGIN), long(HUD_MARGIN + line * HUD_GLYPH_HEIGHT),
+                              hudLines[line].substr(0, HUD_LINE_CHARS), HUD_TEXT_COLOR, HUD_BACKGROUND_COLOR);
+                }
+            });
+        }
+        std::string temp = path + ".tmp";
+        if (!image.WritePng(temp) || rename(temp.c_str(), path.c_str()) != 0)
+        {
+            std::cerr << "failed to write " << path << std::endl;
+        }
+    }
+    // the frame is done (and possibly written) once it's presented, there is no queue behind it
+    if (frameCapture >= 0.0)
+    {
+        latency.Add(SecondsNow() - frameCapture);
+    }
+
+    // no vsync to pace the loop, so sleep out the rest of the frame
+    nextFrame = std::max(nextFrame + FPS_LIMIT, now);
+    double wait = nextFrame - SecondsNow();
+    if (wait > 0.0)
+    {
+        boost::this_thread::sleep(boost::posix_time::microseconds(long(wait * 1e6)));
+    }
+}
+
+bool SoftwareRenderer::IsOpen()
+{
+    return !headlessInterrupted;
+}
+
+bool SoftwareRenderer::IsVisible()
+{
+    return true;
+}
+
+void SoftwareRenderer::WaitEvents(double timeout)
+{
+    boost::unique_lock<boost::mutex> lock(wakeMutex);
+    wakeCondition.timed_wait(lock, boost::posix_time::microseconds(long(timeout * 1e6)), [this]() { return woken; });
+    woken = false;
+}
+
+void SoftwareRenderer::Wake()
+{
+    boost::lock_guard<boost::mutex> lock(wakeMutex);
+    woken = true;
+    wakeCondition.notify_one();
+}
+
+void SoftwareRenderer::SetFramesInFlight(size_t frames)
+{
+}
+
+void SoftwareRenderer::MarkCapture(double captureTime)
+{
+    frameCapture = std::max(frameCapture, captureTime);
+}
+
+bool SoftwareRenderer::TakeLatency(double &seconds)
+{
+    return latency.Take(seconds);
+}
+
+// Seconds between images written by a headless run
+const double HEADLESS_WRITE_INTERVAL = 1.0;
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "--thumbnails")
+    {
+        return RunThumbnails(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--render")
+    {
+        return RunRender(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--compress")
+    {
+        return RunCompress(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--query")
+    {
+        return RunQuery(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--export")
+    {
+        return RunExport(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--columns")
+    {
+        return RunColumns(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--fingerprint")
+    {
+        return RunFingerprint(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--measure")
+    {
+        return RunMeasure(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--scalogram-bench")
+    {
+        return RunScalogramBench(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--thdn")
+    {
+        return RunDistortion(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--histogram")
+    {
+        return RunHistogram(argc, argv);
+    }
+
+    // [--headless <out.png>] [--low-latency [frames]] [--window waveform|spectrogram]... [--record <out.hpac>]
+    // [--find <query>] [--levels <out.hpcol>] [--references <dir>] [--playlist <list> [--loop] | file.wav]
+    std::string headlessPath;
+    std::string recordPath;
+    std::string levelsPath;
+    std::string referencesPath;
+    std::string playlistPath;
+    bool loop = false;
+    bool play = false;
+    double toneHz = 0.0, toneLevel = -6.0, toneThd = 0.0, toneNoise = -INFINITY;
+    bool distortion = false;
+    bool formants = false;
+    bool bits = false;
+    std::string filterSpec;
+    size_t filterTaps = PREFILTER_DEFAULT_TAPS;
+    std::string findText;
+    EventQuery findQuery;
+    std::string filePath;
+    PipelineSettings pipeline;
+    std::vector<ViewState> viewStates;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--headless" && i + 1 < argc)
+        {
+            headlessPath = argv[++i];
+        }
+        else if (arg == "--low-latency")
+        {
+            pipeline.lowLatency = true;
+            if (i + 1 < argc && isdigit(argv[i + 1][0]))
+            {
+                pipeline.framesInFlight = std::max(1, atoi(argv[++i]));
+            }
+        }
+        else if (arg == "--record" && i + 1 < argc)
+        {
+            recordPath = argv[++i];
+        }
+        else if (arg == "--levels" && i + 1 < argc)
+        {
+            levelsPath = argv[++i];
+        }
+        else if (arg == "--playlist" && i + 1 < argc)
+        {
+            playlistPath = argv[++i];
+        }
+        else if (arg == "--loop")
+        {
+            loop = true;
+        }
+        else if (arg == "--play")
+        {
+            play = true;
+        }
+        else if (arg == "--tone" && i + 1 < argc)
+        {
+            toneHz = atof(argv[++i]);
+        }
+        else if (arg == "--tone-level" && i + 1 < argc)
+        {
+            toneLevel = atof(argv[++i]);
+        }
+        else if (arg == "--tone-thd" && i + 1 < argc)
+        {
+            toneThd = atof(argv[++i]);
+        }
+        else if (arg == "--tone-noise" && i + 1 < argc)
+        {
+            toneNoise = atof(argv[++i]);
+        }
+        else if (arg == "--distortion")
+        {
+            distortion = true;
+        }
+        else if (arg == "--formants")
+        {
+            formants = true;
+        }
+        else if (arg == "--bits")
+        {
+            bits = true;
+        }
+        else if (arg == "--filter" && i + 1 < argc)
+        {
+            filterSpec = argv[++i];
+        }
+        else if (arg == "--filter-taps" && i + 1 < argc)
+        {
+            filterTaps = size_t(std::max(atoi(argv[++i]), 3));
+        }
+        else if (arg == "--references" && i + 1 < argc)
+        {
+            referencesPath = argv[++i];
+        }
+        else if (arg == "--find" && i + 1 < argc)
+        {
+            findText = argv[++i];
+            if (!ParseEventQuery(findText, findQuery))
+            {
+                std::cerr << "unknown query " << findText << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--window" && i + 1 < argc)
+        {
+            ViewState view;
+            std::string mode = argv[++i];
+            view.mode = mode == "spectrogram"  ? VIEW_SPECTROGRAM
+                        : mode == "reassigned" ? VIEW_REASSIGNED
+                        : mode == "scalogram"  ? VIEW_SCALOGRAM
+                        : mode == "panorama"   ? VIEW_PANORAMA
+                                               : VIEW_WAVEFORM;
+            viewStates.push_back(view);
+        }
+        else
+        {
+            filePath = arg;
+        }
+    }
+    // one waveform window by default, a headless run draws only the first view
+    if (viewStates.empty() || !headlessPath.empty())
+    {
+        viewStates.resize(1);
+    }
+    for (ViewState &view : viewStates)
+    {
+        view.pipeline = &pipeline;
+    }
+
+    // live input is filtered before it enters the history, so everything downstream sees the result
+    std::unique_ptr<PartitionedConvolver> prefilter;
+    double prefilterSeconds = 0.0;
+    if (!filterSpec.empty())
+    {
+        if (!filePath.empty())
+        {
+            std::cerr << "--filter only applies to live input" << std::endl;
+            return EXIT_FAILURE;
+        }
+        try
+        {
+            prefilter.reset(new PartitionedConvolver(LoadPrefilter(filterSpec, double(SAMPLE_RATE), filterTaps)));
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "Pre-filter of " << prefilter->Taps() << " taps in " << prefilter->Partitions()
+                  << " partitions, latency " << prefilter->BlockSize() * 1000.0 / SAMPLE_RATE << " ms"
+                  << std::endl;
+    }
+
+    // Initialize audio source, a wave file or playlist if one is given or the default device otherwise
+    std::unique_ptr<AudioSource> audioSource;
+    StreamingAudioSource *streamingSource = nullptr;
+    PlaylistSource *playlist = nullptr;
+    boost::scoped_thread<> audioThread;
+    std::unique_ptr<SampleHistory> liveHistory;
+    std::unique_ptr<LivePyramid> livePyramid;
+    SampleHistory *history = nullptr;
+    WaveformPyramid pyramid;
+    uint64_t sourceHash = 0;
+    std::unique_ptr<FileAnalysis> analysis;
+    std::unique_ptr<FilePlayback> playback;
+    if (!filePath.empty())
+    {
+        std::unique_ptr<FileSource> file = OpenFileSource(filePath);
+        history = &file->History();
+        sourceHash = file->ContentHash();
+        if (file->DecodeSeconds() > 0.0)
+        {
+            std::cout << "Decoded " << file->Frames() / double(history->SampleRate()) << " s of audio in "
+                      << file->DecodeSeconds() << " s" << std::endl;
+        }
+        if (play)
+        {
+            try
+            {
+                playback.reset(new FilePlayback(argv[0], *file));
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << e.what() << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        audioSource.reset(file.release());
+
+        auto analysisStart = std::chrono::steady_clock::now();
+        analysis.reset(new FileAnalysis(*history, sourceHash, AnalysisParams()));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - analysisStart;
+        std::cout << "Analysis " << (analysis->WasCached() ? "loaded from cache" : "computed") << " in "
+                  << elapsed.count() << " s: " << analysis->PyramidLevels() << " pyramid levels, "
+                  << analysis->Beats().count << " beats" << std::endl;
+        pyramid = analysis->Pyramid();
+    }
+    else
+    {
+        // a playlist streams like a device, paced in real time
+        if (!playlistPath.empty())
+        {
+            try
+            {
+                playlist = new PlaylistSource(argv[0], ReadPlaylist(playlistPath), loop);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << e.what() << std::endl;
+                return EXIT_FAILURE;
+            }
+            streamingSource = playlist;
+        }
+        else if (toneHz > 0.0)
+        {
+            streamingSource = new ToneSource(argv[0], toneHz, toneLevel, toneThd, toneNoise);
+        }
+        else
+        {
+            streamingSource = new DefaultSoundDevice(argv[0]);
+        }
+        audioSource.reset(streamingSource);
+        audioThread = boost::scoped_thread<>(boost::thread(&StreamingAudioSource::ProcessSound, streamingSource));
+        liveHistory.reset(new SampleHistory(SAMPLE_RATE * LIVE_HISTORY_SECONDS, SAMPLE_RATE));
+        history = liveHistory.get();
+        livePyramid.reset(new LivePyramid(SAMPLE_RATE * LIVE_HISTORY_SECONDS, AnalysisParams().pyramidBase));
+        pyramid = livePyramid->View();
+    }
+
+    // everything that enters the history is also archived, compressed off this thread
+    std::unique_ptr<ArchiveWriter> recorder;
+    if (!recordPath.empty())
+    {
+        try
+        {
+            recorder.reset(new ArchiveWriter(recordPath, 1, history->SampleRate(), ARCHIVE_LIVE_WORKERS));
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    // per frame levels of everything that enters the history
+    std::unique_ptr<ColumnWriter> levels;
+    if (!levelsPath.empty())
+    {
+        try
+        {
+            levels.reset(new ColumnWriter(levelsPath, LevelColumns(history->SampleRate(), AUDIO_FRAMEBUF_SIZE / sizeof(PCM16))));
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    // reference clips recognised in everything that enters the history
+    std::unique_ptr<FingerprintIndex> references;
+    std::unique_ptr<FingerprintMatcher> matcher;
+    std::vector<FingerprintMatch> matches;
+    uint64_t matchedSamples = 0;
+    uint64_t matcherStart = 0;
+    size_t matchCount = 0;
+    std::string lastMatch;
+    if (!referencesPath.empty())
+    {
+        try
+        {
+            references.reset(new FingerprintIndex(referencesPath, history->SampleRate()));
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        matcher.reset(new FingerprintMatcher(*references));
+        std::cout << references->Clips() << " reference clips, " << references->Postings() << " hashes in "
+                  << references->Bytes() / 1048576.0 << " MiB, built in " << references->BuildSeconds() << " s"
+                  << std::endl;
+    }
+    // THD+N of a test tone in everything that enters the history
+    std::unique_ptr<DistortionAnalyzer> distortionAnalyzer;
+    if (distortion)
+    {
+        distortionAnalyzer.reset(new DistortionAnalyzer(double(history->SampleRate())));
+    }
+    // formants of a voice in everything that enters the history
+    std::unique_ptr<FormantTracker> formantTracker;
+    if (formants)
+    {
+        formantTracker.reset(new FormantTracker(double(history->SampleRate())));
+    }
+    // histogram of everything that enters the history for the bits used meter, figures of the last
+    // complete window or, until there is one, of the first window so far once a second
+    std::unique_ptr<SampleHistogram> histogram;
+    BitUsage bitUsage;
+    bool histogramWindowDone = false;
+    double histogramSeconds = 0.0;
+    size_t histogramFrames = 0;
+    if (bits)
+    {
+        histogram.reset(new SampleHistogram());
+    }
+
+    if (history->IsComplete() && !playback)
+    {
+        // show the whole file to start with, a file being played scrolls along with what's heard
+        for (ViewState &view : viewStates)
+        {
+            view.followLive = false;
+            view.length = std::max(double(history->Size()), MIN_VIEW_LENGTH);
+        }
+    }
+
+    // Create the renderer, drawing into a window per view unless running headless
+    std::unique_ptr<Renderer> renderer;
+    std::vector<GLFWwindow *> windows;
+    if (!headlessPath.empty())
+    {
+        renderer.reset(new SoftwareRenderer(WIN_WIDTH, WIN_HEIGHT, headlessPath, HEADLESS_WRITE_INTERVAL, formants));
+    }
+    else
+    {
+        glfwSetErrorCallback(ErrorCallback);
+
+        if (!glfwInit())
+        {
+            std::cerr << "failed to init GLFW" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        // every later window shares objects with the first, and opens on its own monitor if there is one
+        int monitorCount = 0;
+        GLFWmonitor **monitors = glfwGetMonitors(&monitorCount);
+        for (size_t i = 0; i < viewStates.size(); ++i)
+        {
+            GLFWwindow *window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, "hellopulse", NULL,
+                                                  windows.empty() ? NULL : windows[0]);
+            if (!window)
+            {
+                std::cerr << "failed to init window" << std::endl;
+                glfwTerminate();
+                return EXIT_FAILURE;
+            }
+            if (i > 0 && int(i) < monitorCount)
+            {
+                int x, y;
+                glfwGetMonitorPos(monitors[i], &x, &y);
+                glfwSetWindowPos(window, x + 50, y + 50);
+            }
+            glfwSetWindowUserPointer(window, &viewStates[i]);
+            glfwSetKeyCallback(window, KeyCallback);
+            glfwSetScrollCallback(window, ScrollCallback);
+            glfwSetMouseButtonCallback(window, MouseButtonCallback);
+            glfwSetCursorPosCallback(window, CursorPosCallback);
+            glfwSetWindowRefreshCallback(window, RefreshCallback);
+            windows.push_back(window);
+        }
+
+        glfwMakeContextCurrent(windows[0]);
+        if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+        {
+            std::cerr << "failed to load glad" << std::endl;
+            glfwTerminate();
+            return EXIT_FAILURE;
+        }
+
+        try
+        {
+            renderer.reset(new GlRenderer(windows, sourceHash));
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            glfwTerminate();
+            return EXIT_FAILURE;
+        }
+    }
+
+    double lastTime = SecondsNow();
+    double timer = lastTime;
+    double secondsSinceReset = 0;
+
+    int numFrames = 0;
+    double deltaTime = 0;
+
+    // capture to present latency per mode (normal, low latency), for reporting what the mode saves
+    double modeLatency[2] = {-1.0, -1.0};
+
+    // While playing a file each frame draws the audio heard when it is expected on screen: a running
+    // average of the draw to present delay ahead. The A/V offset is the present time less the time
+    // the drawn frame was heard, read from a sample of the stream clock taken after the present, so
+    // neither the prediction nor the clock sample it used are part of the reference.
+    double displayDelay = FPS_LIMIT;
+    double drawnFrame = 0.0;
+    double avFrame = -1.0;
+    double avPresented = 0.0;
+    double avOffsetSum = 0.0;
+    double avOffsetMax = 0.0;
+    size_t avFrames = 0;
+
+    // Statistics shown by the overlay, gathered per frame and summarized once per second
+    std::vector<std::string> hudLines;
+    std::vector<double> frameTimes;
+    double lastFrameTime = -1.0;
+    size_t maxQueued = 0;
+    double hudCpuSeconds = 0.0;
+    size_t hudDraws = 0;
+
+    // Drawing pauses while the output can't be seen or the input has been silent for a while. The loop
+    // then sleeps in WaitEvents, woken by input or by the device thread once audio is heard again.
+    double lastSoundTime = SecondsNow();
+    std::atomic<bool> idle(false);
+    if (streamingSource)
+    {
+        Renderer *wakeRenderer = renderer.get();
+        streamingSource->SetActivityCallback([wakeRenderer, &idle]() {
+            if (idle)
+            {
+                wakeRenderer->Wake();
+            }
+        });
+    }
+    auto shouldPause = [&]() {
+        bool silent = SecondsNow() - lastSoundTime >= SILENCE_SECONDS;
+        bool dirty = false;
+        for (const ViewState &view : viewStates)
+        {
+            dirty = dirty || view.dirty;
+        }
+        return !renderer->IsVisible() || (silent && !dirty);
+    };
+
+    while (renderer->IsOpen())
+    {
+        // Update timer
+        double currentTime = SecondsNow();
+        double elapsedFrames = (currentTime - lastTime) / FPS_LIMIT;
+        deltaTime += elapsedFrames;
+        lastTime = currentTime;
+
+        bool paused = shouldPause();
+        if (!paused)
+        {
+            renderer->SetFramesInFlight(pipeline.lowLatency ? pipeline.framesInFlight : 0);
+            renderer->BeginFrame();
+        }
+
+        if (streamingSource && !streamingSource->IsOpen())
+        {
+            streamingSource->Start();
+        }
+        if (streamingSource)
+        {
+            maxQueued = std::max(maxQueued, streamingSource->QueuedFrames());
+        }
+
+        // Read an audio sample from the device. In low latency mode every queued frame of a device is
+        // consumed right before drawing, so the newest audio is what ends up on screen. While paused
+        // audio keeps flowing into the history: a device is drained and a file advances in real time.
+        AudioSample sample;
+        bool drain = (pipeline.lowLatency || paused) && streamingSource;
+        size_t framesDue = paused ? std::max<size_t>(1, size_t(elapsedFrames)) : 1;
+        size_t framesRead = 0;
+        while (audioSource->Read(sample))
+        {
+            PCM16 historyValues[AUDIO_FRAMEBUF_SIZE / sizeof(PCM16)];
+            for (int i = 0; i < AUDIO_FRAMEBUF_SIZE; i += sizeof(PCM16)) // read a 16 byte value and store it
+            {
+                PCM16 s1 = BytesToPcm16(sample.data[i + 1], sample.data[i]);
+                historyValues[i / sizeof(PCM16)] = s1;
+                //PCM16 s2 = BytesToPcm16(buf[i + 2], buf[i + 3]);
+            }
+            // the meter looks at the captured values, before a pre-filter re-quantizes them
+            if (histogram)
+            {
+                double histogramStart = SecondsNow();
+                size_t count = AUDIO_FRAMEBUF_SIZE / sizeof(PCM16);
+                histogram->Add(historyValues, count);
+                bool complete = histogram->Samples() >= HISTOGRAM_WINDOW_SECONDS * history->SampleRate();
+                if (complete || (!histogramWindowDone && histogram->Samples() % history->SampleRate() < count))
+                {
+                    bitUsage = histogram->Usage();
+                }
+                if (complete)
+                {
+                    histogram->Clear();
+                    histogramWindowDone = true;
+                }
+                histogramSeconds += SecondsNow() - histogramStart;
+                ++histogramFrames;
+            }
+            if (prefilter)
+            {
+                double filterStart = SecondsNow();
+                float filtered[AUDIO_FRAMEBUF_SIZE / sizeof(PCM16)];
+                for (size_t i = 0; i < AUDIO_FRAMEBUF_SIZE / sizeof(PCM16); ++i)
+                {
+                    filtered[i] = historyValues[i] / 32768.0f;
+                }
+                prefilter->Process(filtered, filtered, AUDIO_FRAMEBUF_SIZE / sizeof(PCM16));
+                for (size_t i = 0; i < AUDIO_FRAMEBUF_SIZE / sizeof(PCM16); ++i)
+                {
+                    historyValues[i] = PCM16(std::min(std::max(floorf(filtered[i] * 32768.0f + 0.5f), -32768.0f), 32767.0f));
+                }
+                prefilterSeconds += SecondsNow() - filterStart;
+            }
+
+            history->Append(historyValues, AUDIO_FRAMEBUF_SIZE / sizeof(PCM16));
+            if (livePyramid)
+            {
+                livePyramid->Append(historyValues, AUDIO_FRAMEBUF_SIZE / sizeof(PCM16));
+            }
+            if (recorder)
+            {
+                recorder->Append(historyValues, AUDIO_FRAMEBUF_SIZE / sizeof(PCM16));
+            }
+            if (levels)
+            {
+                AppendLevels(*levels, historyValues, AUDIO_FRAMEBUF_SIZE / sizeof(PCM16));
+            }
+            float values[AUDIO_FRAMEBUF_SIZE / sizeof(PCM16)];
+            if (matcher || distortionAnalyzer || formantTracker)
+            {
+                for (size_t i = 0; i < AUDIO_FRAMEBUF_SIZE / sizeof(PCM16); ++i)
+                {
+                    values[i] = Pcm16ToFloat(historyValues[i]);
+                }
+            }
+            if (distortionAnalyzer)
+            {
+                distortionAnalyzer->Process(values, AUDIO_FRAMEBUF_SIZE / sizeof(PCM16));
+            }
+            if (formantTracker)
+            {
+                formantTracker->Process(values, AUDIO_FRAMEBUF_SIZE / sizeof(PCM16));
+            }
+            if (matcher)
+            {
+                // peaks mustn't pair across the start of another file, which gets a matcher of its own
+                size_t count = AUDIO_FRAMEBUF_SIZE / sizeof(PCM16);
+                size_t split = sample.discontinuity > 0 ? size_t(sample.discontinuity) : 0;
+                matches.clear();
+                matcher->Process(values, split, matches);
+                if (sample.discontinuity >= 0)
+                {
+                    matcher->Finish(matches);
+                }
+                size_t reported = matches.size();
+                uint64_t previousStart = matcherStart;
+                if (sample.discontinuity >= 0)
+                {
+                    matcher.reset(new FingerprintMatcher(*references));
+                    matcherStart = matchedSamples + split;
+                }
+                matcher->Process(values + split, count - split, matches);
+                matchedSamples += count;
+                for (size_t i = 0; i < matches.size(); ++i)
+                {
+                    // a file reports its position, a capture the wall time the clip started at
+                    double rate = double(history->SampleRate());
+                    uint64_t start = (i < reported ? previousStart : matcherStart) + matches[i].start;
+                    double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+                    char when[64];
+                    snprintf(when, sizeof(when), "%.2f s", start / rate);
+                    lastMatch = references->Clip(matches[i].clip).name + " at " +
+                                (history->IsComplete() ? std::string(when)
+                                                       : FormatWallTime(now - (matchedSamples - start) / rate));
+                    std::cout << "match " << lastMatch << " (" << matches[i].votes << " votes)" << std::endl;
+                    ++matchCount;
+                }
+            }
+            if (playlist)
+            {
+                for (const std::string &name : playlist->Started())
+                {
+                    std::cout << "playing " << name << std::endl;
+                }
+            }
+            if (PeakDecibels(sample) > SILENCE_THRESHOLD_DB)
+            {
+                lastSoundTime = SecondsNow();
+            }
+            if (!paused)
+            {
+                renderer->MarkCapture(sample.captureTime);
+            }
+
+            if (!drain && ++framesRead >= framesDue)
+            {
+                break;
+            }
+        }
+
+        if (!paused)
+        {
+            double liveEdge = double(history->Size());
+            if (playback)
+            {
+                liveEdge = playback->AudibleFrame(currentTime + displayDelay);
+                drawnFrame = liveEdge;
+            }
+            // the audio above was uploaded once, every view draws from the same buffers
+            for (size_t v = 0; v < renderer->ViewCount(); ++v)
+            {
+                ViewState &view = viewStates[v];
+                if (v > 0)
+                {
+                    renderer->SelectView(v);
+                }
+                if (view.jump != 0)
+                {
+                    JumpToResult(view, recorder.get(), findText, findQuery, *history);
+                }
+                if (view.followLive)
+                {
+                    view.start = liveEdge - view.length;
+                }
+
+                if (view.mode == VIEW_SPECTROGRAM)
+                {
+                    renderer->DrawSpectrogram(*history, view.start, view.length);
+                }
+                else if (view.mode == VIEW_REASSIGNED)
+                {
+                    renderer->DrawReassigned(*history, view.start, view.length);
+                }
+                else if (view.mode == VIEW_SCALOGRAM)
+                {
+                    renderer->DrawScalogram(*history, view.start, view.length);
+                }
+                else if (view.mode == VIEW_PANORAMA)
+                {
+                    renderer->DrawPanorama(*history, view.start, view.length);
+                }
+                else
+                {
+                    renderer->DrawWaveform(*history, pyramid, view.start, view.length);
+                }
+                // the envelope of the newest formant analysis along the linear frequency axis
+                if (formantTracker && formantTracker->Frame().valid &&
+                    (view.mode == VIEW_SPECTROGRAM || view.mode == VIEW_REASSIGNED))
+                {
+                    renderer->DrawLine(
+                        FormantEnvelopeLine(*formantTracker, formantTracker->Frame(), double(history->SampleRate())));
+                }
+                if (v == 0 && pipeline.showHud)
+                {
+                    double hudStart = SecondsNow();
+                    renderer->DrawHud(hudLines);
+                    hudCpuSeconds += SecondsNow() - hudStart;
+                    ++hudDraws;
+                }
+                view.dirty = false;
+            }
+            ++numFrames;
+            if (lastFrameTime >= 0.0)
+            {
+                frameTimes.push_back(currentTime - lastFrameTime);
+            }
+            lastFrameTime = currentTime;
+        }
+        else
+        {
+            // the time spent paused isn't a frame time
+            lastFrameTime = -1.0;
+        }
+
+        // summarize the last second for the overlay
+        if (SecondsNow() - timer >= 1.0)
+        {
+            double summaryStart = SecondsNow();
+            ++timer;
+            ++secondsSinceReset;
+            char line[HUD_LINE_CHARS + 1];
+            hudLines.clear();
+
+            std::sort(frameTimes.begin(), frameTimes.end());
+            auto percentile = [&frameTimes](double p) {
+                return frameTimes.empty() ? 0.0 : frameTimes[size_t(p * (frameTimes.size() - 1) + 0.5)] * 1000.0;
+            };
+            snprintf(line, sizeof(line), "fps %d  frame p50 %.1f p95 %.1f p99 %.1f ms", numFrames, percentile(0.5),
+                     percentile(0.95), percentile(0.99));
+            hudLines.push_back(line);
+
+            if (streamingSource)
+            {
+                snprintf(line, sizeof(line), "audio queue %zu frames (max %zu)  overruns %zu",
+                         streamingSource->QueuedFrames(), maxQueued, streamingSource->Overruns());
+            }
+            else
+            {
+                snprintf(line, sizeof(line), "audio file, no capture queue");
+            }
+            hudLines.push_back(line);
+            if (playlist)
+            {
+                snprintf(line, sizeof(line), "playing %s, %zu stalls", playlist->Playing().c_str(), playlist->Stalls());
+                hudLines.push_back(line);
+            }
+            if (playback && avFrames > 0)
+            {
+                snprintf(line, sizeof(line), "a/v offset %+.1f ms avg, %.1f max, stream %.1f ms",
+                         avOffsetSum / avFrames * 1000.0, avOffsetMax * 1000.0, playback->Latency() * 1000.0);
+                hudLines.push_back(line);
+            }
+
+            double latency;
+            if (renderer->TakeLatency(latency))
+            {
+                double &current = modeLatency[pipeline.lowLatency ? 1 : 0];
+                current = current < 0.0 ? latency : 0.8 * current + 0.2 * latency;
+                int length = snprintf(line, sizeof(line), "capture to present %.1f ms", latency * 1000.0);
+                if (pipeline.lowLatency && modeLatency[0] >= 0.0 && length < int(sizeof(line)))
+                {
+                    snprintf(line + length, sizeof(line) - length, " (%.1f ms saved)",
+                             (modeLatency[0] - current) * 1000.0);
+                }
+                hudLines.push_back(line);
+            }
+
+            if (recorder && recorder->EncodedBytes() > 0)
+            {
+                double encodeSeconds = recorder->EncodeSeconds();
+                snprintf(line, sizeof(line), "archive ratio %.2f, %.0fx realtime per core",
+                         recorder->WrittenFrames() * sizeof(PCM16) / double(recorder->EncodedBytes()),
+                         encodeSeconds > 0.0 ? recorder->WrittenFrames() / double(history->SampleRate()) / encodeSeconds : 0.0);
+                hudLines.push_back(line);
+            }
+
+            if (matcher)
+            {
+                snprintf(line, sizeof(line), "%zu matches, %.1f us lookup per hop%s%s", matchCount,
+                         matcher->LookupSeconds() * 1e6 / std::max<uint32_t>(matcher->Hops(), 1),
+                         lastMatch.empty() ? "" : ", last ", lastMatch.c_str());
+                hudLines.push_back(line);
+            }
+
+            if (prefilter)
+            {
+                snprintf(line, sizeof(line), "filter %zu taps, %.1f ms latency, %.2f%% cpu", prefilter->Taps(),
+                         prefilter->BlockSize() * 1000.0 / history->SampleRate(), prefilterSeconds * 100.0);
+                hudLines.push_back(line);
+                prefilterSeconds = 0.0;
+            }
+
+            if (distortionAnalyzer && distortionAnalyzer->Result().valid)
+            {
+                const DistortionResult &result = distortionAnalyzer->Result();
+                snprintf(line, sizeof(line), "tone %.1f Hz %.1f dB  THD %.4f%%  THD+N %.4f%%", result.fundamentalHz,
+                         result.fundamentalDb, result.thd * 100.0, result.thdn * 100.0);
+                hudLines.push_back(line);
+                // the quietest and loudest octave of the noise floor
+                size_t quiet = 0, loud = 0;
+                for (size_t b = 0; b < result.bandNoiseDb.size(); ++b)
+                {
+                    quiet = result.bandNoiseDb[b] < result.bandNoiseDb[quiet] ? b : quiet;
+                    loud = result.bandNoiseDb[b] > result.bandNoiseDb[loud] ? b : loud;
+                }
+                snprintf(line, sizeof(line), "SINAD %.1f dB  noise %.1f dB, %.0f to %.0f per oct",
+                         result.sinadDb, result.noiseDb, result.bandNoiseDb.empty() ? 0.0 : result.bandNoiseDb[quiet],
+                         result.bandNoiseDb.empty() ? 0.0 : result.bandNoiseDb[loud]);
+                hudLines.push_back(line);
+                snprintf(line, sizeof(line), "thd analysis %.2f ms, %zu per second",
+                         distortionAnalyzer->AnalysisSeconds() * 1000.0, DISTORTION_UPDATES_PER_SECOND);
+                hudLines.push_back(line);
+            }
+
+            double balanceDb, panoramaSeconds;
+            bool panoramaShown = false;
+            for (const ViewState &view : viewStates)
+            {
+                panoramaShown = panoramaShown || view.mode == VIEW_PANORAMA;
+            }
+            if (panoramaShown && renderer->PanoramaFigures(balanceDb, panoramaSeconds))
+            {
+                if (history->Channels() < 2)
+                {
+                    snprintf(line, sizeof(line), "panorama of mono input, every bin is centred");
+                }
+                else
+                {
+                    snprintf(line, sizeof(line), "panorama balance %+.1f dB left, %.1f us per frame", balanceDb,
+                             panoramaSeconds * 1e6);
+                }
+                hudLines.push_back(line);
+            }
+            if (histogram && bitUsage.samples > 0)
+            {
+                snprintf(line, sizeof(line), "bits %s", DescribeBitUsage(bitUsage).c_str());
+                hudLines.push_back(line);
+                snprintf(line, sizeof(line), "%zu levels, peak %d bits, %.1f effective, %.1f us per frame",
+                         bitUsage.levels, bitUsage.peakBits, bitUsage.effectiveBits,
+                         histogramSeconds * 1e6 / std::max<size_t>(histogramFrames, 1));
+                hudLines.push_back(line);
+            }
+
+            if (formantTracker)
+            {
+                const FormantFrame &frame = formantTracker->Frame();
+                double hopUs = formantTracker->AnalysisSeconds() * 1e6;
+                if (frame.valid)
+                {
+                    snprintf(line, sizeof(line), "formants F1 %.0f F2 %.0f F3 %.0f Hz, lpc %.1f us per hop",
+                             frame.frequency[0], frame.frequency[1], frame.frequency[2], hopUs);
+                }
+                else
+                {
+                    snprintf(line, sizeof(line), "formants silent, lpc %.1f us per hop", hopUs);
+                }
+                hudLines.push_back(line);
+            }
+
+            if (pipeline.lowLatency)
+            {
+                snprintf(line, sizeof(line), "mode low latency, %zu frame(s) in flight", pipeline.framesInFlight);
+            }
+            else
+            {
+                snprintf(line, sizeof(line), "mode normal");
+            }
+            hudLines.push_back(line);
+
+            double gpuSeconds;
+            hudCpuSeconds += SecondsNow() - summaryStart;
+            int length = snprintf(line, sizeof(line), "hud %.3f ms cpu",
+                                  hudDraws ? hudCpuSeconds / hudDraws * 1000.0 : 0.0);
+            if (renderer->HudGpuSeconds(gpuSeconds) && length < int(sizeof(line)))
+            {
+                snprintf(line + length, sizeof(line) - length, ", %.3f ms gpu", gpuSeconds * 1000.0);
+            }
+            hudLines.push_back(line);
+
+            numFrames = 0;
+            frameTimes.clear();
+            avOffsetSum = 0.0;
+            avOffsetMax = 0.0;
+            avFrames = 0;
+            maxQueued = 0;
+            hudCpuSeconds = 0.0;
+            hudDraws = 0;
+        }
+
+        if (!paused)
+        {
+            renderer->Present();
+            if (playback)
+            {
+                // positive when the picture comes after the sound
+                double heard;
+                if (avFrame >= 0.0 && playback->HeardTime(avFrame, avPresented, heard))
+                {
+                    double offset = avPresented - heard;
+                    avOffsetSum += offset;
+                    avOffsetMax = std::max(avOffsetMax, fabs(offset));
+                    ++avFrames;
+                }
+                double presented = SecondsNow();
+                avFrame = drawnFrame > 0.0 ? drawnFrame : -1.0;
+                avPresented = presented;
+                displayDelay = 0.9 * displayDelay + 0.1 * (presented - currentTime);
+            }
+        }
+        else if (shouldPause())
+        {
+            // the last presented frame stays on screen until drawing resumes
+            idle = true;
+            renderer->WaitEvents(IDLE_WAIT);
+            idle = false;
+        }
+    }
+
+    if (streamingSource)
+    {
+        streamingSource->Stop();
+        // join before the renderer the activity callback wakes goes away
+        audioThread = boost::scoped_thread<>();
+    }
+
+    if (recorder)
+    {
+        if (!recorder->Close())
+        {
+            std::cerr << "failed to write " << recordPath << std::endl;
+        }
+        else if (recorder->EncodedBytes() > 0)
+        {
+            std::cout << "Recorded " << recorder->WrittenFrames() / double(history->SampleRate()) << " s to "
+                      << recordPath << ", ratio "
+                      << recorder->WrittenFrames() * sizeof(PCM16) / double(recorder->EncodedBytes()) << std::endl;
+        }
+    }
+    if (levels && !levels->Close())
+    {
+        std::cerr << "failed to write " << levelsPath << std::endl;
+    }
+
+    renderer.reset();
+    for (GLFWwindow *window : windows)
+    {
+        glfwDestroyWindow(window);
+    }
+
+    return EXIT_SUCCESS;
+}